@@ -1,38 +1,102 @@
-#include <fcntl.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <unistd.h>
-#include <string.h>
-#include <stdbool.h>
-
-#include "disk.h"
-#include "fs.h"
-#include "utilities.h"
-
-int main (int argc, char** argv){
-
-    if(argc!=3){
-        printf("disk_creator: usage: ./disk_creator.x <filename> <blocks>\n");
-        return EXIT_FAILURE;
-    }
-
-    char* filename=argv[1];
-
-    char *end;
-    size_t block_size = strtoul(argv[2], &end, 10);
-
-    if (*end != '\0') {
-        printf("disk_creator: error making disk\n");
-        return EXIT_FAILURE;
-    }
-
-    if(create_disk(block_size,filename)==-1){
-        printf("disk_creator: error making disk\n");
-        return EXIT_FAILURE;
-    }
-
-    return EXIT_SUCCESS;
-}
-
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "utilities.h"
+
+/*
+ * usage:
+ *
+ * ./disk_creator.x [-c] [-k] [-f fat16|fat32] [-B <KiB>] [-e <entries>] [-i <bytes>] [-p] <filename> <blocks>
+ *
+ *	-c: keep a CRC32C of every data block, verified on reads
+ *	-k: pack small files and file tails into shared blocks. Such disks
+ *	    cannot be mounted by the reference implementation.
+ *	-f: on-disk format (default: fat16). fat32 disks hold up to
+ *	    FAT32_MAX_DATA_BLOCKS data blocks and files larger than 4 GiB,
+ *	    but cannot be read by the reference implementation
+ *	-B: block size in KiB, a power of two from 4 to 64 (default: 4).
+ *	    Only 4 KiB disks can be read by the reference implementation.
+ *	-e: entries of the root directory, rounded up to whole blocks
+ *	    (default: 128). Disks whose directory spans several blocks cannot
+ *	    be read by the reference implementation.
+ *	-i: bytes per directory entry, a power of two from 64 to 256. Files of
+ *	    up to that size less 32 bytes are stored in their entry, with no
+ *	    data block. Such disks cannot be mounted by the reference
+ *	    implementation.
+ *	-p: allocate every block of the image on the host now. Otherwise the
+ *	    data blocks are left sparse and take room once first written.
+ */
+int main (int argc, char** argv){
+
+    struct disk_format format = { .checksums = false, .version = FS_VERSION_FAT16,
+                                  .block_size = BLOCK_SIZE_DEFAULT };
+
+    int opt;
+
+    while((opt = getopt(argc, argv, "ckf:B:e:i:p")) != -1){
+        switch(opt){
+        case 'c':
+            format.checksums = true;
+            break;
+        case 'k':
+            format.tail_packing = true;
+            break;
+        case 'f':
+            if(strcmp(optarg, "fat16")==0){
+                format.version = FS_VERSION_FAT16;
+            } else if(strcmp(optarg, "fat32")==0){
+                format.version = FS_VERSION_FAT32;
+            } else {
+                printf("disk_creator: unknown format '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'B':
+            format.block_size = strtoul(optarg, NULL, 10) * 1024;
+            break;
+        case 'e':
+            format.directory_entries = strtoul(optarg, NULL, 10);
+            break;
+        case 'i':
+            format.entry_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            format.preallocate = true;
+            break;
+        default:
+            printf("disk_creator: usage: ./disk_creator.x [-c] [-k] [-f fat16|fat32] [-B <KiB>] [-e <entries>] [-i <bytes>] [-p] <filename> <blocks>\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if(argc - optind!=2){
+        printf("disk_creator: usage: ./disk_creator.x [-c] [-k] [-f fat16|fat32] [-B <KiB>] [-e <entries>] [-i <bytes>] [-p] <filename> <blocks>\n");
+        return EXIT_FAILURE;
+    }
+
+    char* filename=argv[optind];
+
+    char *end;
+    size_t block_size = strtoul(argv[optind + 1], &end, 10);
+
+    if (*end != '\0') {
+        printf("disk_creator: error making disk\n");
+        return EXIT_FAILURE;
+    }
+
+    if(create_disk_with(block_size, filename, &format)==-1){
+        printf("disk_creator: error making disk\n");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
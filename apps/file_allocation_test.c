@@ -33,7 +33,7 @@ int main(int argc,char** argv){
 
         for(size_t file = 0; file < FS_FILE_MAX_COUNT; file++){
 
-            size_t write_bytes =  (size_t)1 + (size_t)(rand() % (BLOCK_SIZE * 7));
+            size_t write_bytes =  (size_t)1 + (size_t)(rand() % (block_size * 7));
 
             size_t required_blocks = total_block_size(write_bytes);
 
@@ -42,7 +42,7 @@ int main(int argc,char** argv){
 
             } else {
                 if(DATA_BLOCKS - blocks_filled > 0){
-                    write_bytes = (DATA_BLOCKS - blocks_filled) * BLOCK_SIZE;
+                    write_bytes = (DATA_BLOCKS - blocks_filled) * block_size;
 
                     file_sizes[files++] = write_bytes;
                 }
@@ -128,7 +128,7 @@ int main(int argc,char** argv){
 
     fs_create(name);
 
-    size_t writeBytes = free_blocks() * BLOCK_SIZE;
+    size_t writeBytes = free_blocks() * block_size;
 
     uint8_t* buf=(uint8_t*)calloc(1, writeBytes);
     memset(buf, '0' + rand() % 10, writeBytes);
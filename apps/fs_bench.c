@@ -0,0 +1,1865 @@
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "utilities.h"
+#include "fatScan.h"
+#include "checksum.h"
+
+/*
+ * usage:
+ *
+ * ./fs_bench.x [-i <image>] [-b <data blocks>] [-s <MiB>] [-n <ops>]
+ *              [-w <workload>[,<workload>...]] [-r <runs>] [-j <json file>]
+ *              [-c <baseline json> [-t <percent>]] [-S <seed>]
+ *              [-d none|metadata|full] [-B <KiB>[,<KiB>...]] [-P]
+ *
+ *	-i: disk image to format for every workload (default: fs_bench.fs)
+ *	-b: number of data blocks of the image (default: 8192)
+ *	-s: size of the file used by the sequential and random
+ *	    workloads, in MiB (default: 4)
+ *	-n: number of operations of the random, append and churn
+ *	    workloads (default: 2000)
+ *	-w: comma separated workloads to run, or "all" (default: all)
+ *	-r: runs of every workload; medians and 95% confidence intervals
+ *	    of the runs are reported (default: 1)
+ *	-j: also write the results as JSON to this file ("-" for stdout)
+ *	-c: compare the results with a JSON file written by -j and exit
+ *	    with 1 on regressions
+ *	-t: regression threshold for -c, in percent (default: 10)
+ *	-S: seed of the random workloads (default: 1)
+ *	-d: durability mode the image is mounted with (default: metadata)
+ *	-B: block sizes to format the image with, in KiB (default: 4). With
+ *	    more than one, every workload runs once per size and is reported
+ *	    as <workload>@<KiB>k. -b counts 4 KiB blocks, larger blocks get
+ *	    proportionally fewer so that the capacity stays the same.
+ *	-P: allocate every block of the images on the host when they are
+ *	    formatted, so that first writes to sparse blocks do not add to
+ *	    the latencies measured
+ *
+ * Every workload formats a fresh image, does its setup, then resets the
+ * libfs counters and times its measured phase only.
+ *
+ * With -c, a workload regresses when its median ops/s dropped, or its
+ * median p99 latency grew, by more than the threshold and its confidence
+ * interval does not overlap the baseline's.
+ */
+
+#define KIB 1024
+#define MIB (1024 * 1024)
+
+#define MAX_BLOCK_SIZES 8
+
+#define LOG_RECORD_SIZE 128
+#define CHURN_FILE_SIZE 64
+
+/* largest file of the small_ workloads, a quarter of a 4 KiB block */
+#define SMALL_FILE_MAX 1000
+
+/* largest file of the tiny_ workloads, the inline room of 64 byte entries */
+#define TINY_FILE_MAX 32
+
+struct bench_config{
+    const char* image;
+    size_t data_blocks;
+    size_t file_bytes;
+    size_t ops;
+    unsigned int seed;
+    enum fs_durability durability;
+    /* of the image being benchmarked, 0 for BLOCK_SIZE_DEFAULT */
+    size_t block_size;
+    /* allocate the whole image when formatting it */
+    bool preallocate;
+};
+
+static const char* durability_names[] = {
+    [FS_DURABILITY_NONE] = "none",
+    [FS_DURABILITY_METADATA] = "metadata",
+    [FS_DURABILITY_FULL] = "full",
+};
+
+struct bench_result{
+    const char* name;
+    size_t ops;
+    size_t bytes;
+    double seconds;
+
+    /*
+     * Latency percentiles of the operation the workload is
+     * bottlenecked on, in nanoseconds
+     */
+    enum fs_op lat_op;
+    struct fs_latency lat;
+
+    struct fs_stats stats;
+};
+
+struct workload{
+    const char* name;
+    int (*run)(struct bench_config*, size_t, struct bench_result*);
+
+    /*
+     * Request size for the sequential workloads, kernel for the
+     * fat_scan and crc32c ones, verify policy for the verify
+     * ones, superblock state for the mount ones, directory entries
+     * for the dir_lookup and readdir ones, whether tails are packed for
+     * the small ones, directory entry size for the tiny ones, request
+     * size for cow_write, copy mode for the copy ones
+     */
+    size_t request_size;
+};
+
+static uint64_t rng_state = 1;
+
+static uint64_t next_random(){
+    /* xorshift64 */
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+
+    return rng_state;
+}
+
+static double now_seconds(){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/*
+ * Formats a fresh image with @format, NULL for the defaults, in the
+ * block size of @config. create_disk() announces itself on stdout,
+ * which would interleave with our report.
+ */
+static int format_image(struct bench_config* config, const struct disk_format* format){
+    struct disk_format sized;
+
+    memset(&sized, 0, sizeof(struct disk_format));
+
+    if(format!=NULL){
+        sized = *format;
+    }
+
+    sized.block_size = config->block_size;
+    sized.preallocate = config->preallocate;
+
+    size_t data_blocks = config->data_blocks;
+
+    if(config->block_size > BLOCK_SIZE_DEFAULT){
+        data_blocks = data_blocks * BLOCK_SIZE_DEFAULT / config->block_size;
+    }
+
+    unlink(config->image);
+
+    fflush(stdout);
+
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+
+    int ret = create_disk_with(data_blocks, (char*)config->image, &sized);
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+
+    return ret;
+}
+
+/*
+ * Formats a fresh image with the default format and mounts it
+ */
+static int fresh_image(struct bench_config* config){
+    if(format_image(config, NULL)){
+        return -1;
+    }
+
+    struct fs_mount_options options = { .durability = config->durability };
+
+    return fs_mount_with(config->image, &options);
+}
+
+/*
+ * Creates @filename filled with @size bytes of data and returns it open
+ */
+static int populate_file(const char* filename, size_t size){
+    if(fs_create(filename)){
+        return -1;
+    }
+
+    int fd = fs_open(filename);
+
+    if(fd < 0){
+        return -1;
+    }
+
+    uint8_t* buf = (uint8_t*)malloc(64 * KIB);
+
+    for(size_t i = 0; i < 64 * KIB; i++){
+        buf[i] = (uint8_t)next_random();
+    }
+
+    size_t written = 0;
+
+    while(written < size){
+        size_t chunk = size - written < 64 * KIB ? size - written : 64 * KIB;
+
+        int ret = fs_write(fd, buf, chunk);
+
+        if(ret <= 0){
+            break;
+        }
+
+        written += (size_t)ret;
+    }
+
+    free(buf);
+
+    fs_lseek(fd, 0);
+
+    return fd;
+}
+
+static void begin_measure(struct bench_result* result, enum fs_op lat_op, double* start){
+    result->lat_op = lat_op;
+
+    fs_stats_reset();
+
+    *start = now_seconds();
+}
+
+static void end_measure(struct bench_result* result, double start){
+    result->seconds = now_seconds() - start;
+
+    fs_latency(result->lat_op, &result->lat);
+    fs_stats(&result->stats);
+}
+
+static int wl_seq_write(struct bench_config* config, size_t request_size,
+        struct bench_result* result){
+
+    if(fs_create("seq")){
+        return -1;
+    }
+
+    int fd = fs_open("seq");
+
+    uint8_t* buf = (uint8_t*)calloc(1, request_size);
+
+    memset(buf, 0xab, request_size);
+
+    double start;
+
+    begin_measure(result, FS_OP_WRITE, &start);
+
+    while(result->bytes < config->file_bytes){
+        int ret = fs_write(fd, buf, request_size);
+
+        if(ret <= 0){
+            break;
+        }
+
+        result->bytes += (size_t)ret;
+        result->ops++;
+    }
+
+    end_measure(result, start);
+
+    free(buf);
+
+    fs_close(fd);
+
+    return 0;
+}
+
+static int wl_seq_read(struct bench_config* config, size_t request_size,
+        struct bench_result* result){
+
+    int fd = populate_file("seq", config->file_bytes);
+
+    if(fd < 0){
+        return -1;
+    }
+
+    uint8_t* buf = (uint8_t*)calloc(1, request_size);
+
+    double start;
+
+    begin_measure(result, FS_OP_READ, &start);
+
+    while(1){
+        int ret = fs_read(fd, buf, request_size);
+
+        if(ret <= 0){
+            break;
+        }
+
+        result->bytes += (size_t)ret;
+        result->ops++;
+    }
+
+    end_measure(result, start);
+
+    free(buf);
+
+    fs_close(fd);
+
+    return 0;
+}
+
+/*
+ * seq_read_64k on an image formatted with checksums, mounted with the
+ * verify policy @verify
+ */
+static int wl_seq_read_verify(struct bench_config* config, size_t verify,
+        struct bench_result* result){
+
+    struct disk_format format = { .checksums = true };
+
+    struct fs_mount_options options = {
+        .durability = config->durability,
+        .verify = (enum fs_verify)verify,
+    };
+
+    if(fs_umount() || format_image(config, &format)
+            || fs_mount_with(config->image, &options)){
+        return -1;
+    }
+
+    return wl_seq_read(config, 64 * KIB, result);
+}
+
+static int wl_random(struct bench_config* config, size_t request_size,
+        struct bench_result* result, bool write){
+
+    int fd = populate_file("rand", config->file_bytes);
+
+    if(fd < 0){
+        return -1;
+    }
+
+    size_t slots = config->file_bytes / request_size;
+
+    if(slots==0){
+        fs_close(fd);
+        return -1;
+    }
+
+    uint8_t* buf = (uint8_t*)calloc(1, request_size);
+
+    memset(buf, 0xcd, request_size);
+
+    double start;
+
+    begin_measure(result, write ? FS_OP_WRITE : FS_OP_READ, &start);
+
+    for(size_t op = 0; op < config->ops; op++){
+        size_t offset = (size_t)(next_random() % slots) * request_size;
+
+        fs_lseek(fd, offset);
+
+        int ret = write ? fs_write(fd, buf, request_size)
+                        : fs_read(fd, buf, request_size);
+
+        if(ret <= 0){
+            break;
+        }
+
+        result->bytes += (size_t)ret;
+        result->ops++;
+    }
+
+    end_measure(result, start);
+
+    free(buf);
+
+    fs_close(fd);
+
+    return 0;
+}
+
+static int wl_rand_read(struct bench_config* config, size_t request_size,
+        struct bench_result* result){
+    return wl_random(config, request_size, result, false);
+}
+
+static int wl_rand_write(struct bench_config* config, size_t request_size,
+        struct bench_result* result){
+    return wl_random(config, request_size, result, true);
+}
+
+/*
+ * Many small appends to a single log file
+ */
+static int wl_append_log(struct bench_config* config, size_t request_size,
+        struct bench_result* result){
+
+    if(fs_create("log")){
+        return -1;
+    }
+
+    int fd = fs_open("log");
+
+    char record[LOG_RECORD_SIZE];
+
+    double start;
+
+    begin_measure(result, FS_OP_WRITE, &start);
+
+    for(size_t op = 0; op < config->ops; op++){
+        memset(record, ' ', LOG_RECORD_SIZE);
+        snprintf(record, LOG_RECORD_SIZE, "record %zu", op);
+        record[LOG_RECORD_SIZE - 1] = '\n';
+
+        int ret = fs_write(fd, record, LOG_RECORD_SIZE);
+
+        if(ret <= 0){
+            break;
+        }
+
+        result->bytes += (size_t)ret;
+        result->ops++;
+    }
+
+    end_measure(result, start);
+
+    fs_close(fd);
+
+    return 0;
+}
+
+/*
+ * Fills the root directory with small files then deletes them all,
+ * until config->ops files went through create/write/delete
+ */
+static int wl_churn(struct bench_config* config, size_t request_size,
+        struct bench_result* result){
+
+    char name[FS_FILENAME_LEN];
+    char data[CHURN_FILE_SIZE];
+
+    memset(data, 'c', CHURN_FILE_SIZE);
+
+    double start;
+
+    begin_measure(result, FS_OP_CREATE, &start);
+
+    while(result->ops < config->ops){
+        size_t files = 0;
+
+        while(files < FS_FILE_MAX_COUNT && result->ops + files < config->ops){
+            snprintf(name, FS_FILENAME_LEN, "churn%zu", files);
+
+            if(fs_create(name)){
+                break;
+            }
+
+            int fd = fs_open(name);
+
+            result->bytes += (size_t)fs_write(fd, data, CHURN_FILE_SIZE);
+
+            fs_close(fd);
+
+            files++;
+        }
+
+        if(files==0){
+            break;
+        }
+
+        for(size_t file = 0; file < files; file++){
+            snprintf(name, FS_FILENAME_LEN, "churn%zu", file);
+
+            fs_delete(name);
+        }
+
+        result->ops += files;
+    }
+
+    end_measure(result, start);
+
+    return 0;
+}
+
+/*
+ * Fills the disk with files of random sizes, deletes every other
+ * one, then fills the holes with a single fragmented file
+ */
+static int wl_fill(struct bench_config* config, size_t request_size,
+        struct bench_result* result){
+
+    char name[FS_FILENAME_LEN];
+
+    uint8_t* buf = (uint8_t*)calloc(1, request_size);
+
+    memset(buf, 0xef, request_size);
+
+    size_t capacity = free_blocks() * block_size;
+
+    /* leave one directory entry for the fragmented file */
+    size_t files = FS_FILE_MAX_COUNT - 1;
+    size_t average_size = capacity / files;
+
+    double start;
+
+    begin_measure(result, FS_OP_WRITE, &start);
+
+    bool full = false;
+
+    for(size_t file = 0; file < files && !full; file++){
+        snprintf(name, FS_FILENAME_LEN, "fill%zu", file);
+
+        fs_create(name);
+
+        int fd = fs_open(name);
+
+        size_t size = average_size / 2 + (size_t)(next_random() % (average_size + 1));
+        size_t written = 0;
+
+        while(written < size){
+            size_t chunk = size - written < request_size ? size - written : request_size;
+
+            int ret = fs_write(fd, buf, chunk);
+
+            result->ops++;
+
+            if(ret <= 0){
+                full = true;
+                break;
+            }
+
+            written += (size_t)ret;
+        }
+
+        result->bytes += written;
+
+        fs_close(fd);
+    }
+
+    for(size_t file = 0; file < files; file += 2){
+        snprintf(name, FS_FILENAME_LEN, "fill%zu", file);
+
+        fs_delete(name);
+    }
+
+    fs_create("fragmented");
+
+    int fd = fs_open("fragmented");
+
+    while(1){
+        int ret = fs_write(fd, buf, request_size);
+
+        result->ops++;
+
+        if(ret <= 0){
+            break;
+        }
+
+        result->bytes += (size_t)ret;
+    }
+
+    fs_close(fd);
+
+    end_measure(result, start);
+
+    free(buf);
+
+    return 0;
+}
+
+/*
+ * Microbenchmark of the FAT scanning kernels on an in-memory FAT the
+ * size of the image: counts used entries, finds the first free entry
+ * and the first run of 8 free entries, config->ops times. The disk is
+ * not touched.
+ */
+static int wl_fat_scan(struct bench_config* config, size_t impl,
+        struct bench_result* result){
+
+    size_t entries = config->data_blocks;
+
+    uint16_t* fat = (uint16_t*)calloc(entries, sizeof(uint16_t));
+
+    /* a nearly full fat, free entries only show up near its end */
+    for(size_t entry = 0; entry < entries; entry++){
+        fat[entry] = (uint16_t)(1 + next_random() % 0xFFFE);
+
+        if(entry > entries * 7 / 8 && next_random() % 4 == 0){
+            fat[entry] = 0;
+        }
+    }
+
+    for(size_t entry = entries - 8; entry < entries; entry++){
+        fat[entry] = 0;
+    }
+
+    /* check the kernel against the scalar one before timing it */
+    fat_scan_select(FAT_SCAN_SCALAR);
+
+    size_t expected_count = fat_count_nonzero(fat, entries);
+    size_t expected_zero = fat_find_zero(fat, entries);
+    size_t expected_run = fat_find_zero_run(fat, entries, 8);
+
+    if(fat_scan_select((enum fat_scan_impl)impl)){
+        fprintf(stderr, "fs_bench: fat scan kernel not supported by this CPU\n");
+        fat_scan_select(FAT_SCAN_AUTO);
+        free(fat);
+        return 0;
+    }
+
+    if(fat_count_nonzero(fat, entries)!=expected_count
+            || fat_find_zero(fat, entries)!=expected_zero
+            || fat_find_zero_run(fat, entries, 8)!=expected_run){
+        fprintf(stderr, "fs_bench: %s fat scan kernel disagrees with scalar\n",
+                fat_scan_name());
+        fat_scan_select(FAT_SCAN_AUTO);
+        free(fat);
+        return -1;
+    }
+
+    size_t checksum = 0;
+
+    double start;
+
+    begin_measure(result, FS_OP_INFO, &start);
+
+    for(size_t op = 0; op < config->ops; op++){
+        checksum += fat_count_nonzero(fat, entries);
+        checksum += fat_find_zero(fat, entries);
+        checksum += fat_find_zero_run(fat, entries, 8);
+
+        result->bytes += 3 * entries * sizeof(uint16_t);
+        result->ops++;
+    }
+
+    end_measure(result, start);
+
+    if(checksum==0){
+        fprintf(stderr, "fs_bench: unexpected fat scan result\n");
+    }
+
+    fat_scan_select(FAT_SCAN_AUTO);
+
+    free(fat);
+
+    return 0;
+}
+
+static int wl_crc32c(struct bench_config* config, size_t impl,
+        struct bench_result* result){
+
+    uint8_t* block = (uint8_t*)malloc(BLOCK_SIZE_DEFAULT);
+
+    for(size_t i = 0; i < BLOCK_SIZE_DEFAULT; i++){
+        block[i] = (uint8_t)next_random();
+    }
+
+    /* check the kernel against the software one before timing it */
+    crc32c_select(CRC32C_SOFTWARE);
+
+    uint32_t expected = crc32c(0, block, BLOCK_SIZE_DEFAULT);
+
+    if(crc32c_select((enum crc32c_impl)impl)){
+        fprintf(stderr, "fs_bench: crc32c kernel not supported by this CPU\n");
+        crc32c_select(CRC32C_AUTO);
+        free(block);
+        return 0;
+    }
+
+    if(crc32c(0, block, BLOCK_SIZE_DEFAULT)!=expected){
+        fprintf(stderr, "fs_bench: %s crc32c kernel disagrees with software\n",
+                crc32c_name());
+        crc32c_select(CRC32C_AUTO);
+        free(block);
+        return -1;
+    }
+
+    uint32_t checksum = 0;
+
+    double start;
+
+    begin_measure(result, FS_OP_READ, &start);
+
+    /* the software kernel is slow, give it fewer blocks */
+    size_t blocks = impl==CRC32C_SOFTWARE ? config->ops : config->ops * 16;
+
+    for(size_t op = 0; op < blocks; op++){
+        checksum ^= crc32c(checksum, block, BLOCK_SIZE_DEFAULT);
+
+        result->bytes += BLOCK_SIZE_DEFAULT;
+        result->ops++;
+    }
+
+    end_measure(result, start);
+
+    if(checksum==expected){
+        fprintf(stderr, "fs_bench: unexpected crc32c result\n");
+    }
+
+    crc32c_select(CRC32C_AUTO);
+
+    free(block);
+
+    return 0;
+}
+
+/*
+ * Remounts an image holding a few files. mount_dirty marks the superblock
+ * dirty before every mount, as a crash would leave it, so every mount
+ * looks for journal transactions to replay and unmounting marks the disk
+ * clean again.
+ */
+static int wl_mount(struct bench_config* config, size_t state,
+        struct bench_result* result){
+
+    char name[FS_FILENAME_LEN];
+
+    for(size_t file = 0; file < FS_FILE_MAX_COUNT / 2; file++){
+        snprintf(name, FS_FILENAME_LEN, "mount%zu", file);
+
+        int fd = populate_file(name, 4 * block_size);
+
+        fs_close(fd);
+    }
+
+    struct fs_mount_options options = { .durability = config->durability };
+
+    /* every dirty mount costs a superblock write and sync at unmount */
+    size_t mounts = config->ops / 10 + 1;
+
+    uint8_t dirty = (uint8_t)state;
+
+    if(fs_umount()){
+        return -1;
+    }
+
+    double start;
+
+    begin_measure(result, FS_OP_MOUNT, &start);
+
+    for(size_t mount = 0; mount < mounts; mount++){
+        if(state==FS_STATE_DIRTY){
+            int fd = open(config->image, O_WRONLY);
+
+            pwrite(fd, &dirty, 1, offsetof(struct DiskMetadata, state));
+            close(fd);
+        }
+
+        if(fs_mount_with(config->image, &options)){
+            return -1;
+        }
+
+        result->ops++;
+
+        if(mount + 1 < mounts && fs_umount()){
+            return -1;
+        }
+    }
+
+    end_measure(result, start);
+
+    return 0;
+}
+
+/*
+ * Opens and closes random files of a root directory formatted with, and
+ * filled to, @entries entries. Lookups are hashed, so the time per open
+ * should not depend on @entries.
+ */
+static int wl_dir_lookup(struct bench_config* config, size_t entries,
+        struct bench_result* result){
+
+    char name[FS_FILENAME_LEN];
+
+    struct disk_format format = { .directory_entries = entries };
+
+    struct fs_mount_options options = { .durability = config->durability };
+
+    if(fs_umount() || format_image(config, &format)
+            || fs_mount_with(config->image, &options)){
+        return -1;
+    }
+
+    //empty files take no data blocks
+    for(size_t file = 0; file < entries; file++){
+        snprintf(name, FS_FILENAME_LEN, "d%u", (unsigned int)file);
+
+        if(fs_create(name)){
+            return -1;
+        }
+    }
+
+    double start;
+
+    begin_measure(result, FS_OP_OPEN, &start);
+
+    for(size_t op = 0; op < config->ops; op++){
+        snprintf(name, FS_FILENAME_LEN, "d%u", (unsigned int)(next_random() % entries));
+
+        int fd = fs_open(name);
+
+        if(fd < 0){
+            return -1;
+        }
+
+        fs_close(fd);
+
+        result->ops++;
+    }
+
+    end_measure(result, start);
+
+    return 0;
+}
+
+/*
+ * Lists and sizes the @entries files of a subdirectory with
+ * fs_opendir()/fs_readdir(), in batches of 32. The image is remounted
+ * before, so the first listing reads the directory from disk, and every
+ * later one is answered from the cache.
+ */
+static int wl_readdir(struct bench_config* config, size_t entries,
+        struct bench_result* result){
+
+    char name[FS_PATH_MAX_LEN];
+
+    struct fs_mount_options options = { .durability = config->durability };
+
+    if(fs_mkdir("list")){
+        return -1;
+    }
+
+    for(size_t file = 0; file < entries; file++){
+        snprintf(name, sizeof(name), "list/r%u", (unsigned int)file);
+
+        int fd = populate_file(name, 100);
+
+        fs_close(fd);
+    }
+
+    if(fs_umount() || fs_mount_with(config->image, &options)){
+        return -1;
+    }
+
+    struct fs_dirent batch[32];
+
+    double start;
+
+    begin_measure(result, FS_OP_READDIR, &start);
+
+    for(size_t op = 0; op < config->ops; op++){
+        int dd = fs_opendir("list");
+
+        if(dd < 0){
+            return -1;
+        }
+
+        size_t listed = 0;
+        uint64_t bytes = 0;
+        int read;
+
+        while((read = fs_readdir(dd, batch, 32)) > 0){
+            for(int i = 0; i < read; i++){
+                bytes += batch[i].size;
+            }
+
+            listed += (size_t)read;
+        }
+
+        fs_closedir(dd);
+
+        if(read < 0 || listed!=entries){
+            return -1;
+        }
+
+        result->ops++;
+        result->bytes += bytes;
+    }
+
+    end_measure(result, start);
+
+    return 0;
+}
+
+/*
+ * Formats a fresh image with @format and mounts it
+ */
+static int small_image(struct bench_config* config, const struct disk_format* format){
+    struct fs_mount_options options = { .durability = config->durability };
+
+    if(fs_umount() || format_image(config, format)
+            || fs_mount_with(config->image, &options)){
+        return -1;
+    }
+
+    return fs_mkdir("small");
+}
+
+/*
+ * Creates up to config->ops files of 1 to @max_size bytes in the small
+ * subdirectory, stopping when the disk is full
+ *
+ * Returns: the number of files created
+ */
+static size_t create_small_files(struct bench_config* config, size_t max_size,
+        struct bench_result* result){
+
+    char name[FS_PATH_MAX_LEN];
+    uint8_t data[SMALL_FILE_MAX];
+
+    memset(data, 0x5a, SMALL_FILE_MAX);
+
+    //the workloads of every format create the same files
+    rng_state = (uint64_t)config->seed * 0x9e3779b97f4a7c15ull;
+
+    size_t files = 0;
+
+    for(; files < config->ops; files++){
+        snprintf(name, sizeof(name), "small/s%zu", files);
+
+        if(fs_create(name)){
+            break;
+        }
+
+        int fd = fs_open(name);
+
+        size_t size = 1 + (size_t)(next_random() % max_size);
+
+        int ret = fs_write(fd, data, size);
+
+        fs_close(fd);
+
+        if(ret!=(int)size){
+            fs_delete(name);
+            break;
+        }
+
+        if(result!=NULL){
+            result->ops++;
+            result->bytes += size;
+        }
+    }
+
+    return files;
+}
+
+/*
+ * Creates and writes config->ops files of up to @max_size bytes in a
+ * subdirectory of an image formatted with @format. On an image too small
+ * for them, the ops column tells how many fit.
+ */
+static int small_create(struct bench_config* config, const struct disk_format* format,
+        size_t max_size, struct bench_result* result){
+
+    if(small_image(config, format)){
+        return -1;
+    }
+
+    double start;
+
+    begin_measure(result, FS_OP_WRITE, &start);
+
+    create_small_files(config, max_size, result);
+
+    end_measure(result, start);
+
+    return 0;
+}
+
+/*
+ * Reads back the files of small_create() after a remount
+ */
+static int small_read(struct bench_config* config, const struct disk_format* format,
+        size_t max_size, struct bench_result* result){
+
+    char name[FS_PATH_MAX_LEN];
+    uint8_t data[SMALL_FILE_MAX];
+
+    struct fs_mount_options options = { .durability = config->durability };
+
+    if(small_image(config, format)){
+        return -1;
+    }
+
+    size_t files = create_small_files(config, max_size, NULL);
+
+    if(fs_umount() || fs_mount_with(config->image, &options)){
+        return -1;
+    }
+
+    double start;
+
+    begin_measure(result, FS_OP_READ, &start);
+
+    for(size_t file = 0; file < files; file++){
+        snprintf(name, sizeof(name), "small/s%zu", file);
+
+        int fd = fs_open(name);
+
+        int ret = fs_read(fd, data, SMALL_FILE_MAX);
+
+        fs_close(fd);
+
+        if(ret <= 0){
+            return -1;
+        }
+
+        result->ops++;
+        result->bytes += (size_t)ret;
+    }
+
+    end_measure(result, start);
+
+    return 0;
+}
+
+/*
+ * Files of up to SMALL_FILE_MAX bytes, packed in shared blocks with
+ * @packed. Packed files share the reads of their blocks.
+ */
+static int wl_small_create(struct bench_config* config, size_t packed,
+        struct bench_result* result){
+
+    struct disk_format format = { .tail_packing = packed!=0 };
+
+    return small_create(config, &format, SMALL_FILE_MAX, result);
+}
+
+static int wl_small_read(struct bench_config* config, size_t packed,
+        struct bench_result* result){
+
+    struct disk_format format = { .tail_packing = packed!=0 };
+
+    return small_read(config, &format, SMALL_FILE_MAX, result);
+}
+
+/*
+ * Files of up to TINY_FILE_MAX bytes, such as markers and locks, stored
+ * in directory entries of @entry_size bytes when it is not 0. Inline
+ * files take no data block I/O at all.
+ */
+static int wl_tiny_create(struct bench_config* config, size_t entry_size,
+        struct bench_result* result){
+
+    struct disk_format format = { .entry_size = entry_size };
+
+    return small_create(config, &format, TINY_FILE_MAX, result);
+}
+
+static int wl_tiny_read(struct bench_config* config, size_t entry_size,
+        struct bench_result* result){
+
+    struct disk_format format = { .entry_size = entry_size };
+
+    return small_read(config, &format, TINY_FILE_MAX, result);
+}
+
+/*
+ * Takes and deletes a snapshot of an image holding the files of
+ * small_create(), config->ops / 16 times. A snapshot copies the
+ * metadata, so this should not depend on how much the files hold.
+ */
+static int wl_snapshot(struct bench_config* config, size_t request_size,
+        struct bench_result* result){
+
+    if(small_image(config, NULL)){
+        return -1;
+    }
+
+    create_small_files(config, SMALL_FILE_MAX, NULL);
+
+    size_t cycles = config->ops / 16 > 0 ? config->ops / 16 : 1;
+
+    double start;
+
+    begin_measure(result, FS_OP_SNAPSHOT_CREATE, &start);
+
+    for(size_t cycle = 0; cycle < cycles; cycle++){
+        if(fs_snapshot_create("bench") || fs_snapshot_delete("bench")){
+            break;
+        }
+
+        result->ops++;
+    }
+
+    end_measure(result, start);
+
+    return 0;
+}
+
+/*
+ * Overwrites a file of config->file_bytes in requests of @request_size
+ * right after a snapshot was taken, so that every block written is
+ * first moved to a new one
+ */
+static int wl_cow_write(struct bench_config* config, size_t request_size,
+        struct bench_result* result){
+
+    if(fs_create("cow")){
+        return -1;
+    }
+
+    int fd = fs_open("cow");
+
+    uint8_t* buf = (uint8_t*)calloc(1, request_size);
+
+    memset(buf, 0xab, request_size);
+
+    for(size_t written = 0; written < config->file_bytes; written += request_size){
+        if(fs_write(fd, buf, request_size)!=(int)request_size){
+            break;
+        }
+    }
+
+    if(fs_snapshot_create("bench")){
+        fs_close(fd);
+        free(buf);
+        return -1;
+    }
+
+    fs_lseek(fd, 0);
+
+    memset(buf, 0xcd, request_size);
+
+    double start;
+
+    begin_measure(result, FS_OP_WRITE, &start);
+
+    for(size_t written = 0; written < config->file_bytes; written += request_size){
+        int ret = fs_write(fd, buf, request_size);
+
+        if(ret <= 0){
+            break;
+        }
+
+        result->bytes += (size_t)ret;
+        result->ops++;
+    }
+
+    end_measure(result, start);
+
+    fs_close(fd);
+    free(buf);
+
+    return 0;
+}
+
+/*
+ * Copies a file of config->file_bytes with fs_copy_file() in mode @mode,
+ * config->ops / 64 times. A reflink costs a directory entry whatever the
+ * size of the file.
+ */
+static int wl_copy(struct bench_config* config, size_t mode,
+        struct bench_result* result){
+
+    char name[FS_PATH_MAX_LEN];
+
+    if(fs_create("orig")){
+        return -1;
+    }
+
+    int fd = fs_open("orig");
+
+    uint8_t* buf = (uint8_t*)calloc(1, 64 * KIB);
+
+    memset(buf, 0xab, 64 * KIB);
+
+    for(size_t written = 0; written < config->file_bytes; written += 64 * KIB){
+        if(fs_write(fd, buf, 64 * KIB)!=64 * KIB){
+            break;
+        }
+    }
+
+    fs_close(fd);
+    free(buf);
+
+    size_t copies = config->ops / 64 > 0 ? config->ops / 64 : 1;
+
+    double start;
+
+    begin_measure(result, FS_OP_COPY, &start);
+
+    for(size_t copy = 0; copy < copies; copy++){
+        snprintf(name, sizeof(name), "copy%zu", copy);
+
+        if(fs_copy_file("orig", name, (enum fs_copy_mode)mode)){
+            break;
+        }
+
+        result->bytes += config->file_bytes;
+        result->ops++;
+    }
+
+    end_measure(result, start);
+
+    return 0;
+}
+
+static struct workload workloads[] = {
+    { "seq_write_512",  wl_seq_write,  512 },
+    { "seq_write_4k",   wl_seq_write,  4 * KIB },
+    { "seq_write_64k",  wl_seq_write,  64 * KIB },
+    { "seq_write_1m",   wl_seq_write,  MIB },
+    { "seq_read_512",   wl_seq_read,   512 },
+    { "seq_read_4k",    wl_seq_read,   4 * KIB },
+    { "seq_read_64k",   wl_seq_read,   64 * KIB },
+    { "seq_read_1m",    wl_seq_read,   MIB },
+    { "rand_read_4k",   wl_rand_read,  4 * KIB },
+    { "rand_write_4k",  wl_rand_write, 4 * KIB },
+    { "append_log",     wl_append_log, LOG_RECORD_SIZE },
+    { "churn",          wl_churn,      CHURN_FILE_SIZE },
+    { "fill",           wl_fill,       64 * KIB },
+    { "fat_scan_scalar", wl_fat_scan,  FAT_SCAN_SCALAR },
+    { "fat_scan_sse2",  wl_fat_scan,   FAT_SCAN_SSE2 },
+    { "fat_scan_avx2",  wl_fat_scan,   FAT_SCAN_AVX2 },
+    { "crc32c_software", wl_crc32c,    CRC32C_SOFTWARE },
+    { "crc32c_sse42",   wl_crc32c,     CRC32C_SSE42 },
+    { "verify_off",     wl_seq_read_verify, FS_VERIFY_OFF },
+    { "verify_sampled", wl_seq_read_verify, FS_VERIFY_SAMPLED },
+    { "verify_always",  wl_seq_read_verify, FS_VERIFY_ALWAYS },
+    { "mount_clean",    wl_mount,      FS_STATE_CLEAN },
+    { "mount_dirty",    wl_mount,      FS_STATE_DIRTY },
+    { "dir_lookup_128", wl_dir_lookup, 128 },
+    { "dir_lookup_100k", wl_dir_lookup, 100000 },
+    { "readdir_128",    wl_readdir,    128 },
+    { "small_create",   wl_small_create, false },
+    { "small_create_packed", wl_small_create, true },
+    { "small_read",     wl_small_read, false },
+    { "small_read_packed", wl_small_read, true },
+    { "tiny_create",    wl_tiny_create, 0 },
+    { "tiny_create_inline", wl_tiny_create, 64 },
+    { "tiny_read",      wl_tiny_read,  0 },
+    { "tiny_read_inline", wl_tiny_read, 64 },
+    { "snapshot",       wl_snapshot,   0 },
+    { "cow_write_4k",   wl_cow_write,  4 * KIB },
+    { "copy_deep",      wl_copy,       FS_COPY_DEEP },
+    { "copy_reflink",   wl_copy,       FS_COPY_REFLINK },
+};
+
+#define WORKLOAD_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+
+/* every workload at every block size */
+#define MAX_SUMMARIES (WORKLOAD_COUNT * MAX_BLOCK_SIZES)
+
+static bool workload_selected(const char* selection, const char* name){
+    if(selection==NULL || strcmp(selection, "all")==0){
+        return true;
+    }
+
+    size_t name_len = strlen(name);
+
+    const char* entry = selection;
+
+    while(*entry!='\0'){
+        const char* end = strchr(entry, ',');
+
+        size_t entry_len = end ? (size_t)(end - entry) : strlen(entry);
+
+        if(entry_len==name_len && strncmp(entry, name, name_len)==0){
+            return true;
+        }
+
+        if(end==NULL){
+            break;
+        }
+
+        entry = end + 1;
+    }
+
+    return false;
+}
+
+/*
+ * Median of repeated runs with a distribution-free 95% confidence
+ * interval taken from the order statistics of the samples
+ */
+struct metric{
+    double median;
+    double ci_low;
+    double ci_high;
+};
+
+struct bench_summary{
+    const char* name;
+    size_t runs;
+    enum fs_op lat_op;
+
+    /*
+     * Medians of the runs
+     */
+    size_t ops;
+    size_t bytes;
+    double seconds;
+
+    struct metric mb_s;
+    struct metric ops_s;
+    struct metric p50_us;
+    struct metric p99_us;
+    struct metric p999_us;
+    struct metric max_us;
+
+    uint64_t block_reads;
+    uint64_t block_writes;
+    uint64_t block_syncs;
+};
+
+static int compare_double(const void* a, const void* b){
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+
+    return (x > y) - (x < y);
+}
+
+static struct metric summarize(double* samples, size_t count){
+    struct metric metric;
+
+    qsort(samples, count, sizeof(double), compare_double);
+
+    if(count % 2 == 1){
+        metric.median = samples[count / 2];
+    } else {
+        metric.median = (samples[count / 2 - 1] + samples[count / 2]) / 2;
+    }
+
+    /* ranks n/2 -+ 1.96 * sqrt(n) / 2, from the binomial approximation */
+    double spread = 0.98 * sqrt((double)count);
+
+    double low_rank = floor((double)count / 2 - spread);
+    double high_rank = ceil((double)count / 2 + spread);
+
+    size_t low = low_rank < 0 ? 0 : (size_t)low_rank;
+    size_t high = high_rank > (double)(count - 1) ? count - 1 : (size_t)high_rank;
+
+    metric.ci_low = samples[low];
+    metric.ci_high = samples[high];
+
+    return metric;
+}
+
+static void summarize_runs(struct bench_result* runs, size_t run_count,
+        struct bench_summary* summary){
+
+    double* samples = (double*)calloc(run_count, sizeof(double));
+
+    memset(summary, 0, sizeof(struct bench_summary));
+
+    summary->name = runs[0].name;
+    summary->runs = run_count;
+    summary->lat_op = runs[0].lat_op;
+
+    #define SUMMARIZE(field, expr)                          \
+        for(size_t run = 0; run < run_count; run++){        \
+            struct bench_result* result = &runs[run];       \
+            samples[run] = (expr);                          \
+        }                                                   \
+        summary->field = summarize(samples, run_count);
+
+    SUMMARIZE(mb_s, result->seconds > 0 ? result->bytes / 1e6 / result->seconds : 0);
+    SUMMARIZE(ops_s, result->seconds > 0 ? result->ops / result->seconds : 0);
+    SUMMARIZE(p50_us, result->lat.p50_ns / 1000.0);
+    SUMMARIZE(p99_us, result->lat.p99_ns / 1000.0);
+    SUMMARIZE(p999_us, result->lat.p999_ns / 1000.0);
+    SUMMARIZE(max_us, result->lat.max_ns / 1000.0);
+
+    #undef SUMMARIZE
+
+    for(size_t run = 0; run < run_count; run++){
+        samples[run] = runs[run].seconds;
+    }
+
+    summary->seconds = summarize(samples, run_count).median;
+
+    /* the work done does not change between runs */
+    summary->ops = runs[0].ops;
+    summary->bytes = runs[0].bytes;
+    summary->block_reads = runs[0].stats.block_reads;
+    summary->block_writes = runs[0].stats.block_writes;
+    summary->block_syncs = runs[0].stats.block_syncs;
+
+    free(samples);
+}
+
+static void print_text_header(size_t runs){
+    printf("%-18s %8s %10s %9s %10s %10s", "workload", "ops", "MiB", "sec",
+            "MB/s", "ops/s");
+
+    if(runs > 1){
+        printf(" %21s", "ops/s 95% CI");
+    }
+
+    printf(" %10s %10s %10s %10s\n", "p50_us", "p99_us", "p99.9_us", "max_us");
+}
+
+static void print_text_summary(struct bench_summary* summary){
+    printf("%-18s %8zu %10.2f %9.3f %10.2f %10.1f",
+            summary->name, summary->ops, (double)summary->bytes / MIB,
+            summary->seconds, summary->mb_s.median, summary->ops_s.median);
+
+    if(summary->runs > 1){
+        printf(" %10.1f-%-10.1f", summary->ops_s.ci_low, summary->ops_s.ci_high);
+    }
+
+    printf(" %10.2f %10.2f %10.2f %10.2f\n",
+            summary->p50_us.median, summary->p99_us.median,
+            summary->p999_us.median, summary->max_us.median);
+}
+
+static void print_json_metric(FILE* out, const char* key, struct metric* metric,
+        const char* separator){
+
+    fprintf(out, "\"%s\": %.3f, \"%s_ci_low\": %.3f, \"%s_ci_high\": %.3f%s",
+            key, metric->median, key, metric->ci_low, key, metric->ci_high,
+            separator);
+}
+
+static void print_json(FILE* out, struct bench_config* config, const char* block_sizes,
+        size_t runs, struct bench_summary* summaries, size_t summary_count){
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"data_blocks\": %zu,\n", config->data_blocks);
+    fprintf(out, "  \"file_bytes\": %zu,\n", config->file_bytes);
+    fprintf(out, "  \"ops\": %zu,\n", config->ops);
+    fprintf(out, "  \"durability\": \"%s\",\n", durability_names[config->durability]);
+    fprintf(out, "  \"block_sizes\": \"%s\",\n", block_sizes);
+    fprintf(out, "  \"runs\": %zu,\n", runs);
+    fprintf(out, "  \"workloads\": [\n");
+
+    /* one workload per line, which is what load_baseline() expects */
+    for(size_t i = 0; i < summary_count; i++){
+        struct bench_summary* summary = &summaries[i];
+
+        fprintf(out, "    {\"name\": \"%s\", \"ops\": %zu, \"bytes\": %zu, "
+                "\"seconds\": %.6f, \"lat_op\": \"%s\", ",
+                summary->name, summary->ops, summary->bytes, summary->seconds,
+                fs_op_name(summary->lat_op));
+
+        print_json_metric(out, "mb_s", &summary->mb_s, ", ");
+        print_json_metric(out, "ops_s", &summary->ops_s, ", ");
+        print_json_metric(out, "p50_us", &summary->p50_us, ", ");
+        print_json_metric(out, "p99_us", &summary->p99_us, ", ");
+        print_json_metric(out, "p999_us", &summary->p999_us, ", ");
+        print_json_metric(out, "max_us", &summary->max_us, ", ");
+
+        fprintf(out, "\"block_reads\": %llu, \"block_writes\": %llu, "
+                "\"block_syncs\": %llu}%s\n",
+                (unsigned long long)summary->block_reads,
+                (unsigned long long)summary->block_writes,
+                (unsigned long long)summary->block_syncs,
+                i + 1 < summary_count ? "," : "");
+    }
+
+    fprintf(out, "  ]\n");
+    fprintf(out, "}\n");
+}
+
+/*
+ * Finds "@key": <number> in @line
+ */
+static bool json_number(const char* line, const char* key, double* value){
+    char pattern[64];
+
+    snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+
+    const char* found = strstr(line, pattern);
+
+    if(found==NULL){
+        return false;
+    }
+
+    char* end;
+
+    *value = strtod(found + strlen(pattern), &end);
+
+    return end != found + strlen(pattern);
+}
+
+static bool json_metric(const char* line, const char* key, struct metric* metric){
+    char bound_key[64];
+
+    if(!json_number(line, key, &metric->median)){
+        return false;
+    }
+
+    snprintf(bound_key, sizeof(bound_key), "%s_ci_low", key);
+
+    if(!json_number(line, bound_key, &metric->ci_low)){
+        metric->ci_low = metric->median;
+    }
+
+    snprintf(bound_key, sizeof(bound_key), "%s_ci_high", key);
+
+    if(!json_number(line, bound_key, &metric->ci_high)){
+        metric->ci_high = metric->median;
+    }
+
+    return true;
+}
+
+/*
+ * Reads a JSON file written by print_json(). Returns the number of
+ * workloads loaded, -1 if the file cannot be read.
+ */
+static int load_baseline(const char* path, struct bench_summary* baseline,
+        char names[][32], size_t max_count){
+
+    FILE* file = fopen(path, "r");
+
+    if(file==NULL){
+        return -1;
+    }
+
+    char line[2048];
+    size_t count = 0;
+
+    while(fgets(line, sizeof(line), file)!=NULL && count < max_count){
+        const char* name = strstr(line, "\"name\": \"");
+
+        if(name==NULL){
+            continue;
+        }
+
+        name += strlen("\"name\": \"");
+
+        const char* name_end = strchr(name, '"');
+
+        if(name_end==NULL || name_end - name >= 32){
+            continue;
+        }
+
+        struct bench_summary* summary = &baseline[count];
+
+        memset(summary, 0, sizeof(struct bench_summary));
+
+        memcpy(names[count], name, (size_t)(name_end - name));
+        names[count][name_end - name] = '\0';
+
+        summary->name = names[count];
+
+        if(!json_metric(line, "ops_s", &summary->ops_s)
+                || !json_metric(line, "p99_us", &summary->p99_us)){
+            continue;
+        }
+
+        json_metric(line, "mb_s", &summary->mb_s);
+
+        count++;
+    }
+
+    fclose(file);
+
+    return (int)count;
+}
+
+/*
+ * Compares @summaries to @baseline_path. A workload regresses when its
+ * median moved the wrong way by more than @threshold percent and its
+ * confidence interval no longer overlaps the baseline's.
+ *
+ * Returns the number of regressions, -1 if the baseline cannot be read.
+ */
+static int check_baseline(const char* baseline_path, double threshold,
+        struct bench_summary* summaries, size_t summary_count){
+
+    struct bench_summary baseline[MAX_SUMMARIES];
+    char names[MAX_SUMMARIES][32];
+
+    int baseline_count = load_baseline(baseline_path, baseline, names, MAX_SUMMARIES);
+
+    if(baseline_count < 0){
+        fprintf(stderr, "fs_bench: cannot read baseline '%s'\n", baseline_path);
+        return -1;
+    }
+
+    printf("\nbaseline: %s (threshold %.1f%%)\n", baseline_path, threshold);
+    printf("%-18s %12s %12s %8s %12s %12s %8s  %s\n", "workload",
+            "base_ops/s", "ops/s", "change", "base_p99_us", "p99_us", "change",
+            "verdict");
+
+    int regressions = 0;
+
+    for(size_t i = 0; i < summary_count; i++){
+        struct bench_summary* current = &summaries[i];
+        struct bench_summary* base = NULL;
+
+        for(int j = 0; j < baseline_count; j++){
+            if(strcmp(baseline[j].name, current->name)==0){
+                base = &baseline[j];
+                break;
+            }
+        }
+
+        if(base==NULL){
+            printf("%-18s %12s %12.1f %8s %12s %12.2f %8s  %s\n", current->name,
+                    "-", current->ops_s.median, "-", "-", current->p99_us.median,
+                    "-", "new");
+            continue;
+        }
+
+        double ops_change = base->ops_s.median > 0
+                ? (current->ops_s.median / base->ops_s.median - 1.0) * 100.0 : 0;
+
+        double p99_change = base->p99_us.median > 0
+                ? (current->p99_us.median / base->p99_us.median - 1.0) * 100.0 : 0;
+
+        bool slower = ops_change < -threshold
+                && current->ops_s.ci_high < base->ops_s.ci_low;
+
+        bool laggier = p99_change > threshold
+                && current->p99_us.ci_low > base->p99_us.ci_high;
+
+        const char* verdict = "ok";
+
+        if(slower && laggier){
+            verdict = "REGRESSION (throughput, p99)";
+        } else if(slower){
+            verdict = "REGRESSION (throughput)";
+        } else if(laggier){
+            verdict = "REGRESSION (p99)";
+        }
+
+        if(slower || laggier){
+            regressions++;
+        }
+
+        printf("%-18s %12.1f %12.1f %+7.1f%% %12.2f %12.2f %+7.1f%%  %s\n",
+                current->name, base->ops_s.median, current->ops_s.median,
+                ops_change, base->p99_us.median, current->p99_us.median,
+                p99_change, verdict);
+    }
+
+    return regressions;
+}
+
+static void usage(){
+    fprintf(stderr, "usage: fs_bench.x [-i <image>] [-b <data blocks>] [-s <MiB>] "
+            "[-n <ops>] [-w <workload>[,<workload>...]] [-r <runs>] "
+            "[-j <json file>] [-c <baseline json> [-t <percent>]] [-S <seed>] "
+            "[-d none|metadata|full] [-B <KiB>[,<KiB>...]] [-P]\n");
+    fprintf(stderr, "workloads:\n");
+
+    for(size_t i = 0; i < WORKLOAD_COUNT; i++){
+        fprintf(stderr, "\t%s\n", workloads[i].name);
+    }
+
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv){
+    struct bench_config config = {
+        .image = "fs_bench.fs",
+        .data_blocks = 8192,
+        .file_bytes = 4 * MIB,
+        .ops = 2000,
+        .seed = 1,
+        .durability = FS_DURABILITY_METADATA,
+    };
+
+    const char* selection = NULL;
+    const char* json_path = NULL;
+    const char* baseline_path = NULL;
+    const char* block_list = "4";
+    double threshold = 10.0;
+    size_t runs = 1;
+
+    int opt;
+
+    while((opt = getopt(argc, argv, "i:b:s:n:w:r:j:c:t:S:d:B:Ph")) != -1){
+        switch(opt){
+        case 'i':
+            config.image = optarg;
+            break;
+        case 'b':
+            config.data_blocks = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            config.file_bytes = strtoul(optarg, NULL, 10) * MIB;
+            break;
+        case 'n':
+            config.ops = strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            selection = optarg;
+            break;
+        case 'r':
+            runs = strtoul(optarg, NULL, 10);
+            break;
+        case 'j':
+            json_path = optarg;
+            break;
+        case 'c':
+            baseline_path = optarg;
+            break;
+        case 't':
+            threshold = strtod(optarg, NULL);
+            break;
+        case 'S':
+            config.seed = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            if(strcmp(optarg, "none")==0){
+                config.durability = FS_DURABILITY_NONE;
+            } else if(strcmp(optarg, "metadata")==0){
+                config.durability = FS_DURABILITY_METADATA;
+            } else if(strcmp(optarg, "full")==0){
+                config.durability = FS_DURABILITY_FULL;
+            } else {
+                usage();
+            }
+            break;
+        case 'B':
+            block_list = optarg;
+            break;
+        case 'P':
+            config.preallocate = true;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if(config.file_bytes==0 || config.ops==0 || runs==0){
+        usage();
+    }
+
+    size_t block_sizes[MAX_BLOCK_SIZES];
+    size_t block_size_count = 0;
+
+    for(const char* size = block_list; *size!='\0'; ){
+        char* end;
+        size_t kib = strtoul(size, &end, 10);
+
+        if(end==size || (*end!=',' && *end!='\0') || block_size_count==MAX_BLOCK_SIZES){
+            usage();
+        }
+
+        block_sizes[block_size_count++] = kib * KIB;
+
+        size = *end==',' ? end + 1 : end;
+    }
+
+    if(block_size_count==0){
+        usage();
+    }
+
+    /* workload names carry the block size when several are compared */
+    char (*labels)[32] = (char (*)[32])calloc(MAX_SUMMARIES, 32);
+
+    struct bench_result* results =
+            (struct bench_result*)calloc(runs, sizeof(struct bench_result));
+
+    struct bench_summary* summaries =
+            (struct bench_summary*)calloc(MAX_SUMMARIES, sizeof(struct bench_summary));
+
+    size_t summary_count = 0;
+
+    bool json_only = json_path!=NULL && strcmp(json_path, "-")==0;
+
+    if(!json_only){
+        print_text_header(runs);
+    }
+
+    for(size_t size = 0; size < block_size_count; size++){
+        config.block_size = block_sizes[size];
+
+        for(size_t i = 0; i < WORKLOAD_COUNT; i++){
+            struct workload* workload = &workloads[i];
+
+            if(!workload_selected(selection, workload->name)){
+                continue;
+            }
+
+            memset(results, 0, runs * sizeof(struct bench_result));
+
+            for(size_t run = 0; run < runs; run++){
+                /* every run replays the same operations */
+                rng_state = (uint64_t)config.seed * 0x9e3779b97f4a7c15ull + i + 1;
+
+                if(fresh_image(&config)){
+                    fprintf(stderr, "fs_bench: cannot format and mount '%s' with %zu KiB blocks\n",
+                            config.image, config.block_size / KIB);
+                    return EXIT_FAILURE;
+                }
+
+                struct bench_result* result = &results[run];
+
+                result->name = workload->name;
+
+                if(workload->run(&config, workload->request_size, result)){
+                    fprintf(stderr, "fs_bench: workload '%s' failed\n", workload->name);
+                    fs_umount();
+                    return EXIT_FAILURE;
+                }
+
+                fs_umount();
+            }
+
+            struct bench_summary* summary = &summaries[summary_count++];
+
+            summarize_runs(results, runs, summary);
+
+            if(block_size_count > 1){
+                snprintf(labels[summary_count - 1], 32, "%s@%zuk", workload->name,
+                        config.block_size / KIB);
+
+                summary->name = labels[summary_count - 1];
+            }
+
+            if(!json_only){
+                print_text_summary(summary);
+                fflush(stdout);
+            }
+        }
+    }
+
+    unlink(config.image);
+
+    if(summary_count==0){
+        usage();
+    }
+
+    if(json_path!=NULL){
+        FILE* out = json_only ? stdout : fopen(json_path, "w");
+
+        if(out==NULL){
+            perror("fopen");
+            return EXIT_FAILURE;
+        }
+
+        print_json(out, &config, block_list, runs, summaries, summary_count);
+
+        if(out!=stdout){
+            fclose(out);
+        }
+    }
+
+    int regressions = 0;
+
+    if(baseline_path!=NULL){
+        regressions = check_baseline(baseline_path, threshold, summaries, summary_count);
+
+        if(regressions < 0){
+            return EXIT_FAILURE;
+        }
+
+        printf("%d regression(s)\n", regressions);
+    }
+
+    free(results);
+    free(summaries);
+    free(labels);
+
+    return regressions ? EXIT_FAILURE : EXIT_SUCCESS;
+}
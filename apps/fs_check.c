@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "fs.h"
+
+/*
+ * usage:
+ *
+ * ./fs_check.x [-r] [-s] [-j <threads>] [-v] <diskname>
+ *
+ *	-r: free blocks that are used in the FAT but reached by no file, and
+ *	    stamp blocks found by -s with their current content
+ *	-s: read every file block and check it against its CRC32C, on disks
+ *	    formatted with checksums
+ *	-j: threads walking the file chains (default: one per CPU)
+ *	-v: print every problem found
+ *
+ * The image is mounted to be checked, so a committed journal is
+ * replayed first. Exits with 0 if the file system is consistent, 1
+ * otherwise.
+ */
+
+static void usage(){
+    fprintf(stderr, "usage: ./fs_check.x [-r] [-s] [-j <threads>] [-v] <diskname>\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv){
+    struct fs_check_options options;
+    struct fs_check_report report;
+
+    memset(&options, 0, sizeof(struct fs_check_options));
+
+    int opt;
+
+    while((opt = getopt(argc, argv, "rsj:vh")) != -1){
+        switch(opt){
+        case 'r':
+            options.repair = true;
+            break;
+        case 's':
+            options.scrub = true;
+            break;
+        case 'j':
+            options.threads = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'v':
+            options.verbose = true;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if(optind!=argc - 1){
+        usage();
+    }
+
+    int problems = fs_check(argv[optind], &options, &report);
+
+    if(problems < 0){
+        fprintf(stderr, "fs_check: cannot check '%s'\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    printf("files=%zu\n", report.files);
+    printf("used_blocks=%zu\n", report.used_blocks);
+    printf("bad_chains=%zu\n", report.bad_chains);
+    printf("shared_chains=%zu\n", report.shared_chains);
+    printf("size_mismatches=%zu\n", report.size_mismatches);
+    printf("leaked_blocks=%zu\n", report.leaked_blocks);
+    printf("repaired_blocks=%zu\n", report.repaired_blocks);
+
+    if(options.scrub){
+        printf("checksum_errors=%zu\n", report.checksum_errors);
+        printf("restamped_blocks=%zu\n", report.restamped_blocks);
+    }
+
+    printf("check_time=%.3f ms\n", (double)report.check_ns / 1e6);
+
+    if(problems > 0){
+        printf("%s: %d problem(s) found\n", argv[optind], problems);
+        return EXIT_FAILURE;
+    }
+
+    printf("%s: clean\n", argv[optind]);
+
+    return EXIT_SUCCESS;
+}
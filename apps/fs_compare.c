@@ -0,0 +1,497 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "utilities.h"
+
+/*
+ * usage:
+ *
+ * ./fs_compare.x [-R <ref binary>] [-L <lib binary>] [-t <percent>]
+ *                [-r <runs>] [-b <data blocks>] [<script> ...]
+ *
+ *	-R: reference program (default: ./fs_ref.x)
+ *	-L: program linked with our libfs (default: ./test_fs.x)
+ *	-t: flag workloads where libfs is slower than the reference by
+ *	    more than this percentage (default: 10)
+ *	-r: runs per program and workload, the median is reported (default: 3)
+ *	-b: number of data blocks of the image (default: 8192)
+ *	-d: durability mode the lib program mounts with, none, metadata or
+ *	    full (default: none, the reference never syncs either)
+ *
+ * Every workload is a test_fs.x script. Both programs run it with
+ * "script <image> <script>" on a freshly formatted image, the lib program
+ * with "-d <mode>" in front. When no
+ * script is given, a set of built-in workloads is generated in a
+ * temporary directory.
+ *
+ * For each run, wall time is measured around fork/exec, CPU time comes
+ * from wait4()'s rusage and I/O syscalls from the child's /proc/<pid>/io,
+ * read while it is still a zombie. Outputs of both programs are compared
+ * too, like tester_example.sh does.
+ *
+ * Exits with 1 if any workload is flagged.
+ */
+
+#define MAX_RUNS 64
+
+struct run_sample{
+    double wall_ms;
+    double cpu_ms;
+    uint64_t syscr;
+    uint64_t syscw;
+    uint64_t rchar;
+    uint64_t wchar;
+};
+
+struct program_result{
+    struct run_sample median;
+    char* output;
+    size_t output_size;
+    int status;
+};
+
+static double now_ms(){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec * 1e3 + (double)ts.tv_nsec / 1e6;
+}
+
+static void read_proc_io(pid_t pid, struct run_sample* sample){
+    char path[64];
+    char line[128];
+
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+
+    FILE* file = fopen(path, "r");
+
+    if(file==NULL){
+        return;
+    }
+
+    while(fgets(line, sizeof(line), file)!=NULL){
+        unsigned long long value;
+
+        if(sscanf(line, "syscr: %llu", &value)==1){
+            sample->syscr = value;
+        } else if(sscanf(line, "syscw: %llu", &value)==1){
+            sample->syscw = value;
+        } else if(sscanf(line, "rchar: %llu", &value)==1){
+            sample->rchar = value;
+        } else if(sscanf(line, "wchar: %llu", &value)==1){
+            sample->wchar = value;
+        }
+    }
+
+    fclose(file);
+}
+
+static char* read_file(const char* path, size_t* size){
+    FILE* file = fopen(path, "r");
+
+    if(file==NULL){
+        *size = 0;
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+
+    long length = ftell(file);
+
+    fseek(file, 0, SEEK_SET);
+
+    char* data = (char*)calloc(1, (size_t)length + 1);
+
+    *size = fread(data, 1, (size_t)length, file);
+
+    fclose(file);
+
+    return data;
+}
+
+/*
+ * Formats @image without letting create_disk() print to our stdout
+ */
+static int format_image(const char* image, size_t data_blocks){
+    unlink(image);
+
+    fflush(stdout);
+
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+
+    int ret = create_disk(data_blocks, (char*)image);
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+
+    return ret;
+}
+
+/*
+ * Runs "@program script @image @script" once, with its stdout and
+ * stderr sent to @output_path, and "-d @durability" in front unless
+ * @durability is NULL
+ */
+static int run_once(const char* program, const char* durability,
+        const char* image, const char* script, const char* output_path,
+        struct run_sample* sample, int* status){
+
+    memset(sample, 0, sizeof(struct run_sample));
+
+    double start = now_ms();
+
+    pid_t pid = fork();
+
+    if(pid < 0){
+        perror("fork");
+        return -1;
+    }
+
+    if(pid==0){
+        int out_fd = open(output_path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+
+        if(out_fd >= 0){
+            dup2(out_fd, STDOUT_FILENO);
+            dup2(out_fd, STDERR_FILENO);
+            close(out_fd);
+        }
+
+        if(durability){
+            execl(program, program, "-d", durability, "script", image, script,
+                    (char*)NULL);
+        } else {
+            execl(program, program, "script", image, script, (char*)NULL);
+        }
+
+        perror("execl");
+        _exit(127);
+    }
+
+    siginfo_t info;
+
+    /* leave the child a zombie so its /proc/<pid>/io is still there */
+    if(waitid(P_PID, pid, &info, WEXITED | WNOWAIT)){
+        perror("waitid");
+        return -1;
+    }
+
+    sample->wall_ms = now_ms() - start;
+
+    read_proc_io(pid, sample);
+
+    struct rusage usage;
+
+    if(wait4(pid, status, 0, &usage) < 0){
+        perror("wait4");
+        return -1;
+    }
+
+    sample->cpu_ms = usage.ru_utime.tv_sec * 1e3 + usage.ru_utime.tv_usec / 1e3
+                   + usage.ru_stime.tv_sec * 1e3 + usage.ru_stime.tv_usec / 1e3;
+
+    return 0;
+}
+
+static int compare_double(const void* a, const void* b){
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+
+    return (x > y) - (x < y);
+}
+
+static double median(double* values, size_t count){
+    qsort(values, count, sizeof(double), compare_double);
+
+    if(count % 2 == 1){
+        return values[count / 2];
+    }
+
+    return (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+static int run_program(const char* program, const char* durability,
+        const char* image, const char* script, const char* output_path,
+        size_t data_blocks, size_t runs, struct program_result* result){
+
+    double wall[MAX_RUNS];
+    double cpu[MAX_RUNS];
+
+    memset(result, 0, sizeof(struct program_result));
+
+    for(size_t run = 0; run < runs; run++){
+        struct run_sample sample;
+
+        if(format_image(image, data_blocks)){
+            fprintf(stderr, "fs_compare: cannot format '%s'\n", image);
+            return -1;
+        }
+
+        if(run_once(program, durability, image, script, output_path, &sample,
+                    &result->status)){
+            return -1;
+        }
+
+        wall[run] = sample.wall_ms;
+        cpu[run] = sample.cpu_ms;
+
+        /* syscall counts are deterministic, keep the last run's */
+        result->median.syscr = sample.syscr;
+        result->median.syscw = sample.syscw;
+        result->median.rchar = sample.rchar;
+        result->median.wchar = sample.wchar;
+    }
+
+    result->median.wall_ms = median(wall, runs);
+    result->median.cpu_ms = median(cpu, runs);
+
+    result->output = read_file(output_path, &result->output_size);
+
+    return 0;
+}
+
+/*
+ * Generates the built-in workloads in @dir and returns their paths
+ */
+static size_t generate_workloads(const char* dir, char** scripts){
+    char path[512];
+    char line[256];
+    size_t count = 0;
+
+    /* 4 MiB host file for the large sequential workload */
+    snprintf(path, sizeof(path), "%s/large_data", dir);
+
+    FILE* data = fopen(path, "w");
+
+    for(size_t i = 0; i < 4 * 1024 * 1024; i++){
+        fputc('a' + (int)(i * 7 % 26), data);
+    }
+
+    fclose(data);
+
+    snprintf(path, sizeof(path), "%s/large_file.script", dir);
+
+    FILE* script = fopen(path, "w");
+
+    fprintf(script, "MOUNT\nCREATE\tlarge\nOPEN\tlarge\n");
+    fprintf(script, "WRITE\tFILE\t%s/large_data\n", dir);
+    fprintf(script, "SEEK\t0\nREAD\t%d\tFILE\t%s/large_data\n", 4 * 1024 * 1024, dir);
+    fprintf(script, "CLOSE\nDELETE\tlarge\nUMOUNT\n");
+
+    fclose(script);
+
+    scripts[count++] = strdup(path);
+
+    /* fill the root directory with small files, then delete them */
+    snprintf(path, sizeof(path), "%s/small_files.script", dir);
+
+    script = fopen(path, "w");
+
+    fprintf(script, "MOUNT\n");
+
+    for(int round = 0; round < 4; round++){
+        for(int file = 0; file < FS_FILE_MAX_COUNT; file++){
+            fprintf(script, "CREATE\tsmall%d\nOPEN\tsmall%d\n", file, file);
+            fprintf(script, "WRITE\tDATA\tsmall file number %d\nCLOSE\n", file);
+        }
+
+        for(int file = 0; file < FS_FILE_MAX_COUNT; file++){
+            fprintf(script, "DELETE\tsmall%d\n", file);
+        }
+    }
+
+    fprintf(script, "UMOUNT\n");
+
+    fclose(script);
+
+    scripts[count++] = strdup(path);
+
+    /* many small appends to a single file, then read it back in pieces */
+    snprintf(path, sizeof(path), "%s/append.script", dir);
+
+    script = fopen(path, "w");
+
+    fprintf(script, "MOUNT\nCREATE\tlog\nOPEN\tlog\n");
+
+    memset(line, 0, sizeof(line));
+    memset(line, 'x', 100);
+
+    for(int record = 0; record < 2000; record++){
+        fprintf(script, "WRITE\tDATA\t%s\n", line);
+    }
+
+    for(int record = 0; record < 2000; record += 50){
+        fprintf(script, "SEEK\t%d\nREAD\t100\tDATA\t%s\n", record * 100, line);
+    }
+
+    fprintf(script, "CLOSE\nDELETE\tlog\nUMOUNT\n");
+
+    fclose(script);
+
+    scripts[count++] = strdup(path);
+
+    return count;
+}
+
+static void usage(){
+    fprintf(stderr, "usage: fs_compare.x [-R <ref binary>] [-L <lib binary>] "
+            "[-t <percent>] [-r <runs>] [-b <data blocks>] [-d <durability>] "
+            "[<script> ...]\n");
+    exit(2);
+}
+
+int main(int argc, char** argv){
+    const char* ref_program = "./fs_ref.x";
+    const char* lib_program = "./test_fs.x";
+    double threshold = 10.0;
+    size_t runs = 3;
+    size_t data_blocks = 8192;
+    const char* durability = "none";
+
+    int opt;
+
+    while((opt = getopt(argc, argv, "R:L:t:r:b:d:h")) != -1){
+        switch(opt){
+        case 'R':
+            ref_program = optarg;
+            break;
+        case 'L':
+            lib_program = optarg;
+            break;
+        case 't':
+            threshold = strtod(optarg, NULL);
+            break;
+        case 'r':
+            runs = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            data_blocks = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            if(strcmp(optarg, "none") && strcmp(optarg, "metadata")
+                    && strcmp(optarg, "full")){
+                usage();
+            }
+            durability = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if(runs==0 || runs > MAX_RUNS){
+        usage();
+    }
+
+    char workdir[] = "/tmp/fs_compare.XXXXXX";
+
+    if(mkdtemp(workdir)==NULL){
+        perror("mkdtemp");
+        return 2;
+    }
+
+    char* builtin[8];
+    size_t builtin_count = 0;
+
+    char** scripts = &argv[optind];
+    size_t script_count = (size_t)(argc - optind);
+
+    if(script_count==0){
+        builtin_count = generate_workloads(workdir, builtin);
+        scripts = builtin;
+        script_count = builtin_count;
+    }
+
+    char image[512];
+    char ref_output[512];
+    char lib_output[512];
+
+    snprintf(image, sizeof(image), "%s/disk.fs", workdir);
+    snprintf(ref_output, sizeof(ref_output), "%s/ref.out", workdir);
+    snprintf(lib_output, sizeof(lib_output), "%s/lib.out", workdir);
+
+    printf("%-20s %10s %10s %7s %10s %10s %9s %9s %9s %9s  %s\n",
+            "workload", "ref_ms", "lib_ms", "ratio", "ref_cpu", "lib_cpu",
+            "ref_rd", "lib_rd", "ref_wr", "lib_wr", "status");
+
+    int failures = 0;
+
+    for(size_t i = 0; i < script_count; i++){
+        struct program_result ref, lib;
+
+        if(run_program(ref_program, NULL, image, scripts[i], ref_output,
+                    data_blocks, runs, &ref)
+                || run_program(lib_program, durability, image, scripts[i],
+                    lib_output, data_blocks, runs, &lib)){
+            return 2;
+        }
+
+        const char* name = strrchr(scripts[i], '/');
+
+        name = name ? name + 1 : scripts[i];
+
+        double ratio = ref.median.wall_ms > 0 ? lib.median.wall_ms / ref.median.wall_ms : 0;
+
+        char status[64] = "ok";
+
+        if(ref.output_size!=lib.output_size
+                || (ref.output_size && memcmp(ref.output, lib.output, ref.output_size)!=0)
+                || ref.status!=lib.status){
+            snprintf(status, sizeof(status), "OUTPUT DIFFERS");
+            failures++;
+        } else if(ratio > 1.0 + threshold / 100.0){
+            snprintf(status, sizeof(status), "SLOWER by %.0f%%", (ratio - 1.0) * 100.0);
+            failures++;
+        }
+
+        printf("%-20s %10.2f %10.2f %7.2f %10.2f %10.2f %9llu %9llu %9llu %9llu  %s\n",
+                name, ref.median.wall_ms, lib.median.wall_ms, ratio,
+                ref.median.cpu_ms, lib.median.cpu_ms,
+                (unsigned long long)ref.median.syscr,
+                (unsigned long long)lib.median.syscr,
+                (unsigned long long)ref.median.syscw,
+                (unsigned long long)lib.median.syscw,
+                status);
+
+        fflush(stdout);
+
+        free(ref.output);
+        free(lib.output);
+    }
+
+    /* clean up the work directory */
+    char path[600];
+
+    const char* generated[] = { "disk.fs", "ref.out", "lib.out", "large_data",
+            "large_file.script", "small_files.script", "append.script" };
+
+    for(size_t i = 0; i < sizeof(generated) / sizeof(generated[0]); i++){
+        snprintf(path, sizeof(path), "%s/%s", workdir, generated[i]);
+        unlink(path);
+    }
+
+    rmdir(workdir);
+
+    for(size_t i = 0; i < builtin_count; i++){
+        free(builtin[i]);
+    }
+
+    return failures ? 1 : 0;
+}
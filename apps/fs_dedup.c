@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "disk.h"
+#include "fs.h"
+
+/*
+ * usage:
+ *
+ * ./fs_dedup.x <diskname>
+ *
+ * Deduplicates every file of an existing image: files ending with the same
+ * data blocks share them from the first block on which they agree to the
+ * end. The index of content hashes is saved on the image, so that the
+ * files written later while mounted with fs_mount_options.dedup share
+ * blocks with these. Prints the blocks freed, then fs_info().
+ */
+
+int main(int argc, char** argv){
+    if(argc!=2){
+        fprintf(stderr, "usage: ./fs_dedup.x <diskname>\n");
+        return EXIT_FAILURE;
+    }
+
+    struct fs_mount_options options = {
+        .durability = FS_DURABILITY_METADATA,
+        .verify = FS_VERIFY_SAMPLED,
+        .dedup = true,
+    };
+
+    if(fs_mount_with(argv[1], &options)){
+        fprintf(stderr, "fs_dedup: cannot mount '%s'\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    int freed = fs_dedup();
+
+    if(freed < 0){
+        fprintf(stderr, "fs_dedup: cannot deduplicate '%s'\n", argv[1]);
+        fs_umount();
+        return EXIT_FAILURE;
+    }
+
+    printf("freed_blocks=%d\n", freed);
+
+    fs_info();
+
+    if(fs_umount()){
+        fprintf(stderr, "fs_dedup: cannot unmount '%s'\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
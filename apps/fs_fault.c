@@ -0,0 +1,620 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "utilities.h"
+#include "blockFault.h"
+
+/*
+ * usage:
+ *
+ * ./fs_fault.x crash [-p <program>] [-b <data blocks>] [-c] [-k] [-i <bytes>]
+ *                    [-f fat16|fat32] [-B <KiB>] [-t] [-s <step>] [-v] <script>
+ * ./fs_fault.x fail [-p <program>] [-b <data blocks>] [-c] [-k] [-i <bytes>]
+ *                   [-f fat16|fat32] [-B <KiB>] [-s <step>] [-v] <script>
+ * ./fs_fault.x bench [-p <program>] -l <spec> [-l <spec> ...]
+ *                    [-- <fs_bench.x options>]
+ *
+ * Runs programs on misbehaving media, see blockFault.h for the FS_FAULT
+ * specifications.
+ *
+ * crash: runs the test_fs.x script <script> once to count its I/Os, then
+ * once per crash point on a freshly formatted journaled image, with
+ * writes held in a volatile cache and the power cut before that I/O. The
+ * image is then mounted, which replays the journal and repairs what a
+ * crash may leave behind, and checked with fs_check().
+ *
+ *	-p: program running the script (default: ./test_fs.x)
+ *	-b: number of data blocks of the image (default: 1024)
+ *	-c: format the image with block checksums
+ *	-k: format the image with tail packing
+ *	-i: format the image with directory entries of this many bytes,
+ *	    storing small files inline
+ *	-f: on-disk format of the image (default: fat16)
+ *	-B: block size of the image in KiB (default: 4)
+ *	-t: tear the write at the crash point instead of cutting the power
+ *	    before it
+ *	-s: only crash at one I/O out of this many (default: 1)
+ *	-v: print the result of every crash point
+ *
+ * Exits with 1 if any image cannot be mounted or is inconsistent after
+ * recovery.
+ *
+ * fail: runs the script the same way, with that I/O failing with EIO
+ * instead, and the others working. A run that exits with 0 and prints
+ * what the run without faults printed was told every command succeeded:
+ * its files must then hold the same content, or the failure was lost
+ * silently. Images are also checked with fs_check(). Takes the options of
+ * crash but -t, and exits with 1 if any image is inconsistent or holds
+ * other content than reported.
+ *
+ * bench: runs the benchmark suite once per latency specification, e.g.
+ * -l write=fixed:50us,sync=exp:2ms
+ *
+ *	-p: benchmark program (default: ./fs_bench.x)
+ *	-l: FS_FAULT specification, may be repeated
+ */
+
+#define MAX_SPECS 16
+
+static char image[512];
+static char report_path[512];
+static char reference_path[512];
+static char output_path[512];
+
+static void usage(){
+    fprintf(stderr, "usage: fs_fault.x crash [-p <program>] [-b <data blocks>] [-c] [-k] [-i <bytes>] "
+            "[-f fat16|fat32] [-B <KiB>] [-t] [-s <step>] [-v] <script>\n"
+            "       fs_fault.x fail [-p <program>] [-b <data blocks>] [-c] [-k] [-i <bytes>] "
+            "[-f fat16|fat32] [-B <KiB>] [-s <step>] [-v] <script>\n"
+            "       fs_fault.x bench [-p <program>] -l <spec> [-l <spec> ...] "
+            "[-- <fs_bench.x options>]\n");
+    exit(2);
+}
+
+/*
+ * Runs @argv with FS_FAULT set to @spec, its output sent to file @output
+ * and its errors, which name the failed I/Os, dropped unless it is NULL
+ *
+ * Returns: the wait status of the program, or -1 if it could not be run
+ */
+static int run_with_faults(char** argv, const char* spec, const char* output){
+    pid_t pid = fork();
+
+    if(pid < 0){
+        perror("fork");
+        return -1;
+    }
+
+    if(pid==0){
+        if(output!=NULL){
+            int output_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            int null_fd = open("/dev/null", O_WRONLY);
+
+            if(output_fd >= 0 && null_fd >= 0){
+                dup2(output_fd, STDOUT_FILENO);
+                dup2(null_fd, STDERR_FILENO);
+            }
+
+            close(output_fd);
+            close(null_fd);
+        }
+
+        setenv("FS_FAULT", spec, 1);
+
+        execv(argv[0], argv);
+
+        perror("execv");
+        _exit(127);
+    }
+
+    int status;
+
+    if(waitpid(pid, &status, 0) < 0){
+        perror("waitpid");
+        return -1;
+    }
+
+    return status;
+}
+
+/*
+ * Formats a fresh image. create_disk() announces itself on stdout,
+ * which would interleave with our report.
+ */
+static int format_image(size_t data_blocks, const struct disk_format* format){
+    unlink(image);
+
+    fflush(stdout);
+
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+
+    int ret = create_disk_with(data_blocks, image, format);
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+
+    return ret;
+}
+
+enum crash_outcome{
+    CRASH_CONSISTENT,
+    CRASH_INCONSISTENT,
+    CRASH_UNMOUNTABLE,
+    /* reported written, but holding other content */
+    CRASH_CORRUPTED
+};
+
+static const char* outcome_names[] = {
+    [CRASH_CONSISTENT] = "consistent",
+    [CRASH_INCONSISTENT] = "INCONSISTENT",
+    [CRASH_UNMOUNTABLE] = "UNMOUNTABLE",
+    [CRASH_CORRUPTED] = "CORRUPTED",
+};
+
+struct saved_file{
+    char path[256];
+    uint8_t* data;
+    size_t size;
+};
+
+struct file_set{
+    struct saved_file* files;
+    size_t count;
+    size_t capacity;
+};
+
+static void free_files(struct file_set* set){
+    for(size_t i = 0; i < set->count; i++){
+        free(set->files[i].data);
+    }
+
+    free(set->files);
+
+    memset(set, 0, sizeof(struct file_set));
+}
+
+/*
+ * Adds the files of directory @path of the mounted image, and of its
+ * subdirectories, to @set
+ *
+ * Returns: 0 on success, -1 if one could not be read
+ */
+static int save_directory(const char* path, struct file_set* set){
+    int dd = fs_opendir(path);
+
+    if(dd < 0){
+        return -1;
+    }
+
+    struct fs_dirent dirent;
+    int ret = 0;
+
+    while(ret==0 && fs_readdir(dd, &dirent, 1)==1){
+        char child[256];
+
+        if(strcmp(path, "/")==0){
+            snprintf(child, sizeof(child), "%s", dirent.name);
+        } else {
+            snprintf(child, sizeof(child), "%s/%s", path, dirent.name);
+        }
+
+        if(dirent.is_directory){
+            ret = save_directory(child, set);
+            continue;
+        }
+
+        if(set->count==set->capacity){
+            size_t capacity = set->capacity==0 ? 16 : set->capacity * 2;
+            struct saved_file* files = (struct saved_file*)realloc(set->files,
+                    capacity * sizeof(struct saved_file));
+
+            if(files==NULL){
+                ret = -1;
+                break;
+            }
+
+            set->files = files;
+            set->capacity = capacity;
+        }
+
+        struct saved_file* file = &set->files[set->count++];
+
+        snprintf(file->path, sizeof(file->path), "%s", child);
+        file->size = (size_t)dirent.size;
+        file->data = (uint8_t*)malloc(file->size==0 ? 1 : file->size);
+
+        int fd = fs_open(child);
+
+        if(file->data==NULL || fd < 0
+                || (file->size > 0 && fs_read(fd, file->data, file->size)!=(int)file->size)){
+            ret = -1;
+        }
+
+        if(fd >= 0){
+            fs_close(fd);
+        }
+    }
+
+    fs_closedir(dd);
+
+    return ret;
+}
+
+/*
+ * Fills @set with the files of the image
+ *
+ * Returns: 0 on success, -1 if the image could not be mounted or a file
+ * could not be read
+ */
+static int save_files(struct file_set* set){
+    memset(set, 0, sizeof(struct file_set));
+
+    if(fs_mount(image)){
+        return -1;
+    }
+
+    int ret = save_directory("/", set);
+
+    if(fs_umount()){
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/*
+ * Returns: true if the files of the image are those of @reference
+ */
+static bool same_files(const struct file_set* reference){
+    struct file_set current;
+
+    bool same = save_files(&current)==0 && current.count==reference->count;
+
+    for(size_t i = 0; same && i < current.count; i++){
+        const struct saved_file* a = &current.files[i];
+        const struct saved_file* b = &reference->files[i];
+
+        same = strcmp(a->path, b->path)==0 && a->size==b->size
+                && memcmp(a->data, b->data, a->size)==0;
+    }
+
+    free_files(&current);
+
+    return same;
+}
+
+/*
+ * Returns: true if files @a and @b hold the same bytes
+ */
+static bool same_output(const char* a, const char* b){
+    FILE* first = fopen(a, "r");
+    FILE* second = fopen(b, "r");
+
+    bool same = first!=NULL && second!=NULL;
+
+    while(same){
+        int c = fgetc(first);
+
+        if(c!=fgetc(second)){
+            same = false;
+        } else if(c==EOF){
+            break;
+        }
+    }
+
+    if(first!=NULL){
+        fclose(first);
+    }
+
+    if(second!=NULL){
+        fclose(second);
+    }
+
+    return same;
+}
+
+/*
+ * Mounts the crashed image to recover it, then checks it
+ */
+static enum crash_outcome recover_and_check(struct fs_check_report* report){
+    if(fs_mount(image) || fs_umount()){
+        return CRASH_UNMOUNTABLE;
+    }
+
+    struct fs_check_options options;
+
+    memset(&options, 0, sizeof(struct fs_check_options));
+
+    options.threads = 1;
+
+    int problems = fs_check(image, &options, report);
+
+    if(problems < 0){
+        return CRASH_UNMOUNTABLE;
+    }
+
+    return problems==0 ? CRASH_CONSISTENT : CRASH_INCONSISTENT;
+}
+
+/*
+ * crash and fail, which fails the I/O instead of cutting the power if
+ * @fail is true
+ */
+static int crash_mode(int argc, char** argv, bool fail){
+    char* program = "./test_fs.x";
+    size_t data_blocks = 1024;
+    size_t step = 1;
+    bool tear = false;
+    bool verbose = false;
+
+    struct disk_format format = { .checksums = false, .version = FS_VERSION_FAT16 };
+
+    int opt;
+
+    while((opt = getopt(argc, argv, "p:b:cki:f:B:ts:vh")) != -1){
+        switch(opt){
+        case 'p':
+            program = optarg;
+            break;
+        case 'b':
+            data_blocks = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            format.checksums = true;
+            break;
+        case 'k':
+            format.tail_packing = true;
+            break;
+        case 'i':
+            format.entry_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            if(strcmp(optarg, "fat16")==0){
+                format.version = FS_VERSION_FAT16;
+            } else if(strcmp(optarg, "fat32")==0){
+                format.version = FS_VERSION_FAT32;
+            } else {
+                usage();
+            }
+            break;
+        case 'B':
+            format.block_size = strtoul(optarg, NULL, 10) * 1024;
+            break;
+        case 't':
+            if(fail){
+                usage();
+            }
+
+            tear = true;
+            break;
+        case 's':
+            step = strtoul(optarg, NULL, 10);
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if(optind!=argc - 1 || step==0){
+        usage();
+    }
+
+    char* child_argv[] = { program, "script", image, argv[optind], NULL };
+    char spec[640];
+
+    //count the I/Os of a run without faults
+    snprintf(spec, sizeof(spec), "report=%s", report_path);
+
+    if(format_image(data_blocks, &format)
+            || run_with_faults(child_argv, spec, reference_path)!=0){
+        fprintf(stderr, "fs_fault: '%s script %s' fails without faults\n",
+                program, argv[optind]);
+        return 2;
+    }
+
+    FILE* report_file = fopen(report_path, "r");
+    unsigned long long io_total = 0;
+
+    if(report_file==NULL || fscanf(report_file, "%llu", &io_total)!=1){
+        fprintf(stderr, "fs_fault: no I/O count from '%s'\n", program);
+        return 2;
+    }
+
+    fclose(report_file);
+
+    //what a run told every command succeeded must find on the image
+    struct file_set reference;
+
+    if(fail && save_files(&reference)){
+        fprintf(stderr, "fs_fault: cannot read the files '%s' leaves\n", argv[optind]);
+        return 2;
+    }
+
+    printf("%s: %llu I/Os, %s at every %zu\n", argv[optind], io_total,
+            fail ? "failing the I/O" : tear ? "tearing the write" : "crashing", step);
+
+    size_t points = 0;
+    size_t outcomes[4] = { 0, 0, 0, 0 };
+    size_t completed = 0;
+
+    for(unsigned long long io = 1; io <= io_total; io += step){
+        if(fail){
+            snprintf(spec, sizeof(spec), "fail_at=%llu", io);
+        } else {
+            snprintf(spec, sizeof(spec), "%s=%llu,volatile,halt",
+                    tear ? "tear_at" : "crash_at", io);
+        }
+
+        if(format_image(data_blocks, &format)){
+            fprintf(stderr, "fs_fault: cannot format '%s'\n", image);
+            return 2;
+        }
+
+        int status = run_with_faults(child_argv, spec, output_path);
+
+        if(status < 0){
+            return 2;
+        }
+
+        //group commits are timed, a run can take fewer I/Os than the first one,
+        //and a failed I/O may go unreported
+        bool unreported = fail && WIFEXITED(status) && WEXITSTATUS(status)==0
+                && same_output(reference_path, output_path);
+
+        if(fail ? unreported : !WIFEXITED(status) || WEXITSTATUS(status)!=FAULT_HALT_STATUS){
+            completed++;
+        }
+
+        struct fs_check_report report;
+        enum crash_outcome outcome = recover_and_check(&report);
+
+        if(outcome==CRASH_CONSISTENT && unreported && !same_files(&reference)){
+            outcome = CRASH_CORRUPTED;
+        }
+
+        points++;
+        outcomes[outcome]++;
+
+        if(verbose || outcome!=CRASH_CONSISTENT){
+            printf("io %6llu: %s", io, outcome_names[outcome]);
+
+            if(outcome==CRASH_INCONSISTENT){
+                printf(" (bad_chains=%zu shared_chains=%zu size_mismatches=%zu "
+                        "leaked_blocks=%zu)", report.bad_chains, report.shared_chains,
+                        report.size_mismatches, report.leaked_blocks);
+            }
+
+            printf("\n");
+        }
+    }
+
+    printf("%s points=%zu consistent=%zu inconsistent=%zu unmountable=%zu ",
+            fail ? "fail" : "crash", points, outcomes[CRASH_CONSISTENT],
+            outcomes[CRASH_INCONSISTENT], outcomes[CRASH_UNMOUNTABLE]);
+
+    if(fail){
+        printf("corrupted=%zu unreported=%zu\n", outcomes[CRASH_CORRUPTED], completed);
+
+        free_files(&reference);
+    } else {
+        printf("completed=%zu\n", completed);
+    }
+
+    return outcomes[CRASH_CONSISTENT]==points ? 0 : 1;
+}
+
+static int bench_mode(int argc, char** argv){
+    char* program = "./fs_bench.x";
+    const char* specs[MAX_SPECS];
+    size_t spec_count = 0;
+
+    int opt;
+
+    while((opt = getopt(argc, argv, "p:l:h")) != -1){
+        switch(opt){
+        case 'p':
+            program = optarg;
+            break;
+        case 'l':
+            if(spec_count==MAX_SPECS){
+                usage();
+            }
+
+            specs[spec_count++] = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if(spec_count==0){
+        usage();
+    }
+
+    //the remaining arguments, after "--", go to the benchmark
+    char** child_argv = (char**)calloc((size_t)(argc - optind) + 2, sizeof(char*));
+
+    if(child_argv==NULL){
+        return 2;
+    }
+
+    child_argv[0] = program;
+
+    for(int i = optind; i < argc; i++){
+        child_argv[i - optind + 1] = argv[i];
+    }
+
+    int failures = 0;
+
+    for(size_t i = 0; i < spec_count; i++){
+        printf("== FS_FAULT=%s\n", specs[i]);
+        fflush(stdout);
+
+        int status = run_with_faults(child_argv, specs[i], NULL);
+
+        if(status < 0 || !WIFEXITED(status) || WEXITSTATUS(status)!=0){
+            printf("== %s failed\n", program);
+            failures++;
+        }
+
+        printf("\n");
+    }
+
+    free(child_argv);
+
+    return failures==0 ? 0 : 1;
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        usage();
+    }
+
+    //faults are for the programs run, not for the recovery and checks
+    unsetenv("FS_FAULT");
+
+    const char* dir = access("/dev/shm", W_OK)==0 ? "/dev/shm" : "/tmp";
+
+    snprintf(image, sizeof(image), "%s/fs_fault.%d.fs", dir, (int)getpid());
+    snprintf(report_path, sizeof(report_path), "%s/fs_fault.%d.io", dir, (int)getpid());
+    snprintf(reference_path, sizeof(reference_path), "%s/fs_fault.%d.ref", dir, (int)getpid());
+    snprintf(output_path, sizeof(output_path), "%s/fs_fault.%d.out", dir, (int)getpid());
+
+    int result;
+
+    //the mode takes the place of the program name for getopt
+    if(strcmp(argv[1], "crash")==0){
+        result = crash_mode(argc - 1, &argv[1], false);
+    } else if(strcmp(argv[1], "fail")==0){
+        result = crash_mode(argc - 1, &argv[1], true);
+    } else if(strcmp(argv[1], "bench")==0){
+        result = bench_mode(argc - 1, &argv[1]);
+    } else {
+        usage();
+        return 2;
+    }
+
+    unlink(image);
+    unlink(report_path);
+    unlink(reference_path);
+    unlink(output_path);
+
+    return result;
+}
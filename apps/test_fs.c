@@ -34,6 +34,12 @@ struct thread_arg {
 	char **argv;
 };
 
+/* Options disks are mounted with, the durability set by -d */
+static struct fs_mount_options mount_options = {
+	.durability = FS_DURABILITY_METADATA,
+	.verify = FS_VERIFY_SAMPLED,
+};
+
 void thread_fs_script(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -87,13 +93,37 @@ void thread_fs_script(void *arg)
 			break;
 
 		if (strcmp(command, "MOUNT") == 0) {
-			if (fs_mount(diskname))
+			if (fs_mount_with(diskname, &mount_options))
 				die("Cannot mount disk");
 			else {
 				printf("MOUNT successful.\n");
 				mounted = 1;
 			}
 
+		} else if (strcmp(command, "MOUNT_DEDUP") == 0) {
+			struct fs_mount_options options = mount_options;
+
+			options.dedup = true;
+
+			if (fs_mount_with(diskname, &options))
+				die("Cannot mount disk");
+			else {
+				printf("MOUNT_DEDUP successful.\n");
+				mounted = 1;
+			}
+
+		} else if (strcmp(command, "MOUNT_SNAPSHOT") == 0) {
+			struct fs_mount_options options = mount_options;
+
+			options.snapshot = command_args[1];
+
+			if (fs_mount_with(diskname, &options))
+				die("Cannot mount snapshot");
+			else {
+				printf("MOUNT_SNAPSHOT successful.\n");
+				mounted = 1;
+			}
+
 		} else if (strcmp(command, "UMOUNT") == 0) {
 			if (mounted && fs_umount())
 				die("Cannot unmount");
@@ -122,6 +152,79 @@ void thread_fs_script(void *arg)
 
 			printf("DELETE successful.\n");
 
+		} else if (strcmp(command, "MKDIR") == 0) {
+			fs_filename = command_args[1];
+
+			if(fs_mkdir(fs_filename)) {
+				fs_umount();
+				die("Cannot create directory");
+			}
+
+			printf("MKDIR successful.\n");
+
+		} else if (strcmp(command, "RMDIR") == 0) {
+			fs_filename = command_args[1];
+
+			if(fs_rmdir(fs_filename)) {
+				fs_umount();
+				die("Cannot remove directory");
+			}
+
+			printf("RMDIR successful.\n");
+
+		} else if (strcmp(command, "SNAPSHOT") == 0) {
+			fs_filename = command_args[1];
+
+			if(fs_snapshot_create(fs_filename)) {
+				fs_umount();
+				die("Cannot create snapshot");
+			}
+
+			printf("SNAPSHOT successful.\n");
+
+		} else if (strcmp(command, "SNAPSHOT_DELETE") == 0) {
+			fs_filename = command_args[1];
+
+			if(fs_snapshot_delete(fs_filename)) {
+				fs_umount();
+				die("Cannot delete snapshot");
+			}
+
+			printf("SNAPSHOT_DELETE successful.\n");
+
+		} else if (strcmp(command, "COPY") == 0
+			   || strcmp(command, "REFLINK") == 0) {
+			fs_filename = command_args[1];
+
+			enum fs_copy_mode mode = strcmp(command, "COPY") == 0
+				? FS_COPY_DEEP : FS_COPY_REFLINK;
+
+			if(fs_copy_file(fs_filename, command_args[2], mode)) {
+				fs_umount();
+				die("Cannot copy file");
+			}
+
+			printf("%s successful.\n", command);
+
+		} else if (strcmp(command, "DEDUP") == 0) {
+			if (fs_dedup() < 0) {
+				fs_umount();
+				die("Cannot deduplicate");
+			}
+
+			printf("DEDUP successful.\n");
+
+		} else if (strcmp(command, "COMPRESS") == 0
+			   || strcmp(command, "UNCOMPRESS") == 0) {
+			fs_filename = command_args[1];
+
+			if(fs_set_compression(fs_filename, strcmp(command, "COMPRESS") == 0)) {
+				fs_umount();
+				die("Cannot change compression");
+			}
+
+			printf("%s successful.\n", command);
+
 		} else if (strcmp(command, "OPEN") == 0) {
 			fs_filename = command_args[1];
 
@@ -282,7 +385,7 @@ void thread_fs_stat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (fs_mount_with(diskname, &mount_options))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -329,7 +432,7 @@ void thread_fs_cat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (fs_mount_with(diskname, &mount_options))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -384,7 +487,7 @@ void thread_fs_rm(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (fs_mount_with(diskname, &mount_options))
 		die("Cannot mount diskname");
 
 	if (fs_delete(filename)) {
@@ -430,7 +533,7 @@ void thread_fs_add(void *arg)
 	 * - mount, create a new file, copy content of host file into this new
 	 *   file, close the new file, and umount
 	 */
-	if (fs_mount(diskname))
+	if (fs_mount_with(diskname, &mount_options))
 		die("Cannot mount diskname");
 
 	if (fs_create(filename)) {
@@ -461,20 +564,53 @@ void thread_fs_add(void *arg)
 	close(fd);
 }
 
+void thread_fs_snapshots(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_mount_options options = mount_options;
+	char *diskname;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<snapshot>]");
+
+	diskname = t_arg->argv[0];
+
+	/* With a name, list the root directory of that snapshot */
+	if (t_arg->argc > 1)
+		options.snapshot = t_arg->argv[1];
+
+	if (fs_mount_with(diskname, &options))
+		die("Cannot mount diskname");
+
+	if (t_arg->argc > 1)
+		fs_ls();
+	else
+		fs_snapshot_ls();
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
 void thread_fs_ls(void *arg)
 {
 	struct thread_arg *t_arg = arg;
 	char *diskname;
 
 	if (t_arg->argc < 1)
-		die("Usage: <diskname>");
+		die("Usage: <diskname> [<dirname>]");
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (fs_mount_with(diskname, &mount_options))
 		die("Cannot mount diskname");
 
-	fs_ls();
+	if (t_arg->argc > 1) {
+		if (fs_lsdir(t_arg->argv[1])) {
+			fs_umount();
+			die("Cannot list directory");
+		}
+	} else
+		fs_ls();
 
 	if (fs_umount())
 		die("Cannot unmount diskname");
@@ -490,7 +626,7 @@ void thread_fs_info(void *arg)
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (fs_mount_with(diskname, &mount_options))
 		die("Cannot mount diskname");
 
 	fs_info();
@@ -499,6 +635,90 @@ void thread_fs_info(void *arg)
 		die("Cannot unmount diskname");
 }
 
+void thread_fs_stats(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_stats stats;
+	size_t i;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <script filename>");
+
+	/* Only account for the I/O issued by the script */
+	fs_stats_reset();
+
+	thread_fs_script(arg);
+
+	if (fs_stats(&stats))
+		die("Cannot get stats");
+
+	printf("FS Stats:\n");
+	printf("%-8s %8s %12s %10s %10s %12s %9s %12s %8s\n", "op", "calls",
+	       "bytes_req", "blk_reads", "blk_writes", "blk_bytes", "blk_syncs",
+	       "wall_us", "io_amp");
+
+	for (i = 0; i < FS_OP_COUNT; i++) {
+		struct fs_op_stats *op = &stats.ops[i];
+
+		if (!op->calls)
+			continue;
+
+		printf("%-8s %8llu %12llu %10llu %10llu %12llu %9llu %12.1f ",
+		       fs_op_name(i),
+		       (unsigned long long)op->calls,
+		       (unsigned long long)op->bytes_requested,
+		       (unsigned long long)op->block_reads,
+		       (unsigned long long)op->block_writes,
+		       (unsigned long long)op->block_bytes,
+		       (unsigned long long)op->block_syncs,
+		       op->wall_ns / 1000.0);
+
+		/* Block layer bytes moved per byte the caller asked for */
+		if (op->bytes_requested)
+			printf("%8.2f\n",
+			       (double)op->block_bytes / op->bytes_requested);
+		else
+			printf("%8s\n", "-");
+	}
+
+	printf("total: blk_reads=%llu blk_writes=%llu blk_bytes=%llu "
+	       "blk_syncs=%llu\n",
+	       (unsigned long long)stats.block_reads,
+	       (unsigned long long)stats.block_writes,
+	       (unsigned long long)stats.block_bytes,
+	       (unsigned long long)stats.block_syncs);
+
+	if (stats.clean_mounts || stats.dirty_mounts)
+		printf("mounts: clean=%llu dirty=%llu check_us=%.1f "
+		       "repaired_blocks=%llu\n",
+		       (unsigned long long)stats.clean_mounts,
+		       (unsigned long long)stats.dirty_mounts,
+		       stats.mount_check_ns / 1000.0,
+		       (unsigned long long)stats.mount_repaired_blocks);
+
+	if (stats.blocks_verified || stats.checksum_errors)
+		printf("checksums: verified=%llu errors=%llu\n",
+		       (unsigned long long)stats.blocks_verified,
+		       (unsigned long long)stats.checksum_errors);
+
+	printf("Latency (us):\n");
+	printf("%-9s %8s %10s %10s %10s %10s %10s\n", "op", "count", "min",
+	       "p50", "p99", "p99.9", "max");
+
+	for (i = 0; i < FS_LAT_COUNT; i++) {
+		struct fs_latency lat;
+
+		if (fs_latency(i, &lat) || !lat.count)
+			continue;
+
+		printf("%-9s %8llu %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+		       fs_op_name(i), (unsigned long long)lat.count,
+		       lat.min_ns / 1000.0, lat.p50_ns / 1000.0,
+		       lat.p99_ns / 1000.0, lat.p999_ns / 1000.0,
+		       lat.max_ns / 1000.0);
+	}
+}
+
 size_t get_argv(char *argv)
 {
 	long int ret = strtol(argv, NULL, 0);
@@ -517,13 +737,16 @@ static struct {
 	{ "rm",		thread_fs_rm },
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
-	{ "script",	thread_fs_script }
+	{ "snapshots",	thread_fs_snapshots },
+	{ "script",	thread_fs_script },
+	{ "stats",	thread_fs_stats }
 };
 
 void usage(char *program)
 {
 	size_t i;
-	fprintf(stderr, "Usage: %s <command> [<arg>]\n", program);
+	fprintf(stderr, "Usage: %s [-d none|metadata|full] <command> [<arg>]\n",
+		program);
 	fprintf(stderr, "Possible commands are:\n");
 	for (i = 0; i < ARRAY_SIZE(commands); i++)
 		fprintf(stderr, "\t%s\n", commands[i].name);
@@ -546,6 +769,23 @@ int main(int argc, char **argv)
 	argc--;
 	argv++;
 
+	if (argc > 1 && !strcmp(argv[0], "-d")) {
+		if (!strcmp(argv[1], "none"))
+			mount_options.durability = FS_DURABILITY_NONE;
+		else if (!strcmp(argv[1], "metadata"))
+			mount_options.durability = FS_DURABILITY_METADATA;
+		else if (!strcmp(argv[1], "full"))
+			mount_options.durability = FS_DURABILITY_FULL;
+		else
+			usage(program);
+
+		argc -= 2;
+		argv += 2;
+	}
+
+	if (argc == 0)
+		usage(program);
+
 	cmd = argv[0];
 	arg.argc = --argc;
 	arg.argv = &argv[1];
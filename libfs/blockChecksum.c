@@ -0,0 +1,289 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "blockChecksum.h"
+#include "checksum.h"
+#include "disk.h"
+#include "fs.h"
+#include "stats.h"
+
+static bool enabled = false;
+
+static enum fs_verify verify_policy = FS_VERIFY_OFF;
+
+/* covered reads seen, for FS_VERIFY_SAMPLED */
+static uint64_t sample_counter = 0;
+
+/* disk blocks of the data region, the journal and the checksum region */
+static size_t data_start = 0;
+static size_t data_end = 0;
+static size_t journal_start = 0;
+static size_t journal_end = 0;
+static size_t region_start = 0;
+static size_t region_blocks = 0;
+
+/* the whole region, indexed by data block */
+static uint32_t* table = NULL;
+
+/* one bit per data block left out by checksums_exclude() */
+static uint8_t* excluded = NULL;
+
+/* per region block: changed since the last flush */
+static bool* dirty = NULL;
+static size_t dirty_count = 0;
+
+size_t checksum_region_blocks(size_t total_data_blocks, size_t bytes){
+    size_t per_block = bytes / sizeof(uint32_t);
+
+    return (total_data_blocks + per_block - 1) / per_block;
+}
+
+int checksums_load(enum fs_verify verify){
+    enabled = false;
+
+    if(volume.checksum_blocks==0){
+        return 0;
+    }
+
+    data_start = volume.data_start_index;
+    data_end = data_start + volume.data_blocks;
+    journal_start = volume.journal_start_index;
+    journal_end = journal_start + volume.journal_blocks;
+    region_start = volume.checksum_start_index;
+    region_blocks = volume.checksum_blocks;
+
+    table = (uint32_t*)malloc(region_blocks * block_size);
+    dirty = (bool*)calloc(region_blocks, sizeof(bool));
+    excluded = (uint8_t*)calloc(volume.data_blocks / 8 + 1, sizeof(uint8_t));
+
+    if(table==NULL || dirty==NULL || excluded==NULL){
+        checksums_unload();
+        return -1;
+    }
+
+    struct iovec iov = { table, region_blocks * block_size };
+
+    if(block_readv(region_start, &iov, 1)){
+        checksums_unload();
+        return -1;
+    }
+
+    verify_policy = verify;
+    sample_counter = 0;
+    dirty_count = 0;
+    enabled = true;
+
+    return 0;
+}
+
+void checksums_unload(){
+    free(table);
+    free(dirty);
+    free(excluded);
+
+    table = NULL;
+    dirty = NULL;
+    excluded = NULL;
+
+    enabled = false;
+    verify_policy = FS_VERIFY_OFF;
+    dirty_count = 0;
+    region_blocks = 0;
+}
+
+bool checksums_cover(size_t block){
+    if(!enabled || block < data_start || block >= data_end){
+        return false;
+    }
+
+    if(block >= journal_start && block < journal_end){
+        return false;
+    }
+
+    if(block >= region_start && block < region_start + region_blocks){
+        return false;
+    }
+
+    size_t data_block = block - data_start;
+
+    return (excluded[data_block / 8] & (1 << (data_block % 8))) == 0;
+}
+
+bool checksums_dirty(){
+    return dirty_count!=0;
+}
+
+int checksums_flush(){
+    if(dirty_count==0){
+        return 0;
+    }
+
+    size_t block = 0;
+
+    //changed region blocks are adjacent in the table too, write them in runs
+    while(block < region_blocks){
+        if(!dirty[block]){
+            block++;
+            continue;
+        }
+
+        size_t run = 0;
+
+        while(block + run < region_blocks && dirty[block + run]){
+            run++;
+        }
+
+        struct iovec iov = { &table[block * CHECKSUMS_PER_BLOCK], run * block_size };
+
+        if(block_writev(region_start + block, &iov, 1)){
+            return -1;
+        }
+
+        for(; run > 0; run--, block++){
+            dirty[block] = false;
+            dirty_count--;
+        }
+    }
+
+    return 0;
+}
+
+static void stamp(size_t block, uint32_t crc){
+    size_t data_block = block - data_start;
+
+    if(table[data_block]==crc){
+        return;
+    }
+
+    table[data_block] = crc;
+
+    size_t region_block = data_block / CHECKSUMS_PER_BLOCK;
+
+    if(!dirty[region_block]){
+        dirty[region_block] = true;
+        dirty_count++;
+    }
+}
+
+void checksums_exclude(size_t block){
+    if(!checksums_cover(block)){
+        return;
+    }
+
+    stamp(block, 0);
+
+    size_t data_block = block - data_start;
+
+    excluded[data_block / 8] |= (uint8_t)(1 << (data_block % 8));
+}
+
+void checksums_include(size_t block){
+    if(!enabled || block < data_start || block >= data_end){
+        return;
+    }
+
+    size_t data_block = block - data_start;
+
+    excluded[data_block / 8] &= (uint8_t)~(1 << (data_block % 8));
+}
+
+static bool sampled(){
+    switch(verify_policy){
+    case FS_VERIFY_ALWAYS:
+        return true;
+    case FS_VERIFY_SAMPLED:
+        return sample_counter++ % CHECKSUM_SAMPLE_INTERVAL == 0;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Walks the blocks of @iov starting at disk block @block, stamping them
+ * or checking the ones the policy picks. Blocks may straddle buffers.
+ *
+ * Returns: the number of blocks that did not match
+ */
+static size_t walk_blocks(size_t block, const struct iovec* iov, int iovcnt,
+        bool write){
+
+    size_t mismatches = 0;
+
+    size_t in_block = 0;
+    uint32_t crc = 0;
+    bool wanted = false;
+
+    for(int i = 0; i < iovcnt; i++){
+        const uint8_t* data = (const uint8_t*)iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+
+        while(left > 0){
+            if(in_block==0){
+                wanted = checksums_cover(block) && (write || sampled());
+                crc = 0;
+            }
+
+            size_t chunk = block_size - in_block < left ? block_size - in_block : left;
+
+            if(wanted){
+                crc = crc32c(crc, data, chunk);
+            }
+
+            data += chunk;
+            left -= chunk;
+            in_block += chunk;
+
+            if(in_block < block_size){
+                continue;
+            }
+
+            if(wanted && write){
+                stamp(block, crc);
+            } else if(wanted){
+                uint32_t expected = table[block - data_start];
+
+                block_io.verified++;
+
+                if(expected!=0 && expected!=crc){
+                    block_io.checksum_errors++;
+                    mismatches++;
+
+                    fprintf(stderr, "checksums_verify: block %zu does not match its checksum\n",
+                            block);
+                }
+            }
+
+            in_block = 0;
+            block++;
+        }
+    }
+
+    return mismatches;
+}
+
+void checksums_stamp(size_t block, const struct iovec* iov, int iovcnt){
+    if(enabled){
+        walk_blocks(block, iov, iovcnt, true);
+    }
+}
+
+int checksums_verify(size_t block, const struct iovec* iov, int iovcnt){
+    if(!enabled || verify_policy==FS_VERIFY_OFF){
+        return 0;
+    }
+
+    return walk_blocks(block, iov, iovcnt, false)==0 ? 0 : -1;
+}
+
+bool checksum_matches(size_t block, const void* data){
+    if(!checksums_cover(block)){
+        return true;
+    }
+
+    uint32_t expected = table[block - data_start];
+
+    return expected==0 || expected==crc32c(0, data, block_size);
+}
@@ -0,0 +1,111 @@
+#ifndef BLOCKCHECKSUM_H_
+#define BLOCKCHECKSUM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "fs.h"
+
+/*
+ * Optional CRC32C of every data block. Disks formatted with checksums
+ * have a region of checksumBlocks blocks at checksumStartIndex holding
+ * CHECKSUMS_PER_BLOCK checksums each, indexed by data block. Like the
+ * journal, its blocks are data blocks chained in the FAT, and neither
+ * the journal nor the region itself is covered.
+ *
+ * The region is loaded at mount. block_write() and friends stamp the
+ * checksum of every data block they write, block_read() and friends
+ * verify it as the mount's enum fs_verify says. A checksum of 0 means
+ * the block was never stamped, and it is not verified.
+ *
+ * Changed checksum blocks are written in place when metadata is
+ * committed and at unmount. They are not journaled: a data block and its
+ * checksum are never updated atomically anyway, since file data is
+ * overwritten in place. A crash can leave the checksum of a block written
+ * during the last group of operations stale, fs_check() with scrub and
+ * repair stamps those again.
+ *
+ * Blocks of subdirectories are journaled like metadata, whose commit
+ * block has a checksum of its own, and their home location is written
+ * at checkpoint, long after the transaction carrying its checksum. They
+ * are left out: their checksum is set to 0 when the directory is loaded
+ * or grows, and they are not stamped until the directory is removed.
+ * Fragment blocks, journaled the same way, are left out too.
+ */
+
+/* checksums held by a region block of the mounted disk */
+#define CHECKSUMS_PER_BLOCK (block_size / sizeof(uint32_t))
+
+/* FS_VERIFY_SAMPLED checks one data block read out of this many */
+#define CHECKSUM_SAMPLE_INTERVAL 16
+
+/*
+ * Blocks of the checksum region of a disk with @total_data_blocks data
+ * blocks of @bytes each, the region included
+ */
+size_t checksum_region_blocks(size_t total_data_blocks, size_t bytes);
+
+/*
+ * Reads the checksum region of the mounted disk, if it has one
+ *
+ * Returns: 0 on success, -1 otherwise
+ */
+int checksums_load(enum fs_verify verify);
+
+/*
+ * Forgets the checksums of the disk being unmounted. They must have been
+ * flushed.
+ */
+void checksums_unload();
+
+/*
+ * Returns: true if disk block @block is a data block with a checksum
+ */
+bool checksums_cover(size_t block);
+
+/*
+ * Stops covering data block @block until checksums_include() or the
+ * unmount, and forgets its checksum
+ */
+void checksums_exclude(size_t block);
+
+/*
+ * Covers data block @block again, from its next write on
+ */
+void checksums_include(size_t block);
+
+/*
+ * Returns: true if checksums changed since they were last flushed
+ */
+bool checksums_dirty();
+
+/*
+ * Writes the changed checksum blocks to the disk
+ *
+ * Returns: 0 on success, -1 otherwise
+ */
+int checksums_flush();
+
+/*
+ * Records the checksums of the blocks just written from @iov, starting at
+ * disk block @block. Blocks without a checksum are skipped.
+ */
+void checksums_stamp(size_t block, const struct iovec* iov, int iovcnt);
+
+/*
+ * Checks the blocks just read into @iov, starting at disk block @block,
+ * against their checksums, as often as the verify policy asks
+ *
+ * Returns: 0 if they match or were not checked, -1 otherwise
+ */
+int checksums_verify(size_t block, const struct iovec* iov, int iovcnt);
+
+/*
+ * Returns: true if the content @data of disk block @block matches its
+ * checksum, or if it has none. Ignores the verify policy.
+ */
+bool checksum_matches(size_t block, const void* data);
+
+#endif
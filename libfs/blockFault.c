@@ -0,0 +1,618 @@
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blockFault.h"
+#include "disk.h"
+#include "stats.h"
+
+/* shorter latencies are spun, the scheduler is too coarse for them */
+#define SPIN_LIMIT_NS 150000ull
+
+#define SECTOR_SIZE 512
+
+/*
+ * Unit of the volatile cache. Every block size is a multiple of it, and
+ * the superblock is read in it before the block size is known.
+ */
+#define CACHE_UNIT BLOCK_SIZE_MIN
+
+static bool active = false;
+
+static struct fault_config config;
+
+static uint64_t io_count = 0;
+
+static bool power_lost = false;
+
+/* xorshift64 state of the latency distributions */
+static uint64_t rng = 0;
+
+/* volatile cache: written units not synced yet, indexed by CACHE_UNIT */
+static uint8_t** cache = NULL;
+static size_t cache_size = 0;
+static size_t cached_blocks = 0;
+
+static bool env_read = false;
+
+static uint64_t next_random(){
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+
+    return rng;
+}
+
+/*
+ * Parses a duration such as "250us"
+ *
+ * Returns: 0 on success, -1 otherwise
+ */
+static int parse_time(const char* text, uint64_t* ns){
+    char* end;
+
+    errno = 0;
+
+    double value = strtod(text, &end);
+
+    if(end==text || errno!=0 || value < 0){
+        return -1;
+    }
+
+    double unit;
+
+    if(*end=='\0' || strcmp(end, "ns")==0){
+        unit = 1;
+    } else if(strcmp(end, "us")==0){
+        unit = 1e3;
+    } else if(strcmp(end, "ms")==0){
+        unit = 1e6;
+    } else if(strcmp(end, "s")==0){
+        unit = 1e9;
+    } else {
+        return -1;
+    }
+
+    *ns = (uint64_t)(value * unit);
+
+    return 0;
+}
+
+static int parse_latency(char* text, struct fault_latency* latency){
+    char* saveptr;
+    char* kind = strtok_r(text, ":", &saveptr);
+    char* a = strtok_r(NULL, ":", &saveptr);
+    char* b = strtok_r(NULL, ":", &saveptr);
+
+    if(kind==NULL || a==NULL || parse_time(a, &latency->a_ns)){
+        return -1;
+    }
+
+    if(strcmp(kind, "uniform")==0){
+        if(b==NULL || parse_time(b, &latency->b_ns) || latency->b_ns < latency->a_ns){
+            return -1;
+        }
+
+        latency->distribution = FAULT_LATENCY_UNIFORM;
+
+        return 0;
+    }
+
+    if(b!=NULL){
+        return -1;
+    }
+
+    if(strcmp(kind, "fixed")==0){
+        latency->distribution = FAULT_LATENCY_FIXED;
+    } else if(strcmp(kind, "exp")==0){
+        latency->distribution = FAULT_LATENCY_EXPONENTIAL;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int parse_count(const char* text, uint64_t* count){
+    char* end;
+
+    errno = 0;
+
+    unsigned long long value = strtoull(text, &end, 10);
+
+    if(end==text || *end!='\0' || errno!=0){
+        return -1;
+    }
+
+    *count = value;
+
+    return 0;
+}
+
+/*
+ * Adds the I/Os "<n>" or "<n>..<m>" of @text to those failing
+ */
+static int parse_range(char* text, struct fault_config* config){
+    if(config->fail_ranges==FAULT_FAIL_RANGES){
+        return -1;
+    }
+
+    uint64_t* first = &config->fail_first[config->fail_ranges];
+    uint64_t* last = &config->fail_last[config->fail_ranges];
+
+    char* dots = strstr(text, "..");
+
+    if(dots!=NULL){
+        *dots = '\0';
+    }
+
+    if(parse_count(text, first) || parse_count(dots!=NULL ? dots + 2 : text, last)
+            || *first==0 || *last < *first){
+        return -1;
+    }
+
+    config->fail_ranges++;
+
+    return 0;
+}
+
+static int parse_option(char* option, struct fault_config* config){
+    char* value = strchr(option, '=');
+
+    if(value!=NULL){
+        *value++ = '\0';
+    }
+
+    if(strcmp(option, "volatile")==0 && value==NULL){
+        config->volatile_cache = true;
+        return 0;
+    }
+
+    if(strcmp(option, "halt")==0 && value==NULL){
+        config->halt = true;
+        return 0;
+    }
+
+    //more I/Os of the fail_at list before it
+    if(value==NULL && option[0] >= '0' && option[0] <= '9' && config->fail_ranges > 0){
+        return parse_range(option, config);
+    }
+
+    if(value==NULL){
+        return -1;
+    }
+
+    if(strcmp(option, "read")==0){
+        return parse_latency(value, &config->read);
+    }
+
+    if(strcmp(option, "write")==0){
+        return parse_latency(value, &config->write);
+    }
+
+    if(strcmp(option, "sync")==0){
+        return parse_latency(value, &config->sync);
+    }
+
+    if(strcmp(option, "fail_at")==0){
+        return parse_range(value, config);
+    }
+
+    if(strcmp(option, "crash_at")==0){
+        return parse_count(value, &config->crash_at);
+    }
+
+    if(strcmp(option, "tear_at")==0){
+        return parse_count(value, &config->tear_at);
+    }
+
+    if(strcmp(option, "seed")==0){
+        return parse_count(value, &config->seed);
+    }
+
+    if(strcmp(option, "report")==0){
+        if(strlen(value) >= sizeof(config->report)){
+            return -1;
+        }
+
+        strcpy(config->report, value);
+
+        return 0;
+    }
+
+    return -1;
+}
+
+int fault_parse(const char* spec, struct fault_config* config){
+    memset(config, 0, sizeof(struct fault_config));
+
+    char* copy = strdup(spec);
+
+    if(copy==NULL){
+        return -1;
+    }
+
+    int result = 0;
+    char* saveptr;
+
+    for(char* option = strtok_r(copy, ",", &saveptr); option!=NULL;
+            option = strtok_r(NULL, ",", &saveptr)){
+
+        if(parse_option(option, config)){
+            fprintf(stderr, "fault_parse: invalid option '%s'\n", option);
+            result = -1;
+            break;
+        }
+    }
+
+    free(copy);
+
+    return result;
+}
+
+static void drop_cache(){
+    for(size_t block = 0; block < cache_size; block++){
+        free(cache[block]);
+    }
+
+    free(cache);
+
+    cache = NULL;
+    cache_size = 0;
+    cached_blocks = 0;
+}
+
+int fault_configure(const struct fault_config* new_config){
+    drop_cache();
+
+    active = false;
+    io_count = 0;
+    power_lost = false;
+
+    if(new_config==NULL){
+        return 0;
+    }
+
+    config = *new_config;
+
+    //xorshift never leaves 0
+    rng = config.seed!=0 ? config.seed : 0x9E3779B97F4A7C15ull;
+
+    active = true;
+
+    return 0;
+}
+
+int fault_configure_from_env(){
+    if(env_read){
+        return 0;
+    }
+
+    env_read = true;
+
+    const char* spec = getenv("FS_FAULT");
+
+    if(spec==NULL || *spec=='\0'){
+        return 0;
+    }
+
+    struct fault_config env_config;
+
+    if(fault_parse(spec, &env_config)){
+        return -1;
+    }
+
+    return fault_configure(&env_config);
+}
+
+bool fault_active(){
+    return active;
+}
+
+uint64_t fault_io_count(){
+    return io_count;
+}
+
+static void write_report(){
+    if(config.report[0]=='\0'){
+        return;
+    }
+
+    FILE* report = fopen(config.report, "w");
+
+    if(report==NULL){
+        return;
+    }
+
+    fprintf(report, "%llu\n", (unsigned long long)io_count);
+    fclose(report);
+}
+
+static void lose_power(){
+    power_lost = true;
+
+    drop_cache();
+
+    if(config.halt){
+        write_report();
+        _exit(FAULT_HALT_STATUS);
+    }
+}
+
+static void delay(const struct fault_latency* latency){
+    uint64_t ns;
+
+    switch(latency->distribution){
+    case FAULT_LATENCY_FIXED:
+        ns = latency->a_ns;
+        break;
+    case FAULT_LATENCY_UNIFORM:
+        ns = latency->a_ns + next_random() % (latency->b_ns - latency->a_ns + 1);
+        break;
+    case FAULT_LATENCY_EXPONENTIAL:
+        //53 random bits, never 0 so that the log is finite
+        ns = (uint64_t)(-(double)latency->a_ns
+                * log(((next_random() >> 11) + 1) * 0x1.0p-53));
+        break;
+    default:
+        return;
+    }
+
+    if(ns==0){
+        return;
+    }
+
+    if(ns < SPIN_LIMIT_NS){
+        uint64_t end_ns = stats_now_ns() + ns;
+
+        while(stats_now_ns() < end_ns);
+
+        return;
+    }
+
+    struct timespec duration = { (time_t)(ns / 1000000000ull), (long)(ns % 1000000000ull) };
+
+    while(clock_nanosleep(CLOCK_MONOTONIC, 0, &duration, &duration)==EINTR);
+}
+
+/*
+ * Counts an I/O and applies the faults due before it is done
+ *
+ * Returns: 0 if the I/O can go on, -1 with errno set otherwise
+ */
+static int begin_io(const struct fault_latency* latency){
+    if(power_lost){
+        errno = EIO;
+        return -1;
+    }
+
+    io_count++;
+
+    if(io_count==config.crash_at){
+        lose_power();
+        errno = EIO;
+        return -1;
+    }
+
+    for(size_t i = 0; i < config.fail_ranges; i++){
+        if(io_count >= config.fail_first[i] && io_count <= config.fail_last[i]){
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    delay(latency);
+
+    return 0;
+}
+
+static size_t iov_bytes(const struct iovec* iov, int iovcnt){
+    size_t bytes = 0;
+
+    for(int i = 0; i < iovcnt; i++){
+        bytes += iov[i].iov_len;
+    }
+
+    return bytes;
+}
+
+/*
+ * Copies @length bytes between byte @at of the data described by @iov and
+ * @buffer, into @iov if @to_iov is true
+ */
+static void iov_copy(const struct iovec* iov, int iovcnt, size_t at, uint8_t* buffer,
+        size_t length, bool to_iov){
+
+    for(int i = 0; i < iovcnt && length > 0; i++){
+        if(at >= iov[i].iov_len){
+            at -= iov[i].iov_len;
+            continue;
+        }
+
+        size_t chunk = iov[i].iov_len - at < length ? iov[i].iov_len - at : length;
+        uint8_t* base = (uint8_t*)iov[i].iov_base + at;
+
+        if(to_iov){
+            memcpy(base, buffer, chunk);
+        } else {
+            memcpy(buffer, base, chunk);
+        }
+
+        buffer += chunk;
+        length -= chunk;
+        at = 0;
+    }
+}
+
+/*
+ * Keeps a copy of the whole blocks written from @iov at @offset
+ *
+ * Returns: 0 on success, -1 otherwise
+ */
+static int cache_write(const struct iovec* iov, int iovcnt, off_t offset, size_t bytes){
+    size_t first = (size_t)offset / CACHE_UNIT;
+    size_t blocks = bytes / CACHE_UNIT;
+
+    if(first + blocks > cache_size){
+        size_t size = cache_size==0 ? 64 : cache_size;
+
+        while(size < first + blocks){
+            size *= 2;
+        }
+
+        uint8_t** grown = (uint8_t**)realloc(cache, size * sizeof(uint8_t*));
+
+        if(grown==NULL){
+            return -1;
+        }
+
+        memset(&grown[cache_size], 0, (size - cache_size) * sizeof(uint8_t*));
+
+        cache = grown;
+        cache_size = size;
+    }
+
+    for(size_t block = 0; block < blocks; block++){
+        uint8_t** slot = &cache[first + block];
+
+        if(*slot==NULL){
+            if((*slot = (uint8_t*)malloc(CACHE_UNIT))==NULL){
+                return -1;
+            }
+
+            cached_blocks++;
+        }
+
+        iov_copy(iov, iovcnt, block * CACHE_UNIT, *slot, CACHE_UNIT, false);
+    }
+
+    return 0;
+}
+
+/*
+ * Writes the volatile cache to the disk image and empties it. A block is
+ * cached once with its latest content, so the order does not matter.
+ */
+static int cache_flush(int fd){
+    for(size_t block = 0; block < cache_size && cached_blocks > 0; block++){
+        if(cache[block]==NULL){
+            continue;
+        }
+
+        if(pwrite(fd, cache[block], CACHE_UNIT, (off_t)block * CACHE_UNIT)!=CACHE_UNIT){
+            return -1;
+        }
+
+        free(cache[block]);
+
+        cache[block] = NULL;
+        cached_blocks--;
+    }
+
+    return 0;
+}
+
+ssize_t fault_preadv(int fd, const struct iovec* iov, int iovcnt, off_t offset){
+    if(begin_io(&config.read)){
+        return -1;
+    }
+
+    if(io_count==config.tear_at){
+        lose_power();
+        errno = EIO;
+        return -1;
+    }
+
+    ssize_t result = preadv(fd, iov, iovcnt, offset);
+
+    if(result <= 0 || cached_blocks==0){
+        return result;
+    }
+
+    //newer data of the blocks still in the cache
+    size_t first = (size_t)offset / CACHE_UNIT;
+    size_t blocks = (size_t)result / CACHE_UNIT;
+
+    for(size_t block = 0; block < blocks && first + block < cache_size; block++){
+        if(cache[first + block]!=NULL){
+            iov_copy(iov, iovcnt, block * CACHE_UNIT, cache[first + block], CACHE_UNIT, true);
+        }
+    }
+
+    return result;
+}
+
+ssize_t fault_pwritev(int fd, const struct iovec* iov, int iovcnt, off_t offset){
+    if(begin_io(&config.write)){
+        return -1;
+    }
+
+    size_t bytes = iov_bytes(iov, iovcnt);
+
+    if(io_count==config.tear_at){
+        //the first sectors made it to the media before the power went
+        size_t torn = bytes / 2 / SECTOR_SIZE * SECTOR_SIZE;
+        uint8_t* buffer = (uint8_t*)malloc(torn > 0 ? torn : 1);
+
+        if(buffer!=NULL){
+            iov_copy(iov, iovcnt, 0, buffer, torn, false);
+
+            if(pwrite(fd, buffer, torn, offset) < 0){
+                perror("pwrite");
+            }
+
+            free(buffer);
+        }
+
+        lose_power();
+        errno = EIO;
+        return -1;
+    }
+
+    if(!config.volatile_cache){
+        return pwritev(fd, iov, iovcnt, offset);
+    }
+
+    if(cache_write(iov, iovcnt, offset, bytes)){
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return (ssize_t)bytes;
+}
+
+int fault_fdatasync(int fd){
+    if(begin_io(&config.sync)){
+        return -1;
+    }
+
+    if(io_count==config.tear_at){
+        lose_power();
+        errno = EIO;
+        return -1;
+    }
+
+    if(cache_flush(fd)){
+        return -1;
+    }
+
+    return fdatasync(fd);
+}
+
+void fault_close(int fd){
+    if(!active){
+        return;
+    }
+
+    if(!power_lost){
+        cache_flush(fd);
+    }
+
+    drop_cache();
+    write_report();
+}
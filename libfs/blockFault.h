@@ -0,0 +1,133 @@
+#ifndef BLOCKFAULT_H_
+#define BLOCKFAULT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Misbehaving block backend, for resilience benchmarks and crash tests.
+ *
+ * When a configuration is active, every transfer and sync of the block
+ * layer goes through the fault_* calls below instead of the system calls.
+ * They can add latency drawn from a distribution, fail the Nth I/O, cut
+ * the power before the Nth I/O or in the middle of it, and keep writes
+ * in a volatile cache until the next sync, like a disk write cache. When
+ * the power goes, that cache is lost and every later I/O fails, or the
+ * program exits with FAULT_HALT_STATUS.
+ *
+ * Programs pick it up from the FS_FAULT environment variable, read at
+ * the first block_disk_open(), so unmodified programs such as test_fs.x
+ * and fs_bench.x can be run on misbehaving media. The variable holds a
+ * comma separated list of:
+ *
+ *	read=<dist>, write=<dist>, sync=<dist>
+ *		latency added to every read, write or sync, where <dist> is
+ *		fixed:<t>, uniform:<min>:<max> or exp:<mean>, and times take a
+ *		ns, us, ms or s suffix
+ *	fail_at=<n>	the nth I/O fails with EIO, the next ones work. Also
+ *			<n>..<m> for the nth to the mth, and a list of up to
+ *			FAULT_FAIL_RANGES of them: fail_at=10..13,15
+ *	crash_at=<n>	the power goes right before the nth I/O
+ *	tear_at=<n>	the power goes during the nth I/O: if it is a write,
+ *			only its first half reaches the disk, in 512 byte sectors
+ *	volatile	writes only reach the disk image at the next sync
+ *	halt		exit when the power goes
+ *	seed=<n>	seed of the latency distributions
+ *	report=<path>	write the number of I/Os done to <path> when the disk
+ *			is closed
+ *
+ * I/Os are counted from 1 across all disks a program opens: every read,
+ * write and sync call is one, whatever its length.
+ */
+
+#define FAULT_HALT_STATUS 86
+
+#define FAULT_FAIL_RANGES 8
+
+enum fault_distribution{
+    FAULT_LATENCY_NONE,
+    FAULT_LATENCY_FIXED,
+    FAULT_LATENCY_UNIFORM,
+    FAULT_LATENCY_EXPONENTIAL
+};
+
+struct fault_latency{
+    enum fault_distribution distribution;
+    /* fixed value, minimum or mean */
+    uint64_t a_ns;
+    /* maximum of the uniform distribution */
+    uint64_t b_ns;
+};
+
+struct fault_config{
+    struct fault_latency read;
+    struct fault_latency write;
+    struct fault_latency sync;
+
+    /* 1-based I/O numbers, 0 for never */
+    uint64_t crash_at;
+    uint64_t tear_at;
+
+    /* I/Os failing, from fail_first[i] to fail_last[i] included */
+    uint64_t fail_first[FAULT_FAIL_RANGES];
+    uint64_t fail_last[FAULT_FAIL_RANGES];
+    size_t fail_ranges;
+
+    bool volatile_cache;
+    bool halt;
+    uint64_t seed;
+
+    /* file the I/O count is written to when the disk is closed, or "" */
+    char report[256];
+};
+
+/*
+ * Parses an FS_FAULT specification into @config
+ *
+ * Returns: 0 on success, -1 if @spec is invalid
+ */
+int fault_parse(const char* spec, struct fault_config* config);
+
+/*
+ * Activates @config, or deactivates fault injection if @config is NULL.
+ * Resets the I/O count and brings the power back.
+ *
+ * Returns: 0 on success, -1 if @config is invalid
+ */
+int fault_configure(const struct fault_config* config);
+
+/*
+ * Activates the configuration in FS_FAULT, the first time it is called
+ *
+ * Returns: -1 if FS_FAULT is set and invalid, 0 otherwise
+ */
+int fault_configure_from_env();
+
+/*
+ * Returns: true if a configuration is active
+ */
+bool fault_active();
+
+/*
+ * Returns: the number of I/Os counted since the configuration was
+ * activated
+ */
+uint64_t fault_io_count();
+
+/*
+ * Stand-ins for preadv(), pwritev() and fdatasync() on the disk image @fd
+ */
+ssize_t fault_preadv(int fd, const struct iovec* iov, int iovcnt, off_t offset);
+ssize_t fault_pwritev(int fd, const struct iovec* iov, int iovcnt, off_t offset);
+int fault_fdatasync(int fd);
+
+/*
+ * Called when the disk image @fd is closed: writes the volatile cache
+ * out, as a clean shutdown would, and the I/O count report
+ */
+void fault_close(int fd);
+
+#endif
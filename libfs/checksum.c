@@ -0,0 +1,210 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CRC32C_X86 1
+#endif
+
+#include "checksum.h"
+
+/* reflected Castagnoli polynomial */
+#define CRC32C_POLY 0x82F63B78u
+
+/*
+ * The SSE4.2 kernel splits every 4096 byte chunk into three streams of
+ * this many bytes, plus a 16 byte tail
+ */
+#define STREAM_BYTES 1360
+#define CHUNK_BYTES 4096
+
+struct crc32c_ops{
+    const char* name;
+    /* raw update: no pre or post inversion */
+    uint32_t (*update)(uint32_t, const uint8_t*, size_t);
+};
+
+static const struct crc32c_ops* active_ops = NULL;
+
+static uint32_t crc32c_table[256];
+
+/*
+ * shift_table[k][b] is what byte b, in position k of a CRC register,
+ * turns into after STREAM_BYTES zero bytes
+ */
+static uint32_t shift_table[4][256];
+
+static bool tables_ready = false;
+
+static uint32_t software_update(uint32_t crc, const uint8_t* byte, size_t length){
+    for(size_t i = 0; i < length; i++){
+        crc = crc32c_table[(crc ^ byte[i]) & 0xFF] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+static void build_tables(){
+    for(uint32_t byte = 0; byte < 256; byte++){
+        uint32_t crc = byte;
+
+        for(int bit = 0; bit < 8; bit++){
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+
+        crc32c_table[byte] = crc;
+    }
+
+    //running zeros through the register is linear, shift each bit once
+    static const uint8_t zeros[STREAM_BYTES];
+    uint32_t shifted_bit[32];
+
+    for(int bit = 0; bit < 32; bit++){
+        shifted_bit[bit] = software_update((uint32_t)1 << bit, zeros, STREAM_BYTES);
+    }
+
+    for(int k = 0; k < 4; k++){
+        for(uint32_t byte = 0; byte < 256; byte++){
+            uint32_t shifted = 0;
+
+            for(int bit = 0; bit < 8; bit++){
+                if(byte & (1u << bit)){
+                    shifted ^= shifted_bit[8 * k + bit];
+                }
+            }
+
+            shift_table[k][byte] = shifted;
+        }
+    }
+
+    tables_ready = true;
+}
+
+static const struct crc32c_ops software_ops = { "software", software_update };
+
+#ifdef CRC32C_X86
+
+static inline uint32_t shift_stream(uint32_t crc){
+    return shift_table[0][crc & 0xFF] ^ shift_table[1][(crc >> 8) & 0xFF]
+         ^ shift_table[2][(crc >> 16) & 0xFF] ^ shift_table[3][crc >> 24];
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t sse42_serial(uint32_t crc, const uint8_t* data, size_t length){
+    uint64_t crc64 = crc;
+
+    for(; length >= 8; length -= 8, data += 8){
+        uint64_t word;
+
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+
+    crc = (uint32_t)crc64;
+
+    for(; length > 0; length--, data++){
+        crc = _mm_crc32_u8(crc, *data);
+    }
+
+    return crc;
+}
+
+/*
+ * crc32 has a latency of 3 cycles but issues every cycle, so three
+ * independent streams keep it busy. Each stream is merged into the next
+ * by shifting it over STREAM_BYTES zero bytes, which CRC linearity
+ * allows: crc(a, x || y) = shift(crc(a, x), |y|) ^ crc(0, y).
+ */
+__attribute__((target("sse4.2")))
+static uint32_t sse42_update(uint32_t crc, const uint8_t* data, size_t length){
+    for(; length >= CHUNK_BYTES; length -= CHUNK_BYTES, data += CHUNK_BYTES){
+        uint64_t crc_a = crc;
+        uint64_t crc_b = 0;
+        uint64_t crc_c = 0;
+
+        const uint8_t* a = data;
+        const uint8_t* b = data + STREAM_BYTES;
+        const uint8_t* c = data + 2 * STREAM_BYTES;
+
+        for(size_t offset = 0; offset < STREAM_BYTES; offset += 8){
+            uint64_t word_a, word_b, word_c;
+
+            memcpy(&word_a, a + offset, 8);
+            memcpy(&word_b, b + offset, 8);
+            memcpy(&word_c, c + offset, 8);
+
+            crc_a = _mm_crc32_u64(crc_a, word_a);
+            crc_b = _mm_crc32_u64(crc_b, word_b);
+            crc_c = _mm_crc32_u64(crc_c, word_c);
+        }
+
+        crc = shift_stream((uint32_t)crc_a) ^ (uint32_t)crc_b;
+        crc = shift_stream(crc) ^ (uint32_t)crc_c;
+
+        crc = sse42_serial(crc, data + 3 * STREAM_BYTES, CHUNK_BYTES - 3 * STREAM_BYTES);
+    }
+
+    return sse42_serial(crc, data, length);
+}
+
+static const struct crc32c_ops sse42_ops = { "sse4.2", sse42_update };
+
+#endif
+
+static const struct crc32c_ops* best_ops(){
+#ifdef CRC32C_X86
+    __builtin_cpu_init();
+
+    if(__builtin_cpu_supports("sse4.2")){
+        return &sse42_ops;
+    }
+#endif
+
+    return &software_ops;
+}
+
+static inline const struct crc32c_ops* ops(){
+    if(!tables_ready){
+        build_tables();
+    }
+
+    if(active_ops==NULL){
+        active_ops = best_ops();
+    }
+
+    return active_ops;
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t length){
+    return ~ops()->update(~crc, (const uint8_t*)data, length);
+}
+
+int crc32c_select(enum crc32c_impl impl){
+    switch(impl){
+    case CRC32C_AUTO:
+        active_ops = best_ops();
+        return 0;
+    case CRC32C_SOFTWARE:
+        active_ops = &software_ops;
+        return 0;
+#ifdef CRC32C_X86
+    case CRC32C_SSE42:
+        __builtin_cpu_init();
+
+        if(!__builtin_cpu_supports("sse4.2")){
+            return -1;
+        }
+
+        active_ops = &sse42_ops;
+        return 0;
+#endif
+    default:
+        return -1;
+    }
+}
+
+const char* crc32c_name(){
+    return ops()->name;
+}
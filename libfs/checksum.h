@@ -0,0 +1,38 @@
+#ifndef CHECKSUM_H_
+#define CHECKSUM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The implementation is picked the first time crc32c() is called, from
+ * what the CPU supports (the SSE4.2 crc32 instruction, then a table
+ * driven loop).
+ */
+
+enum crc32c_impl{
+    CRC32C_AUTO,
+    CRC32C_SOFTWARE,
+    CRC32C_SSE42
+};
+
+/*
+ * CRC32C (Castagnoli polynomial) of @length bytes at @data, continuing
+ * from @crc. Start a new checksum with crc = 0.
+ */
+uint32_t crc32c(uint32_t crc, const void* data, size_t length);
+
+/*
+ * Forces an implementation, mostly for benchmarks comparing them.
+ * CRC32C_AUTO goes back to the best one the CPU supports.
+ *
+ * Returns: -1 if the CPU does not support @impl, 0 otherwise
+ */
+int crc32c_select(enum crc32c_impl impl);
+
+/*
+ * Name of the implementation currently in use
+ */
+const char* crc32c_name();
+
+#endif
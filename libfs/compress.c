@@ -0,0 +1,823 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "compress.h"
+#include "directory.h"
+#include "disk.h"
+#include "fdTable.h"
+#include "fs.h"
+#include "lz.h"
+#include "metadata.h"
+#include "reflink.h"
+
+struct compress_cache{
+    /* chain the table was read from */
+    size_t first_block;
+    size_t units;
+    struct CompressUnit* table;
+    /* data blocks of the chain, in order */
+    size_t* chain;
+    size_t chain_blocks;
+    /* the unit in content, SIZE_MAX if none */
+    size_t unit;
+    uint8_t* content;
+    uint8_t* packed;
+};
+
+/*
+ * Blocks allocated for a new chain, in order
+ */
+struct new_chain{
+    size_t* blocks;
+    size_t count;
+    size_t capacity;
+};
+
+/*
+ * Unit compress_write() stored in new blocks, linked in once they are all
+ * written
+ */
+struct written_unit{
+    uint32_t length;
+    size_t blocks[COMPRESS_UNIT_BLOCKS];
+    size_t count;
+};
+
+static inline size_t unit_bytes(){
+    return (size_t)COMPRESS_UNIT_BLOCKS << block_shift;
+}
+
+/*
+ * Bytes of content of unit @unit of a file of @size bytes
+ */
+static size_t unit_length(size_t size, size_t unit){
+    size_t start = unit * unit_bytes();
+
+    return size - start < unit_bytes() ? size - start : unit_bytes();
+}
+
+static size_t header_blocks(size_t units){
+    size_t bytes = sizeof(struct CompressHeader) + units * sizeof(struct CompressUnit);
+
+    return (bytes + block_size - 1) >> block_shift;
+}
+
+/*
+ * Blocks unit @unit takes in the chain
+ */
+static size_t stored_blocks(const struct CompressUnit* unit, size_t length){
+    return total_block_size(unit->length!=0 ? unit->length : length);
+}
+
+static void free_cache(struct compress_cache* cache){
+    free(cache->table);
+    free(cache->chain);
+    free(cache->content);
+    free(cache->packed);
+
+    memset(cache, 0, sizeof(struct compress_cache));
+
+    cache->first_block = FAT_EOC;
+    cache->unit = SIZE_MAX;
+}
+
+/*
+ * Fills @blocks with the chain of at most @limit blocks starting at data
+ * block @first
+ *
+ * Returns: the blocks of the chain, 0 if it is longer or runs out of range
+ */
+static size_t read_chain(size_t first, size_t limit, size_t* blocks){
+    size_t block = first;
+    size_t count = 0;
+
+    while(block!=FAT_EOC){
+        if(count==limit || block==0 || block >= data_blocks){
+            return 0;
+        }
+
+        blocks[count++] = block;
+        block = get_fat_entry(block);
+    }
+
+    return count;
+}
+
+/*
+ * Reads the unit table of the compressed chain from data block @first, of
+ * a file of @size bytes
+ *
+ * Returns: 0 on success, -1 if it could not be read or is not valid
+ */
+static int load_cache(struct compress_cache* cache, size_t first, size_t size){
+    free_cache(cache);
+
+    size_t units = (size + unit_bytes() - 1) / unit_bytes();
+    size_t limit = total_block_size(size);
+    size_t table_blocks = header_blocks(units);
+
+    cache->chain = (size_t*)malloc((limit==0 ? 1 : limit) * sizeof(size_t));
+    cache->table = (struct CompressUnit*)malloc((units==0 ? 1 : units) * sizeof(struct CompressUnit));
+    cache->content = (uint8_t*)malloc(unit_bytes());
+    cache->packed = (uint8_t*)malloc(unit_bytes());
+
+    uint8_t* header = (uint8_t*)malloc(table_blocks * block_size);
+
+    int ret = cache->chain!=NULL && cache->table!=NULL && cache->content!=NULL
+            && cache->packed!=NULL && header!=NULL ? 0 : -1;
+
+    if(ret==0){
+        cache->chain_blocks = read_chain(first, limit, cache->chain);
+
+        if(cache->chain_blocks < table_blocks
+                || transfer_blocks(cache->chain, table_blocks, header, false)){
+            ret = -1;
+        }
+    }
+
+    const struct CompressHeader* read = (const struct CompressHeader*)header;
+
+    if(ret==0 && (memcmp(read->signature, COMPRESS_SIGNATURE, 8)!=0
+            || read->units!=units || read->headerBlocks!=table_blocks)){
+        ret = -1;
+    }
+
+    for(size_t u = 0; ret==0 && u < units; u++){
+        memcpy(&cache->table[u], &header[sizeof(struct CompressHeader) + u * sizeof(struct CompressUnit)],
+                sizeof(struct CompressUnit));
+
+        size_t length = unit_length(size, u);
+        struct CompressUnit* unit = &cache->table[u];
+
+        if(unit->block < table_blocks || unit->length >= length
+                || unit->block + stored_blocks(unit, length) > cache->chain_blocks){
+            ret = -1;
+        }
+    }
+
+    free(header);
+
+    if(ret!=0){
+        free_cache(cache);
+        return -1;
+    }
+
+    cache->first_block = first;
+    cache->units = units;
+
+    return 0;
+}
+
+/*
+ * Decompresses unit @unit of a file of @size bytes into the content of
+ * @cache
+ */
+static int decode_unit(struct compress_cache* cache, size_t unit, size_t size){
+    if(cache->unit==unit){
+        return 0;
+    }
+
+    const struct CompressUnit* stored = &cache->table[unit];
+
+    size_t length = unit_length(size, unit);
+    size_t blocks = stored_blocks(stored, length);
+
+    cache->unit = SIZE_MAX;
+
+    uint8_t* target = stored->length==0 ? cache->content : cache->packed;
+
+    if(transfer_blocks(&cache->chain[stored->block], blocks, target, false)){
+        return -1;
+    }
+
+    if(stored->length!=0 && lz_decompress(cache->packed, stored->length, cache->content, length)){
+        return -1;
+    }
+
+    cache->unit = unit;
+
+    return 0;
+}
+
+/*
+ * Allocates @count blocks at the end of @chain, linked after its last one
+ *
+ * Returns: 0 on success, -1 if the disk is full or the chain would reach
+ * its capacity
+ */
+static int allocate_blocks(struct new_chain* chain, size_t count){
+    if(chain->count + count > chain->capacity){
+        return -1;
+    }
+
+    for(size_t i = 0; i < count; i++){
+        size_t block;
+
+        if(first_block_available(&block)==false){
+            return -1;
+        }
+
+        set_fat_entry(block, FAT_EOC);
+
+        if(chain->count > 0){
+            set_fat_entry(chain->blocks[chain->count - 1], (uint32_t)block);
+        }
+
+        chain->blocks[chain->count++] = block;
+    }
+
+    return 0;
+}
+
+/*
+ * Appends @count blocks, whose content is @buffer, to @chain
+ *
+ * Returns: 0 on success, -1 if the disk is full, the chain would reach its
+ * capacity, or a block could not be written
+ */
+static int append_blocks(struct new_chain* chain, const uint8_t* buffer, size_t count){
+    size_t start = chain->count;
+
+    if(allocate_blocks(chain, count)){
+        return -1;
+    }
+
+    return transfer_blocks(&chain->blocks[start], count, (uint8_t*)buffer, true);
+}
+
+/*
+ * Points entry @entry_index of @dir to the chain from data block @first,
+ * stored compressed or not, and frees the chain it had
+ */
+static int switch_chain(struct directory* dir, size_t entry_index, size_t first, bool compressed){
+    struct DirEntry* entry = dir_entry(dir, entry_index);
+
+    size_t old_first = dir_entry_first_block(entry);
+
+    //the directory block, and the FAT block of the first block freed
+    if(metadata_reserve(2) || (compressed && metadata_set_feature(FS_FEATURE_COMPRESSION))){
+        return -1;
+    }
+
+    dir_entry_set_first_block(entry, first);
+    dir_entry_set_compressed(entry, compressed);
+
+    if(dir_update(dir, entry_index)){
+        return -1;
+    }
+
+    return erase_file(old_first);
+}
+
+int compress_file(struct directory* dir, size_t entry_index){
+    struct DirEntry* entry = dir_entry(dir, entry_index);
+
+    if(!dir_entry_compress(entry) || dir_entry_is_compressed(entry) || dir_entry_is_directory(entry)
+            || dir_entry_is_inline(entry) || dir_entry_is_packed(entry)
+            || dir_entry_first_block(entry)==FAT_EOC){
+        return 0;
+    }
+
+    size_t size = (size_t)dir_entry_size(entry);
+    size_t blocks = total_block_size(size);
+    size_t units = (size + unit_bytes() - 1) / unit_bytes();
+    size_t table_blocks = header_blocks(units);
+
+    //every unit takes a block at least
+    if(table_blocks + units >= blocks){
+        return 0;
+    }
+
+    size_t* plain = (size_t*)malloc(blocks * sizeof(size_t));
+    uint8_t* header = (uint8_t*)calloc(table_blocks, block_size);
+    uint8_t* content = (uint8_t*)malloc(unit_bytes());
+    uint8_t* packed = (uint8_t*)malloc(unit_bytes());
+
+    //only worth it if it saves a block
+    struct new_chain chain = { (size_t*)malloc(blocks * sizeof(size_t)), 0, blocks - 1 };
+
+    int ret = plain!=NULL && header!=NULL && content!=NULL && packed!=NULL
+            && chain.blocks!=NULL ? 0 : -1;
+
+    //a chain that does not match the size is fs_check()'s business
+    bool compressible = ret==0 && read_chain(dir_entry_first_block(entry), blocks, plain)==blocks;
+
+    //the table is written last, in blocks taken first
+    if(compressible && append_blocks(&chain, header, table_blocks)){
+        compressible = false;
+    }
+
+    struct CompressHeader* written = (struct CompressHeader*)header;
+
+    memcpy(written->signature, COMPRESS_SIGNATURE, 8);
+    written->units = (uint32_t)units;
+    written->headerBlocks = (uint32_t)table_blocks;
+
+    for(size_t u = 0; compressible && u < units; u++){
+        size_t length = unit_length(size, u);
+        size_t length_blocks = total_block_size(length);
+
+        if(transfer_blocks(&plain[u * COMPRESS_UNIT_BLOCKS], length_blocks, content, false)){
+            ret = -1;
+            break;
+        }
+
+        //past the end of the file, the last block holds zeros
+        memset(&content[length], 0, (length_blocks << block_shift) - length);
+
+        struct CompressUnit unit;
+
+        unit.block = (uint32_t)chain.count;
+        unit.length = (uint32_t)lz_compress(content, length, packed, (length_blocks - 1) << block_shift);
+
+        const uint8_t* stored = content;
+
+        if(unit.length!=0){
+            memset(&packed[unit.length], 0, (total_block_size(unit.length) << block_shift) - unit.length);
+            stored = packed;
+        }
+
+        memcpy(&header[sizeof(struct CompressHeader) + u * sizeof(struct CompressUnit)], &unit,
+                sizeof(struct CompressUnit));
+
+        //a full disk, or a file that does not compress, stays as it is
+        if(append_blocks(&chain, stored, stored_blocks(&unit, length))){
+            compressible = false;
+        }
+    }
+
+    if(ret==0 && compressible){
+        if(transfer_blocks(chain.blocks, table_blocks, header, true)
+                || switch_chain(dir, entry_index, chain.blocks[0], true)){
+            ret = -1;
+        }
+    }
+
+    if((ret!=0 || !compressible) && chain.count > 0 && dir_entry_first_block(entry)!=chain.blocks[0]){
+        erase_file(chain.blocks[0]);
+    }
+
+    free(plain);
+    free(header);
+    free(content);
+    free(packed);
+    free(chain.blocks);
+
+    return ret;
+}
+
+/*
+ * compress_expand(), telling in @full whether it failed for lack of blocks
+ */
+static int expand_file(struct directory* dir, size_t entry_index, bool* full){
+    struct DirEntry* entry = dir_entry(dir, entry_index);
+
+    *full = false;
+
+    if(!dir_entry_is_compressed(entry)){
+        return 0;
+    }
+
+    size_t size = (size_t)dir_entry_size(entry);
+    size_t blocks = total_block_size(size);
+
+    struct compress_cache cache;
+
+    memset(&cache, 0, sizeof(struct compress_cache));
+
+    struct new_chain chain = { (size_t*)malloc((blocks==0 ? 1 : blocks) * sizeof(size_t)), 0, blocks };
+
+    int ret = chain.blocks==NULL || load_cache(&cache, dir_entry_first_block(entry), size) ? -1 : 0;
+
+    for(size_t u = 0; ret==0 && u < cache.units; u++){
+        size_t length = unit_length(size, u);
+
+        if(decode_unit(&cache, u, size)){
+            ret = -1;
+            break;
+        }
+
+        memset(&cache.content[length], 0, (total_block_size(length) << block_shift) - length);
+
+        size_t start = chain.count;
+
+        if(allocate_blocks(&chain, total_block_size(length))){
+            *full = true;
+            ret = -1;
+        } else {
+            ret = transfer_blocks(&chain.blocks[start], total_block_size(length), cache.content, true);
+        }
+    }
+
+    if(ret==0 && switch_chain(dir, entry_index, chain.count > 0 ? chain.blocks[0] : FAT_EOC, false)){
+        ret = -1;
+    }
+
+    if(ret!=0 && chain.count > 0 && dir_entry_first_block(entry)!=chain.blocks[0]){
+        erase_file(chain.blocks[0]);
+    }
+
+    free_cache(&cache);
+    free(chain.blocks);
+
+    return ret;
+}
+
+int compress_expand(struct directory* dir, size_t entry_index){
+    bool full;
+
+    return expand_file(dir, entry_index, &full);
+}
+
+/*
+ * compress_expand() for the file @fd points to, the other descriptors of
+ * the file seeing the new chain
+ *
+ * Returns: 0 on success or if the disk is full, the file staying
+ * compressed then, -1 otherwise
+ */
+static int compress_unpack(struct fdNode* fd){
+    compress_forget(fd);
+
+    bool full;
+
+    if(expand_file(fd->directory, fd->dir_entry_index, &full)){
+        return full ? 0 : -1;
+    }
+
+    fd->first_data_block = dir_entry_first_block(dir_entry(fd->directory, fd->dir_entry_index));
+    fd->cursor_index = 0;
+    fd->cursor_block = fd->first_data_block;
+    fd->chain_blocks = 0;
+    fd->last_block = FAT_EOC;
+
+    chain_changed(fd);
+
+    return 0;
+}
+
+/*
+ * Returns: the unit cache of @fd, holding the table of its chain, NULL if
+ * it could not be read
+ */
+static struct compress_cache* fd_cache(struct fdNode* fd){
+    if(fd->unit_cache==NULL){
+        fd->unit_cache = (struct compress_cache*)calloc(1, sizeof(struct compress_cache));
+
+        if(fd->unit_cache==NULL){
+            return NULL;
+        }
+
+        fd->unit_cache->first_block = FAT_EOC;
+        fd->unit_cache->unit = SIZE_MAX;
+    }
+
+    struct compress_cache* cache = fd->unit_cache;
+
+    if(cache->first_block!=fd->first_data_block
+            && load_cache(cache, fd->first_data_block, fd->size)){
+        return NULL;
+    }
+
+    return cache;
+}
+
+/*
+ * Compresses the @length bytes of content of @cache to new blocks, as is
+ * if that saves no block
+ *
+ * Returns: 0 on success, -1 with nothing left allocated otherwise, @full
+ * telling whether the disk ran out of blocks
+ */
+static int store_unit(struct compress_cache* cache, size_t length, struct written_unit* written,
+        bool* full){
+
+    size_t length_blocks = total_block_size(length);
+
+    //past the end of the unit, its last block holds zeros
+    memset(&cache->content[length], 0, (length_blocks << block_shift) - length);
+
+    written->length = (uint32_t)lz_compress(cache->content, length, cache->packed,
+            (length_blocks - 1) << block_shift);
+
+    const uint8_t* stored = cache->content;
+
+    if(written->length!=0){
+        memset(&cache->packed[written->length], 0,
+                (total_block_size(written->length) << block_shift) - written->length);
+        stored = cache->packed;
+    }
+
+    size_t blocks = total_block_size(written->length!=0 ? written->length : length);
+
+    struct new_chain chain = { written->blocks, 0, COMPRESS_UNIT_BLOCKS };
+
+    *full = allocate_blocks(&chain, blocks)!=0;
+
+    if(*full || transfer_blocks(written->blocks, blocks, (uint8_t*)stored, true)){
+        if(chain.count > 0){
+            erase_file(written->blocks[0]);
+        }
+
+        written->count = 0;
+
+        return -1;
+    }
+
+    written->count = chain.count;
+
+    return 0;
+}
+
+int compress_write(struct fdNode* fd, const uint8_t* data, size_t end_offset){
+    struct compress_cache* cache = fd_cache(fd);
+
+    if(cache==NULL){
+        return -1;
+    }
+
+    size_t size = fd->size;
+    size_t old_units = cache->units;
+    size_t old_table_blocks = header_blocks(old_units);
+    size_t first_unit = fd->offset / unit_bytes();
+    size_t last_unit = (end_offset - 1) / unit_bytes();
+
+    //the chain is relinked up to the end of the last unit written, which
+    //has to be the file's own, or of the last one for a unit appended
+    size_t last_old = last_unit < old_units ? last_unit : old_units - 1;
+    const struct CompressUnit* last_stored = &cache->table[last_old];
+    size_t last_block = last_stored->block + stored_blocks(last_stored, unit_length(size, last_old)) - 1;
+
+    if(reflink_shared(cache->chain[last_block])){
+        if(unshare_blocks(fd, last_block)){
+            return 0;
+        }
+
+        //the copies took the place of the shared blocks
+        cache->first_block = fd->first_data_block;
+
+        if(read_chain(fd->first_data_block, cache->chain_blocks, cache->chain)!=cache->chain_blocks){
+            free_cache(cache);
+            return -1;
+        }
+    }
+
+    //the new table takes its blocks first, so that running out of blocks
+    //ends the units written instead
+    size_t end_units = ((end_offset > size ? end_offset : size) + unit_bytes() - 1) / unit_bytes();
+    size_t max_table_blocks = header_blocks(end_units);
+
+    struct new_chain table_chain = { (size_t*)malloc(max_table_blocks * sizeof(size_t)), 0, max_table_blocks };
+
+    struct written_unit* written = (struct written_unit*)malloc(
+            (last_unit - first_unit + 1) * sizeof(struct written_unit));
+
+    if(table_chain.blocks==NULL || written==NULL){
+        free(table_chain.blocks);
+        free(written);
+        return -1;
+    }
+
+    if(allocate_blocks(&table_chain, max_table_blocks)){
+        if(table_chain.count > 0){
+            erase_file(table_chain.blocks[0]);
+        }
+
+        free(table_chain.blocks);
+        free(written);
+        return 0;
+    }
+
+    size_t count = 0;
+    size_t offset = fd->offset;
+    size_t new_size = size;
+    size_t bytes_written = 0;
+    bool full = false;
+    int failure = 0;
+
+    //the units written go to new blocks, one at a time
+    for(size_t unit = first_unit; unit <= last_unit; unit++){
+        size_t offset_in_unit = offset - unit * unit_bytes();
+        size_t length = end_offset - offset;
+
+        if(length > unit_bytes() - offset_in_unit){
+            length = unit_bytes() - offset_in_unit;
+        }
+
+        size_t old_length = unit < old_units ? unit_length(size, unit) : 0;
+        size_t new_length = offset_in_unit + length > old_length ? offset_in_unit + length : old_length;
+
+        if(unit < old_units && decode_unit(cache, unit, size)){
+            failure = -1;
+            break;
+        }
+
+        //the content no longer is the one of the table
+        cache->unit = SIZE_MAX;
+
+        memcpy(&cache->content[offset_in_unit], &data[bytes_written], length);
+
+        if(store_unit(cache, new_length, &written[count], &full)){
+            failure = full ? 0 : -1;
+            break;
+        }
+
+        count++;
+        offset += length;
+        bytes_written += length;
+
+        if(offset > new_size){
+            new_size = offset;
+        }
+    }
+
+    //what was written before a failure is kept
+    if(count==0){
+        erase_file(table_chain.blocks[0]);
+        free(table_chain.blocks);
+        free(written);
+        return failure;
+    }
+
+    size_t units = (new_size + unit_bytes() - 1) / unit_bytes();
+    size_t table_blocks = header_blocks(units);
+
+    struct CompressUnit* table = (struct CompressUnit*)malloc(units * sizeof(struct CompressUnit));
+
+    size_t chain_blocks = table_blocks;
+
+    for(size_t unit = 0; table!=NULL && unit < units; unit++){
+        bool rewritten = unit >= first_unit && unit < first_unit + count;
+
+        table[unit].block = (uint32_t)chain_blocks;
+        table[unit].length = rewritten ? written[unit - first_unit].length : cache->table[unit].length;
+
+        chain_blocks += rewritten ? written[unit - first_unit].count
+                                  : stored_blocks(&cache->table[unit], unit_length(size, unit));
+    }
+
+    uint8_t* header = (uint8_t*)calloc(table_blocks, block_size);
+
+    struct new_chain chain = { (size_t*)malloc(chain_blocks * sizeof(size_t)), 0, chain_blocks };
+
+    bool plain = chain_blocks > total_block_size(new_size);
+
+    int ret = 0;
+
+    if(table==NULL || header==NULL || chain.blocks==NULL || plain){
+        ret = -1;
+    } else {
+        struct CompressHeader* written_header = (struct CompressHeader*)header;
+
+        memcpy(written_header->signature, COMPRESS_SIGNATURE, 8);
+        written_header->units = (uint32_t)units;
+        written_header->headerBlocks = (uint32_t)table_blocks;
+
+        memcpy(&header[sizeof(struct CompressHeader)], table, units * sizeof(struct CompressUnit));
+
+        memcpy(chain.blocks, table_chain.blocks, table_blocks * sizeof(size_t));
+        chain.count = table_blocks;
+
+        if(transfer_blocks(chain.blocks, table_blocks, header, true)){
+            ret = -1;
+        }
+    }
+
+    for(size_t unit = 0; ret==0 && unit < units; unit++){
+        bool rewritten = unit >= first_unit && unit < first_unit + count;
+
+        const size_t* blocks = rewritten ? written[unit - first_unit].blocks
+                                         : &cache->chain[cache->table[unit].block];
+        size_t unit_blocks = rewritten ? written[unit - first_unit].count
+                                       : stored_blocks(&cache->table[unit], unit_length(size, unit));
+
+        memcpy(&chain.blocks[chain.count], blocks, unit_blocks * sizeof(size_t));
+        chain.count += unit_blocks;
+    }
+
+    //the directory block, and the FAT blocks of the links and of the blocks freed
+    if(ret==0 && metadata_reserve(old_table_blocks + max_table_blocks + count * (COMPRESS_UNIT_BLOCKS + 2) + 2)){
+        ret = -1;
+    }
+
+    if(ret==0){
+        for(size_t i = 0; i < chain.count; i++){
+            uint32_t next = i + 1 < chain.count ? (uint32_t)chain.blocks[i + 1] : FAT_EOC;
+
+            if(get_fat_entry(chain.blocks[i])!=next){
+                set_fat_entry(chain.blocks[i], next);
+            }
+        }
+
+        struct DirEntry* entry = dir_entry(fd->directory, fd->dir_entry_index);
+
+        dir_entry_set_first_block(entry, chain.blocks[0]);
+        dir_entry_set_size(entry, new_size);
+
+        dir_update(fd->directory, fd->dir_entry_index);
+
+        //the blocks the table did not need, the old table and the old
+        //blocks of the units written
+        for(size_t i = table_blocks; i < max_table_blocks; i++){
+            set_fat_entry(table_chain.blocks[i], 0);
+        }
+
+        for(size_t i = 0; i < old_table_blocks; i++){
+            set_fat_entry(cache->chain[i], 0);
+        }
+
+        for(size_t unit = first_unit; unit < first_unit + count && unit < old_units; unit++){
+            size_t first = cache->table[unit].block;
+            size_t blocks = stored_blocks(&cache->table[unit], unit_length(size, unit));
+
+            for(size_t i = first; i < first + blocks; i++){
+                set_fat_entry(cache->chain[i], 0);
+            }
+        }
+
+        fd->first_data_block = chain.blocks[0];
+        fd->cursor_index = 0;
+        fd->cursor_block = fd->first_data_block;
+        fd->chain_blocks = 0;
+        fd->last_block = FAT_EOC;
+        fd->size = new_size;
+        fd->offset = offset;
+
+        chain_changed(fd);
+
+        //the content is the one of the last unit written
+        free(cache->table);
+        free(cache->chain);
+
+        cache->table = table;
+        cache->chain = chain.blocks;
+        cache->chain_blocks = chain.count;
+        cache->units = units;
+        cache->first_block = fd->first_data_block;
+        cache->unit = first_unit + count - 1;
+
+        table = NULL;
+        chain.blocks = NULL;
+    } else {
+        erase_file(table_chain.blocks[0]);
+
+        for(size_t i = 0; i < count; i++){
+            erase_file(written[i].blocks[0]);
+        }
+    }
+
+    free(table);
+    free(header);
+    free(chain.blocks);
+    free(table_chain.blocks);
+    free(written);
+
+    //compressing no longer saves a block, the file is written plain
+    if(plain){
+        return compress_unpack(fd);
+    }
+
+    return ret==0 ? (int)bytes_written : -1;
+}
+
+int compress_read(struct fdNode* fd, uint8_t* data, size_t end_offset){
+    struct compress_cache* cache = fd_cache(fd);
+
+    if(cache==NULL){
+        return -1;
+    }
+
+    size_t bytes_read = 0;
+
+    while(fd->offset < end_offset){
+        size_t unit = fd->offset / unit_bytes();
+        size_t offset_in_unit = fd->offset - unit * unit_bytes();
+
+        size_t length = unit_length(fd->size, unit) - offset_in_unit;
+
+        if(length > end_offset - fd->offset){
+            length = end_offset - fd->offset;
+        }
+
+        //a unit that cannot be read ends the read
+        if(decode_unit(cache, unit, fd->size)){
+            return bytes_read > 0 ? (int)bytes_read : -1;
+        }
+
+        memcpy(&data[bytes_read], &cache->content[offset_in_unit], length);
+
+        fd->offset += length;
+        bytes_read += length;
+    }
+
+    return (int)bytes_read;
+}
+
+void compress_forget(struct fdNode* fd){
+    if(fd->unit_cache!=NULL){
+        free_cache(fd->unit_cache);
+        free(fd->unit_cache);
+    }
+
+    fd->unit_cache = NULL;
+}
@@ -0,0 +1,98 @@
+#ifndef COMPRESS_H_
+#define COMPRESS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "directory.h"
+#include "fdTable.h"
+
+/*
+ * Compressed files, marked DIR_ATTR_COMPRESS by fs_set_compression().
+ *
+ * The content of a file is cut in units of COMPRESS_UNIT_BLOCKS blocks,
+ * each compressed with the codec of lz.h and stored from the start of a
+ * block, or stored as is when compressing it saves no block. The chain
+ * starts with a CompressHeader and one CompressUnit per unit telling the
+ * block of the chain the unit starts at and its compressed length, so
+ * that a read at any offset decompresses the one unit holding it, into
+ * the cache of its descriptor. The entry, marked DIR_ATTR_COMPRESSED
+ * then, keeps the size of the content: its chain has fewer blocks than
+ * the size needs, which fs_check() allows on FS_FEATURE_COMPRESSION disks.
+ *
+ * Files are compressed when the last descriptor open on them is closed,
+ * instead of having their tail packed, and only if that saves a block.
+ * The compressed chain is written to new blocks, then the entry points to
+ * it and the plain chain is freed, so a crash leaves either one and at
+ * worst blocks fs_check() reports as leaked. fs_write() rewrites the units
+ * it changes the same way, to new blocks linked in with a new unit table,
+ * so that appending or overwriting costs the units touched rather than the
+ * whole file, and needs free blocks for them only.
+ */
+
+#define COMPRESS_SIGNATURE "ECS150CZ"
+
+/* blocks of content compressed at once */
+#define COMPRESS_UNIT_BLOCKS 16
+
+struct __attribute__((__packed__)) CompressHeader{
+    uint8_t signature[8];
+    uint32_t units;
+    /* blocks the header and the unit table take */
+    uint32_t headerBlocks;
+};
+
+struct __attribute__((__packed__)) CompressUnit{
+    /* block of the chain the unit starts at */
+    uint32_t block;
+    /* compressed bytes, 0 for a unit stored as is */
+    uint32_t length;
+};
+
+/*
+ * Compresses the file of entry @entry_index of @dir if it is marked
+ * DIR_ATTR_COMPRESS and stored plain, no descriptor having it open
+ *
+ * Returns: 0 on success, or if compressing it saves no block or the disk
+ * has no room for the compressed chain, -1 if a block could not be read or
+ * written
+ */
+int compress_file(struct directory* dir, size_t entry_index);
+
+/*
+ * Stores the compressed file of entry @entry_index of @dir as a plain
+ * chain again, no descriptor having it open
+ *
+ * Returns: 0 on success, -1 if the disk is full or a block could not be
+ * read or written
+ */
+int compress_expand(struct directory* dir, size_t entry_index);
+
+/*
+ * fs_write() to the compressed file @fd points to, from its offset to
+ * @end_offset. The units written are compressed again to new blocks, and
+ * a new unit table, then linked in place of the old ones, the other units
+ * keeping their blocks. A file that compressing no longer saves a block is
+ * stored as a plain chain again instead, with nothing written.
+ *
+ * Returns: the bytes written, fewer if the disk fills up, 0 if it is full
+ * or if the file is now stored plain, -1 if a block could not be read or
+ * written
+ */
+int compress_write(struct fdNode* fd, const uint8_t* data, size_t end_offset);
+
+/*
+ * fs_read() of the compressed file @fd points to, from its offset to
+ * @end_offset, at most its size
+ *
+ * Returns: the bytes read, -1 if nothing could be read
+ */
+int compress_read(struct fdNode* fd, uint8_t* data, size_t end_offset);
+
+/*
+ * Frees the units and the unit table cached for @fd
+ */
+void compress_forget(struct fdNode* fd);
+
+#endif
@@ -0,0 +1,729 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dedup.h"
+#include "directory.h"
+#include "disk.h"
+#include "fdTable.h"
+#include "fragment.h"
+#include "fs.h"
+#include "metadata.h"
+#include "reflink.h"
+#include "stats.h"
+
+/* blocks read and compared at once */
+#define DEDUP_BATCH_BLOCKS 64
+
+static bool enabled = false;
+
+/* open addressing on the suffix hash, 0 marking a free slot */
+static struct DedupEntry* table = NULL;
+static size_t capacity = 0;
+static size_t count = 0;
+
+/* per data block, the hash it is indexed under, 0 if it is not */
+static uint64_t* block_hash = NULL;
+
+/* the index differs from its region */
+static bool dirty = false;
+
+static uint64_t hashed_blocks = 0;
+static uint64_t hash_ns = 0;
+static uint64_t freed_blocks = 0;
+
+static inline uint64_t rotate(uint64_t value, unsigned int bits){
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t avalanche(uint64_t hash){
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53ULL;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+/*
+ * Hashes a block four 64 bit lanes at a time
+ */
+static uint64_t hash_block(const uint8_t* data){
+    uint64_t lanes[4] = {
+        0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL,
+        0x165667B19E3779F9ULL, 0x27D4EB2F165667C5ULL
+    };
+
+    for(size_t offset = 0; offset < block_size; offset += 4 * sizeof(uint64_t)){
+        for(size_t lane = 0; lane < 4; lane++){
+            uint64_t word;
+
+            memcpy(&word, &data[offset + lane * sizeof(uint64_t)], sizeof(uint64_t));
+
+            lanes[lane] = rotate(lanes[lane] + word * 0xC2B2AE3D27D4EB4FULL, 31)
+                    * 0x9E3779B97F4A7C15ULL;
+        }
+    }
+
+    return avalanche(rotate(lanes[0], 1) + rotate(lanes[1], 7)
+            + rotate(lanes[2], 12) + rotate(lanes[3], 18));
+}
+
+/*
+ * Hash of a block followed by the blocks hashed to @next, never 0
+ */
+static uint64_t suffix_hash(uint64_t content, uint64_t next){
+    uint64_t hash = avalanche(content ^ rotate(next, 29) ^ 0x27D4EB2F165667C5ULL);
+
+    return hash==0 ? 1 : hash;
+}
+
+static size_t find(uint64_t hash){
+    for(size_t slot = hash & (capacity - 1); capacity!=0 && table[slot].hash!=0;
+            slot = (slot + 1) & (capacity - 1)){
+        if(table[slot].hash==hash){
+            return slot;
+        }
+    }
+
+    return SIZE_MAX;
+}
+
+/*
+ * Frees slot @slot, moving the entries after it that would no longer be
+ * found
+ */
+static void remove_slot(size_t slot){
+    size_t mask = capacity - 1;
+    size_t hole = slot;
+
+    block_hash[table[slot].block] = 0;
+
+    for(size_t next = (hole + 1) & mask; table[next].hash!=0; next = (next + 1) & mask){
+        size_t home = table[next].hash & mask;
+
+        if(((next - home) & mask) >= ((next - hole) & mask)){
+            table[hole] = table[next];
+            hole = next;
+        }
+    }
+
+    table[hole].hash = 0;
+    table[hole].block = 0;
+
+    count--;
+    dirty = true;
+}
+
+static int grow(){
+    size_t grown_capacity = capacity==0 ? 1024 : 2 * capacity;
+
+    struct DedupEntry* grown = (struct DedupEntry*)calloc(grown_capacity, sizeof(struct DedupEntry));
+
+    if(grown==NULL){
+        return -1;
+    }
+
+    for(size_t i = 0; i < capacity; i++){
+        if(table[i].hash==0){
+            continue;
+        }
+
+        size_t slot = table[i].hash & (grown_capacity - 1);
+
+        while(grown[slot].hash!=0){
+            slot = (slot + 1) & (grown_capacity - 1);
+        }
+
+        grown[slot] = table[i];
+    }
+
+    free(table);
+
+    table = grown;
+    capacity = grown_capacity;
+
+    return 0;
+}
+
+/*
+ * Indexes data block @block under @hash, replacing the block indexed
+ * under it and the hash @block was indexed under
+ */
+static int insert(uint64_t hash, size_t block){
+    if(block_hash[block]==hash){
+        return 0;
+    }
+
+    if(block_hash[block]!=0){
+        size_t slot = find(block_hash[block]);
+
+        if(slot!=SIZE_MAX && table[slot].block==block){
+            remove_slot(slot);
+        }
+
+        block_hash[block] = 0;
+    }
+
+    size_t slot = find(hash);
+
+    if(slot!=SIZE_MAX){
+        block_hash[table[slot].block] = 0;
+    } else {
+        //kept at most half full
+        if(2 * (count + 1) > capacity && grow()){
+            return -1;
+        }
+
+        for(slot = hash & (capacity - 1); table[slot].hash!=0; slot = (slot + 1) & (capacity - 1));
+
+        count++;
+    }
+
+    table[slot].hash = hash;
+    table[slot].block = block;
+
+    block_hash[block] = hash;
+    dirty = true;
+
+    return 0;
+}
+
+/*
+ * Returns: the record in the cached block 0, NULL if it was never written
+ */
+static struct DedupRecord* dedup_record(){
+    uint8_t* superblock = metadata_superblock();
+
+    if(superblock==NULL){
+        return NULL;
+    }
+
+    struct DedupRecord* record = (struct DedupRecord*)&superblock[DEDUP_RECORD_OFFSET];
+
+    if(memcmp(record->signature, DEDUP_SIGNATURE, 8)!=0){
+        return NULL;
+    }
+
+    return record;
+}
+
+bool dedup_region(size_t* first_block, size_t* blocks){
+    struct DedupRecord* record = dedup_record();
+
+    if(record==NULL || record->firstBlock==0){
+        return false;
+    }
+
+    *first_block = (size_t)record->firstBlock;
+    *blocks = (size_t)record->blocks;
+
+    return true;
+}
+
+/*
+ * Fills @blocks with the chain of @count blocks starting at data block
+ * @first
+ *
+ * Returns: false if the chain is not @count file blocks ending there
+ */
+static bool chain_of(size_t first, size_t count, size_t* blocks){
+    size_t block = first;
+
+    for(size_t i = 0; i < count; i++){
+        if(block==0 || block >= data_blocks
+                || metadata_block(get_actual_block_index(block))!=NULL){
+            return false;
+        }
+
+        blocks[i] = block;
+        block = get_fat_entry(block);
+    }
+
+    return block==FAT_EOC;
+}
+
+/*
+ * Returns: true if the @count blocks from data block @first are a chain
+ * of the same content as the blocks @blocks
+ */
+static bool same_chain(size_t first, const size_t* blocks, size_t count, uint8_t* buffer){
+    size_t* chain = (size_t*)malloc(count * sizeof(size_t));
+
+    bool same = chain!=NULL && chain_of(first, count, chain);
+
+    uint8_t* other = &buffer[DEDUP_BATCH_BLOCKS * block_size];
+
+    for(size_t done = 0; same && done < count; done += DEDUP_BATCH_BLOCKS){
+        size_t batch = count - done < DEDUP_BATCH_BLOCKS ? count - done : DEDUP_BATCH_BLOCKS;
+
+        if(transfer_blocks(&blocks[done], batch, buffer, false)
+                || transfer_blocks(&chain[done], batch, other, false)
+                || memcmp(buffer, other, batch * block_size)!=0){
+            same = false;
+        }
+
+        //never mistake a fragment block for a file block
+        for(size_t i = 0; same && i < batch; i++){
+            if(memcmp(&other[i * block_size], FRAGMENT_SIGNATURE, 8)==0){
+                same = false;
+            }
+        }
+    }
+
+    free(chain);
+
+    return same;
+}
+
+int dedup_file(struct directory* dir, size_t entry_index){
+    struct DirEntry* entry = dir_entry(dir, entry_index);
+
+    if(!enabled || dir_entry_is_directory(entry) || dir_entry_is_inline(entry)
+            || dir_entry_is_packed(entry) || dir_entry_is_compressed(entry)
+            || dir_entry_first_block(entry)==FAT_EOC){
+        return 0;
+    }
+
+    size_t n = total_block_size((size_t)dir_entry_size(entry));
+
+    size_t* blocks = (size_t*)malloc(n * sizeof(size_t));
+    uint64_t* hashes = (uint64_t*)malloc(n * sizeof(uint64_t));
+    uint8_t* buffer = (uint8_t*)malloc(2 * DEDUP_BATCH_BLOCKS * block_size);
+
+    if(blocks==NULL || hashes==NULL || buffer==NULL){
+        free(blocks);
+        free(hashes);
+        free(buffer);
+        return -1;
+    }
+
+    int ret = 0;
+
+    //a chain that does not match the size is fs_check()'s business
+    if(n==0 || !chain_of(dir_entry_first_block(entry), n, blocks)){
+        n = 0;
+    }
+
+    uint64_t start = stats_now_ns();
+
+    for(size_t done = 0; ret==0 && done < n; done += DEDUP_BATCH_BLOCKS){
+        size_t batch = n - done < DEDUP_BATCH_BLOCKS ? n - done : DEDUP_BATCH_BLOCKS;
+
+        if(transfer_blocks(&blocks[done], batch, buffer, false)){
+            ret = -1;
+            break;
+        }
+
+        for(size_t i = 0; i < batch; i++){
+            hashes[done + i] = hash_block(&buffer[i * block_size]);
+        }
+    }
+
+    for(size_t i = n; ret==0 && i-- > 0; ){
+        hashes[i] = suffix_hash(hashes[i], i + 1 < n ? hashes[i + 1] : 0);
+    }
+
+    hashed_blocks += n;
+    hash_ns += stats_now_ns() - start;
+
+    //blocks before the first one found are the file's own
+    size_t own = n;
+
+    for(size_t i = 0; ret==0 && i < n; i++){
+        //a shared block is followed by shared ones, and may not be relinked
+        if(i > 0 && reflink_shared(blocks[i - 1])){
+            break;
+        }
+
+        size_t slot = find(hashes[i]);
+
+        if(slot==SIZE_MAX || table[slot].block==blocks[i]){
+            continue;
+        }
+
+        size_t found = (size_t)table[slot].block;
+
+        if(!same_chain(found, &blocks[i], n - i, buffer)){
+            remove_slot(slot);
+            continue;
+        }
+
+        //the FAT block or the directory block of the link, and the one of the
+        //first block freed
+        if(metadata_reserve(3) || reflink_share(found)){
+            ret = -1;
+            break;
+        }
+
+        if(i==0){
+            dir_entry_set_first_block(entry, found);
+            dir_update(dir, entry_index);
+        } else {
+            set_fat_entry(blocks[i - 1], (uint32_t)found);
+        }
+
+        for(size_t k = i; k < n && !reflink_shared(blocks[k]); k++){
+            ret++;
+        }
+
+        erase_file(blocks[i]);
+
+        own = i;
+        break;
+    }
+
+    for(size_t i = 0; ret >= 0 && i < own; i++){
+        if(insert(hashes[i], blocks[i])){
+            ret = -1;
+        }
+    }
+
+    if(ret > 0){
+        freed_blocks += (uint64_t)ret;
+    }
+
+    free(blocks);
+    free(hashes);
+    free(buffer);
+
+    return ret;
+}
+
+int dedup_directory(struct directory* dir){
+    size_t capacity_of_dir = dir_capacity(dir);
+
+    int freed = 0;
+
+    for(size_t i = dir_next_used(dir, 0); i < capacity_of_dir; i = dir_next_used(dir, i + 1)){
+        int ret;
+
+        if(dir_entry_is_directory(dir_entry(dir, i))){
+            struct directory* child = dir_child(dir, i);
+
+            ret = child==NULL ? -1 : dedup_directory(child);
+        } else if(isOpenByEntry(fd_table, dir, i)){
+            continue;
+        } else {
+            ret = dedup_file(dir, i);
+        }
+
+        if(ret < 0){
+            return -1;
+        }
+
+        freed += ret;
+    }
+
+    return freed;
+}
+
+/*
+ * Marks in @live the blocks of the files below @dir that can be indexed
+ */
+static int mark_directory(struct directory* dir, uint8_t* live){
+    size_t capacity_of_dir = dir_capacity(dir);
+
+    for(size_t i = dir_next_used(dir, 0); i < capacity_of_dir; i = dir_next_used(dir, i + 1)){
+        struct DirEntry* entry = dir_entry(dir, i);
+
+        if(dir_entry_is_inline(entry) || dir_entry_is_packed(entry)){
+            continue;
+        }
+
+        if(dir_entry_is_directory(entry)){
+            struct directory* child = dir_child(dir, i);
+
+            if(child==NULL || mark_directory(child, live)){
+                return -1;
+            }
+
+            continue;
+        }
+
+        size_t block = dir_entry_first_block(entry);
+
+        for(size_t step = 0; step < data_blocks && block!=0 && block < data_blocks; step++){
+            live[block] = 1;
+            block = get_fat_entry(block);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Indexes the entries of the region of @record whose block a file reaches,
+ * @owned telling whether its blocks are a chain of the region's length that
+ * no file reaches
+ *
+ * Returns: 0 on success, -1 if the region is not what the record says or
+ * could not be read
+ */
+static int read_region(const struct DedupRecord* record, const uint8_t* live, bool* owned){
+    size_t blocks = (size_t)record->blocks;
+    size_t per_block = block_size / sizeof(struct DedupEntry);
+
+    if(blocks==0 || blocks >= data_blocks || record->entries > blocks * per_block){
+        return -1;
+    }
+
+    size_t* region = (size_t*)malloc(blocks * sizeof(size_t));
+    uint8_t* buffer = (uint8_t*)malloc(block_size);
+
+    int ret = region!=NULL && buffer!=NULL
+            && chain_of((size_t)record->firstBlock, blocks, region) ? 0 : -1;
+
+    //a region file blocks are in was freed by another implementation
+    for(size_t i = 0; ret==0 && i < blocks; i++){
+        if(live[region[i]]){
+            ret = -1;
+        }
+    }
+
+    *owned = ret==0;
+
+    size_t left = (size_t)record->entries;
+
+    for(size_t i = 0; ret==0 && i < blocks && left > 0; i++){
+        if(block_read(get_actual_block_index(region[i]), buffer)){
+            ret = -1;
+            break;
+        }
+
+        const struct DedupEntry* entries = (const struct DedupEntry*)buffer;
+
+        for(size_t e = 0; ret==0 && e < per_block && left > 0; e++, left--){
+            size_t block = (size_t)entries[e].block;
+
+            if(entries[e].hash!=0 && block < data_blocks && live[block]
+                    && insert(entries[e].hash, block)){
+                ret = -1;
+            }
+        }
+    }
+
+    free(region);
+    free(buffer);
+
+    return ret;
+}
+
+int dedup_load(){
+    dedup_unload();
+
+    block_hash = (uint64_t*)calloc(data_blocks, sizeof(uint64_t));
+
+    if(block_hash==NULL){
+        return -1;
+    }
+
+    enabled = true;
+
+    struct DedupRecord* record = dedup_record();
+
+    if(record==NULL || record->firstBlock==0){
+        return 0;
+    }
+
+    uint8_t* live = (uint8_t*)calloc(data_blocks, sizeof(uint8_t));
+
+    if(live==NULL || mark_directory(dir_root(), live)){
+        free(live);
+        dedup_unload();
+        return -1;
+    }
+
+    bool owned = false;
+
+    if(read_region(record, live, &owned)){
+        //forgotten, its blocks freed only if they are the region's
+        if(owned){
+            erase_file((size_t)record->firstBlock);
+        }
+
+        memset(record, 0, sizeof(struct DedupRecord));
+
+        for(size_t i = 0; i < capacity; i++){
+            if(table[i].hash!=0){
+                block_hash[table[i].block] = 0;
+            }
+        }
+
+        memset(table, 0, capacity * sizeof(struct DedupEntry));
+        count = 0;
+    }
+
+    free(live);
+
+    //the next save rewrites the region without the entries dropped
+    dirty = record->firstBlock==0;
+
+    return 0;
+}
+
+void dedup_unload(){
+    free(table);
+    free(block_hash);
+
+    table = NULL;
+    block_hash = NULL;
+    capacity = 0;
+    count = 0;
+
+    enabled = false;
+    dirty = false;
+
+    hashed_blocks = 0;
+    hash_ns = 0;
+    freed_blocks = 0;
+}
+
+bool dedup_enabled(){
+    return enabled;
+}
+
+void dedup_forget(size_t block){
+    if(block_hash==NULL || block >= data_blocks || block_hash[block]==0){
+        return;
+    }
+
+    size_t slot = find(block_hash[block]);
+
+    if(slot!=SIZE_MAX && table[slot].block==block){
+        remove_slot(slot);
+    }
+
+    block_hash[block] = 0;
+}
+
+/*
+ * Allocates a region of @blocks blocks and writes the index to it
+ *
+ * Returns: its first block, 0 on failure with nothing left allocated
+ */
+static size_t write_region(size_t blocks){
+    size_t* region = (size_t*)malloc(blocks * sizeof(size_t));
+    uint8_t* buffer = (uint8_t*)malloc(block_size);
+
+    size_t allocated = 0;
+
+    while(region!=NULL && allocated < blocks && first_block_available(&region[allocated])){
+        set_fat_entry(region[allocated], FAT_EOC);
+
+        if(allocated > 0){
+            set_fat_entry(region[allocated - 1], (uint32_t)region[allocated]);
+        }
+
+        allocated++;
+    }
+
+    int ret = buffer!=NULL && allocated==blocks ? 0 : -1;
+
+    size_t per_block = block_size / sizeof(struct DedupEntry);
+    size_t slot = 0;
+
+    for(size_t i = 0; ret==0 && i < blocks; i++){
+        memset(buffer, 0, block_size);
+
+        struct DedupEntry* entries = (struct DedupEntry*)buffer;
+
+        for(size_t e = 0; e < per_block && slot < capacity; slot++){
+            if(table[slot].hash!=0){
+                entries[e++] = table[slot];
+            }
+        }
+
+        ret = block_write(get_actual_block_index(region[i]), buffer);
+    }
+
+    size_t first = allocated > 0 ? region[0] : 0;
+
+    if(ret!=0 && allocated > 0){
+        erase_file(first);
+        first = 0;
+    }
+
+    free(region);
+    free(buffer);
+
+    return first;
+}
+
+int dedup_save(){
+    if(!enabled || !dirty || metadata_superblock()==NULL){
+        return 0;
+    }
+
+    struct DedupRecord* cached = (struct DedupRecord*)&metadata_superblock()[DEDUP_RECORD_OFFSET];
+    struct DedupRecord saved;
+
+    if(dedup_record()==NULL){
+        memset(cached, 0, sizeof(struct DedupRecord));
+    }
+
+    saved = *cached;
+
+    size_t per_block = block_size / sizeof(struct DedupEntry);
+    size_t blocks = (count + per_block - 1) / per_block;
+
+    //an index the disk has no room for is not kept
+    if(blocks > fat_free_blocks()){
+        blocks = 0;
+    }
+
+    size_t first = 0;
+
+    if(blocks > 0){
+        first = write_region(blocks);
+
+        //committed before the record points to it
+        if(first==0 || metadata_sync()){
+            if(first!=0){
+                erase_file(first);
+            }
+
+            return -1;
+        }
+    }
+
+    memcpy(cached->signature, DEDUP_SIGNATURE, 8);
+    cached->firstBlock = first;
+    cached->blocks = blocks;
+    cached->entries = first==0 ? 0 : count;
+
+    //the old region is left to the check of the next mount if a crash
+    //comes before it is freed
+    if(saved.firstBlock!=0 ? metadata_write_superblock_check() : metadata_write_superblock()){
+        *cached = saved;
+
+        if(first!=0){
+            erase_file(first);
+        }
+
+        return -1;
+    }
+
+    //an old region that cannot be freed is left to the check as well
+    if(saved.firstBlock!=0 && erase_file((size_t)saved.firstBlock)==0
+            && metadata_commit_check()){
+        return -1;
+    }
+
+    dirty = false;
+
+    return 0;
+}
+
+void dedup_info(){
+    if(!enabled){
+        return;
+    }
+
+    printf("dedup_saved_blk=%zu\n", reflink_saved_blocks());
+    printf("dedup_freed_blk=%llu\n", (unsigned long long)freed_blocks);
+    printf("dedup_index_entries=%zu\n", count);
+    printf("dedup_hashed_blk=%llu\n", (unsigned long long)hashed_blocks);
+    printf("dedup_hash_ms=%.3f\n", (double)hash_ns / 1e6);
+}
@@ -0,0 +1,122 @@
+#ifndef DEDUP_H_
+#define DEDUP_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "directory.h"
+
+/*
+ * Deduplication of file blocks, on disks mounted with
+ * fs_mount_options.dedup.
+ *
+ * Files share blocks the way reflinked copies do, see reflink.h: a FAT
+ * entry holds a single next block, so two files can only share the end of
+ * their chains. A file is deduplicated against the index, a hash table of
+ * the suffix hash of the blocks of the files seen so far: the hash of a
+ * block's content mixed with the suffix hash of the next block, so that
+ * one lookup finds a chain ending with the same blocks. From its first
+ * block on, the first block of the file whose suffix is found, and whose
+ * chain compares equal byte for byte, is replaced with the block found,
+ * and the blocks of the file from there are freed, or dropped if other
+ * files share them. Blocks in the middle of a file, such as zero-filled
+ * records followed by different ones, cannot be shared this way.
+ *
+ * Files are deduplicated when the last descriptor they were written
+ * through is closed, after their tail is packed, and by fs_dedup(). Packed
+ * and inline files are left alone, and so are files another descriptor
+ * has open.
+ *
+ * A block in the index belongs to a file: it is taken out when the FAT
+ * frees it. The index is written to a region of data blocks chained in
+ * the FAT at fs_sync() and fs_umount(), a DedupRecord in block 0 pointing
+ * to it. The new region is committed before the record points to it, and
+ * the old one freed after, so a crash leaves at worst a region fs_check()
+ * reports as leaked. Loaded at mount, entries for blocks no file reaches
+ * are dropped; the others may be stale, which costs a comparison.
+ */
+
+#define DEDUP_SIGNATURE "ECS150DD"
+
+/* where the record starts in block 0, past the snapshot table */
+#define DEDUP_RECORD_OFFSET 2048
+
+struct __attribute__((__packed__)) DedupRecord{
+    uint8_t signature[8];
+    /* first data block of the region, 0 without one */
+    uint64_t firstBlock;
+    uint64_t blocks;
+    uint64_t entries;
+};
+
+struct __attribute__((__packed__)) DedupEntry{
+    uint64_t hash;
+    uint64_t block;
+};
+
+/*
+ * Turns deduplication on and reads the index of the mounted disk. Called
+ * once the directories, the FAT and the reflink counts are loaded.
+ *
+ * Returns: 0 on success, -1 if memory ran out or a subdirectory could not
+ * be read. A region that cannot be read is dropped.
+ */
+int dedup_load();
+
+/*
+ * Drops the index and turns deduplication off
+ */
+void dedup_unload();
+
+/*
+ * Returns: true if the disk was mounted with deduplication
+ */
+bool dedup_enabled();
+
+/*
+ * Takes data block @block out of the index, called by set_fat_entry()
+ * when it frees the block
+ */
+void dedup_forget(size_t block);
+
+/*
+ * Shares the blocks of the file of entry @entry_index of @dir, which no
+ * descriptor has open, with a file ending the same way, and indexes those
+ * it keeps
+ *
+ * Returns: the blocks freed, -1 if a block could not be read or memory ran
+ * out
+ */
+int dedup_file(struct directory* dir, size_t entry_index);
+
+/*
+ * Deduplicates every file below @dir no descriptor has open
+ *
+ * Returns: the blocks freed, -1 if a subdirectory or a block could not be
+ * read
+ */
+int dedup_directory(struct directory* dir);
+
+/*
+ * Writes the index to a new region if it changed, and frees the old one
+ *
+ * Returns: 0 on success or if the disk has no room left for it, in which
+ * case it is no longer kept, -1 if it could not be written
+ */
+int dedup_save();
+
+/*
+ * Region of the index, for fs_check()
+ *
+ * Returns: false if the disk has none
+ */
+bool dedup_region(size_t* first_block, size_t* blocks);
+
+/*
+ * Prints the blocks sharing saves, the size of the index and the time
+ * spent hashing, for fs_info()
+ */
+void dedup_info();
+
+#endif
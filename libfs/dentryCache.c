@@ -0,0 +1,109 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dentryCache.h"
+#include "directory.h"
+
+struct dentry{
+    /* NULL when the slot is empty */
+    char* path;
+    uint64_t hash;
+
+    /* NULL for a negative entry */
+    struct directory* dir;
+    size_t entry_index;
+
+    /* creations seen when a negative entry was added */
+    uint64_t generation;
+};
+
+static struct dentry dentries[DENTRY_CACHE_SLOTS];
+
+static uint64_t generation = 0;
+
+/*
+ * FNV-1a
+ */
+static uint64_t hash_path(const char* path){
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    for(; *path!='\0'; path++){
+        hash = (hash ^ (uint8_t)*path) * 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+static inline struct dentry* slot_of(uint64_t hash){
+    return &dentries[hash % DENTRY_CACHE_SLOTS];
+}
+
+static void drop(struct dentry* dentry){
+    free(dentry->path);
+
+    memset(dentry, 0, sizeof(struct dentry));
+}
+
+int dentry_lookup(const char* path, struct directory** dir, size_t* entry_index){
+    uint64_t hash = hash_path(path);
+
+    struct dentry* dentry = slot_of(hash);
+
+    if(dentry->path==NULL || dentry->hash!=hash || strcmp(dentry->path, path)!=0){
+        return -1;
+    }
+
+    if(dentry->dir==NULL){
+        return dentry->generation==generation ? 0 : -1;
+    }
+
+    *dir = dentry->dir;
+    *entry_index = dentry->entry_index;
+
+    return 1;
+}
+
+void dentry_add(const char* path, struct directory* dir, size_t entry_index){
+    uint64_t hash = hash_path(path);
+
+    struct dentry* dentry = slot_of(hash);
+
+    if(dentry->path==NULL || strcmp(dentry->path, path)!=0){
+        char* copy = strdup(path);
+
+        if(copy==NULL){
+            return;
+        }
+
+        drop(dentry);
+
+        dentry->path = copy;
+        dentry->hash = hash;
+    }
+
+    dentry->dir = dir;
+    dentry->entry_index = entry_index;
+    dentry->generation = generation;
+}
+
+void dentry_forget(const char* path){
+    uint64_t hash = hash_path(path);
+
+    struct dentry* dentry = slot_of(hash);
+
+    if(dentry->path!=NULL && dentry->hash==hash && strcmp(dentry->path, path)==0){
+        drop(dentry);
+    }
+}
+
+void dentry_created(){
+    generation++;
+}
+
+void dentry_clear(){
+    for(size_t slot = 0; slot < DENTRY_CACHE_SLOTS; slot++){
+        drop(&dentries[slot]);
+    }
+
+    generation = 0;
+}
@@ -0,0 +1,53 @@
+#ifndef DENTRYCACHE_H_
+#define DENTRYCACHE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "directory.h"
+
+/*
+ * Results of path walks, so that a path looked up again is answered
+ * with one hash probe instead of a lookup per component.
+ *
+ * Entries are keyed by the path without its leading '/'. A positive entry
+ * holds the directory and entry index the path leads to. A negative one
+ * records that the path does not exist: it stands as long as nothing is
+ * created, every creation making all of them stale at once, since a
+ * negative entry for a/b/c can be answered by a/b missing as well as by c.
+ * Removing a file or directory drops the entry of its path. The cache is
+ * direct mapped, a path taking the place of the one hashed to its slot.
+ */
+
+#define DENTRY_CACHE_SLOTS 4096
+
+/*
+ * Returns: 1 and fills @dir and @entry_index if @path is cached as
+ * existing, 0 if it is cached as missing, -1 if it is not cached
+ */
+int dentry_lookup(const char* path, struct directory** dir, size_t* entry_index);
+
+/*
+ * Caches @path as leading to entry @entry_index of @dir, or as missing if
+ * @dir is NULL
+ */
+void dentry_add(const char* path, struct directory* dir, size_t entry_index);
+
+/*
+ * Drops the entry of @path, which was just removed
+ */
+void dentry_forget(const char* path);
+
+/*
+ * Makes every negative entry stale, called when a file or directory is
+ * created
+ */
+void dentry_created();
+
+/*
+ * Drops every entry
+ */
+void dentry_clear();
+
+#endif
@@ -0,0 +1,727 @@
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#define DIRECTORY_SSE2 1
+#endif
+
+#include "blockChecksum.h"
+#include "directory.h"
+#include "disk.h"
+#include "fs.h"
+#include "metadata.h"
+#include "snapshot.h"
+#include "utilities.h"
+
+struct directory{
+    /* the entry of the directory in its parent, NULL for the root */
+    struct directory* parent;
+    size_t parent_entry;
+
+    /* cached blocks in chain order, and the disk blocks they come from */
+    uint8_t** blocks;
+    size_t* disk_blocks;
+    size_t block_count;
+
+    size_t entry_count;
+
+    /*
+     * Entry names zero padded past their NULL character, so that two
+     * names are equal exactly when their 16 bytes are. They are the names
+     * the index was built from, until dir_update() sees the new ones.
+     */
+    uint8_t (*names)[FS_FILENAME_LEN];
+
+    /*
+     * Open addressing hash table of the used entries, linear probing. A
+     * slot holds an entry index plus one, 0 when empty. It has at least
+     * twice as many slots as entries, so probes stay short however full
+     * the directory.
+     */
+    uint32_t* slots;
+    size_t slot_mask;
+
+    /* used entries of every block, to skip empty ones */
+    uint32_t* block_used;
+
+    size_t free_entries;
+
+    /* no entry below it is free */
+    size_t free_hint;
+
+    /* subdirectories walked into, per entry, NULL until then */
+    struct directory** children;
+};
+
+static struct directory* root = NULL;
+
+static size_t entries_per_block = 0;
+
+static void pad_name(const uint8_t* name, uint8_t* padded){
+    size_t length = 0;
+
+    while(length < FS_FILENAME_LEN && name[length]!='\0'){
+        length++;
+    }
+
+    memcpy(padded, name, length);
+    memset(&padded[length], 0, FS_FILENAME_LEN - length);
+}
+
+static inline bool names_equal(const uint8_t* name, const uint8_t* key){
+#ifdef DIRECTORY_SSE2
+    __m128i a = _mm_load_si128((const __m128i*)name);
+    __m128i b = _mm_load_si128((const __m128i*)key);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) == 0xFFFF;
+#else
+    return memcmp(name, key, FS_FILENAME_LEN) == 0;
+#endif
+}
+
+static inline struct DirEntry* entry_at(const struct directory* dir, size_t entry_index){
+    return (struct DirEntry*)(dir->blocks[entry_index / entries_per_block]
+            + entry_index % entries_per_block * volume.entry_size);
+}
+
+static inline size_t home_slot(const uint8_t* key, size_t mask){
+    uint64_t low;
+    uint64_t high;
+
+    memcpy(&low, key, sizeof(uint64_t));
+    memcpy(&high, &key[sizeof(uint64_t)], sizeof(uint64_t));
+
+    uint64_t hash = low * 0x9e3779b97f4a7c15ull ^ high * 0xc2b2ae3d27d4eb4full;
+
+    return (size_t)(hash ^ hash >> 29) & mask;
+}
+
+static void insert_slot(struct directory* dir, size_t entry_index){
+    size_t slot = home_slot(dir->names[entry_index], dir->slot_mask);
+
+    while(dir->slots[slot]!=0){
+        slot = (slot + 1) & dir->slot_mask;
+    }
+
+    dir->slots[slot] = (uint32_t)entry_index + 1;
+}
+
+/*
+ * Takes @entry_index out of the table, shifting back the entries probed
+ * past it so that lookups need no tombstones
+ */
+static void remove_slot(struct directory* dir, size_t entry_index){
+    size_t mask = dir->slot_mask;
+    size_t slot = home_slot(dir->names[entry_index], mask);
+
+    while(dir->slots[slot]!=(uint32_t)entry_index + 1){
+        slot = (slot + 1) & mask;
+    }
+
+    size_t next = slot;
+
+    while(1){
+        next = (next + 1) & mask;
+
+        if(dir->slots[next]==0){
+            break;
+        }
+
+        size_t home = home_slot(dir->names[dir->slots[next] - 1], mask);
+
+        //the entry at next can fill the hole if its probe went through it
+        if(((next - home) & mask) >= ((next - slot) & mask)){
+            dir->slots[slot] = dir->slots[next];
+            slot = next;
+        }
+    }
+
+    dir->slots[slot] = 0;
+}
+
+/*
+ * Returns the index of the used entry whose padded name is @key, -1 if
+ * none
+ */
+static int find(const struct directory* dir, const uint8_t* key){
+    if(dir->entry_count==0){
+        return -1;
+    }
+
+    size_t slot = home_slot(key, dir->slot_mask);
+
+    while(dir->slots[slot]!=0){
+        size_t entry_index = dir->slots[slot] - 1;
+
+        if(names_equal(dir->names[entry_index], key)){
+            return (int)entry_index;
+        }
+
+        slot = (slot + 1) & dir->slot_mask;
+    }
+
+    return -1;
+}
+
+/*
+ * Brings the index of @entry_index up to date with its name in the
+ * cached directory
+ */
+static void index_entry(struct directory* dir, size_t entry_index){
+    uint8_t padded[FS_FILENAME_LEN] __attribute__((aligned(16)));
+
+    pad_name(entry_at(dir, entry_index)->filename, padded);
+
+    uint8_t* indexed = dir->names[entry_index];
+
+    if(names_equal(indexed, padded)){
+        return;
+    }
+
+    size_t block = entry_index / entries_per_block;
+
+    if(indexed[0]!='\0'){
+        remove_slot(dir, entry_index);
+
+        dir->block_used[block]--;
+        dir->free_entries++;
+
+        if(entry_index < dir->free_hint){
+            dir->free_hint = entry_index;
+        }
+    }
+
+    memcpy(indexed, padded, FS_FILENAME_LEN);
+
+    if(indexed[0]!='\0'){
+        insert_slot(dir, entry_index);
+
+        dir->block_used[block]++;
+        dir->free_entries--;
+    }
+}
+
+/*
+ * Makes room in the index of @dir for its first @block_count blocks,
+ * keeping what it holds. The entries added are indexed as free.
+ *
+ * Returns: 0 on success, -1 if memory ran out
+ */
+static int grow_index(struct directory* dir, size_t block_count){
+    size_t entry_count = block_count * entries_per_block;
+
+    size_t slot_count = 16;
+
+    while(slot_count < 2 * entry_count){
+        slot_count *= 2;
+    }
+
+    uint8_t (*names)[FS_FILENAME_LEN] = aligned_alloc(16, entry_count * FS_FILENAME_LEN);
+    uint32_t* slots = (uint32_t*)calloc(slot_count, sizeof(uint32_t));
+    uint32_t* block_used = (uint32_t*)calloc(block_count, sizeof(uint32_t));
+    struct directory** children =
+            (struct directory**)calloc(entry_count, sizeof(struct directory*));
+
+    if(names==NULL || slots==NULL || block_used==NULL || children==NULL){
+        free(names);
+        free(slots);
+        free(block_used);
+        free(children);
+
+        return -1;
+    }
+
+    size_t old_entries = dir->entry_count;
+
+    memset(names, 0, entry_count * FS_FILENAME_LEN);
+
+    if(old_entries!=0){
+        memcpy(names, dir->names, old_entries * FS_FILENAME_LEN);
+        memcpy(block_used, dir->block_used, old_entries / entries_per_block * sizeof(uint32_t));
+        memcpy(children, dir->children, old_entries * sizeof(struct directory*));
+    }
+
+    free(dir->names);
+    free(dir->slots);
+    free(dir->block_used);
+    free(dir->children);
+
+    dir->names = names;
+    dir->slots = slots;
+    dir->slot_mask = slot_count - 1;
+    dir->block_used = block_used;
+    dir->children = children;
+
+    dir->entry_count = entry_count;
+    dir->free_entries += entry_count - old_entries;
+
+    //the table was resized, every used entry goes in again
+    for(size_t entry_index = 0; entry_index < old_entries; entry_index++){
+        if(names[entry_index][0]!='\0'){
+            insert_slot(dir, entry_index);
+        }
+    }
+
+    return 0;
+}
+
+static void free_directory(struct directory* dir){
+    if(dir==NULL){
+        return;
+    }
+
+    for(size_t entry_index = 0; entry_index < dir->entry_count; entry_index++){
+        free_directory(dir->children[entry_index]);
+    }
+
+    //the root lives in the metadata cache
+    for(size_t block = 0; dir->parent!=NULL && block < dir->block_count; block++){
+        metadata_detach(dir->disk_blocks[block]);
+        checksums_include(dir->disk_blocks[block]);
+
+        free(dir->blocks[block]);
+    }
+
+    free(dir->blocks);
+    free(dir->disk_blocks);
+    free(dir->names);
+    free(dir->slots);
+    free(dir->block_used);
+    free(dir->children);
+
+    free(dir);
+}
+
+/*
+ * Appends cached block @copy of disk block @disk_block to @dir, before
+ * the index grows to cover it
+ *
+ * Returns: 0 on success, -1 if memory ran out
+ */
+static int append_block(struct directory* dir, size_t disk_block, uint8_t* copy){
+    uint8_t** blocks = (uint8_t**)realloc(dir->blocks,
+            (dir->block_count + 1) * sizeof(uint8_t*));
+
+    if(blocks==NULL){
+        return -1;
+    }
+
+    dir->blocks = blocks;
+
+    size_t* disk_blocks = (size_t*)realloc(dir->disk_blocks,
+            (dir->block_count + 1) * sizeof(size_t));
+
+    if(disk_blocks==NULL){
+        return -1;
+    }
+
+    dir->disk_blocks = disk_blocks;
+
+    dir->blocks[dir->block_count] = copy;
+    dir->disk_blocks[dir->block_count] = disk_block;
+    dir->block_count++;
+
+    return 0;
+}
+
+/*
+ * Reads and attaches the next block of subdirectory @dir, data block
+ * @data_block
+ *
+ * Returns: 0 on success, -1 otherwise
+ */
+static int read_block(struct directory* dir, size_t data_block){
+    size_t disk_block = get_actual_block_index(data_block);
+
+    uint8_t* copy = (uint8_t*)malloc(block_size);
+
+    if(copy==NULL){
+        return -1;
+    }
+
+    //journaled, see blockChecksum.h
+    checksums_exclude(disk_block);
+
+    if(snapshot_read(disk_block, copy) || metadata_attach(disk_block, copy)){
+        free(copy);
+        return -1;
+    }
+
+    if(append_block(dir, disk_block, copy)){
+        metadata_detach(disk_block);
+        free(copy);
+        return -1;
+    }
+
+    return 0;
+}
+
+static struct directory* load_directory(struct directory* parent, size_t entry_index){
+    struct directory* dir = (struct directory*)calloc(1, sizeof(struct directory));
+
+    if(dir==NULL){
+        return NULL;
+    }
+
+    dir->parent = parent;
+    dir->parent_entry = entry_index;
+
+    size_t data_block = dir_entry_first_block(entry_at(parent, entry_index));
+
+    //a chain out of range, running into a free block or into itself is not read
+    while(data_block!=FAT_EOC){
+        if(data_block==0 || data_block >= data_blocks || dir->block_count==data_blocks
+                || get_fat_entry(data_block)==0 || read_block(dir, data_block)){
+            free_directory(dir);
+            return NULL;
+        }
+
+        data_block = get_fat_entry(data_block);
+    }
+
+    if(dir->block_count!=0 && grow_index(dir, dir->block_count)){
+        free_directory(dir);
+        return NULL;
+    }
+
+    for(size_t entry = 0; entry < dir->entry_count; entry++){
+        index_entry(dir, entry);
+    }
+
+    return dir;
+}
+
+/*
+ * Adds a block to the chain of subdirectory @dir, and its entries to the
+ * index. The block starts out zeroed in the cache, and reaches the disk
+ * like any change to it.
+ *
+ * Returns: 0 on success, -1 if the disk or the directory is full
+ */
+static int add_block(struct directory* dir){
+    size_t data_block;
+
+    if(dir->entry_count + entries_per_block > DIRECTORY_MAX_ENTRIES
+            || first_block_available(&data_block)==false){
+        return -1;
+    }
+
+    size_t disk_block = get_actual_block_index(data_block);
+
+    uint8_t* copy = (uint8_t*)calloc(1, block_size);
+
+    if(copy==NULL){
+        return -1;
+    }
+
+    if(metadata_attach(disk_block, copy)){
+        free(copy);
+        return -1;
+    }
+
+    if(append_block(dir, disk_block, copy) || grow_index(dir, dir->block_count)){
+        if(dir->block_count!=0 && dir->blocks[dir->block_count - 1]==copy){
+            dir->block_count--;
+        }
+
+        metadata_detach(disk_block);
+        free(copy);
+        return -1;
+    }
+
+    checksums_exclude(disk_block);
+
+    struct DirEntry* entry = entry_at(dir->parent, dir->parent_entry);
+
+    if(dir->block_count==1){
+        dir_entry_set_first_block(entry, data_block);
+    } else {
+        set_fat_entry(dir->disk_blocks[dir->block_count - 2] - volume.data_start_index,
+                (uint32_t)data_block);
+    }
+
+    set_fat_entry(data_block, FAT_EOC);
+
+    dir_entry_set_size(entry, (uint64_t)dir->block_count * block_size);
+
+    dir_update(dir->parent, dir->parent_entry);
+
+    return metadata_dirty(disk_block);
+}
+
+int dir_load(){
+    uint8_t* first = metadata_block(root_directory_index);
+
+    if(first==NULL){
+        return -1;
+    }
+
+    entries_per_block = block_size / volume.entry_size;
+
+    root = (struct directory*)calloc(1, sizeof(struct directory));
+
+    if(root==NULL){
+        return -1;
+    }
+
+    for(size_t block = 0; block < volume.root_directory_blocks; block++){
+        if(append_block(root, root_directory_index + block, &first[block * block_size])){
+            dir_unload();
+            return -1;
+        }
+    }
+
+    if(grow_index(root, root->block_count)){
+        dir_unload();
+        return -1;
+    }
+
+    for(size_t entry = 0; entry < root->entry_count; entry++){
+        index_entry(root, entry);
+    }
+
+    return 0;
+}
+
+void dir_unload(){
+    free_directory(root);
+
+    root = NULL;
+}
+
+struct directory* dir_root(){
+    return root;
+}
+
+struct directory* dir_child(struct directory* dir, size_t entry_index){
+    if(dir==NULL || entry_index >= dir->entry_count || dir->names[entry_index][0]=='\0'){
+        return NULL;
+    }
+
+    if(dir->children[entry_index]!=NULL){
+        return dir->children[entry_index];
+    }
+
+    if(!dir_entry_is_directory(entry_at(dir, entry_index))){
+        return NULL;
+    }
+
+    dir->children[entry_index] = load_directory(dir, entry_index);
+
+    return dir->children[entry_index];
+}
+
+void dir_forget_child(struct directory* dir, size_t entry_index){
+    if(dir==NULL || entry_index >= dir->entry_count){
+        return;
+    }
+
+    free_directory(dir->children[entry_index]);
+
+    dir->children[entry_index] = NULL;
+}
+
+struct DirEntry* dir_entry(struct directory* dir, size_t entry_index){
+    if(dir==NULL || entry_index >= dir->entry_count){
+        return NULL;
+    }
+
+    return entry_at(dir, entry_index);
+}
+
+size_t dir_capacity(const struct directory* dir){
+    return dir->entry_count;
+}
+
+size_t dir_next_used(const struct directory* dir, size_t entry_index){
+    while(entry_index < dir->entry_count){
+        size_t block = entry_index / entries_per_block;
+
+        if(dir->block_used[block]==0){
+            entry_index = (block + 1) * entries_per_block;
+            continue;
+        }
+
+        if(dir->names[entry_index][0]!='\0'){
+            return entry_index;
+        }
+
+        entry_index++;
+    }
+
+    return dir->entry_count;
+}
+
+size_t dir_entry_first_block(const struct DirEntry* entry){
+    if(volume.version==FS_VERSION_FAT32){
+        return ((const struct DirEntry32*)entry)->index;
+    }
+
+    return entry->index;
+}
+
+uint64_t dir_entry_size(const struct DirEntry* entry){
+    if(volume.version==FS_VERSION_FAT32){
+        return ((const struct DirEntry32*)entry)->size;
+    }
+
+    return entry->size;
+}
+
+void dir_entry_set_first_block(struct DirEntry* entry, size_t block){
+    if(volume.version==FS_VERSION_FAT32){
+        ((struct DirEntry32*)entry)->index = (uint32_t)block;
+    } else {
+        entry->index = (uint16_t)block;
+    }
+}
+
+void dir_entry_set_size(struct DirEntry* entry, uint64_t size){
+    if(volume.version==FS_VERSION_FAT32){
+        ((struct DirEntry32*)entry)->size = size;
+    } else {
+        entry->size = (uint32_t)size;
+    }
+}
+
+bool dir_entry_is_directory(const struct DirEntry* entry){
+    return (entry->attributes & DIR_ATTR_DIRECTORY) != 0;
+}
+
+bool dir_entry_is_packed(const struct DirEntry* entry){
+    return (entry->attributes & DIR_ATTR_PACKED) != 0;
+}
+
+size_t dir_entry_fragment(const struct DirEntry* entry){
+    return entry->fragment;
+}
+
+void dir_entry_set_fragment(struct DirEntry* entry, bool packed, size_t slot){
+    if(packed){
+        entry->attributes |= DIR_ATTR_PACKED;
+        entry->fragment = (uint8_t)slot;
+    } else {
+        entry->attributes &= (uint8_t)~DIR_ATTR_PACKED;
+        entry->fragment = 0;
+    }
+}
+
+bool dir_entry_is_inline(const struct DirEntry* entry){
+    return (entry->attributes & DIR_ATTR_INLINE) != 0;
+}
+
+void dir_entry_set_inline(struct DirEntry* entry, bool is_inline){
+    if(is_inline){
+        entry->attributes |= DIR_ATTR_INLINE;
+    } else {
+        entry->attributes &= (uint8_t)~DIR_ATTR_INLINE;
+    }
+}
+
+bool dir_entry_compress(const struct DirEntry* entry){
+    return (entry->attributes & DIR_ATTR_COMPRESS) != 0;
+}
+
+void dir_entry_set_compress(struct DirEntry* entry, bool compress){
+    if(compress){
+        entry->attributes |= DIR_ATTR_COMPRESS;
+    } else {
+        entry->attributes &= (uint8_t)~DIR_ATTR_COMPRESS;
+    }
+}
+
+bool dir_entry_is_compressed(const struct DirEntry* entry){
+    return (entry->attributes & DIR_ATTR_COMPRESSED) != 0;
+}
+
+void dir_entry_set_compressed(struct DirEntry* entry, bool compressed){
+    if(compressed){
+        entry->attributes |= DIR_ATTR_COMPRESSED;
+    } else {
+        entry->attributes &= (uint8_t)~DIR_ATTR_COMPRESSED;
+    }
+}
+
+uint8_t* dir_entry_inline_data(struct DirEntry* entry){
+    return (uint8_t*)entry + sizeof(struct DirEntry);
+}
+
+size_t dir_inline_max(){
+    return volume.entry_size - sizeof(struct DirEntry);
+}
+
+void dir_entry_clear(struct DirEntry* entry){
+    memset(entry, 0, volume.entry_size);
+}
+
+void dir_entry_home(const struct directory* dir, size_t entry_index,
+        size_t* disk_block, size_t* block_entry){
+
+    *disk_block = dir->disk_blocks[entry_index / entries_per_block];
+    *block_entry = entry_index % entries_per_block;
+}
+
+int dir_lookup(struct directory* dir, const char* filename){
+    uint8_t key[FS_FILENAME_LEN] __attribute__((aligned(16)));
+
+    if(dir==NULL || filename==NULL){
+        return -1;
+    }
+
+    size_t length = strlen(filename);
+
+    if(length==0 || length >= FS_FILENAME_LEN){
+        return -1;
+    }
+
+    memcpy(key, filename, length);
+    memset(&key[length], 0, FS_FILENAME_LEN - length);
+
+    return find(dir, key);
+}
+
+int dir_find_free(struct directory* dir){
+    if(dir==NULL){
+        return -1;
+    }
+
+    if(dir->free_entries==0 && (dir->parent==NULL || add_block(dir))){
+        return -1;
+    }
+
+    size_t entry_index = dir->free_hint;
+
+    while(entry_index < dir->entry_count){
+        size_t block = entry_index / entries_per_block;
+
+        //full blocks are skipped whole
+        if(dir->block_used[block]==entries_per_block){
+            entry_index = (block + 1) * entries_per_block;
+            continue;
+        }
+
+        if(dir->names[entry_index][0]=='\0'){
+            dir->free_hint = entry_index;
+            return (int)entry_index;
+        }
+
+        entry_index++;
+    }
+
+    return -1;
+}
+
+size_t dir_free_count(const struct directory* dir){
+    return dir->free_entries;
+}
+
+int dir_update(struct directory* dir, size_t entry_index){
+    if(dir==NULL || entry_index >= dir->entry_count){
+        return -1;
+    }
+
+    index_entry(dir, entry_index);
+
+    return metadata_dirty(dir->disk_blocks[entry_index / entries_per_block]);
+}
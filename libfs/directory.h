@@ -0,0 +1,190 @@
+#ifndef DIRECTORY_H_
+#define DIRECTORY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "disk.h"
+#include "fs.h"
+
+/*
+ * Directories of the mounted disk, each with a lookup index: a hash
+ * table of the names, so lookups take the same time with 100k entries
+ * as with 128, and used entry counts per block, so that free entries are
+ * found and listings walk the directory without visiting empty blocks.
+ *
+ * The root directory is the blocks from rootDirectoryIndex on, in the
+ * metadata cache, and is indexed at mount time. A subdirectory is the
+ * chain of an entry marked DIR_ATTR_DIRECTORY: its blocks are read, and
+ * attached to the metadata cache so that changes to them are journaled,
+ * the first time dir_child() walks into it. It then stays cached until
+ * it is removed or the disk unmounted. A subdirectory grows by a block
+ * when it is full, and never shrinks.
+ *
+ * Every change to an entry goes through dir_update(), which refreshes the
+ * index and hands the block to metadata_dirty().
+ */
+struct directory;
+
+/*
+ * Indexes the root directory. The metadata cache must be loaded.
+ *
+ * Returns: 0 on success, -1 otherwise
+ */
+int dir_load();
+
+/*
+ * Drops every directory, after the metadata cache was unloaded
+ */
+void dir_unload();
+
+/*
+ * Returns: the root directory, NULL if no disk is mounted
+ */
+struct directory* dir_root();
+
+/*
+ * Returns the subdirectory entry @entry_index of @dir stands for, reading
+ * its blocks if it was not walked into yet
+ *
+ * Returns: NULL if the entry is not a directory or its chain is broken
+ */
+struct directory* dir_child(struct directory* dir, size_t entry_index);
+
+/*
+ * Drops the cached copy of subdirectory @entry_index of @dir and of
+ * everything below it, once their blocks were freed
+ */
+void dir_forget_child(struct directory* dir, size_t entry_index);
+
+/*
+ * Returns the cached entry at index, or NULL if out of bounds
+ */
+struct DirEntry* dir_entry(struct directory* dir, size_t entry_index);
+
+/*
+ * Returns: the number of entries of the directory, used or not
+ */
+size_t dir_capacity(const struct directory* dir);
+
+/*
+ * Returns: the index of the first used entry at or after @entry_index,
+ * dir_capacity() if there is none
+ */
+size_t dir_next_used(const struct directory* dir, size_t entry_index);
+
+/*
+ * First data block and size of an entry, whichever struct DirEntry or
+ * struct DirEntry32 the mounted disk uses
+ */
+size_t dir_entry_first_block(const struct DirEntry* entry);
+uint64_t dir_entry_size(const struct DirEntry* entry);
+
+void dir_entry_set_first_block(struct DirEntry* entry, size_t block);
+void dir_entry_set_size(struct DirEntry* entry, uint64_t size);
+
+/*
+ * Returns: true if @entry is a subdirectory
+ */
+bool dir_entry_is_directory(const struct DirEntry* entry);
+
+/*
+ * Returns: true if the tail of @entry is packed in a fragment
+ */
+bool dir_entry_is_packed(const struct DirEntry* entry);
+
+/*
+ * Slot of the fragment holding the tail of a packed entry
+ */
+size_t dir_entry_fragment(const struct DirEntry* entry);
+
+/*
+ * Marks @entry packed in fragment slot @slot, or not packed if @packed
+ * is false
+ */
+void dir_entry_set_fragment(struct DirEntry* entry, bool packed, size_t slot);
+
+/*
+ * Returns: true if the content of @entry is inline
+ */
+bool dir_entry_is_inline(const struct DirEntry* entry);
+
+/*
+ * Marks the content of @entry inline, or not if @is_inline is false
+ */
+void dir_entry_set_inline(struct DirEntry* entry, bool is_inline);
+
+/*
+ * Returns: true if @entry is to be stored compressed, see compress.h
+ */
+bool dir_entry_compress(const struct DirEntry* entry);
+
+/*
+ * Marks @entry to be stored compressed, or not if @compress is false
+ */
+void dir_entry_set_compress(struct DirEntry* entry, bool compress);
+
+/*
+ * Returns: true if the chain of @entry holds its content compressed
+ */
+bool dir_entry_is_compressed(const struct DirEntry* entry);
+
+/*
+ * Marks the chain of @entry compressed, or not if @compressed is false
+ */
+void dir_entry_set_compressed(struct DirEntry* entry, bool compressed);
+
+/*
+ * Returns: the bytes following @entry, which hold its content when it is
+ * inline
+ */
+uint8_t* dir_entry_inline_data(struct DirEntry* entry);
+
+/*
+ * Returns: the largest file stored inline, 0 if the mounted disk has no
+ * room for inline data
+ */
+size_t dir_inline_max();
+
+/*
+ * Zeroes @entry, inline bytes included, which frees it
+ */
+void dir_entry_clear(struct DirEntry* entry);
+
+/*
+ * Disk block holding entry @entry_index of @dir, and the index of the
+ * entry within that block
+ */
+void dir_entry_home(const struct directory* dir, size_t entry_index,
+        size_t* disk_block, size_t* block_entry);
+
+/*
+ * Looks up a file by name. The name is padded to FS_FILENAME_LEN
+ * bytes once, hashed, then compared with one 16 byte compare per
+ * entry probed.
+ *
+ * Returns: the entry index, -1 if there is no such file
+ */
+int dir_lookup(struct directory* dir, const char* filename);
+
+/*
+ * Returns: the index of the first free entry, -1 if the directory is
+ * full. A full subdirectory grows by a block first.
+ */
+int dir_find_free(struct directory* dir);
+
+/*
+ * Returns: the number of free entries
+ */
+size_t dir_free_count(const struct directory* dir);
+
+/*
+ * Must be called after modifying a cached entry. Refreshes the lookup
+ * index of the entry and marks the directory block dirty.
+ *
+ * Returns: 0 on success, -1 if the block could not be written
+ */
+int dir_update(struct directory* dir, size_t entry_index);
+
+#endif
@@ -3,16 +3,31 @@
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <string.h>
 
 #include "disk.h"
 #include "fs.h"
+#include "stats.h"
+#include "fatScan.h"
+#include "directory.h"
+#include "metadata.h"
+#include "blockChecksum.h"
+#include "blockFault.h"
+#include "snapshot.h"
+#include "reflink.h"
+#include "dedup.h"
+#include "compress.h"
 
-uint16_t FAT_EOC = 0xFFFF;
+uint32_t FAT_EOC = FAT16_EOC;
+
+uint32_t FAT_HELD = FAT16_EOC - 1;
+
+size_t block_size = BLOCK_SIZE_DEFAULT;
+unsigned int block_shift = 12; /* log2(BLOCK_SIZE_DEFAULT) */
 
 uint8_t* bounce_buffer = NULL;
-size_t bounce_buffer_size = BLOCK_SIZE * sizeof(uint8_t);
 
 uint8_t* disk_buffer = NULL;
 
@@ -26,13 +41,45 @@ uint8_t* disk_buffer = NULL;
 struct disk {
 	/* File descriptor */
 	int fd;
+	/* Size of the disk image in bytes */
+	size_t bytes;
 	/* Block count */
 	size_t bcount;
+	/* Blocks written since the last sync */
+	size_t unsynced;
 };
 
 /* Currently open virtual disk (invalid by default) */
 static struct disk disk = { .fd = INVALID_FD };
 
+/*
+ * Raw transfers and syncs of the disk image, through the fault injection
+ * layer when FS_FAULT asks for it
+ */
+static ssize_t disk_preadv(const struct iovec *iov, int iovcnt, off_t offset)
+{
+	if (fault_active())
+		return fault_preadv(disk.fd, iov, iovcnt, offset);
+
+	return preadv(disk.fd, iov, iovcnt, offset);
+}
+
+static ssize_t disk_pwritev(const struct iovec *iov, int iovcnt, off_t offset)
+{
+	if (fault_active())
+		return fault_pwritev(disk.fd, iov, iovcnt, offset);
+
+	return pwritev(disk.fd, iov, iovcnt, offset);
+}
+
+static int disk_fdatasync(void)
+{
+	if (fault_active())
+		return fault_fdatasync(disk.fd);
+
+	return fdatasync(disk.fd);
+}
+
 int block_disk_open(const char *diskname)
 {
 	int fd;
@@ -48,6 +95,11 @@ int block_disk_open(const char *diskname)
 		return -1;
 	}
 
+	if (fault_configure_from_env()) {
+		block_error("invalid FS_FAULT specification");
+		return -1;
+	}
+
 	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
 		perror("open");
 		return -1;
@@ -59,14 +111,19 @@ int block_disk_open(const char *diskname)
 	}
 
 	/* The disk image's size should be a multiple of the block size */
-	if (st.st_size % BLOCK_SIZE != 0) {
+	if (st.st_size % BLOCK_SIZE_MIN != 0) {
 		block_error("size '%llu' is not multiple of '%d'",
-		        (unsigned long long)st.st_size, BLOCK_SIZE);
+		        (unsigned long long)st.st_size, BLOCK_SIZE_MIN);
 		return -1;
 	}
 
+	block_size = BLOCK_SIZE_DEFAULT;
+	block_shift = __builtin_ctzl(BLOCK_SIZE_DEFAULT);
+
 	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	disk.bytes = st.st_size;
+	disk.bcount = disk.bytes >> block_shift;
+	disk.unsynced = 0;
 
 	return 0;
 }
@@ -78,10 +135,42 @@ int block_disk_close(void)
 		return -1;
 	}
 
+	fault_close(disk.fd);
+
 	close(disk.fd);
 
 	disk.fd = INVALID_FD;
 
+	block_size = BLOCK_SIZE_DEFAULT;
+	block_shift = __builtin_ctzl(BLOCK_SIZE_DEFAULT);
+
+	return 0;
+}
+
+int block_disk_set_block_size(size_t size)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (size < BLOCK_SIZE_MIN || size > BLOCK_SIZE_MAX
+	    || (size & (size - 1)) != 0) {
+		block_error("invalid block size '%zu'", size);
+		return -1;
+	}
+
+	if (disk.bytes % size != 0) {
+		block_error("size '%zu' is not multiple of '%zu'",
+			    disk.bytes, size);
+		return -1;
+	}
+
+	block_size = size;
+	block_shift = __builtin_ctzl(size);
+
+	disk.bcount = disk.bytes >> block_shift;
+
 	return 0;
 }
 
@@ -97,6 +186,9 @@ int block_disk_count(void)
 
 int block_write(size_t block, const void *buf)
 {
+	uint64_t start_ns;
+	struct iovec iov;
+
 	if (disk.fd == INVALID_FD) {
 		block_error("no disk currently open");
 		return -1;
@@ -108,23 +200,35 @@ int block_write(size_t block, const void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
-		return -1;
-	}
+	start_ns = stats_now_ns();
 
 	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
+	iov.iov_base = (void *)buf;
+	iov.iov_len = block_size;
+
+	/* A hole the host has no room to fill can leave the write short */
+	if (disk_pwritev(&iov, 1, block << block_shift) != (ssize_t)block_size) {
 		perror("write");
 		return -1;
 	}
 
+	disk.unsynced++;
+
+	block_io.writes++;
+	block_io.bytes += block_size;
+	latency_record(FS_LAT_BLOCK_WRITE, stats_now_ns() - start_ns);
+
+	if (checksums_cover(block))
+		checksums_stamp(block, &iov, 1);
+
 	return 0;
 }
 
 int block_read(size_t block, void *buf)
 {
+	uint64_t start_ns;
+	struct iovec iov;
+
 	if (disk.fd == INVALID_FD) {
 		block_error("no disk currently open");
 		return -1;
@@ -136,21 +240,282 @@ int block_read(size_t block, void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
-		return -1;
-	}
+	start_ns = stats_now_ns();
 
 	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
+	iov.iov_base = buf;
+	iov.iov_len = block_size;
+
+	if (disk_preadv(&iov, 1, block << block_shift) < 0) {
 		perror("read");
 		return -1;
 	}
 
+	block_io.reads++;
+	block_io.bytes += block_size;
+	latency_record(FS_LAT_BLOCK_READ, stats_now_ns() - start_ns);
+
+	if (checksums_cover(block))
+		return checksums_verify(block, &iov, 1);
+
+	return 0;
+}
+
+/*
+ * Checks a vector of whole blocks starting at @block and returns its
+ * length in blocks, or 0 if it does not fit the disk
+ */
+static size_t vector_blocks(size_t block, const struct iovec *iov, int iovcnt)
+{
+	size_t bytes = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		bytes += iov[i].iov_len;
+
+	if (bytes == 0 || (bytes & (block_size - 1)) != 0) {
+		block_error("vector length '%zu' is not multiple of '%zu'",
+			    bytes, block_size);
+		return 0;
+	}
+
+	if (block + (bytes >> block_shift) > disk.bcount) {
+		block_error("block index out of bounds (%zu/%zu)",
+			    block + (bytes >> block_shift) - 1, disk.bcount);
+		return 0;
+	}
+
+	return bytes >> block_shift;
+}
+
+int block_writev(size_t block, const struct iovec *iov, int iovcnt)
+{
+	uint64_t start_ns;
+	size_t blocks;
+
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if ((blocks = vector_blocks(block, iov, iovcnt)) == 0)
+		return -1;
+
+	start_ns = stats_now_ns();
+
+	/* One system call for the whole run of blocks */
+	if (disk_pwritev(iov, iovcnt, block << block_shift)
+	    != (ssize_t)(blocks << block_shift)) {
+		perror("pwritev");
+		return -1;
+	}
+
+	disk.unsynced += blocks;
+
+	block_io.writes += blocks;
+	block_io.bytes += blocks << block_shift;
+	latency_record(FS_LAT_BLOCK_WRITE, stats_now_ns() - start_ns);
+
+	checksums_stamp(block, iov, iovcnt);
+
 	return 0;
 }
 
+int block_readv(size_t block, const struct iovec *iov, int iovcnt)
+{
+	uint64_t start_ns;
+	size_t blocks;
+
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if ((blocks = vector_blocks(block, iov, iovcnt)) == 0)
+		return -1;
+
+	start_ns = stats_now_ns();
+
+	if (disk_preadv(iov, iovcnt, block << block_shift)
+	    != (ssize_t)(blocks << block_shift)) {
+		perror("preadv");
+		return -1;
+	}
+
+	block_io.reads += blocks;
+	block_io.bytes += blocks << block_shift;
+	latency_record(FS_LAT_BLOCK_READ, stats_now_ns() - start_ns);
+
+	return checksums_verify(block, iov, iovcnt);
+}
+
+int block_sync(void)
+{
+	uint64_t start_ns;
+
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	/* Nothing to wait for, skip the system call */
+	if (disk.unsynced == 0)
+		return 0;
+
+	start_ns = stats_now_ns();
+
+	if (disk_fdatasync() < 0) {
+		perror("fdatasync");
+		return -1;
+	}
+
+	disk.unsynced = 0;
+
+	block_io.syncs++;
+	latency_record(FS_LAT_BLOCK_SYNC, stats_now_ns() - start_ns);
+
+	return 0;
+}
+
+/*
+ * Free entries of every FAT block, so that allocation skips full ones
+ * instead of scanning the whole FAT
+ */
+static size_t* fat_block_free = NULL;
+
+/* no FAT block before this one has a free entry */
+static size_t first_free_fat_block = 0;
+
+static size_t free_entries = 0;
+
+static size_t count_nonzero(size_t first, size_t count){
+    if(volume.fat_entry_size==sizeof(uint32_t)){
+        return fat_count_nonzero32((uint32_t*)metadata_fat() + first, count);
+    }
+
+    return fat_count_nonzero((uint16_t*)metadata_fat() + first, count);
+}
+
+static size_t find_zero(size_t first, size_t count){
+    if(volume.fat_entry_size==sizeof(uint32_t)){
+        return fat_find_zero32((uint32_t*)metadata_fat() + first, count);
+    }
+
+    return fat_find_zero((uint16_t*)metadata_fat() + first, count);
+}
+
+static size_t find_zero_run(size_t first, size_t count, size_t run_length){
+    if(volume.fat_entry_size==sizeof(uint32_t)){
+        return fat_find_zero_run32((uint32_t*)metadata_fat() + first, count, run_length);
+    }
+
+    return fat_find_zero_run((uint16_t*)metadata_fat() + first, count, run_length);
+}
+
+/*
+ * Entries of FAT block @fat_block that describe data blocks
+ */
+static size_t fat_block_entries(size_t fat_block){
+    size_t first = fat_block * volume.fat_entries;
+
+    return data_blocks - first < volume.fat_entries ? data_blocks - first : volume.fat_entries;
+}
+
+int fat_load(){
+    fat_unload();
+
+    if(metadata_fat()==NULL){
+        return -1;
+    }
+
+    fat_block_free = (size_t*)calloc(volume.fat_blocks, sizeof(size_t));
+
+    if(fat_block_free==NULL){
+        return -1;
+    }
+
+    for(size_t fat_block = 0; fat_block < volume.fat_blocks; fat_block++){
+        size_t entries = fat_block_entries(fat_block);
+
+        fat_block_free[fat_block] = entries
+                - count_nonzero(fat_block * volume.fat_entries, entries);
+
+        free_entries += fat_block_free[fat_block];
+    }
+
+    return 0;
+}
+
+void fat_unload(){
+    free(fat_block_free);
+
+    fat_block_free = NULL;
+    first_free_fat_block = 0;
+    free_entries = 0;
+}
+
+size_t fat_free_blocks(){
+    return free_entries;
+}
+
+/*
+ * Keeps the free counts up to date when data block @data_block_index
+ * goes from free to used or back
+ */
+static void account_fat_entry(size_t data_block_index, bool freed){
+    if(fat_block_free==NULL){
+        return;
+    }
+
+    size_t fat_block = data_block_index / volume.fat_entries;
+
+    if(freed){
+        fat_block_free[fat_block]++;
+        free_entries++;
+
+        if(fat_block < first_free_fat_block){
+            first_free_fat_block = fat_block;
+        }
+    } else {
+        fat_block_free[fat_block]--;
+        free_entries--;
+    }
+}
+
+void chain_changed(struct fdNode* fd){
+    for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
+        struct fdNode* other = fd_table->fdTable[i];
+
+        if(other==fd || !other->in_use || other->directory!=fd->directory
+                || other->dir_entry_index!=fd->dir_entry_index){
+            continue;
+        }
+
+        other->first_data_block = fd->first_data_block;
+        other->chain_blocks = 0;
+        other->cursor_block = FAT_EOC;
+
+        compress_forget(other);
+    }
+}
+
+int transfer_blocks(const size_t* blocks, size_t count, uint8_t* buffer, bool write){
+    size_t run;
+
+    for(size_t i = 0; i < count; i += run){
+        for(run = 1; i + run < count && blocks[i + run]==blocks[i] + run; run++);
+
+        struct iovec iov = { &buffer[i * block_size], run * block_size };
+
+        size_t disk_block = get_actual_block_index(blocks[i]);
+
+        if(write ? block_writev(disk_block, &iov, 1) : block_readv(disk_block, &iov, 1)){
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 bool add_file_to_disk(struct fdNode* fd){
     size_t available_block;
 
@@ -158,41 +523,220 @@ bool add_file_to_disk(struct fdNode* fd){
         return false;
     }
 
+    if(clear_block(available_block)){
+        return false;
+    }
+
     fd->first_data_block = available_block;
 
-    clear_block(fd->first_data_block);
+    struct DirEntry* dirEntry = dir_entry(fd->directory, fd->dir_entry_index);
 
-    if(disk_buffer==NULL){
-        disk_buffer = (uint8_t*)calloc(1, bounce_buffer_size);
-    } else {
-        memset(disk_buffer,0,bounce_buffer_size);
+    dir_entry_set_first_block(dirEntry, available_block);
+
+    dir_update(fd->directory, fd->dir_entry_index);
+
+    set_fat_entry(available_block, FAT_EOC);
+
+    fd->cursor_index = 0;
+    fd->cursor_block = available_block;
+    fd->chain_blocks = 1;
+    fd->last_block = available_block;
+
+    chain_changed(fd);
+
+    return true;
+}
+
+bool promote_inline_file(struct fdNode* fd){
+    size_t available_block;
+
+    if(first_block_available(&available_block)==false){
+        return false;
+    }
+
+    struct DirEntry* dirEntry = dir_entry(fd->directory, fd->dir_entry_index);
+
+    uint8_t* inline_data = dir_entry_inline_data(dirEntry);
+
+    init_bounce_buffer();
+    clear_bounce_buffer();
+
+    memcpy(bounce_buffer, inline_data, (size_t)dir_entry_size(dirEntry));
+
+    if(block_write(get_actual_block_index(available_block), bounce_buffer)){
+        return false;
     }
 
-    block_read(root_directory_index, disk_buffer);
+    fd->first_data_block = available_block;
+
+    memset(inline_data, 0, dir_inline_max());
+
+    dir_entry_set_inline(dirEntry, false);
+
+    dir_entry_set_first_block(dirEntry, available_block);
 
-    struct DirEntry* dirEntry=(struct DirEntry*)disk_buffer + fd->dir_entry_index;
+    dir_update(fd->directory, fd->dir_entry_index);
 
-    dirEntry->index = (uint16_t)available_block;
+    set_fat_entry(available_block, FAT_EOC);
 
-    block_write(root_directory_index, disk_buffer);
+    fd->cursor_index = 0;
+    fd->cursor_block = available_block;
+    fd->chain_blocks = 1;
+    fd->last_block = available_block;
 
-    set_fat_entry(dirEntry->index, FAT_EOC);
+    chain_changed(fd);
 
     return true;
 }
 
+size_t copy_on_write(struct fdNode* fd, size_t file_block_index, size_t data_block){
+    size_t copy;
+
+    //the FAT blocks of the three entries and the directory block
+    if(metadata_reserve(4) || first_block_available(&copy)==false){
+        return FAT_EOC;
+    }
+
+    size_t previous = file_block_index==0 ? FAT_EOC : file_block(fd, file_block_index - 1);
+
+    set_fat_entry(copy, get_fat_entry(data_block));
+
+    if(previous==FAT_EOC){
+        fd->first_data_block = copy;
+
+        struct DirEntry* dirEntry = dir_entry(fd->directory, fd->dir_entry_index);
+
+        dir_entry_set_first_block(dirEntry, copy);
+
+        dir_update(fd->directory, fd->dir_entry_index);
+    } else {
+        set_fat_entry(previous, (uint32_t)copy);
+    }
+
+    //becomes FAT_HELD, the snapshot keeps reading it
+    set_fat_entry(data_block, 0);
+
+    if(fd->last_block==data_block){
+        fd->last_block = copy;
+    }
+
+    fd->cursor_index = file_block_index;
+    fd->cursor_block = copy;
+
+    chain_changed(fd);
+
+    return copy;
+}
+
+int unshare_blocks(struct fdNode* fd, size_t file_block_index){
+    size_t last = file_block(fd, file_block_index);
+
+    //blocks before one the file has to itself are its own too
+    if(last==FAT_EOC || !reflink_shared(last)){
+        return 0;
+    }
+
+    size_t previous = FAT_EOC;
+    size_t block = fd->first_data_block;
+
+    while(!reflink_shared(block)){
+        previous = block;
+        block = get_fat_entry(block);
+    }
+
+    size_t first_copy = FAT_EOC;
+    size_t last_copy = FAT_EOC;
+
+    init_bounce_buffer();
+
+    //the copies are linked in once they are all written, so that a crash
+    //leaves them leaked rather than the file cut short
+    for(size_t shared = block; ; shared = get_fat_entry(shared)){
+        size_t copy;
+
+        if(first_block_available(&copy)==false
+                || block_read(get_actual_block_index(shared), bounce_buffer)
+                || block_write(get_actual_block_index(copy), bounce_buffer)){
+            if(first_copy!=FAT_EOC){
+                erase_file(first_copy);
+            }
+
+            return -1;
+        }
+
+        set_fat_entry(copy, FAT_EOC);
+
+        if(last_copy==FAT_EOC){
+            first_copy = copy;
+        } else {
+            set_fat_entry(last_copy, (uint32_t)copy);
+        }
+
+        last_copy = copy;
+
+        if(shared==last){
+            break;
+        }
+    }
+
+    //the FAT blocks of the two links and the directory block
+    if(metadata_reserve(3)){
+        erase_file(first_copy);
+        return -1;
+    }
+
+    set_fat_entry(last_copy, get_fat_entry(last));
+
+    if(previous==FAT_EOC){
+        fd->first_data_block = first_copy;
+
+        struct DirEntry* dirEntry = dir_entry(fd->directory, fd->dir_entry_index);
+
+        dir_entry_set_first_block(dirEntry, first_copy);
+
+        dir_update(fd->directory, fd->dir_entry_index);
+    } else {
+        set_fat_entry(previous, (uint32_t)first_copy);
+    }
+
+    //the blocks copied stay with the files still sharing them
+    for(size_t shared = block; ; shared = get_fat_entry(shared)){
+        reflink_put(shared);
+
+        if(shared==last){
+            break;
+        }
+    }
+
+    if(fd->last_block==last){
+        fd->last_block = last_copy;
+    }
+
+    fd->cursor_index = file_block_index;
+    fd->cursor_block = last_copy;
+
+    chain_changed(fd);
+
+    return 0;
+}
+
 int erase_file(size_t data_block_start){
-    if((uint16_t)data_block_start == FAT_EOC){
+    if(data_block_start == FAT_EOC){
         return 0;
     }
 
-    uint16_t data_block = (uint16_t)data_block_start;
+    size_t data_block = data_block_start;
 
     while(1){
 
-        uint16_t next_block=get_fat_entry(data_block);
+        uint32_t next_block=get_fat_entry(data_block);
 
-        set_fat_entry(data_block,0);
+        //a block other files share is theirs from now on
+        if(reflink_shared(data_block)){
+            reflink_put(data_block);
+        } else {
+            set_fat_entry(data_block,0);
+        }
 
         if(next_block!=FAT_EOC){
 
@@ -211,11 +755,11 @@ size_t skip_blocks(size_t data_block_index, size_t number_of_blocks){
         return data_block_index;
     }
 
-    uint16_t data_block=(uint16_t)data_block_index;
+    size_t data_block=data_block_index;
 
     for(size_t block_jump = 1; block_jump <= number_of_blocks; block_jump++){
 
-        uint16_t next_block = get_fat_entry(data_block);
+        uint32_t next_block = get_fat_entry(data_block);
 
         if(next_block != FAT_EOC){
 
@@ -236,10 +780,10 @@ size_t total_file_blocks(size_t data_block_index){
 
     size_t block_count = 1;
 
-    uint16_t data_block=(uint16_t)data_block_index;
+    size_t data_block=data_block_index;
 
     while(1){
-        uint16_t next_block = get_fat_entry(data_block);
+        uint32_t next_block = get_fat_entry(data_block);
 
         if(next_block!=FAT_EOC){
 
@@ -255,50 +799,150 @@ size_t total_file_blocks(size_t data_block_index){
     return block_count;
 }
 
-bool first_block_available(size_t* block_index_holder){
+size_t file_blocks(struct fdNode* fd){
+    if(fd->first_data_block == FAT_EOC){
+        return 0;
+    }
 
-    if(disk_buffer==NULL){
-        disk_buffer = (uint8_t*)calloc(1, bounce_buffer_size);
-    } else {
-        memset(disk_buffer,0,bounce_buffer_size);
+    if(fd->chain_blocks != 0){
+        return fd->chain_blocks;
+    }
+
+    size_t block_index = 0;
+    size_t data_block = fd->first_data_block;
+
+    //the chain up to the cursor is known
+    if(fd->cursor_block != FAT_EOC){
+        block_index = fd->cursor_index;
+        data_block = fd->cursor_block;
+    }
+
+    uint32_t next_block;
+
+    while((next_block = get_fat_entry(data_block)) != FAT_EOC){
+        data_block = next_block;
+        block_index++;
+    }
+
+    fd->chain_blocks = block_index + 1;
+    fd->last_block = data_block;
+
+    return fd->chain_blocks;
+}
+
+size_t file_block(struct fdNode* fd, size_t block){
+    if(fd->first_data_block == FAT_EOC){
+        return FAT_EOC;
     }
 
-    for(size_t fat_block_index = (size_t)FAT_BLOCK_START_INDEX;
-            fat_block_index < root_directory_index; fat_block_index++){
+    size_t block_index = 0;
+    size_t data_block = fd->first_data_block;
 
-        block_read(fat_block_index,disk_buffer);
+    if(fd->chain_blocks != 0 && block >= fd->chain_blocks - 1){
+        block_index = fd->chain_blocks - 1;
+        data_block = fd->last_block;
+    } else if(fd->cursor_block != FAT_EOC && fd->cursor_index <= block){
+        block_index = fd->cursor_index;
+        data_block = fd->cursor_block;
+    }
+
+    while(block_index < block){
+        uint32_t next_block = get_fat_entry(data_block);
+
+        if(next_block == FAT_EOC){
+            return FAT_EOC;
+        }
+
+        data_block = next_block;
+        block_index++;
+    }
 
-        uint16_t* fat_entry=(uint16_t*)disk_buffer;
+    fd->cursor_index = block_index;
+    fd->cursor_block = data_block;
 
-        for(int entry = 0; entry < FAT_ENTRIES; entry++){
-            size_t data_block_index = (fat_block_index - (size_t)FAT_BLOCK_START_INDEX)
-                                   * (size_t)FAT_ENTRIES + (size_t)entry;
+    return data_block;
+}
+
+bool first_block_available(size_t* block_index_holder){
+    if(metadata_fat()==NULL || fat_block_free==NULL){
+        return false;
+    }
 
-            if(data_block_index == data_blocks){
-                return false;
+    for(size_t fat_block = first_free_fat_block; fat_block < volume.fat_blocks; fat_block++){
+        if(fat_block_free[fat_block]==0){
+            if(fat_block==first_free_fat_block){
+                first_free_fat_block++;
             }
 
-            if(*fat_entry==0){
+            continue;
+        }
+
+        size_t entry = fat_block * volume.fat_entries;
+        size_t end = entry + fat_block_entries(fat_block);
 
-                *block_index_holder  = data_block_index;
+        while(1){
+            entry += find_zero(entry, end - entry);
 
-                return true;
+            if(entry >= end){
+                break;
             }
 
-            fat_entry++;
+            //freed by the running transaction, cannot be reused before it commits
+            if(metadata_pending_free(entry)){
+                entry++;
+                continue;
+            }
+
+            *block_index_holder = entry;
+
+            return true;
         }
+    }
 
-        memset(disk_buffer,0,bounce_buffer_size);
+    //the only free blocks are waiting for a commit, do it now
+    if(metadata_has_pending_frees() && metadata_commit()==0){
+        return first_block_available(block_index_holder);
     }
 
     return false;
 }
 
+bool first_run_available(size_t run_length, size_t* block_index_holder){
+    if(metadata_fat()==NULL || run_length==0 || run_length > data_blocks){
+        return false;
+    }
+
+    size_t start = first_free_fat_block * volume.fat_entries;
+
+    while(1){
+        //runs can cross fat block boundaries, the cache holds the whole fat
+        start += find_zero_run(start, data_blocks - start, run_length);
+
+        if(start >= data_blocks){
+            return false;
+        }
+
+        size_t pending = start;
+
+        while(pending < start + run_length && !metadata_pending_free(pending)){
+            pending++;
+        }
+
+        if(pending == start + run_length){
+            *block_index_holder = start;
+
+            return true;
+        }
+
+        start = pending + 1;
+    }
+}
+
 size_t allocate_more_blocks(struct fdNode* fd, size_t needed_blocks){
 
-    size_t file_block_count = total_file_blocks(fd->first_data_block);
+    size_t file_block_count = file_blocks(fd);
 
-    size_t end_block = skip_blocks(fd->first_data_block, file_block_count - 1);
+    size_t end_block = fd->last_block;
 
     size_t new_blocks = 0;
 
@@ -306,105 +950,140 @@ size_t allocate_more_blocks(struct fdNode* fd, size_t needed_blocks){
 
         size_t available_block;
 
-        if(first_block_available(&available_block)==false){
+        if(first_block_available(&available_block)==false
+                || clear_block(available_block)){
              break;
         }
 
-        clear_block(available_block);
-
         new_blocks++;
 
-        set_fat_entry(end_block, (uint16_t)available_block);
+        set_fat_entry(end_block, (uint32_t)available_block);
 
         set_fat_entry(available_block, FAT_EOC);
 
         end_block = available_block;
    }
 
+   fd->chain_blocks = file_block_count + new_blocks;
+   fd->last_block = end_block;
+
+   chain_changed(fd);
+
    return new_blocks;
 }
 
-size_t total_block_size(size_t size_in_bytes){
+int release_unused_blocks(struct fdNode* fd){
+    size_t keep = total_block_size(fd->size);
+
+    if(fd->first_data_block==FAT_EOC || file_blocks(fd) <= keep){
+        return 0;
+    }
+
+    size_t rest;
+
+    if(keep==0){
+        rest = fd->first_data_block;
 
-    size_t total_blocks = size_in_bytes / (size_t)BLOCK_SIZE;
+        fd->first_data_block = FAT_EOC;
 
-    if(size_in_bytes % (size_t)BLOCK_SIZE != 0){
-        total_blocks++;
+        struct DirEntry* dirEntry = dir_entry(fd->directory, fd->dir_entry_index);
+
+        dir_entry_set_first_block(dirEntry, FAT_EOC);
+
+        dir_update(fd->directory, fd->dir_entry_index);
+    } else {
+        size_t last = file_block(fd, keep - 1);
+
+        rest = get_fat_entry(last);
+
+        set_fat_entry(last, FAT_EOC);
     }
 
-    return total_blocks;
+    fd->cursor_index = 0;
+    fd->cursor_block = FAT_EOC;
+    fd->chain_blocks = 0;
+    fd->last_block = FAT_EOC;
+
+    chain_changed(fd);
+
+    return erase_file(rest);
+}
+
+size_t total_block_size(size_t size_in_bytes){
+    return (size_in_bytes + block_size - 1) >> block_shift;
 }
 
 size_t current_block_offset(size_t current_byte_offset){
-    return current_byte_offset / (size_t)BLOCK_SIZE;
+    return current_byte_offset >> block_shift;
 }
 
 size_t get_actual_block_index(size_t data_block_index){
-    return root_directory_index + 1 + data_block_index;
+    return volume.data_start_index + data_block_index;
 }
 
 size_t get_fat_block_index(size_t data_block_index){
      return (size_t)FAT_BLOCK_START_INDEX
-             + data_block_index / (size_t)FAT_ENTRIES;
+             + data_block_index / volume.fat_entries;
 }
 
 size_t get_fat_block_entry(size_t data_block_index){
-    return data_block_index % (size_t)FAT_ENTRIES;
+    return data_block_index % volume.fat_entries;
 }
 
-void set_fat_entry(size_t data_block_index, uint16_t value){
+void set_fat_entry(size_t data_block_index, uint32_t value){
 
-    if(disk_buffer==NULL){
-        disk_buffer = (uint8_t*)calloc(1, bounce_buffer_size);
-    } else {
-        memset(disk_buffer,0,bounce_buffer_size);
-    }
+     uint32_t old_value = get_fat_entry(data_block_index);
 
-     size_t fat_block_index = get_fat_block_index(data_block_index);
-     size_t fat_block_entry = get_fat_block_entry(data_block_index);
+     if(value==0){
+         dedup_forget(data_block_index);
+     }
 
-     block_read(fat_block_index, disk_buffer);
+     //blocks a snapshot reads are not handed out again
+     if(value==0 && snapshot_held(data_block_index)){
+         value = FAT_HELD;
+     }
 
-     uint16_t* entry_ptr=(uint16_t*)disk_buffer + fat_block_entry;
+     if(value==0 && old_value!=0){
+         metadata_free_block(data_block_index);
+         account_fat_entry(data_block_index, true);
+     } else if(value!=0 && old_value==0){
+         account_fat_entry(data_block_index, false);
+     }
 
-     *entry_ptr = value;
+     if(volume.fat_entry_size==sizeof(uint32_t)){
+         ((uint32_t*)metadata_fat())[data_block_index] = value;
+     } else {
+         ((uint16_t*)metadata_fat())[data_block_index] = (uint16_t)value;
+     }
 
-     block_write(fat_block_index,disk_buffer);
+     metadata_dirty(get_fat_block_index(data_block_index));
 }
 
-uint16_t get_fat_entry(size_t data_block_index){
-
-    if(disk_buffer==NULL){
-        disk_buffer = (uint8_t*)calloc(1, bounce_buffer_size);
-    } else {
-        memset(disk_buffer,0,bounce_buffer_size);
+uint32_t get_fat_entry(size_t data_block_index){
+    if(volume.fat_entry_size==sizeof(uint32_t)){
+        return ((uint32_t*)metadata_fat())[data_block_index];
     }
 
-    size_t fat_block_index = get_fat_block_index(data_block_index);
-    size_t fat_block_entry = get_fat_block_entry(data_block_index);
-
-    block_read(fat_block_index, disk_buffer);
-
-    uint16_t* entry_ptr=(uint16_t*)disk_buffer + fat_block_entry;
-
-    uint16_t entry_value = *entry_ptr;
-
-    return entry_value;
+    return ((uint16_t*)metadata_fat())[data_block_index];
 }
 
-void clear_block(size_t data_block_index){
+int clear_block(size_t data_block_index){
     if(disk_buffer==NULL){
-       disk_buffer = (uint8_t*)calloc(1, bounce_buffer_size);
+       disk_buffer = (uint8_t*)calloc(1, BLOCK_SIZE_MAX);
+
+       if(disk_buffer==NULL){
+           return -1;
+       }
     } else {
-       memset(disk_buffer,0,bounce_buffer_size);
+       memset(disk_buffer,0,block_size);
     }
 
-    block_write(get_actual_block_index(data_block_index), disk_buffer);
+    return block_write(get_actual_block_index(data_block_index), disk_buffer);
 }
 
 int init_bounce_buffer(){
     if(bounce_buffer==NULL){
-        bounce_buffer = (uint8_t*)calloc(1, bounce_buffer_size);
+        bounce_buffer = (uint8_t*)calloc(1, BLOCK_SIZE_MAX);
 
         if(!bounce_buffer){
             return -1;
@@ -416,7 +1095,7 @@ int init_bounce_buffer(){
 
 void clear_bounce_buffer(){
     if(bounce_buffer!=NULL){
-        memset(bounce_buffer, 0, bounce_buffer_size);
+        memset(bounce_buffer, 0, block_size);
     }
 }
 
@@ -3,22 +3,42 @@
 
 #include <stddef.h> /* for size_t definition */
 #include <stdbool.h>
+#include <sys/uio.h> /* for struct iovec */
 #include "fdTable.h"
 #include "fs.h"
 
 #define SUPERBLOCK_INDEX 0
 #define FAT_BLOCK_START_INDEX 1
 
-/** Size of a disk block in bytes */
-#define BLOCK_SIZE 4096
+/** Sizes of a disk block in bytes, a power of two chosen at format time */
+#define BLOCK_SIZE_MIN 4096
+#define BLOCK_SIZE_MAX 65536
+#define BLOCK_SIZE_DEFAULT BLOCK_SIZE_MIN
 
-/*Fat entries per fat block*/
-#define FAT_ENTRIES 2048
+/*
+ * Size of a block of the open disk, and its log2: BLOCK_SIZE_DEFAULT
+ * while no file system is mounted, then the size it was formatted with.
+ */
+extern size_t block_size;
+extern unsigned int block_shift;
+
+#define FAT16_EOC 0xFFFF
+#define FAT32_EOC 0xFFFFFFFF
+
+/*
+ * End of chain marker of the mounted disk, FAT16_EOC or FAT32_EOC
+ */
+extern uint32_t FAT_EOC;
 
-extern uint16_t FAT_EOC;
+/*
+ * FAT entry of a block the file system freed while a snapshot still
+ * reads it, FAT_EOC - 1, see snapshot.h. It is neither free nor part of
+ * a chain.
+ */
+extern uint32_t FAT_HELD;
 
+/* BLOCK_SIZE_MAX bytes, so that it fits a block of any disk */
 extern uint8_t* bounce_buffer;
-extern size_t bounce_buffer_size;
 
 
 struct fdNode;
@@ -27,9 +47,59 @@ struct __attribute__((__packed__)) DirEntry{
     uint8_t filename[16];
     uint32_t size;
     uint16_t index;
-    uint8_t padding[10];
+    uint8_t padding[8];
+    /* slot of the fragment holding the tail, if DIR_ATTR_PACKED */
+    uint8_t fragment;
+    /* DIR_ATTR_* flags, zero for a regular file */
+    uint8_t attributes;
+};
+
+/*
+ * Directory entry of FS_VERSION_FAT32 disks, same size and name as
+ * struct DirEntry. Use dir_entry_size() and friends to read either.
+ */
+struct __attribute__((__packed__)) DirEntry32{
+    uint8_t filename[16];
+    uint64_t size;
+    uint32_t index;
+    uint8_t padding[2];
+    /* at the same offsets as in struct DirEntry */
+    uint8_t fragment;
+    uint8_t attributes;
 };
 
+/*
+ * The entry is a directory: its chain holds struct DirEntry records, its
+ * size is the number of bytes of those blocks. Implementations of the
+ * original format, which leave the byte zero, see it as a regular file.
+ */
+#define DIR_ATTR_DIRECTORY 0x10
+
+/*
+ * The content of the file is in the bytes following the entry, on disks
+ * formatted with FS_FEATURE_INLINE_DATA. Its first block is FAT_EOC.
+ */
+#define DIR_ATTR_INLINE 0x20
+
+/*
+ * The last block of the chain is a fragment block shared with other
+ * files, the tail of the file being in its fragment slot, see fragment.h.
+ * Only disks formatted with FS_FEATURE_TAIL_PACKING have such entries.
+ */
+#define DIR_ATTR_PACKED 0x40
+
+/*
+ * The file is to be stored compressed once no descriptor has it open, see
+ * compress.h
+ */
+#define DIR_ATTR_COMPRESS 0x80
+
+/*
+ * The chain holds the content of the file compressed, on disks with
+ * FS_FEATURE_COMPRESSION. The size is the one of the content.
+ */
+#define DIR_ATTR_COMPRESSED 0x08
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -50,6 +120,20 @@ int block_disk_open(const char *diskname);
  */
 int block_disk_close(void);
 
+/**
+ * block_disk_set_block_size - Set the block size of the open disk
+ * @size: Block size in bytes, a power of two in [%BLOCK_SIZE_MIN,
+ * %BLOCK_SIZE_MAX]
+ *
+ * The disk is opened with %BLOCK_SIZE_DEFAULT blocks, enough to read the
+ * superblock at the start of block 0. Once the superblock tells the size
+ * the disk was formatted with, every later block index is in @size blocks.
+ *
+ * Return: -1 if there was no virtual disk file opened, if @size is invalid or
+ * if the disk image's size is not a multiple of it. 0 otherwise.
+ */
+int block_disk_set_block_size(size_t size);
+
 /**
  * block_disk_count - Get disk's block count
  *
@@ -63,7 +147,7 @@ int block_disk_count(void);
  * @block: Index of the block to write to
  * @buf: Data buffer to write in the block
  *
- * Write the content of buffer @buf (%BLOCK_SIZE bytes) in the virtual disk's
+ * Write the content of buffer @buf (@block_size bytes) in the virtual disk's
  * block @block.
  *
  * Return: -1 if @block is out of bounds or inaccessible or if the writing
@@ -76,7 +160,7 @@ int block_write(size_t block, const void *buf);
  * @block: Index of the block to read from
  * @buf: Data buffer to be filled with content of block
  *
- * Read the content of virtual disk's block @block (%BLOCK_SIZE bytes) into
+ * Read the content of virtual disk's block @block (@block_size bytes) into
  * buffer @buf.
  *
  * Return: -1 if @block is out of bounds or inaccessible, or if the reading
@@ -84,18 +168,105 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_writev - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @iov: Buffers to write, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Write the buffers of @iov back to back starting at the virtual disk's
+ * block @block, with a single system call. The buffers must add up to a
+ * whole number of blocks.
+ *
+ * Return: -1 if the blocks are out of bounds or inaccessible, or if the
+ * writing operation fails. 0 otherwise.
+ */
+int block_writev(size_t block, const struct iovec *iov, int iovcnt);
+
+/**
+ * block_readv - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @iov: Buffers to fill, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Read consecutive blocks starting at the virtual disk's block @block into
+ * the buffers of @iov, with a single system call. The buffers must add up to
+ * a whole number of blocks.
+ *
+ * Return: -1 if the blocks are out of bounds or inaccessible, or if the
+ * reading operation fails. 0 otherwise.
+ */
+int block_readv(size_t block, const struct iovec *iov, int iovcnt);
+
+/**
+ * block_sync - Flush written blocks to stable storage
+ *
+ * Wait until every block written so far is on stable storage. Returns right
+ * away if nothing was written since the last call.
+ *
+ * Return: -1 if there was no virtual disk file opened or if flushing failed.
+ * 0 otherwise.
+ */
+int block_sync(void);
+
 /*
  * Allocates 1 block for a new file.
  *
- * Returns: true if there was disk space, false otherwise
+ * Returns: true if there was disk space and the block could be cleared,
+ * false otherwise
  */
 bool add_file_to_disk(struct fdNode* fd);
 
+/*
+ * Moves the inline content of the file of @fd to a block of its own,
+ * which becomes its first block.
+ *
+ * Returns: true on success, false if the disk is full or the block could
+ * not be written
+ */
+bool promote_inline_file(struct fdNode* fd);
+
+/*
+ * Moves block @file_block of the file of @fd, data block @data_block,
+ * which a snapshot holds, to a new block the chain links in its place.
+ * The content is not copied: the caller writes the new block, reading
+ * the old one for what it does not overwrite.
+ *
+ * Returns: the new data block, FAT_EOC if the disk is full
+ */
+size_t copy_on_write(struct fdNode* fd, size_t file_block, size_t data_block);
+
+/*
+ * Gives the file of @fd its own copy of the blocks it shares with reflinked
+ * files, from the first one up to block @file_block, so that they can be
+ * written. The copies are linked in place of the shared blocks, and the
+ * last one to the block following @file_block, which stays shared.
+ *
+ * Returns: 0 on success or if block @file_block was not shared, -1 if the
+ * disk is full or a block could not be copied
+ */
+int unshare_blocks(struct fdNode* fd, size_t file_block);
+
+/*
+ * Other descriptors of the file @fd points to see its new chain, and drop
+ * what they cached of the old one
+ */
+void chain_changed(struct fdNode* fd);
+
+/*
+ * Reads or writes the @count data blocks @blocks from or to @buffer, back
+ * to back, with one system call per run of consecutive blocks
+ *
+ * Returns: 0 on success, -1 otherwise
+ */
+int transfer_blocks(const size_t* blocks, size_t count, uint8_t* buffer, bool write);
+
 /*
  * Removes file from fat filesystem.
  *
  * This goes through the chain of fat entries
- * for a file and sets them to zero.
+ * for a file and sets them to zero, except for the
+ * blocks reflinked files share, which lose a sharer.
  *
  * Params: first data block of file
  */
@@ -115,6 +286,38 @@ size_t skip_blocks(size_t data_block_index, size_t traversal_blocks);
  */
 size_t total_file_blocks(size_t data_block_index);
 
+/*
+ * The number of blocks of the open file @fd, walking its chain only the
+ * first time
+ */
+size_t file_blocks(struct fdNode* fd);
+
+/*
+ * The data block holding block @file_block of the open file @fd, walking
+ * from the last block looked up when it is not further along
+ *
+ * Returns: FAT_EOC if the file is shorter
+ */
+size_t file_block(struct fdNode* fd, size_t file_block);
+
+/*
+ * Builds the free entry counts of the FAT blocks that allocation starts
+ * from. The metadata cache must be loaded.
+ *
+ * Returns: 0 on success, -1 otherwise
+ */
+int fat_load();
+
+/*
+ * Drops the free entry counts
+ */
+void fat_unload();
+
+/*
+ * The number of free data blocks
+ */
+size_t fat_free_blocks();
+
 /*
  * This takes a pointer and populates it with the first free data block index
  *
@@ -122,6 +325,14 @@ size_t total_file_blocks(size_t data_block_index);
  */
 bool first_block_available(size_t* block_index_holder);
 
+/*
+ * This populates block_index_holder with the first data block of the
+ * first run of run_length consecutive free data blocks
+ *
+ * Returns: true if such a run was found, false otherwise
+ */
+bool first_run_available(size_t run_length, size_t* block_index_holder);
+
 /*
  * This function will attempt to allocate up to needed_blocks
  * data blocks for a file.
@@ -130,6 +341,14 @@ bool first_block_available(size_t* block_index_holder);
  */
 size_t allocate_more_blocks(struct fdNode* fd,size_t needed_blocks);
 
+/*
+ * Frees the blocks of the chain of @fd past those its size needs, which a
+ * write that stopped early allocated
+ *
+ * Returns: 0 on success, -1 if they could not be freed
+ */
+int release_unused_blocks(struct fdNode* fd);
+
 /*
  * The number of data blocks required to hold certain number of bytes
  */
@@ -156,24 +375,26 @@ size_t get_fat_block_index(size_t data_block_index);
  * Given a data block, returns where in a
  * fat block its entry will be located
  *
- * Returns: A number 0 to 2047
+ * Returns: A number 0 to volume.fat_entries - 1
  */
 size_t get_fat_block_entry(size_t data_block_index);
 
 /*
  * Sets a value in the fat for a data block
  */
-void set_fat_entry(size_t data_block_index, uint16_t value);
+void set_fat_entry(size_t data_block_index, uint32_t value);
 
 /*
  * Gets a value from the fat for a data block
  */
-uint16_t get_fat_entry(size_t data_block_index);
+uint32_t get_fat_entry(size_t data_block_index);
 
 /*
  * Erases a data blockS
+ *
+ * Returns: 0 on success, -1 if the block could not be written
  */
-void clear_block(size_t data_block_index);
+int clear_block(size_t data_block_index);
 
 /*
  * Functions for accessing the bounce buffer
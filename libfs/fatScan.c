@@ -0,0 +1,570 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FAT_SCAN_X86 1
+#endif
+
+#include "fatScan.h"
+
+struct fat_scan_ops{
+    const char* name;
+    size_t (*count_nonzero)(const uint16_t*, size_t);
+    size_t (*find_zero)(const uint16_t*, size_t);
+    size_t (*find_zero_run)(const uint16_t*, size_t, size_t);
+    size_t (*count_nonzero32)(const uint32_t*, size_t);
+    size_t (*find_zero32)(const uint32_t*, size_t);
+    size_t (*find_zero_run32)(const uint32_t*, size_t, size_t);
+};
+
+static const struct fat_scan_ops* active_ops = NULL;
+
+/*
+ * Feeds the zero mask of @width entries starting at entry @base (bit i
+ * set if entry base+i is zero) to a run search. Returns true once
+ * @needed consecutive zero entries were seen, with the first one in
+ * *run_start.
+ */
+static inline bool feed_run_mask(uint32_t mask, size_t width, size_t base,
+        size_t needed, size_t* run_start, size_t* run_length){
+
+    uint32_t full = width==32 ? 0xFFFFFFFFu : ((uint32_t)1 << width) - 1;
+
+    if(mask==full){
+        if(*run_length==0){
+            *run_start = base;
+        }
+
+        *run_length += width;
+
+        return *run_length >= needed;
+    }
+
+    if(mask==0){
+        *run_length = 0;
+
+        return false;
+    }
+
+    for(size_t bit = 0; bit < width; bit++){
+        if(mask & ((uint32_t)1 << bit)){
+            if(*run_length==0){
+                *run_start = base + bit;
+            }
+
+            (*run_length)++;
+
+            if(*run_length >= needed){
+                return true;
+            }
+        } else {
+            *run_length = 0;
+        }
+    }
+
+    return false;
+}
+
+static size_t scalar_count_nonzero(const uint16_t* entries, size_t count){
+    size_t nonzero = 0;
+
+    for(size_t entry = 0; entry < count; entry++){
+        if(entries[entry]!=0){
+            nonzero++;
+        }
+    }
+
+    return nonzero;
+}
+
+static size_t scalar_find_zero(const uint16_t* entries, size_t count){
+    for(size_t entry = 0; entry < count; entry++){
+        if(entries[entry]==0){
+            return entry;
+        }
+    }
+
+    return count;
+}
+
+static size_t scalar_find_zero_run(const uint16_t* entries, size_t count, size_t run_length){
+    if(run_length==0){
+        return 0;
+    }
+
+    size_t run_start = 0;
+    size_t run = 0;
+
+    for(size_t entry = 0; entry < count; entry++){
+        if(entries[entry]==0){
+            if(run==0){
+                run_start = entry;
+            }
+
+            if(++run >= run_length){
+                return run_start;
+            }
+        } else {
+            run = 0;
+        }
+    }
+
+    return count;
+}
+
+static size_t scalar_count_nonzero32(const uint32_t* entries, size_t count){
+    size_t nonzero = 0;
+
+    for(size_t entry = 0; entry < count; entry++){
+        if(entries[entry]!=0){
+            nonzero++;
+        }
+    }
+
+    return nonzero;
+}
+
+static size_t scalar_find_zero32(const uint32_t* entries, size_t count){
+    for(size_t entry = 0; entry < count; entry++){
+        if(entries[entry]==0){
+            return entry;
+        }
+    }
+
+    return count;
+}
+
+static size_t scalar_find_zero_run32(const uint32_t* entries, size_t count, size_t run_length){
+    if(run_length==0){
+        return 0;
+    }
+
+    size_t run_start = 0;
+    size_t run = 0;
+
+    for(size_t entry = 0; entry < count; entry++){
+        if(feed_run_mask(entries[entry]==0, 1, entry, run_length, &run_start, &run)){
+            return run_start;
+        }
+    }
+
+    return count;
+}
+
+static const struct fat_scan_ops scalar_ops = {
+    "scalar", scalar_count_nonzero, scalar_find_zero, scalar_find_zero_run,
+    scalar_count_nonzero32, scalar_find_zero32, scalar_find_zero_run32
+};
+
+#ifdef FAT_SCAN_X86
+
+/*
+ * SSE2: 8 entries per vector
+ */
+__attribute__((target("sse2")))
+static size_t sse2_count_nonzero(const uint16_t* entries, size_t count){
+    const __m128i zero = _mm_setzero_si128();
+
+    size_t zeros = 0;
+    size_t entry = 0;
+
+    for(; entry + 8 <= count; entry += 8){
+        __m128i value = _mm_loadu_si128((const __m128i*)&entries[entry]);
+
+        /* two mask bits per zero entry */
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(value, zero));
+
+        zeros += (size_t)__builtin_popcount((unsigned int)mask) / 2;
+    }
+
+    return entry - zeros + scalar_count_nonzero(&entries[entry], count - entry);
+}
+
+__attribute__((target("sse2")))
+static size_t sse2_find_zero(const uint16_t* entries, size_t count){
+    const __m128i zero = _mm_setzero_si128();
+
+    size_t entry = 0;
+
+    for(; entry + 8 <= count; entry += 8){
+        __m128i value = _mm_loadu_si128((const __m128i*)&entries[entry]);
+
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(value, zero));
+
+        if(mask!=0){
+            return entry + (size_t)__builtin_ctz((unsigned int)mask) / 2;
+        }
+    }
+
+    return entry + scalar_find_zero(&entries[entry], count - entry);
+}
+
+__attribute__((target("sse2")))
+static size_t sse2_find_zero_run(const uint16_t* entries, size_t count, size_t run_length){
+    if(run_length==0){
+        return 0;
+    }
+
+    const __m128i zero = _mm_setzero_si128();
+
+    size_t run_start = 0;
+    size_t run = 0;
+    size_t entry = 0;
+
+    for(; entry + 16 <= count; entry += 16){
+        __m128i low = _mm_loadu_si128((const __m128i*)&entries[entry]);
+        __m128i high = _mm_loadu_si128((const __m128i*)&entries[entry + 8]);
+
+        /* one mask bit per entry */
+        __m128i packed = _mm_packs_epi16(_mm_cmpeq_epi16(low, zero),
+                                         _mm_cmpeq_epi16(high, zero));
+
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(packed);
+
+        if(feed_run_mask(mask, 16, entry, run_length, &run_start, &run)){
+            return run_start;
+        }
+    }
+
+    for(; entry < count; entry++){
+        if(feed_run_mask(entries[entry]==0, 1, entry, run_length, &run_start, &run)){
+            return run_start;
+        }
+    }
+
+    return count;
+}
+
+/*
+ * SSE2, 32 bit entries: 4 entries per vector
+ */
+__attribute__((target("sse2")))
+static size_t sse2_count_nonzero32(const uint32_t* entries, size_t count){
+    const __m128i zero = _mm_setzero_si128();
+
+    size_t zeros = 0;
+    size_t entry = 0;
+
+    for(; entry + 4 <= count; entry += 4){
+        __m128i value = _mm_loadu_si128((const __m128i*)&entries[entry]);
+
+        /* one mask bit per entry */
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(value, zero)));
+
+        zeros += (size_t)__builtin_popcount((unsigned int)mask);
+    }
+
+    return entry - zeros + scalar_count_nonzero32(&entries[entry], count - entry);
+}
+
+__attribute__((target("sse2")))
+static size_t sse2_find_zero32(const uint32_t* entries, size_t count){
+    const __m128i zero = _mm_setzero_si128();
+
+    size_t entry = 0;
+
+    for(; entry + 4 <= count; entry += 4){
+        __m128i value = _mm_loadu_si128((const __m128i*)&entries[entry]);
+
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(value, zero)));
+
+        if(mask!=0){
+            return entry + (size_t)__builtin_ctz((unsigned int)mask);
+        }
+    }
+
+    return entry + scalar_find_zero32(&entries[entry], count - entry);
+}
+
+__attribute__((target("sse2")))
+static size_t sse2_find_zero_run32(const uint32_t* entries, size_t count, size_t run_length){
+    if(run_length==0){
+        return 0;
+    }
+
+    const __m128i zero = _mm_setzero_si128();
+
+    size_t run_start = 0;
+    size_t run = 0;
+    size_t entry = 0;
+
+    for(; entry + 4 <= count; entry += 4){
+        __m128i value = _mm_loadu_si128((const __m128i*)&entries[entry]);
+
+        uint32_t mask = (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(value, zero)));
+
+        if(feed_run_mask(mask, 4, entry, run_length, &run_start, &run)){
+            return run_start;
+        }
+    }
+
+    for(; entry < count; entry++){
+        if(feed_run_mask(entries[entry]==0, 1, entry, run_length, &run_start, &run)){
+            return run_start;
+        }
+    }
+
+    return count;
+}
+
+static const struct fat_scan_ops sse2_ops = {
+    "sse2", sse2_count_nonzero, sse2_find_zero, sse2_find_zero_run,
+    sse2_count_nonzero32, sse2_find_zero32, sse2_find_zero_run32
+};
+
+/*
+ * AVX2: 16 entries per vector
+ */
+__attribute__((target("avx2,popcnt")))
+static size_t avx2_count_nonzero(const uint16_t* entries, size_t count){
+    const __m256i zero = _mm256_setzero_si256();
+
+    size_t zeros = 0;
+    size_t entry = 0;
+
+    for(; entry + 32 <= count; entry += 32){
+        __m256i first = _mm256_loadu_si256((const __m256i*)&entries[entry]);
+        __m256i second = _mm256_loadu_si256((const __m256i*)&entries[entry + 16]);
+
+        unsigned int first_mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi16(first, zero));
+        unsigned int second_mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi16(second, zero));
+
+        zeros += (size_t)(__builtin_popcount(first_mask) + __builtin_popcount(second_mask)) / 2;
+    }
+
+    return entry - zeros + sse2_count_nonzero(&entries[entry], count - entry);
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_find_zero(const uint16_t* entries, size_t count){
+    const __m256i zero = _mm256_setzero_si256();
+
+    size_t entry = 0;
+
+    for(; entry + 16 <= count; entry += 16){
+        __m256i value = _mm256_loadu_si256((const __m256i*)&entries[entry]);
+
+        int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(value, zero));
+
+        if(mask!=0){
+            return entry + (size_t)__builtin_ctz((unsigned int)mask) / 2;
+        }
+    }
+
+    return entry + sse2_find_zero(&entries[entry], count - entry);
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_find_zero_run(const uint16_t* entries, size_t count, size_t run_length){
+    if(run_length==0){
+        return 0;
+    }
+
+    const __m256i zero = _mm256_setzero_si256();
+
+    size_t run_start = 0;
+    size_t run = 0;
+    size_t entry = 0;
+
+    for(; entry + 32 <= count; entry += 32){
+        __m256i low = _mm256_loadu_si256((const __m256i*)&entries[entry]);
+        __m256i high = _mm256_loadu_si256((const __m256i*)&entries[entry + 16]);
+
+        /*
+         * packs works within 128 bit lanes, the permute puts the
+         * entries back in order before taking one mask bit per entry
+         */
+        __m256i packed = _mm256_packs_epi16(_mm256_cmpeq_epi16(low, zero),
+                                            _mm256_cmpeq_epi16(high, zero));
+
+        packed = _mm256_permute4x64_epi64(packed, 0xD8);
+
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(packed);
+
+        if(feed_run_mask(mask, 32, entry, run_length, &run_start, &run)){
+            return run_start;
+        }
+    }
+
+    for(; entry < count; entry++){
+        if(feed_run_mask(entries[entry]==0, 1, entry, run_length, &run_start, &run)){
+            return run_start;
+        }
+    }
+
+    return count;
+}
+
+/*
+ * AVX2, 32 bit entries: 8 entries per vector
+ */
+__attribute__((target("avx2,popcnt")))
+static size_t avx2_count_nonzero32(const uint32_t* entries, size_t count){
+    const __m256i zero = _mm256_setzero_si256();
+
+    size_t zeros = 0;
+    size_t entry = 0;
+
+    for(; entry + 16 <= count; entry += 16){
+        __m256i first = _mm256_loadu_si256((const __m256i*)&entries[entry]);
+        __m256i second = _mm256_loadu_si256((const __m256i*)&entries[entry + 8]);
+
+        unsigned int first_mask = (unsigned int)_mm256_movemask_ps(
+                _mm256_castsi256_ps(_mm256_cmpeq_epi32(first, zero)));
+        unsigned int second_mask = (unsigned int)_mm256_movemask_ps(
+                _mm256_castsi256_ps(_mm256_cmpeq_epi32(second, zero)));
+
+        zeros += (size_t)__builtin_popcount(first_mask | (second_mask << 8));
+    }
+
+    return entry - zeros + sse2_count_nonzero32(&entries[entry], count - entry);
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_find_zero32(const uint32_t* entries, size_t count){
+    const __m256i zero = _mm256_setzero_si256();
+
+    size_t entry = 0;
+
+    for(; entry + 8 <= count; entry += 8){
+        __m256i value = _mm256_loadu_si256((const __m256i*)&entries[entry]);
+
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(value, zero)));
+
+        if(mask!=0){
+            return entry + (size_t)__builtin_ctz((unsigned int)mask);
+        }
+    }
+
+    return entry + sse2_find_zero32(&entries[entry], count - entry);
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_find_zero_run32(const uint32_t* entries, size_t count, size_t run_length){
+    if(run_length==0){
+        return 0;
+    }
+
+    const __m256i zero = _mm256_setzero_si256();
+
+    size_t run_start = 0;
+    size_t run = 0;
+    size_t entry = 0;
+
+    for(; entry + 32 <= count; entry += 32){
+        uint32_t mask = 0;
+
+        for(size_t part = 0; part < 4; part++){
+            __m256i value = _mm256_loadu_si256((const __m256i*)&entries[entry + part * 8]);
+
+            mask |= (uint32_t)_mm256_movemask_ps(
+                    _mm256_castsi256_ps(_mm256_cmpeq_epi32(value, zero))) << (part * 8);
+        }
+
+        if(feed_run_mask(mask, 32, entry, run_length, &run_start, &run)){
+            return run_start;
+        }
+    }
+
+    for(; entry < count; entry++){
+        if(feed_run_mask(entries[entry]==0, 1, entry, run_length, &run_start, &run)){
+            return run_start;
+        }
+    }
+
+    return count;
+}
+
+static const struct fat_scan_ops avx2_ops = {
+    "avx2", avx2_count_nonzero, avx2_find_zero, avx2_find_zero_run,
+    avx2_count_nonzero32, avx2_find_zero32, avx2_find_zero_run32
+};
+
+#endif
+
+static const struct fat_scan_ops* best_ops(){
+#ifdef FAT_SCAN_X86
+    __builtin_cpu_init();
+
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")){
+        return &avx2_ops;
+    }
+
+    if(__builtin_cpu_supports("sse2")){
+        return &sse2_ops;
+    }
+#endif
+
+    return &scalar_ops;
+}
+
+static inline const struct fat_scan_ops* ops(){
+    if(active_ops==NULL){
+        active_ops = best_ops();
+    }
+
+    return active_ops;
+}
+
+size_t fat_count_nonzero(const uint16_t* entries, size_t count){
+    return ops()->count_nonzero(entries, count);
+}
+
+size_t fat_find_zero(const uint16_t* entries, size_t count){
+    return ops()->find_zero(entries, count);
+}
+
+size_t fat_find_zero_run(const uint16_t* entries, size_t count, size_t run_length){
+    return ops()->find_zero_run(entries, count, run_length);
+}
+
+size_t fat_count_nonzero32(const uint32_t* entries, size_t count){
+    return ops()->count_nonzero32(entries, count);
+}
+
+size_t fat_find_zero32(const uint32_t* entries, size_t count){
+    return ops()->find_zero32(entries, count);
+}
+
+size_t fat_find_zero_run32(const uint32_t* entries, size_t count, size_t run_length){
+    return ops()->find_zero_run32(entries, count, run_length);
+}
+
+int fat_scan_select(enum fat_scan_impl impl){
+    switch(impl){
+    case FAT_SCAN_AUTO:
+        active_ops = best_ops();
+        return 0;
+    case FAT_SCAN_SCALAR:
+        active_ops = &scalar_ops;
+        return 0;
+#ifdef FAT_SCAN_X86
+    case FAT_SCAN_SSE2:
+        __builtin_cpu_init();
+
+        if(!__builtin_cpu_supports("sse2")){
+            return -1;
+        }
+
+        active_ops = &sse2_ops;
+        return 0;
+    case FAT_SCAN_AVX2:
+        __builtin_cpu_init();
+
+        if(!__builtin_cpu_supports("avx2") || !__builtin_cpu_supports("popcnt")){
+            return -1;
+        }
+
+        active_ops = &avx2_ops;
+        return 0;
+#endif
+    default:
+        return -1;
+    }
+}
+
+const char* fat_scan_name(){
+    return ops()->name;
+}
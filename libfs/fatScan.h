@@ -0,0 +1,58 @@
+#ifndef FATSCAN_H_
+#define FATSCAN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Kernels scanning arrays of 16 bit FAT entries, and their *32 versions
+ * for the 32 bit entries of FS_VERSION_FAT32 disks. The implementation is
+ * picked the first time one of them is called, from what the CPU
+ * supports (AVX2, then SSE2, then plain C).
+ */
+
+enum fat_scan_impl{
+    FAT_SCAN_AUTO,
+    FAT_SCAN_SCALAR,
+    FAT_SCAN_SSE2,
+    FAT_SCAN_AVX2
+};
+
+/*
+ * Number of entries in @entries[0, @count) that are not zero
+ */
+size_t fat_count_nonzero(const uint16_t* entries, size_t count);
+
+/*
+ * Index of the first zero entry in @entries[0, @count)
+ *
+ * Returns: @count if there is none
+ */
+size_t fat_find_zero(const uint16_t* entries, size_t count);
+
+/*
+ * Index of the first entry of the first run of @run_length consecutive
+ * zero entries in @entries[0, @count)
+ *
+ * Returns: @count if there is none
+ */
+size_t fat_find_zero_run(const uint16_t* entries, size_t count, size_t run_length);
+
+size_t fat_count_nonzero32(const uint32_t* entries, size_t count);
+size_t fat_find_zero32(const uint32_t* entries, size_t count);
+size_t fat_find_zero_run32(const uint32_t* entries, size_t count, size_t run_length);
+
+/*
+ * Forces an implementation, mostly for benchmarks comparing them.
+ * FAT_SCAN_AUTO goes back to the best one the CPU supports.
+ *
+ * Returns: -1 if the CPU does not support @impl, 0 otherwise
+ */
+int fat_scan_select(enum fat_scan_impl impl);
+
+/*
+ * Name of the implementation currently in use
+ */
+const char* fat_scan_name();
+
+#endif
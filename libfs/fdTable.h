@@ -1,77 +1,108 @@
-
-#ifndef FDTABLE_H_
-#define FDTABLE_H_
-
-#include <stdbool.h>
-#include <stddef.h>
-#include <stdint.h>
-#include "fs.h"
-#include "disk.h"
-
-/** Maximum filename length (including the NULL character) */
-#ifndef FS_FILENAME_LEN
-#define FS_FILENAME_LEN 16
-#endif
-
-/** Maximum number of files in the root directory */
-#ifndef FS_FILE_MAX_COUNT
-#define FS_FILE_MAX_COUNT 128
-#endif
-
-
-/** Maximum number of open files */
-#ifndef FS_OPEN_MAX_COUNT
-#define FS_OPEN_MAX_COUNT 32
-#endif
-
-/*
- * fdNode is a data structure that represents a fd entry.
- */
-struct fdNode{
-    /*
-     * Whether is fdNode is in use
-     */
-    bool in_use;
-    char* filename;
-
-    /*
-     * The entry index of the file in the directory
-     */
-    size_t dir_entry_index;
-
-    size_t size;
-    size_t offset;
-
-    /*
-     * The first data block of the file. Is FAT_EOC if file has no data blocks.
-     */
-    size_t first_data_block;
-};
-
-struct fdTable{
-    struct fdNode* fdTable[FS_OPEN_MAX_COUNT];
-
-   /*
-    * Number of slots in fdTable occupied
-    */
-    size_t fdsOccupied;
-};
-
-struct fdNode* getFdEntry(struct fdTable*,int fd);
-bool isOpenByFd(struct fdTable*,int fd);
-
-bool isOpenByName(struct fdTable* fdTable,char* filename);
-
-bool table_is_full(struct fdTable*);
-
-struct fdTable* fd_table_constructor();
-void fdTable_destructor(struct fdTable*);
-
-struct fdNode* fdNode_constructor();
-void fdNode_destructor(struct fdNode*);
-
-int addFd(struct fdTable*,char* filename);
-void removeFd(struct fdTable*,int fd);
-
-
-#endif
+
+#ifndef FDTABLE_H_
+#define FDTABLE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "fs.h"
+#include "disk.h"
+
+/** Maximum filename length (including the NULL character) */
+#ifndef FS_FILENAME_LEN
+#define FS_FILENAME_LEN 16
+#endif
+
+/** Maximum number of files in the root directory */
+#ifndef FS_FILE_MAX_COUNT
+#define FS_FILE_MAX_COUNT 128
+#endif
+
+
+/** Maximum number of open files */
+#ifndef FS_OPEN_MAX_COUNT
+#define FS_OPEN_MAX_COUNT 32
+#endif
+
+struct directory;
+struct compress_cache;
+
+/*
+ * fdNode is a data structure that represents a fd entry.
+ */
+struct fdNode{
+    /*
+     * Whether is fdNode is in use
+     */
+    bool in_use;
+    char* filename;
+
+    /*
+     * The directory holding the file, and the index of its entry there
+     */
+    struct directory* directory;
+    size_t dir_entry_index;
+
+    size_t size;
+    size_t offset;
+
+    /*
+     * The first data block of the file. Is FAT_EOC if file has no data blocks.
+     */
+    size_t first_data_block;
+
+    /*
+     * Chain cache, so that sequential access and appends do not walk the
+     * chain from its start: block cursor_index of the file is data block
+     * cursor_block, and the chain has chain_blocks blocks ending at
+     * last_block. chain_blocks is 0 when unknown.
+     */
+    size_t cursor_index;
+    size_t cursor_block;
+    size_t chain_blocks;
+    size_t last_block;
+
+    /*
+     * Set by fs_write(), so that fs_close() packs the tail of the file
+     */
+    bool written;
+
+    /*
+     * Unit table and last unit decompressed of a compressed file, NULL
+     * until it is read, see compress.h
+     */
+    struct compress_cache* unit_cache;
+};
+
+struct fdTable{
+    struct fdNode* fdTable[FS_OPEN_MAX_COUNT];
+
+   /*
+    * Number of slots in fdTable occupied
+    */
+    size_t fdsOccupied;
+};
+
+struct fdNode* getFdEntry(struct fdTable*,int fd);
+bool isOpenByFd(struct fdTable*,int fd);
+
+bool isOpenByName(struct fdTable* fdTable,char* filename);
+
+/*
+ * Whether the file of entry @dir_entry_index of @directory is open
+ */
+bool isOpenByEntry(struct fdTable* fdTable,struct directory* directory,size_t dir_entry_index);
+
+bool table_is_full(struct fdTable*);
+
+struct fdTable* fd_table_constructor();
+void fdTable_destructor(struct fdTable*);
+
+struct fdNode* fdNode_constructor();
+void fdNode_destructor(struct fdNode*);
+
+int addFd(struct fdTable*,char* filename);
+void removeFd(struct fdTable*,int fd);
+
+
+#endif
@@ -0,0 +1,859 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "blockChecksum.h"
+#include "directory.h"
+#include "disk.h"
+#include "fragment.h"
+#include "fs.h"
+#include "journal.h"
+#include "metadata.h"
+#include "snapshot.h"
+#include "reflink.h"
+
+/* known blocks looked at for room before a new fragment block is taken */
+#define FRAGMENT_SCAN_BLOCKS 64
+
+/*
+ * Blocks a fragment operation dirties at most: the fragment blocks it
+ * takes slots from and gives them back to, a directory block and a FAT
+ * block, each of them twice when a fragment grows out of its block
+ */
+#define FRAGMENT_TRANSACTION_BLOCKS 8
+
+struct known_block{
+    /* data block index */
+    size_t block;
+    /* cached copy, attached to the metadata cache */
+    uint8_t* copy;
+};
+
+static bool enabled = false;
+
+/* bytes per slot of the mounted disk */
+static size_t slot_size = 0;
+
+/* fragment blocks used this mount */
+static struct known_block* known = NULL;
+static size_t known_count = 0;
+static size_t known_capacity = 0;
+
+/* block the last fragment went in, tried first, FAT_EOC if none */
+static size_t fill = 0;
+
+/* where looking for room in the other known blocks goes on from */
+static size_t scan_hint = 0;
+
+/* known blocks left empty by the running operation */
+static size_t* emptied = NULL;
+static size_t emptied_count = 0;
+static size_t emptied_capacity = 0;
+
+static inline size_t slots_for(size_t length){
+    return (length + sizeof(struct FragmentOwner) + slot_size - 1) / slot_size;
+}
+
+static inline uint64_t slot_mask(size_t slot, size_t count){
+    return (((uint64_t)1 << count) - 1) << slot;
+}
+
+static inline struct FragmentOwner* owner_at(uint8_t* copy, size_t slot){
+    return (struct FragmentOwner*)&copy[slot * slot_size];
+}
+
+static inline uint8_t* data_at(uint8_t* copy, size_t slot){
+    return &copy[slot * slot_size + sizeof(struct FragmentOwner)];
+}
+
+/*
+ * Bytes of the tail of a file of @size bytes, 0 for an empty file
+ */
+static size_t tail_length(size_t size){
+    if(size==0){
+        return 0;
+    }
+
+    return size - ((total_block_size(size) - 1) << block_shift);
+}
+
+static int add_known(size_t block, uint8_t* copy){
+    if(known_count==known_capacity){
+        size_t capacity = known_capacity==0 ? 16 : 2 * known_capacity;
+
+        struct known_block* grown = (struct known_block*)realloc(known,
+                capacity * sizeof(struct known_block));
+
+        if(grown==NULL){
+            return -1;
+        }
+
+        known = grown;
+        known_capacity = capacity;
+    }
+
+    known[known_count].block = block;
+    known[known_count].copy = copy;
+    known_count++;
+
+    return 0;
+}
+
+static void forget_known(size_t block){
+    for(size_t i = 0; i < known_count; i++){
+        if(known[i].block==block){
+            known[i] = known[--known_count];
+            return;
+        }
+    }
+}
+
+/*
+ * Returns the cached copy of fragment block @block, reading and attaching
+ * it the first time
+ *
+ * Returns: NULL if @block is not a fragment block
+ */
+static uint8_t* load_block(size_t block){
+    if(block==0 || block >= data_blocks || get_fat_entry(block)!=FAT_EOC){
+        return NULL;
+    }
+
+    size_t disk_block = get_actual_block_index(block);
+
+    uint8_t* copy = metadata_block(disk_block);
+
+    if(copy==NULL){
+        copy = (uint8_t*)malloc(block_size);
+
+        if(copy==NULL){
+            return NULL;
+        }
+
+        //journaled, see blockChecksum.h
+        checksums_exclude(disk_block);
+
+        if(snapshot_read(disk_block, copy)
+                || memcmp(copy, FRAGMENT_SIGNATURE, 8)!=0){
+            checksums_include(disk_block);
+            free(copy);
+            return NULL;
+        }
+
+        if(add_known(block, copy)){
+            free(copy);
+            return NULL;
+        }
+
+        if(metadata_attach(disk_block, copy)){
+            forget_known(block);
+            free(copy);
+            return NULL;
+        }
+    }
+
+    //an attached directory block is no fragment block
+    struct FragmentHeader* header = (struct FragmentHeader*)copy;
+
+    if(memcmp(header->signature, FRAGMENT_SIGNATURE, 8)!=0 || (header->used & 1)==0){
+        return NULL;
+    }
+
+    return copy;
+}
+
+/*
+ * Returns the fragment at @slot of fragment block @block, if it holds
+ * @length bytes
+ *
+ * Returns: its data, NULL if there is no such fragment
+ */
+static uint8_t* fragment_at(size_t block, size_t slot, size_t length){
+    uint8_t* copy = load_block(block);
+
+    if(copy==NULL || slot==0 || slot >= FRAGMENT_SLOTS){
+        return NULL;
+    }
+
+    struct FragmentHeader* header = (struct FragmentHeader*)copy;
+    struct FragmentOwner* owner = owner_at(copy, slot);
+
+    if(owner->slots==0 || slot + owner->slots > FRAGMENT_SLOTS
+            || owner->slots < slots_for(length)
+            || (header->used & slot_mask(slot, owner->slots))!=slot_mask(slot, owner->slots)){
+        return NULL;
+    }
+
+    return data_at(copy, slot);
+}
+
+/*
+ * Takes a new fragment block, with no slot in use but the header
+ *
+ * Returns: 0 on success, -1 if the disk is full
+ */
+static int new_block(size_t* block){
+    size_t data_block;
+
+    if(first_block_available(&data_block)==false){
+        return -1;
+    }
+
+    size_t disk_block = get_actual_block_index(data_block);
+
+    uint8_t* copy = (uint8_t*)calloc(1, block_size);
+
+    if(copy==NULL){
+        return -1;
+    }
+
+    if(add_known(data_block, copy)){
+        free(copy);
+        return -1;
+    }
+
+    if(metadata_attach(disk_block, copy)){
+        forget_known(data_block);
+        free(copy);
+        return -1;
+    }
+
+    checksums_exclude(disk_block);
+
+    struct FragmentHeader* header = (struct FragmentHeader*)copy;
+
+    memcpy(header->signature, FRAGMENT_SIGNATURE, 8);
+    header->used = 1;
+
+    set_fat_entry(data_block, FAT_EOC);
+
+    metadata_dirty(disk_block);
+
+    *block = data_block;
+
+    return 0;
+}
+
+/*
+ * Marks the first run of @count free slots of known block @copy used
+ *
+ * Returns: 0 and fills @slot on success, -1 if there is no such run
+ */
+static int take_slots(uint8_t* copy, size_t count, size_t* slot){
+    struct FragmentHeader* header = (struct FragmentHeader*)copy;
+
+    if((size_t)__builtin_popcountll(~header->used) < count){
+        return -1;
+    }
+
+    for(size_t start = 1; start + count <= FRAGMENT_SLOTS; start++){
+        if((header->used & slot_mask(start, count))==0){
+            header->used |= slot_mask(start, count);
+            *slot = start;
+
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Allocates a fragment of @count slots owned by entry @block_entry of
+ * directory block @directory_block, in any known block but @avoid, or in
+ * a new one if @may_grow
+ *
+ * Returns: 0 and fills @block and @slot on success, -1 otherwise
+ */
+static int alloc_fragment(size_t count, size_t directory_block, size_t block_entry,
+        size_t avoid, bool may_grow, size_t* block, size_t* slot){
+
+    uint8_t* copy = NULL;
+
+    if(fill!=FAT_EOC && fill!=avoid){
+        copy = metadata_block(get_actual_block_index(fill));
+
+        if(copy!=NULL && take_slots(copy, count, slot)==0){
+            *block = fill;
+        } else {
+            copy = NULL;
+        }
+    }
+
+    for(size_t i = 0; copy==NULL && i < known_count && i < FRAGMENT_SCAN_BLOCKS; i++){
+        size_t candidate = (scan_hint + i) % known_count;
+
+        if(known[candidate].block!=avoid && take_slots(known[candidate].copy, count, slot)==0){
+            copy = known[candidate].copy;
+            *block = known[candidate].block;
+
+            scan_hint = candidate;
+        }
+    }
+
+    if(copy==NULL){
+        if(!may_grow || new_block(block)){
+            return -1;
+        }
+
+        copy = metadata_block(get_actual_block_index(*block));
+
+        take_slots(copy, count, slot);
+    }
+
+    fill = *block;
+
+    struct FragmentOwner* owner = owner_at(copy, *slot);
+
+    owner->directoryBlock = (uint32_t)directory_block;
+    owner->entryIndex = (uint16_t)block_entry;
+    owner->slots = (uint16_t)count;
+
+    metadata_dirty(get_actual_block_index(*block));
+
+    return 0;
+}
+
+/*
+ * Grows the fragment at @slot of @copy to @count slots if the slots past
+ * it are free
+ *
+ * Returns: true if it holds @count slots now
+ */
+static bool grow_fragment(uint8_t* copy, size_t slot, size_t count){
+    struct FragmentHeader* header = (struct FragmentHeader*)copy;
+    struct FragmentOwner* owner = owner_at(copy, slot);
+
+    if(owner->slots >= count){
+        return true;
+    }
+
+    if(slot + count > FRAGMENT_SLOTS){
+        return false;
+    }
+
+    uint64_t added = slot_mask(slot + owner->slots, count - owner->slots);
+
+    if((header->used & added)!=0){
+        return false;
+    }
+
+    header->used |= added;
+    owner->slots = (uint16_t)count;
+
+    return true;
+}
+
+/*
+ * Returns the last block of the chain of @entry, and fills @previous with
+ * the one before, FAT_EOC if the chain is a single block
+ */
+static size_t tail_of(const struct DirEntry* entry, size_t* previous){
+    size_t blocks = total_block_size((size_t)dir_entry_size(entry));
+    size_t block = dir_entry_first_block(entry);
+
+    *previous = FAT_EOC;
+
+    for(size_t i = 1; i < blocks; i++){
+        if(block==0 || block >= data_blocks){
+            return FAT_EOC;
+        }
+
+        *previous = block;
+        block = get_fat_entry(block);
+    }
+
+    return block;
+}
+
+/*
+ * Makes @block the last block of the chain of @entry, after @previous
+ */
+static void link_tail(struct DirEntry* entry, size_t previous, size_t block){
+    if(previous==FAT_EOC){
+        dir_entry_set_first_block(entry, block);
+    } else {
+        set_fat_entry(previous, (uint32_t)block);
+    }
+}
+
+/*
+ * Open descriptors of the file of @entry see its new chain
+ */
+static void tail_moved(const struct DirEntry* entry){
+    for(int i = 0; fd_table!=NULL && i < FS_OPEN_MAX_COUNT; i++){
+        struct fdNode* fd = fd_table->fdTable[i];
+
+        if(!fd->in_use || dir_entry(fd->directory, fd->dir_entry_index)!=entry){
+            continue;
+        }
+
+        fd->first_data_block = dir_entry_first_block(entry);
+        fd->cursor_index = 0;
+        fd->cursor_block = FAT_EOC;
+        fd->chain_blocks = 0;
+        fd->last_block = FAT_EOC;
+    }
+}
+
+static void mark_emptied(size_t block){
+    for(size_t i = 0; i < emptied_count; i++){
+        if(emptied[i]==block){
+            return;
+        }
+    }
+
+    if(emptied_count==emptied_capacity){
+        size_t capacity = emptied_capacity==0 ? 16 : 2 * emptied_capacity;
+
+        size_t* grown = (size_t*)realloc(emptied, capacity * sizeof(size_t));
+
+        //left in use, fs_check() frees it once nothing refers to it
+        if(grown==NULL){
+            return;
+        }
+
+        emptied = grown;
+        emptied_capacity = capacity;
+    }
+
+    emptied[emptied_count++] = block;
+}
+
+/*
+ * Moves the fragment at @slot of sparse block @block to another known
+ * block, if its directory entry is cached
+ *
+ * Returns: 0 on success, -1 if it stays
+ */
+static int move_fragment(size_t block, uint8_t* copy, size_t slot){
+    struct FragmentOwner* owner = owner_at(copy, slot);
+
+    size_t directory_block = owner->directoryBlock;
+    size_t block_entry = owner->entryIndex;
+    size_t count = owner->slots;
+
+    //subdirectories that were not walked into are not cached
+    uint8_t* directory = directory_block < root_directory_index ? NULL
+                                                                : metadata_block(directory_block);
+
+    if(directory==NULL || block_entry >= block_size / volume.entry_size){
+        return -1;
+    }
+
+    struct DirEntry* entry = (struct DirEntry*)(directory + block_entry * volume.entry_size);
+
+    size_t previous;
+
+    if(!dir_entry_is_packed(entry) || dir_entry_is_directory(entry)
+            || dir_entry_fragment(entry)!=slot || tail_of(entry, &previous)!=block){
+        return -1;
+    }
+
+    //the move goes in one transaction
+    if(metadata_reserve(FRAGMENT_TRANSACTION_BLOCKS)){
+        return -1;
+    }
+
+    size_t to_block, to_slot;
+
+    if(alloc_fragment(count, directory_block, block_entry, block, false, &to_block, &to_slot)){
+        return -1;
+    }
+
+    uint8_t* to_copy = metadata_block(get_actual_block_index(to_block));
+
+    memcpy(data_at(to_copy, to_slot), data_at(copy, slot),
+            count * slot_size - sizeof(struct FragmentOwner));
+
+    ((struct FragmentHeader*)copy)->used &= ~slot_mask(slot, count);
+    memset(owner, 0, sizeof(struct FragmentOwner));
+
+    metadata_dirty(get_actual_block_index(block));
+
+    link_tail(entry, previous, to_block);
+    dir_entry_set_fragment(entry, true, to_slot);
+
+    metadata_dirty(directory_block);
+
+    tail_moved(entry);
+
+    return 0;
+}
+
+/*
+ * Moves every fragment of sparse block @block elsewhere, stopping at the
+ * first one that cannot be moved
+ */
+static void compact(size_t block, uint8_t* copy){
+    struct FragmentHeader* header = (struct FragmentHeader*)copy;
+
+    size_t slot = 1;
+
+    while(slot < FRAGMENT_SLOTS){
+        if(((header->used >> slot) & 1)==0){
+            slot++;
+            continue;
+        }
+
+        size_t count = owner_at(copy, slot)->slots;
+
+        if(count==0 || slot + count > FRAGMENT_SLOTS || move_fragment(block, copy, slot)){
+            return;
+        }
+
+        slot += count;
+    }
+}
+
+/*
+ * Frees the fragment at @slot of fragment block @block, then frees or
+ * compacts the block if that left it empty or sparse
+ */
+static void free_fragment(size_t block, size_t slot){
+    uint8_t* copy = metadata_block(get_actual_block_index(block));
+
+    struct FragmentHeader* header = (struct FragmentHeader*)copy;
+    struct FragmentOwner* owner = owner_at(copy, slot);
+
+    header->used &= ~slot_mask(slot, owner->slots);
+    memset(owner, 0, sizeof(struct FragmentOwner));
+
+    metadata_dirty(get_actual_block_index(block));
+
+    size_t used = (size_t)__builtin_popcountll(header->used) - 1;
+
+    if(used > 0 && used <= FRAGMENT_COMPACT_SLOTS && block!=fill){
+        compact(block, copy);
+    }
+
+    if(header->used==1){
+        mark_emptied(block);
+    }
+}
+
+int fragment_load(){
+    fragment_unload();
+
+    enabled = (volume.features & FS_FEATURE_TAIL_PACKING)!=0;
+    slot_size = block_size / FRAGMENT_SLOTS;
+
+    return 0;
+}
+
+void fragment_unload(){
+    for(size_t i = 0; i < known_count; i++){
+        size_t disk_block = get_actual_block_index(known[i].block);
+
+        metadata_detach(disk_block);
+        checksums_include(disk_block);
+
+        free(known[i].copy);
+    }
+
+    free(known);
+    free(emptied);
+
+    known = NULL;
+    known_count = 0;
+    known_capacity = 0;
+
+    emptied = NULL;
+    emptied_count = 0;
+    emptied_capacity = 0;
+
+    enabled = false;
+    fill = FAT_EOC;
+    scan_hint = 0;
+}
+
+bool fragment_enabled(){
+    return enabled;
+}
+
+size_t fragment_max_bytes(){
+    return FRAGMENT_MAX_SLOTS * slot_size - sizeof(struct FragmentOwner);
+}
+
+uint8_t* fragment_tail(const struct DirEntry* entry, size_t block){
+    return fragment_at(block, dir_entry_fragment(entry),
+            tail_length((size_t)dir_entry_size(entry)));
+}
+
+bool fragment_valid(size_t block, size_t slot, size_t length){
+    return fragment_at(block, slot, length)!=NULL;
+}
+
+bool fragment_can_write(struct fdNode* fd, size_t end_offset){
+    if(!enabled){
+        return false;
+    }
+
+    size_t size = end_offset > fd->size ? end_offset : fd->size;
+
+    if(size > fragment_max_bytes()){
+        return false;
+    }
+
+    if(fd->first_data_block==FAT_EOC){
+        return true;
+    }
+
+    return dir_entry_is_packed(dir_entry(fd->directory, fd->dir_entry_index));
+}
+
+int fragment_write(struct fdNode* fd, const uint8_t* data, size_t count){
+    struct DirEntry* entry = dir_entry(fd->directory, fd->dir_entry_index);
+
+    size_t end_offset = fd->offset + count;
+    size_t size = end_offset > fd->size ? end_offset : fd->size;
+    size_t slots = slots_for(size);
+
+    size_t directory_block, block_entry;
+
+    dir_entry_home(fd->directory, fd->dir_entry_index, &directory_block, &block_entry);
+
+    if(metadata_reserve(FRAGMENT_TRANSACTION_BLOCKS)){
+        return -1;
+    }
+
+    size_t block = FAT_EOC;
+    size_t slot = 0;
+    uint8_t* tail = NULL;
+
+    if(dir_entry_is_packed(entry)){
+        block = dir_entry_first_block(entry);
+        slot = dir_entry_fragment(entry);
+
+        tail = fragment_at(block, slot, fd->size);
+
+        if(tail==NULL){
+            return -1;
+        }
+    }
+
+    bool moved = false;
+
+    if(tail==NULL || !grow_fragment(metadata_block(get_actual_block_index(block)), slot, slots)){
+        size_t to_block, to_slot;
+
+        if(alloc_fragment(slots, directory_block, block_entry, FAT_EOC, true,
+                &to_block, &to_slot)){
+            return -1;
+        }
+
+        uint8_t* to_tail = data_at(metadata_block(get_actual_block_index(to_block)), to_slot);
+
+        dir_entry_set_first_block(entry, to_block);
+        dir_entry_set_fragment(entry, true, to_slot);
+
+        //the entry points to the new fragment before the old one is freed,
+        //so that compacting the old block leaves it alone
+        if(tail!=NULL){
+            memcpy(to_tail, tail, fd->size);
+
+            free_fragment(block, slot);
+        }
+
+        block = to_block;
+        tail = to_tail;
+        moved = true;
+    }
+
+    memcpy(&tail[fd->offset], data, count);
+
+    metadata_dirty(get_actual_block_index(block));
+
+    fd->offset = end_offset;
+    fd->size = size;
+
+    dir_entry_set_size(entry, size);
+
+    dir_update(fd->directory, fd->dir_entry_index);
+
+    if(moved){
+        tail_moved(entry);
+    }
+
+    return (int)count;
+}
+
+int fragment_unpack(struct fdNode* fd){
+    struct DirEntry* entry = dir_entry(fd->directory, fd->dir_entry_index);
+
+    if(!dir_entry_is_packed(entry)){
+        return 0;
+    }
+
+    size_t size = (size_t)dir_entry_size(entry);
+    size_t blocks = total_block_size(size);
+
+    size_t previous = blocks > 1 ? file_block(fd, blocks - 2) : FAT_EOC;
+    size_t block = previous==FAT_EOC ? dir_entry_first_block(entry) : get_fat_entry(previous);
+    size_t slot = dir_entry_fragment(entry);
+
+    uint8_t* tail = fragment_at(block, slot, tail_length(size));
+
+    if(tail==NULL || metadata_reserve(FRAGMENT_TRANSACTION_BLOCKS)){
+        return -1;
+    }
+
+    size_t to_block;
+
+    if(first_block_available(&to_block)==false){
+        return -1;
+    }
+
+    init_bounce_buffer();
+    clear_bounce_buffer();
+
+    memcpy(bounce_buffer, tail, tail_length(size));
+
+    if(block_write(get_actual_block_index(to_block), bounce_buffer)){
+        return -1;
+    }
+
+    set_fat_entry(to_block, FAT_EOC);
+
+    link_tail(entry, previous, to_block);
+    dir_entry_set_fragment(entry, false, 0);
+
+    dir_update(fd->directory, fd->dir_entry_index);
+
+    free_fragment(block, slot);
+
+    tail_moved(entry);
+
+    return 0;
+}
+
+int fragment_pack(struct fdNode* fd){
+    if(!enabled){
+        return 0;
+    }
+
+    struct DirEntry* entry = dir_entry(fd->directory, fd->dir_entry_index);
+
+    size_t size = (size_t)dir_entry_size(entry);
+
+    //files marked compressed are compressed instead
+    if(dir_entry_is_packed(entry) || dir_entry_is_directory(entry)
+            || dir_entry_is_inline(entry) || dir_entry_compress(entry) || size==0
+            || tail_length(size) > fragment_max_bytes()){
+        return 0;
+    }
+
+    size_t blocks = total_block_size(size);
+
+    size_t previous = blocks > 1 ? file_block(fd, blocks - 2) : FAT_EOC;
+    size_t block = previous==FAT_EOC ? dir_entry_first_block(entry) : get_fat_entry(previous);
+
+    //a tail reflinked files share stays where it is
+    if(block==FAT_EOC || reflink_shared(block) || metadata_reserve(FRAGMENT_TRANSACTION_BLOCKS)){
+        return 0;
+    }
+
+    init_bounce_buffer();
+    clear_bounce_buffer();
+
+    if(block_read(get_actual_block_index(block), bounce_buffer)){
+        return -1;
+    }
+
+    size_t directory_block, block_entry;
+
+    dir_entry_home(fd->directory, fd->dir_entry_index, &directory_block, &block_entry);
+
+    size_t to_block, to_slot;
+
+    //a full disk leaves the tail where it is
+    if(alloc_fragment(slots_for(tail_length(size)), directory_block, block_entry,
+            FAT_EOC, true, &to_block, &to_slot)){
+        return 0;
+    }
+
+    memcpy(data_at(metadata_block(get_actual_block_index(to_block)), to_slot),
+            bounce_buffer, tail_length(size));
+
+    link_tail(entry, previous, to_block);
+    dir_entry_set_fragment(entry, true, to_slot);
+
+    dir_update(fd->directory, fd->dir_entry_index);
+
+    set_fat_entry(block, 0);
+
+    tail_moved(entry);
+
+    return 0;
+}
+
+void fragment_erase(struct DirEntry* entry){
+    if(!dir_entry_is_packed(entry)){
+        return;
+    }
+
+    size_t previous;
+    size_t block = tail_of(entry, &previous);
+    size_t slot = dir_entry_fragment(entry);
+
+    metadata_reserve(FRAGMENT_TRANSACTION_BLOCKS);
+
+    bool valid = fragment_at(block, slot, tail_length((size_t)dir_entry_size(entry)))!=NULL;
+
+    link_tail(entry, previous, FAT_EOC);
+    dir_entry_set_fragment(entry, false, 0);
+
+    if(valid){
+        free_fragment(block, slot);
+    }
+}
+
+int fragment_release(){
+    if(emptied_count==0){
+        return 0;
+    }
+
+    size_t released = 0;
+
+    //blocks may have taken new fragments since they were emptied
+    for(size_t i = 0; i < emptied_count; i++){
+        uint8_t* copy = metadata_block(get_actual_block_index(emptied[i]));
+
+        if(copy==NULL || ((struct FragmentHeader*)copy)->used!=1){
+            continue;
+        }
+
+        set_fat_entry(emptied[i], 0);
+
+        if(fill==emptied[i]){
+            fill = FAT_EOC;
+        }
+
+        emptied[released++] = emptied[i];
+    }
+
+    emptied_count = 0;
+
+    int ret = 0;
+
+    //see fs_rmdir()
+    if(released!=0 && (metadata_commit() || journal_checkpoint())){
+        ret = -1;
+    }
+
+    for(size_t i = 0; i < released; i++){
+        size_t disk_block = get_actual_block_index(emptied[i]);
+
+        uint8_t* copy = metadata_block(disk_block);
+
+        metadata_detach(disk_block);
+        checksums_include(disk_block);
+
+        forget_known(emptied[i]);
+
+        free(copy);
+    }
+
+    scan_hint = 0;
+
+    return ret;
+}
@@ -0,0 +1,147 @@
+#ifndef FRAGMENT_H_
+#define FRAGMENT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "disk.h"
+#include "fdTable.h"
+
+/*
+ * Tail packing, on disks formatted with FS_FEATURE_TAIL_PACKING.
+ *
+ * The content of a small file, or the last, partial block of a larger one,
+ * goes in a fragment: a run of slots of a fragment block shared with other
+ * files. The fragment block is the last link of the file's chain, so that
+ * chains keep one block per started block of the file, and the entry is
+ * marked DIR_ATTR_PACKED with the first slot of the fragment.
+ *
+ * A fragment block is cut in FRAGMENT_SLOTS slots. Slot 0 holds a
+ * FragmentHeader, whose bitmap tells the slots in use. Every fragment
+ * starts with a FragmentOwner telling the directory entry it belongs to,
+ * so that fragments can be moved: when freeing a fragment leaves its block
+ * with FRAGMENT_COMPACT_SLOTS slots in use or fewer, the other fragments
+ * are moved to blocks with room and the block is freed.
+ *
+ * Fragment blocks are attached to the metadata cache the first time they
+ * are used, and journaled with the FAT and the directories, so a packed
+ * file costs no data block I/O once its fragment block is cached, and the
+ * header, the entries and the fragments always agree after a crash. Like
+ * directory blocks, they are left out of block checksums.
+ *
+ * Files are written the usual way: a write that would take a packed file
+ * past FRAGMENT_MAX_SLOTS slots first moves its tail to a block of its
+ * own, and fs_close() packs the tail again. Files that fit in a fragment
+ * are written in it directly.
+ */
+
+#define FRAGMENT_SIGNATURE "ECS150FR"
+
+/* slots per fragment block, one bit each in FragmentHeader.used */
+#define FRAGMENT_SLOTS 64
+
+/* largest fragment, a quarter of a block */
+#define FRAGMENT_MAX_SLOTS 16
+
+/* fragment blocks this sparse are emptied into others */
+#define FRAGMENT_COMPACT_SLOTS 16
+
+struct __attribute__((__packed__)) FragmentHeader{
+    uint8_t signature[8];
+    /* bit n set when slot n is in use, slot 0 being the header */
+    uint64_t used;
+};
+
+struct __attribute__((__packed__)) FragmentOwner{
+    /* disk block of the directory entry of the file, and its index there */
+    uint32_t directoryBlock;
+    uint16_t entryIndex;
+    /* slots the fragment takes, this record included */
+    uint16_t slots;
+};
+
+/*
+ * Starts packing tails if the mounted disk was formatted for it
+ *
+ * Returns: 0 on success, -1 otherwise
+ */
+int fragment_load();
+
+/*
+ * Drops the fragment blocks, after the metadata cache was unloaded
+ */
+void fragment_unload();
+
+/*
+ * Returns: true if the mounted disk packs tails
+ */
+bool fragment_enabled();
+
+/*
+ * Returns: the largest tail packed, in bytes
+ */
+size_t fragment_max_bytes();
+
+/*
+ * Returns the tail of packed entry @entry, whose fragment block is data
+ * block @block, reading the block if it was not used yet
+ *
+ * Returns: NULL if @block is not a fragment block or the slot of @entry
+ * is not a fragment holding its tail
+ */
+uint8_t* fragment_tail(const struct DirEntry* entry, size_t block);
+
+/*
+ * Returns: true if a write of the file of @fd up to @end_offset would
+ * fit a fragment, so that fragment_write() can take it
+ */
+bool fragment_can_write(struct fdNode* fd, size_t end_offset);
+
+/*
+ * Writes @count bytes of @data at the offset of @fd, in the fragment of
+ * the file, which is allocated or grown first
+ *
+ * Returns: @count, or -1 if no fragment could be allocated, in which case
+ * nothing was changed
+ */
+int fragment_write(struct fdNode* fd, const uint8_t* data, size_t count);
+
+/*
+ * Moves the packed tail of the file of @fd, if any, to a block of its own
+ *
+ * Returns: 0 on success, -1 if the disk is full
+ */
+int fragment_unpack(struct fdNode* fd);
+
+/*
+ * Moves the tail of the file of @fd, if it is short enough, from its last
+ * block to a fragment, and frees the block
+ *
+ * Returns: 0 if the tail was packed or stays where it is, -1 on an I/O
+ * error
+ */
+int fragment_pack(struct fdNode* fd);
+
+/*
+ * Frees the fragment of @entry, about to be erased, and cuts it from its
+ * chain. Does nothing if @entry is not packed.
+ */
+void fragment_erase(struct DirEntry* entry);
+
+/*
+ * Called at the end of every operation that may free fragments. Frees
+ * the fragment blocks left empty, checkpointing the journal first so that
+ * replaying it cannot write them over the files that reuse them.
+ *
+ * Returns: 0 on success, -1 if the journal could not be written
+ */
+int fragment_release();
+
+/*
+ * Returns: true if @slot of fragment block @block starts a fragment able
+ * to hold @length bytes, for fs_check()
+ */
+bool fragment_valid(size_t block, size_t slot, size_t length);
+
+#endif
@@ -5,10 +5,23 @@
 #include <string.h>
 #include <stdbool.h>
 #include <fcntl.h>
-#include <stdint.h>
+#include <limits.h>
 
 #include "disk.h"
 #include "fs.h"
+#include "stats.h"
+#include "fatScan.h"
+#include "directory.h"
+#include "dentryCache.h"
+#include "metadata.h"
+#include "journal.h"
+#include "fsCheck.h"
+#include "blockChecksum.h"
+#include "fragment.h"
+#include "snapshot.h"
+#include "reflink.h"
+#include "dedup.h"
+#include "compress.h"
 
 /*
  * These 4 variables can be assigned in fs_mount
@@ -23,407 +36,1036 @@ size_t data_blocks=0;
 
 struct DiskMetadata* diskMetadata = NULL;
 
-bool isValidFileName(const char *filename);
+struct volume_layout volume;
 
-bool isValidMetadata();
+/* a snapshot is mounted, which nothing may change */
+static bool read_only = false;
 
-int fs_mount(const char *diskname)
-{
-    int ret = block_disk_open(diskname);
+/*
+ * Directories open with fs_opendir(): the directory, NULL once it was
+ * removed, and the index fs_readdir() goes on from
+ */
+struct dir_stream{
+    bool open;
+    struct directory* dir;
+    size_t next;
+};
 
-    if(ret != 0){
-        return ret;
-    }
+static struct dir_stream dir_streams[FS_DIR_OPEN_MAX_COUNT];
 
-    init_bounce_buffer();
-    clear_bounce_buffer();
+/*
+ * Used by fs_mount()
+ */
+static const struct fs_mount_options default_mount_options = {
+    .durability = FS_DURABILITY_METADATA,
+    .verify = FS_VERIFY_SAMPLED,
+};
 
-    ret = block_read(SUPERBLOCK_INDEX, bounce_buffer);
+bool isValidFileName(const char *filename);
 
-    if(ret != 0){
-        block_disk_close();
-        return ret;
+bool isValidMetadata();
+
+/*
+ * Returns: @path without its leading '/', the key of the dentry cache,
+ * NULL if it is empty or longer than FS_PATH_MAX_LEN allows
+ */
+static const char* path_key(const char* path){
+    if(path==NULL){
+        return NULL;
     }
 
-    diskMetadata = (struct DiskMetadata*)calloc(1,sizeof(struct DiskMetadata));
+    if(path[0]=='/'){
+        path++;
+    }
 
-    memcpy(diskMetadata, bounce_buffer, sizeof(struct DiskMetadata));
+    size_t length = strnlen(path, FS_PATH_MAX_LEN);
 
-    if(isValidMetadata() == false){
+    if(length==0 || length==FS_PATH_MAX_LEN){
+        return NULL;
+    }
 
-        block_disk_close();
+    return path;
+}
 
-        free(diskMetadata);
-        diskMetadata=NULL;
+/*
+ * Finds the entry path @key leads to, from the dentry cache or by
+ * walking it from the root, and caches the result. Subdirectories are
+ * read the first time a walk goes through them.
+ *
+ * Returns: 0 and fills @dir and @entry_index if it exists, -1 otherwise
+ */
+static int resolve(const char* key, struct directory** dir, size_t* entry_index){
+    int cached = dentry_lookup(key, dir, entry_index);
 
-        return -1;
+    if(cached!=-1){
+        return cached==1 ? 0 : -1;
     }
 
-    disk_mounted = true;
+    char name[FS_FILENAME_LEN];
 
-    root_directory_index = diskMetadata->rootDirectoryIndex;
+    struct directory* current = dir_root();
+    const char* component = key;
 
-    data_blocks=diskMetadata->totalDataBlocks;
+    while(1){
+        const char* slash = strchr(component, '/');
+        size_t length = slash==NULL ? strlen(component) : (size_t)(slash - component);
 
-    fd_table = fd_table_constructor();
+        if(length==0 || length >= FS_FILENAME_LEN){
+            return -1;
+        }
 
-    return 0;
-}
+        memcpy(name, component, length);
+        name[length] = '\0';
 
-int fs_umount(void)
-{
-    int close_status = block_disk_close();
+        int found = dir_lookup(current, name);
 
-    if(close_status==0){
+        if(found==-1){
+            dentry_add(key, NULL, 0);
+            return -1;
+        }
 
-        free(diskMetadata);
-        diskMetadata=NULL;
+        if(slash==NULL){
+            *dir = current;
+            *entry_index = (size_t)found;
 
-        fdTable_destructor(fd_table);
-        fd_table=NULL;
+            dentry_add(key, current, (size_t)found);
 
-        disk_mounted = false;
-        root_directory_index=0;
-        data_blocks=0;
-    }
+            return 0;
+        }
 
-    return close_status;
-}
+        //a file, or a directory whose chain is broken
+        current = dir_child(current, (size_t)found);
 
-int fs_info(void)
-{
-    if(disk_mounted==false){
-        return -1;
+        if(current==NULL){
+            return -1;
+        }
+
+        component = slash + 1;
     }
+}
 
-    init_bounce_buffer();
-    clear_bounce_buffer();
+/*
+ * Finds the directory the last component of path @key goes in, and copies
+ * that component to @name
+ *
+ * Returns: 0 on success, -1 if the parent does not exist or the name is
+ * invalid
+ */
+static int resolve_parent(const char* key, struct directory** dir, char* name){
+    const char* slash = strrchr(key, '/');
 
-    size_t fat_occupied_entries = 0;
+    if(slash==NULL){
+        *dir = dir_root();
+    } else {
+        char parent[FS_PATH_MAX_LEN];
+        struct directory* grandparent;
+        size_t entry_index;
 
-    for(size_t fBlock = FAT_BLOCK_START_INDEX; fBlock < root_directory_index; fBlock++){
+        memcpy(parent, key, (size_t)(slash - key));
+        parent[slash - key] = '\0';
 
-        if(block_read(fBlock, bounce_buffer)){
+        if(parent[0]=='\0' || resolve(parent, &grandparent, &entry_index)){
             return -1;
         }
 
-        uint16_t* fatEntry = (uint16_t*)bounce_buffer;
-
-        for(int entry = 0; entry < FAT_ENTRIES; entry++){
+        *dir = dir_child(grandparent, entry_index);
 
-            if(*fatEntry != 0){
-                fat_occupied_entries++;
-            }
-
-            fatEntry++;
+        if(*dir==NULL){
+            return -1;
         }
 
-        clear_bounce_buffer();
+        key = slash + 1;
     }
 
-    if(block_read(root_directory_index, bounce_buffer)){
+    if(isValidFileName(key)==false){
         return -1;
     }
 
-    int dirFreeEntries = 0;
+    strcpy(name, key);
 
-    struct DirEntry* dirEntry = (struct DirEntry*)bounce_buffer;
+    return 0;
+}
 
-    for(int entry = 0; entry < FS_FILE_MAX_COUNT; entry++){
+/*
+ * Fills volume from the superblock in the bounce buffer, whatever its
+ * version
+ */
+static void read_layout(){
+    memset(&volume, 0, sizeof(struct volume_layout));
 
-        if(*(dirEntry->filename) == '\0'){
-            dirFreeEntries++;
-        }
+    volume.version = diskMetadata->version;
+    volume.features = diskMetadata->features;
 
-        dirEntry ++;
+    //an out of range shift gives a size block_disk_set_block_size() rejects
+    if(diskMetadata->blockShift==0){
+        volume.block_size = BLOCK_SIZE_DEFAULT;
+    } else if(diskMetadata->blockShift < 32){
+        volume.block_size = (size_t)1 << diskMetadata->blockShift;
     }
 
-    printf("FS Info:\n"
-            "total_blk_count=%hu\n"
-            "fat_blk_count=%hhu\n"
-            "rdir_blk=%hu\n"
-            "data_blk=%hu\n"
-            "data_blk_count=%hu\n",
-            diskMetadata->totalBlocks,
-            diskMetadata->totalFatBlocks,
-            diskMetadata->rootDirectoryIndex,
-            diskMetadata->dataStartIndex,
-            diskMetadata->totalDataBlocks);
+    if(volume.version==FS_VERSION_FAT32){
+        struct DiskMetadata32* metadata = (struct DiskMetadata32*)bounce_buffer;
+
+        volume.fat_entry_size = sizeof(uint32_t);
+        volume.fat_entries = volume.block_size / sizeof(uint32_t);
+        volume.total_blocks = (size_t)metadata->totalBlocks;
+        volume.fat_blocks = (size_t)metadata->totalFatBlocks;
+        volume.root_directory_index = (size_t)metadata->rootDirectoryIndex;
+        volume.data_start_index = (size_t)metadata->dataStartIndex;
+        volume.data_blocks = (size_t)metadata->totalDataBlocks;
+        volume.journal_start_index = (size_t)metadata->journalStartIndex;
+        volume.journal_blocks = (size_t)metadata->journalBlocks;
+        volume.checksum_start_index = (size_t)metadata->checksumStartIndex;
+        volume.checksum_blocks = (size_t)metadata->checksumBlocks;
+        volume.root_directory_blocks = (size_t)metadata->rootDirectoryBlocks;
+    } else {
+        volume.fat_entry_size = sizeof(uint16_t);
+        volume.fat_entries = volume.block_size / sizeof(uint16_t);
+        volume.total_blocks = diskMetadata->totalBlocks;
+        volume.fat_blocks = diskMetadata->totalFatBlocks;
+        volume.root_directory_index = diskMetadata->rootDirectoryIndex;
+        volume.data_start_index = diskMetadata->dataStartIndex;
+        volume.data_blocks = diskMetadata->totalDataBlocks;
+        volume.journal_start_index = diskMetadata->journalStartIndex;
+        volume.journal_blocks = diskMetadata->journalBlocks;
+        volume.checksum_start_index = diskMetadata->checksumStartIndex;
+        volume.checksum_blocks = diskMetadata->checksumBlocks;
+        volume.root_directory_blocks = diskMetadata->rootDirectoryBlocks;
+    }
 
-    size_t fat_available=(size_t)diskMetadata->totalDataBlocks - fat_occupied_entries;
+    if(volume.root_directory_blocks==0){
+        volume.root_directory_blocks = 1;
+    }
 
-    printf("fat_free_ratio=%zu/%zu\n", fat_available, (size_t)diskMetadata->totalDataBlocks);
+    volume.entry_size = sizeof(struct DirEntry);
 
-    printf("rdir_free_ratio=%d/%d\n",dirFreeEntries, FS_FILE_MAX_COUNT);
+    //an out of range shift gives a size isValidMetadata() rejects
+    if((volume.features & FS_FEATURE_INLINE_DATA)!=0){
+        volume.entry_size = diskMetadata->entryShift < 32 ? (size_t)1 << diskMetadata->entryShift : 0;
+    }
 
-    return 0;
+    if(volume.entry_size!=0){
+        volume.directory_entries = volume.root_directory_blocks
+                * (volume.block_size / volume.entry_size);
+    }
 }
 
-int fs_create(const char *filename)
+static int do_mount(const char *diskname, const struct fs_mount_options *options)
 {
-    if(disk_mounted==false){
+    if(options==NULL){
+        options = &default_mount_options;
+    }
+
+    if(options->durability < FS_DURABILITY_NONE
+            || options->durability > FS_DURABILITY_FULL){
         return -1;
     }
 
-    if(isValidFileName(filename)==false){
+    if(options->verify < FS_VERIFY_OFF || options->verify > FS_VERIFY_ALWAYS){
         return -1;
     }
 
+    int ret = block_disk_open(diskname);
+
+    if(ret != 0){
+        return ret;
+    }
+
     init_bounce_buffer();
     clear_bounce_buffer();
 
-    block_read(root_directory_index,bounce_buffer);
+    ret = block_read(SUPERBLOCK_INDEX, bounce_buffer);
 
-    struct DirEntry* entry=(struct DirEntry*)bounce_buffer;
+    if(ret != 0){
+        block_disk_close();
+        return ret;
+    }
 
-    int availableIndex=-1;
+    diskMetadata = (struct DiskMetadata*)calloc(1,sizeof(struct DiskMetadata));
 
-    for(int i=0;i<FS_FILE_MAX_COUNT;i++){
+    memcpy(diskMetadata, bounce_buffer, sizeof(struct DiskMetadata));
 
-        if(strcmp(filename,(char*)entry->filename)==0){
-            return -1;
-        }
+    read_layout();
 
-        if(availableIndex == -1 && *(entry->filename)=='\0'){
-            availableIndex = i;
-        }
+    //block 0 was read in BLOCK_SIZE_DEFAULT, the rest of the disk is in its own size
+    if(block_disk_set_block_size(volume.block_size) || isValidMetadata() == false){
 
-        entry++;
-    }
+        block_disk_close();
+
+        free(diskMetadata);
+        diskMetadata=NULL;
 
-    if(availableIndex == -1){
         return -1;
     }
 
-    entry = (struct DirEntry*)bounce_buffer + availableIndex;
+    root_directory_index = volume.root_directory_index;
 
-    memset(entry,0,sizeof(struct DirEntry));
+    data_blocks = volume.data_blocks;
 
-    strcpy((char*)entry->filename,filename);
+    FAT_EOC = volume.version==FS_VERSION_FAT32 ? FAT32_EOC : FAT16_EOC;
 
-    entry->index=FAT_EOC;
+    FAT_HELD = FAT_EOC - 1;
 
-    block_write(root_directory_index,bounce_buffer);
+    bool clean = diskMetadata->state==FS_STATE_CLEAN;
 
-	return 0;
-}
+    if(metadata_load(options->durability)){
 
-int fs_delete(const char *filename)
-{
-    if(disk_mounted==false){
-        return -1;
-    }
+        block_disk_close();
 
-    if(filename==NULL){
-        return -1;
-    }
+        free(diskMetadata);
+        diskMetadata=NULL;
+
+        root_directory_index=0;
+        data_blocks=0;
 
-    if(isValidFileName(filename)==false){
         return -1;
     }
 
-    init_bounce_buffer();
-    clear_bounce_buffer();
+    read_only = options->snapshot!=NULL;
 
-    block_read(root_directory_index, bounce_buffer);
+    if(read_only){
+        metadata_set_read_only();
+    }
 
-    struct DirEntry* dir_entry = (struct DirEntry*)bounce_buffer;
+    if(checksums_load(options->verify) || snapshot_load(options->snapshot)
+            || dir_load() || fat_load() || fragment_load()
+            || (!read_only && reflink_load())
+            || (!read_only && options->dedup && dedup_load())){
 
-    for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
+        dedup_unload();
 
-        if(strcmp(filename,(char*)dir_entry->filename) == 0){
+        reflink_unload();
 
-            if(isOpenByName(fd_table,(char*)dir_entry->filename)==true){
+        fat_unload();
 
-                return -1;
-            }
+        fragment_unload();
 
-            uint16_t dir_entry_index = dir_entry->index;
+        dir_unload();
 
-            memset(dir_entry,0,sizeof(struct DirEntry));
+        snapshot_unload();
 
-            block_write(root_directory_index, bounce_buffer);
+        checksums_unload();
 
-            if(dir_entry_index==FAT_EOC){
-                return 0;
-            }
+        metadata_unload();
 
-            return erase_file(dir_entry_index);
-        }
+        block_disk_close();
 
-        dir_entry++;
-    }
+        free(diskMetadata);
+        diskMetadata=NULL;
 
-    return -1;
-}
+        root_directory_index=0;
+        data_blocks=0;
+
+        read_only = false;
 
-int fs_ls(void)
-{
-    if(disk_mounted==false){
         return -1;
     }
 
-    init_bounce_buffer();
-    clear_bounce_buffer();
-
-    block_read(root_directory_index, bounce_buffer);
-
-    struct DirEntry* dir_entry = (struct DirEntry*)bounce_buffer;
-
-    printf("FS Ls:\n");
+    disk_mounted = true;
 
-    for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
+    fd_table = fd_table_constructor();
 
-        if(*(dir_entry->filename)!='\0'){
+    struct fs_check_report report;
 
-            printf("file: %s, size: %u, data_blk: %hu\n",
-                    (char*)dir_entry->filename,
-                    dir_entry->size,
-                    dir_entry->index);
-        }
+    memset(&report, 0, sizeof(struct fs_check_report));
 
-        dir_entry++;
+    //problems it cannot repair are left for fs_check.x to report
+    if(!clean && !options->skip_check && !read_only){
+        check_unclean_mount(&report);
     }
 
+    stats_mount(clean, report.check_ns, report.repaired_blocks);
+
     return 0;
 }
 
-int fs_open(const char *filename)
+static int do_umount(void)
 {
-    if(disk_mounted==false){
-        return -1;
-    }
+    int flush_status = 0;
 
-    if(filename==NULL){
-        return -1;
-    }
+    if(disk_mounted==true){
+        dentry_clear();
 
-    if(isValidFileName(filename)==false){
-        return -1;
-    }
+        memset(dir_streams, 0, sizeof(dir_streams));
 
-    if(table_is_full(fd_table)==true){
-        return -1;
-    }
+        int dedup_status = dedup_save();
 
-    init_bounce_buffer();
-    clear_bounce_buffer();
+        fat_unload();
 
-    block_read(root_directory_index, bounce_buffer);
+        //subdirectory blocks are written home from their cached copies
+        flush_status = metadata_unload();
 
-    struct DirEntry* dir_entry = (struct DirEntry*)bounce_buffer;
+        if(dedup_status!=0){
+            flush_status = -1;
+        }
 
-    for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
+        checksums_unload();
 
-        if(strcmp(filename,(char*)dir_entry->filename) == 0){
+        dir_unload();
 
-            int fd = addFd(fd_table,(char*)dir_entry->filename);
+        fragment_unload();
 
-            struct fdNode* fdEntry = getFdEntry(fd_table,fd);
+        snapshot_unload();
 
-            fdEntry->dir_entry_index = i;
+        reflink_unload();
 
-            if(dir_entry->index!=FAT_EOC){
-                fdEntry->size = dir_entry->size;
+        dedup_unload();
+    }
 
-                fdEntry->first_data_block= dir_entry->index;
-            }
+    int close_status = block_disk_close();
 
-            return fd;
-        }
+    if(close_status==0){
+
+        free(diskMetadata);
+        diskMetadata=NULL;
+
+        fdTable_destructor(fd_table);
+        fd_table=NULL;
 
-        dir_entry++;
+        disk_mounted = false;
+        read_only = false;
+        root_directory_index=0;
+        data_blocks=0;
     }
 
-    return -1;
+    if(flush_status!=0){
+        return -1;
+    }
+
+    return close_status;
 }
 
-int fs_close(int fd)
+static int do_info(void)
 {
     if(disk_mounted==false){
         return -1;
     }
 
-    if(fd<0 || fd >= FS_OPEN_MAX_COUNT){
-        return -1;
+    printf("FS Info:\n"
+            "total_blk_count=%zu\n"
+            "fat_blk_count=%zu\n"
+            "rdir_blk=%zu\n"
+            "data_blk=%zu\n"
+            "data_blk_count=%zu\n",
+            volume.total_blocks,
+            volume.fat_blocks,
+            volume.root_directory_index,
+            volume.data_start_index,
+            volume.data_blocks);
+
+    size_t fat_available = fat_free_blocks();
+
+    printf("fat_free_ratio=%zu/%zu\n", fat_available, volume.data_blocks);
+
+    printf("rdir_free_ratio=%zu/%zu\n", dir_free_count(dir_root()), dir_capacity(dir_root()));
+
+    //the output of the reference implementation, unless the disk has more
+    if(block_size!=BLOCK_SIZE_DEFAULT){
+        printf("blk_size=%zu\n", block_size);
     }
 
-    if(isOpenByFd(fd_table,fd)==false){
-        return -1;
+    if(volume.root_directory_blocks!=1){
+        printf("rdir_blk_count=%zu\n", volume.root_directory_blocks);
     }
 
-    removeFd(fd_table,fd);
+    dedup_info();
 
     return 0;
 }
 
-int fs_stat(int fd)
+/*
+ * Creates an empty entry for path @filename, a file or, with
+ * DIR_ATTR_DIRECTORY in @attributes, a directory
+ */
+static int create_entry(const char *filename, uint8_t attributes)
 {
-   if(disk_mounted==false){
-       return -1;
-   }
+    if(disk_mounted==false || read_only){
+        return -1;
+    }
 
-   if(fd<0 || fd >= FS_OPEN_MAX_COUNT){
-       return -1;
-   }
+    const char* key = path_key(filename);
 
-   if(isOpenByFd(fd_table,fd)==false){
-       return -1;
-   }
+    struct directory* dir;
+    char name[FS_FILENAME_LEN];
 
-   struct fdNode* fdEntry=getFdEntry(fd_table,fd);
+    if(key==NULL || resolve_parent(key, &dir, name)){
+        return -1;
+    }
 
-   return fdEntry->size;
-}
+    if(dir_lookup(dir, name) != -1){
+        return -1;
+    }
 
-int fs_lseek(int fd, size_t offset)
-{
-    if(disk_mounted==false){
+    int availableIndex = dir_find_free(dir);
+
+    if(availableIndex == -1){
         return -1;
     }
 
-    if(fd<0 || fd >= FS_OPEN_MAX_COUNT){
-         return -1;
-     }
+    struct DirEntry* entry = dir_entry(dir, availableIndex);
 
-     if(isOpenByFd(fd_table,fd)==false){
-         return -1;
-     }
+    dir_entry_clear(entry);
 
-     struct fdNode* fdEntry=getFdEntry(fd_table,fd);
+    strcpy((char*)entry->filename,name);
 
-     if(offset < 0 || offset > fdEntry->size){
-         return -1;
-     }
+    entry->attributes = attributes;
 
-     fdEntry->offset=offset;
+    dir_entry_set_first_block(entry, FAT_EOC);
 
-     return 0;
+    dir_update(dir, availableIndex);
+
+    dentry_created();
+
+    dentry_add(key, dir, availableIndex);
+
+	return 0;
 }
 
-int fs_write(int fd, void *buf, size_t count)
+static int do_create(const char *filename)
 {
-    if(buf==NULL){
-       return -1;
-    }
+    return create_entry(filename, 0);
+}
 
-    if(disk_mounted==false){
+static int do_mkdir(const char *dirname)
+{
+    return create_entry(dirname, DIR_ATTR_DIRECTORY);
+}
+
+static int do_delete(const char *filename)
+{
+    if(disk_mounted==false || read_only){
         return -1;
     }
 
-    if(fd<0 || fd >= FS_OPEN_MAX_COUNT){
+    const char* key = path_key(filename);
+
+    struct directory* dir;
+    size_t entry_index;
+
+    if(key==NULL || resolve(key, &dir, &entry_index)){
         return -1;
     }
 
-    if(isOpenByFd(fd_table,fd)==false){
+    struct DirEntry* entry = dir_entry(dir, entry_index);
+
+    if(dir_entry_is_directory(entry)){
         return -1;
     }
 
-    if(count<=0){
-        return 0;
+    if(isOpenByEntry(fd_table, dir, entry_index)==true){
+
+        return -1;
     }
 
-    struct fdNode* fdEntry = getFdEntry(fd_table,fd);
+    fragment_erase(entry);
+
+    size_t dir_entry_index = dir_entry_first_block(entry);
+
+    dir_entry_clear(entry);
+
+    dir_update(dir, entry_index);
+
+    dentry_forget(key);
+
+    int ret = erase_file(dir_entry_index);
+
+    if(fragment_release()){
+        ret = -1;
+    }
+
+    return ret;
+}
+
+static int do_rmdir(const char *dirname)
+{
+    if(disk_mounted==false || read_only){
+        return -1;
+    }
+
+    const char* key = path_key(dirname);
+
+    struct directory* dir;
+    size_t entry_index;
+
+    if(key==NULL || resolve(key, &dir, &entry_index)){
+        return -1;
+    }
+
+    struct DirEntry* entry = dir_entry(dir, entry_index);
+
+    struct directory* child = dir_child(dir, entry_index);
+
+    if(child==NULL || dir_free_count(child)!=dir_capacity(child)){
+        return -1;
+    }
+
+    size_t first_block = dir_entry_first_block(entry);
+
+    dir_entry_clear(entry);
+
+    dir_update(dir, entry_index);
+
+    dentry_forget(key);
+
+    int ret = erase_file(first_block);
+
+    //once the frees commit its blocks can go to a file, which replaying a
+    //transaction still in the journal would overwrite with the directory
+    if(first_block!=FAT_EOC && (metadata_commit() || journal_checkpoint())){
+        ret = -1;
+    }
+
+    for(size_t dd = 0; dd < FS_DIR_OPEN_MAX_COUNT; dd++){
+        if(dir_streams[dd].dir==child){
+            dir_streams[dd].dir = NULL;
+        }
+    }
+
+    dir_forget_child(dir, entry_index);
+
+    return ret;
+}
+
+static void list_directory(struct directory* dir)
+{
+    printf("FS Ls:\n");
+
+    //a block at a time, empty blocks skipped
+    for(size_t i = dir_next_used(dir, 0); i < dir_capacity(dir); i = dir_next_used(dir, i + 1)){
+
+        struct DirEntry* entry = dir_entry(dir, i);
+
+        printf("%s: %.*s, size: %zu, data_blk: %zu\n",
+                dir_entry_is_directory(entry) ? "dir" : "file",
+                FS_FILENAME_LEN, (char*)entry->filename,
+                (size_t)dir_entry_size(entry),
+                dir_entry_first_block(entry));
+    }
+}
+
+static int do_ls(void)
+{
+    if(disk_mounted==false){
+        return -1;
+    }
+
+    list_directory(dir_root());
+
+    return 0;
+}
+
+/*
+ * Returns: the directory @dirname leads to, the root for "/", NULL if
+ * there is no such directory
+ */
+static struct directory* find_directory(const char *dirname)
+{
+    if(strcmp(dirname, "/")==0){
+        return dir_root();
+    }
+
+    const char* key = path_key(dirname);
+
+    struct directory* dir;
+    size_t entry_index;
+
+    if(key==NULL || resolve(key, &dir, &entry_index)){
+        return NULL;
+    }
+
+    return dir_child(dir, entry_index);
+}
+
+static int do_lsdir(const char *dirname)
+{
+    if(disk_mounted==false || dirname==NULL){
+        return -1;
+    }
+
+    struct directory* dir = find_directory(dirname);
+
+    if(dir==NULL){
+        return -1;
+    }
+
+    list_directory(dir);
+
+    return 0;
+}
+
+static void fill_dirent(const struct DirEntry* entry, struct fs_dirent* dirent)
+{
+    memcpy(dirent->name, entry->filename, FS_FILENAME_LEN);
+    dirent->name[FS_FILENAME_LEN - 1] = '\0';
+
+    dirent->size = dir_entry_size(entry);
+    dirent->first_block = dir_entry_first_block(entry);
+
+    //chains are as long as their size needs, as fs_check() makes sure,
+    //compressed ones aside
+    if(dir_entry_is_compressed(entry)){
+        dirent->block_count = total_file_blocks(dirent->first_block);
+    } else {
+        dirent->block_count = dir_entry_is_inline(entry) ? 0 : total_block_size((size_t)dirent->size);
+    }
+
+    dirent->is_directory = dir_entry_is_directory(entry);
+    dirent->compress = dir_entry_compress(entry);
+    dirent->is_compressed = dir_entry_is_compressed(entry);
+}
+
+static int do_opendir(const char *dirname)
+{
+    if(disk_mounted==false || dirname==NULL){
+        return -1;
+    }
+
+    int dd = 0;
+
+    while(dd < FS_DIR_OPEN_MAX_COUNT && dir_streams[dd].open){
+        dd++;
+    }
+
+    if(dd==FS_DIR_OPEN_MAX_COUNT){
+        return -1;
+    }
+
+    struct directory* dir = find_directory(dirname);
+
+    if(dir==NULL){
+        return -1;
+    }
+
+    dir_streams[dd].open = true;
+    dir_streams[dd].dir = dir;
+    dir_streams[dd].next = 0;
+
+    return dd;
+}
+
+static int do_readdir(int dd, struct fs_dirent *entries, size_t count)
+{
+    if(disk_mounted==false || dd < 0 || dd >= FS_DIR_OPEN_MAX_COUNT
+            || dir_streams[dd].open==false || (entries==NULL && count!=0)){
+        return -1;
+    }
+
+    struct dir_stream* stream = &dir_streams[dd];
+
+    if(stream->dir==NULL){
+        return 0;
+    }
+
+    if(count > INT_MAX){
+        count = INT_MAX;
+    }
+
+    size_t read = 0;
+
+    //a block at a time, empty blocks skipped
+    size_t i = dir_next_used(stream->dir, stream->next);
+
+    while(read < count && i < dir_capacity(stream->dir)){
+        fill_dirent(dir_entry(stream->dir, i), &entries[read]);
+        read++;
+
+        i = dir_next_used(stream->dir, i + 1);
+    }
+
+    stream->next = i;
+
+    return (int)read;
+}
+
+static int do_closedir(int dd)
+{
+    if(disk_mounted==false || dd < 0 || dd >= FS_DIR_OPEN_MAX_COUNT
+            || dir_streams[dd].open==false){
+        return -1;
+    }
+
+    memset(&dir_streams[dd], 0, sizeof(struct dir_stream));
+
+    return 0;
+}
+
+static int do_stat_name(const char *filename, struct fs_dirent *dirent)
+{
+    if(disk_mounted==false || dirent==NULL){
+        return -1;
+    }
+
+    const char* key = path_key(filename);
+
+    struct directory* dir;
+    size_t entry_index;
+
+    if(key==NULL || resolve(key, &dir, &entry_index)){
+        return -1;
+    }
+
+    fill_dirent(dir_entry(dir, entry_index), dirent);
+
+    return 0;
+}
+
+static int do_open(const char *filename)
+{
+    if(disk_mounted==false){
+        return -1;
+    }
+
+    const char* key = path_key(filename);
+
+    if(key==NULL){
+        return -1;
+    }
+
+    if(table_is_full(fd_table)==true){
+        return -1;
+    }
+
+    struct directory* dir;
+    size_t entry_index;
+
+    if(resolve(key, &dir, &entry_index)){
+        return -1;
+    }
+
+    struct DirEntry* entry = dir_entry(dir, entry_index);
+
+    if(dir_entry_is_directory(entry)){
+        return -1;
+    }
+
+    int fd = addFd(fd_table,(char*)key);
+
+    struct fdNode* fdEntry = getFdEntry(fd_table,fd);
+
+    fdEntry->directory = dir;
+    fdEntry->dir_entry_index = entry_index;
+
+    if(dir_entry_first_block(entry)!=FAT_EOC){
+        fdEntry->size = (size_t)dir_entry_size(entry);
+
+        fdEntry->first_data_block = dir_entry_first_block(entry);
+    }
+
+    //inline files have a size but no block
+    if(dir_entry_is_inline(entry)){
+        fdEntry->size = (size_t)dir_entry_size(entry);
+    }
+
+    return fd;
+}
+
+static int do_close(int fd)
+{
+    if(disk_mounted==false){
+        return -1;
+    }
+
+    if(fd<0 || fd >= FS_OPEN_MAX_COUNT){
+        return -1;
+    }
+
+    if(isOpenByFd(fd_table,fd)==false){
+        return -1;
+    }
+
+    struct fdNode* fdEntry = getFdEntry(fd_table,fd);
+
+    struct directory* dir = fdEntry->directory;
+    size_t entry_index = fdEntry->dir_entry_index;
+    bool written = fdEntry->written;
+
+    int ret = 0;
+
+    if(written && (fragment_pack(fdEntry) || fragment_release())){
+        ret = -1;
+    }
+
+    removeFd(fd_table,fd);
+
+    bool last = !isOpenByEntry(fd_table, dir, entry_index);
+
+    //once no descriptor caches the chain of the file
+    if(ret==0 && written && last && !read_only && compress_file(dir, entry_index)){
+        ret = -1;
+    }
+
+    if(ret==0 && written && dedup_enabled() && last && dedup_file(dir, entry_index) < 0){
+        ret = -1;
+    }
+
+    return ret;
+}
+
+static int do_stat(int fd)
+{
+   if(disk_mounted==false){
+       return -1;
+   }
+
+   if(fd<0 || fd >= FS_OPEN_MAX_COUNT){
+       return -1;
+   }
+
+   if(isOpenByFd(fd_table,fd)==false){
+       return -1;
+   }
+
+   struct fdNode* fdEntry=getFdEntry(fd_table,fd);
+
+   //FS_VERSION_FAT32 files can outgrow an int, see fs_stat_size()
+   if(fdEntry->size > INT_MAX){
+       return -1;
+   }
+
+   return (int)fdEntry->size;
+}
+
+static int do_stat_size(int fd, uint64_t *size)
+{
+    if(size==NULL){
+        return -1;
+    }
+
+    if(disk_mounted==false){
+        return -1;
+    }
+
+    if(fd<0 || fd >= FS_OPEN_MAX_COUNT){
+        return -1;
+    }
+
+    if(isOpenByFd(fd_table,fd)==false){
+        return -1;
+    }
+
+    *size = getFdEntry(fd_table,fd)->size;
+
+    return 0;
+}
+
+static int do_lseek(int fd, size_t offset)
+{
+    if(disk_mounted==false){
+        return -1;
+    }
+
+    if(fd<0 || fd >= FS_OPEN_MAX_COUNT){
+         return -1;
+     }
+
+     if(isOpenByFd(fd_table,fd)==false){
+         return -1;
+     }
+
+     struct fdNode* fdEntry=getFdEntry(fd_table,fd);
+
+     if(offset < 0 || offset > fdEntry->size){
+         return -1;
+     }
+
+     fdEntry->offset=offset;
+
+     return 0;
+}
+
+static int do_write(int fd, void *buf, size_t count)
+{
+    if(buf==NULL){
+       return -1;
+    }
+
+    if(disk_mounted==false || read_only){
+        return -1;
+    }
+
+    if(fd<0 || fd >= FS_OPEN_MAX_COUNT){
+        return -1;
+    }
+
+    if(isOpenByFd(fd_table,fd)==false){
+        return -1;
+    }
+
+    if(count<=0){
+        return 0;
+    }
+
+    //the byte count is returned as an int
+    if(count > INT_MAX){
+        count = INT_MAX;
+    }
+
+    struct fdNode* fdEntry = getFdEntry(fd_table,fd);
+
+    uint8_t* data = (uint8_t*)buf;
+
+    struct DirEntry* entry = dir_entry(fdEntry->directory, fdEntry->dir_entry_index);
+
+    size_t end_offset = fdEntry->offset + count;
+
+    //tiny files are written in their entry, with no data block
+    if(end_offset <= dir_inline_max() && fdEntry->size <= dir_inline_max()
+            && (dir_entry_is_inline(entry) || dir_entry_first_block(entry)==FAT_EOC)){
+
+        memcpy(&dir_entry_inline_data(entry)[fdEntry->offset], data, count);
+
+        fdEntry->offset = end_offset;
+
+        if(fdEntry->offset > fdEntry->size){
+            fdEntry->size = fdEntry->offset;
+        }
+
+        dir_entry_set_inline(entry, true);
+        dir_entry_set_size(entry, fdEntry->size);
+
+        dir_update(fdEntry->directory, fdEntry->dir_entry_index);
+
+        return count;
+    }
+
+    //and move to a block of their own once they outgrow it
+    if(dir_entry_is_inline(entry) && promote_inline_file(fdEntry)==false){
+        return 0;
+    }
+
+    //compressed files are rewritten a unit at a time, and written plain
+    //once compressing them saves no block
+    if(dir_entry_is_compressed(entry)){
+        int written = compress_write(fdEntry, data, end_offset);
+
+        if(written!=0 || dir_entry_is_compressed(entry)){
+            if(written > 0){
+                fdEntry->written = true;
+            }
+
+            return written;
+        }
+    }
+
+    //files that fit a fragment are written in it
+    if(fragment_can_write(fdEntry, end_offset)){
+        int written = fragment_write(fdEntry, data, count);
+
+        if(written >= 0){
+            fdEntry->written = true;
+
+            fragment_release();
+
+            return written;
+        }
+    }
+
+    //the tail goes back to a block of its own until fs_close()
+    if(fragment_unpack(fdEntry)){
+        return 0;
+    }
+
+    fdEntry->written = true;
 
     if(fdEntry->first_data_block == FAT_EOC){
         //disk full
@@ -432,11 +1074,18 @@ int fs_write(int fd, void *buf, size_t count)
         }
     }
 
-    size_t total_block_count = total_file_blocks(fdEntry->first_data_block);
+    size_t total_block_count = file_blocks(fdEntry);
 
-    size_t total_bytes = total_block_count * (size_t)BLOCK_SIZE;
+    size_t total_bytes = total_block_count << block_shift;
 
-    size_t end_offset = fdEntry->offset + count;
+    //blocks shared with reflinked files are copied before they are written,
+    //up to the last one when the file grows past it
+    size_t last_written = end_offset > total_bytes ? total_block_count - 1
+                                                   : current_block_offset(end_offset - 1);
+
+    if(unshare_blocks(fdEntry, last_written)){
+        return 0;
+    }
 
     if(end_offset > total_bytes){
 
@@ -450,9 +1099,9 @@ int fs_write(int fd, void *buf, size_t count)
             return 0;
         }
 
-        total_block_count = total_file_blocks(fdEntry->first_data_block);
+        total_block_count = file_blocks(fdEntry);
 
-        total_bytes = total_block_count * (size_t)BLOCK_SIZE;
+        total_bytes = total_block_count << block_shift;
 
         if(end_offset > total_bytes){
 
@@ -463,7 +1112,9 @@ int fs_write(int fd, void *buf, size_t count)
     init_bounce_buffer();
     clear_bounce_buffer();
 
-    size_t write_block =  skip_blocks(fdEntry->first_data_block, current_block_offset(fdEntry->offset));
+    size_t block_index = current_block_offset(fdEntry->offset);
+
+    size_t write_block = file_block(fdEntry, block_index);
 
     size_t raw_write_block = get_actual_block_index(write_block);
 
@@ -471,70 +1122,251 @@ int fs_write(int fd, void *buf, size_t count)
 
     size_t character = 0;
 
+    bool failed = false;
+
     while(fdEntry->offset < end_offset){
 
          size_t write_characters = 0;
 
-         size_t offset_in_block = fdEntry->offset % (size_t)BLOCK_SIZE;
+         size_t offset_in_block = fdEntry->offset & (block_size - 1);
 
          if(current_block_offset(fdEntry->offset) < current_block_offset(end_offset)){
 
              //we will write until end of block
-             write_characters = (size_t)BLOCK_SIZE - offset_in_block;
+             write_characters = block_size - offset_in_block;
 
          } else {
 
              //we will write somewhere within the block
-             write_characters = end_offset % (size_t)BLOCK_SIZE - offset_in_block;
+             write_characters = (end_offset & (block_size - 1)) - offset_in_block;
+         }
+
+         size_t raw_read_block = raw_write_block;
+
+         //a block a snapshot reads is left alone, the file gets a new one
+         if(snapshot_held(write_block)){
+             size_t copy = copy_on_write(fdEntry, block_index, write_block);
+
+             if(copy == FAT_EOC){
+                 break;
+             }
+
+             write_block = copy;
+             raw_write_block = get_actual_block_index(copy);
          }
 
-         if(write_characters == BLOCK_SIZE){
+         if(write_characters == block_size){
 
-            block_write(raw_write_block, &buf[character]);
+            if(block_write(raw_write_block, &data[character]) != 0){
+                failed = true;
+                break;
+            }
 
          } else {
 
-            clear_bounce_buffer();
+            clear_bounce_buffer();
+
+            //a block that failed its checksum is not merged with new data
+            if(block_read(raw_read_block, bounce_buffer) != 0){
+                failed = true;
+                break;
+            }
+
+            memcpy(&bounce_buffer[offset_in_block], &data[character], write_characters);
+
+            if(block_write(raw_write_block, bounce_buffer) != 0){
+                failed = true;
+                break;
+            }
+
+         }
+
+         fdEntry->offset += write_characters;
+
+         character += write_characters;
+
+         bytesWritten += write_characters;
+
+         if(fdEntry->offset > fdEntry->size){
+             fdEntry->size = fdEntry->offset;
+         }
+
+         if(fdEntry->offset < end_offset){
+
+             write_block =  skip_blocks(write_block, 1);
+             raw_write_block =  get_actual_block_index(write_block);
+             block_index++;
+         }
+    }
+
+    fdEntry->cursor_index = block_index;
+    fdEntry->cursor_block = write_block;
+
+    dir_entry_set_size(entry, fdEntry->size);
+
+    dir_update(fdEntry->directory, fdEntry->dir_entry_index);
+
+    //the blocks allocated for what was not written go back
+    if(fdEntry->offset < end_offset){
+        release_unused_blocks(fdEntry);
+    }
+
+    fragment_release();
+
+    if(failed && bytesWritten == 0){
+        return -1;
+    }
+
+    return bytesWritten;
+}
+
+static int do_snapshot_create(const char *name)
+{
+    if(disk_mounted==false || read_only || name==NULL || !isValidFileName(name)){
+        return -1;
+    }
+
+    return snapshot_create(name);
+}
+
+static int do_snapshot_delete(const char *name)
+{
+    if(disk_mounted==false || read_only || name==NULL || !isValidFileName(name)){
+        return -1;
+    }
+
+    return snapshot_delete(name);
+}
+
+static int do_snapshot_ls(void)
+{
+    if(disk_mounted==false){
+        return -1;
+    }
+
+    snapshot_list();
+
+    return 0;
+}
+
+static int do_copy_file(const char *src, const char *dst, enum fs_copy_mode mode)
+{
+    if(disk_mounted==false || read_only){
+        return -1;
+    }
+
+    if(mode!=FS_COPY_REFLINK && mode!=FS_COPY_DEEP){
+        return -1;
+    }
+
+    const char* src_key = path_key(src);
+    const char* dst_key = path_key(dst);
+
+    struct directory* src_dir;
+    size_t src_index;
+
+    if(src_key==NULL || dst_key==NULL || resolve(src_key, &src_dir, &src_index)){
+        return -1;
+    }
+
+    if(dir_entry_is_directory(dir_entry(src_dir, src_index))){
+        return -1;
+    }
+
+    struct directory* dir;
+    size_t entry_index;
+
+    if(create_entry(dst, 0) || resolve(dst_key, &dir, &entry_index)){
+        return -1;
+    }
+
+    if(reflink_copy(src_dir, src_index, dir, entry_index, mode)==0){
+        return 0;
+    }
+
+    //a copy that did not fit is not left behind empty
+    dir_entry_clear(dir_entry(dir, entry_index));
+
+    dir_update(dir, entry_index);
+
+    dentry_forget(dst_key);
+
+    return -1;
+}
+
+static int do_dedup(void)
+{
+    if(disk_mounted==false || read_only || !dedup_enabled()){
+        return -1;
+    }
 
-            block_read(raw_write_block, bounce_buffer);
+    return dedup_directory(dir_root());
+}
 
-            memcpy(&bounce_buffer[offset_in_block], &buf[character], write_characters);
+static int do_set_compression(const char *filename, bool compress)
+{
+    if(disk_mounted==false || read_only){
+        return -1;
+    }
 
-            block_write(raw_write_block, bounce_buffer);
+    const char* key = path_key(filename);
 
-         }
+    struct directory* dir;
+    size_t entry_index;
 
-         fdEntry->offset += write_characters;
+    if(key==NULL || resolve(key, &dir, &entry_index)){
+        return -1;
+    }
 
-         character += write_characters;
+    struct DirEntry* entry = dir_entry(dir, entry_index);
 
-         bytesWritten += write_characters;
+    //descriptors cache the chain
+    if(dir_entry_is_directory(entry) || isOpenByEntry(fd_table, dir, entry_index)){
+        return -1;
+    }
 
-         if(fdEntry->offset > fdEntry->size){
-             fdEntry->size = fdEntry->offset;
-         }
+    if(!compress && compress_expand(dir, entry_index)){
+        return -1;
+    }
 
-         if(fdEntry->offset < end_offset){
+    dir_entry_set_compress(entry, compress);
 
-             write_block =  skip_blocks(write_block, 1);
-             raw_write_block =  get_actual_block_index(write_block);
-         }
+    if(dir_update(dir, entry_index)){
+        return -1;
     }
 
-    clear_bounce_buffer();
+    return compress ? compress_file(dir, entry_index) : 0;
+}
+
+static int do_sync(void)
+{
+    if(disk_mounted==false || dedup_save()){
+        return -1;
+    }
 
-    block_read(root_directory_index,bounce_buffer);
+    return metadata_sync();
+}
 
-    struct DirEntry* dir_entry=(struct DirEntry*)bounce_buffer + fdEntry->dir_entry_index;
+static int do_fsync(int fd)
+{
+    if(disk_mounted==false){
+        return -1;
+    }
 
-    dir_entry->size=(uint32_t)fdEntry->size;
+    if(fd<0 || fd >= FS_OPEN_MAX_COUNT){
+        return -1;
+    }
 
-    block_write(root_directory_index,bounce_buffer);
+    if(isOpenByFd(fd_table,fd)==false){
+        return -1;
+    }
 
-    return bytesWritten;
+    //the size lives in the directory and the blocks in the fat, so the
+    //whole running transaction goes along with the file's data
+    return metadata_sync();
 }
 
-int fs_read(int fd, void *buf, size_t count)
+static int do_read(int fd, void *buf, size_t count)
 {
     if(buf==NULL){
        return -1;
@@ -556,11 +1388,16 @@ int fs_read(int fd, void *buf, size_t count)
         return 0;
     }
 
+    //the byte count is returned as an int
+    if(count > INT_MAX){
+        count = INT_MAX;
+    }
+
     struct fdNode* fdEntry = getFdEntry(fd_table,fd);
 
-    if(fdEntry->first_data_block == FAT_EOC){
-        return 0;
-    }
+    uint8_t* data = (uint8_t*)buf;
+
+    struct DirEntry* entry = dir_entry(fdEntry->directory, fdEntry->dir_entry_index);
 
     if(fdEntry->offset >= fdEntry->size){
         return 0;
@@ -572,10 +1409,36 @@ int fs_read(int fd, void *buf, size_t count)
         end_offset = fdEntry->size;
     }
 
+    //served from the cached directory block
+    if(dir_entry_is_inline(entry)){
+        memcpy(data, &dir_entry_inline_data(entry)[fdEntry->offset], end_offset - fdEntry->offset);
+
+        int bytesRead = (int)(end_offset - fdEntry->offset);
+
+        fdEntry->offset = end_offset;
+
+        return bytesRead;
+    }
+
+    //decompressed a unit at a time
+    if(dir_entry_is_compressed(entry)){
+        return compress_read(fdEntry, data, end_offset);
+    }
+
+    if(fdEntry->first_data_block == FAT_EOC){
+        return 0;
+    }
+
+    //the last block of a packed file is its fragment
+    size_t tail_index = dir_entry_is_packed(entry) ? total_block_size(fdEntry->size) - 1
+                                                   : SIZE_MAX;
+
     init_bounce_buffer();
     clear_bounce_buffer();
 
-    size_t read_block = skip_blocks(fdEntry->first_data_block, current_block_offset(fdEntry->offset));
+    size_t block_index = current_block_offset(fdEntry->offset);
+
+    size_t read_block = file_block(fdEntry, block_index);
 
     size_t raw_read_block = get_actual_block_index(read_block);
 
@@ -587,30 +1450,47 @@ int fs_read(int fd, void *buf, size_t count)
 
         size_t read_characters = 0;
 
-        size_t offset_in_block = fdEntry->offset % (size_t)BLOCK_SIZE;
+        size_t offset_in_block = fdEntry->offset & (block_size - 1);
 
         if(current_block_offset(fdEntry->offset) < current_block_offset(end_offset)){
 
             //we will write until end of block
-            read_characters = (size_t)BLOCK_SIZE - offset_in_block;
+            read_characters = block_size - offset_in_block;
 
           } else {
 
               //we will write somewhere within the block
-              read_characters = end_offset % (size_t)BLOCK_SIZE - offset_in_block;
+              read_characters = (end_offset & (block_size - 1)) - offset_in_block;
           }
 
-          if(read_characters == BLOCK_SIZE){
+          int read_status;
 
-             block_read(raw_read_block, &buf[character]);
+          if(block_index == tail_index){
+
+             uint8_t* tail = fragment_tail(entry, read_block);
+
+             read_status = tail==NULL ? -1 : 0;
+
+             if(tail!=NULL){
+                 memcpy(&data[character], &tail[offset_in_block], read_characters);
+             }
+
+          } else if(read_characters == block_size){
+
+             read_status = block_read(raw_read_block, &data[character]);
 
           } else {
 
              clear_bounce_buffer();
 
-             block_read(raw_read_block, bounce_buffer);
+             read_status = block_read(raw_read_block, bounce_buffer);
+
+             memcpy(&data[character], &bounce_buffer[offset_in_block], read_characters);
+          }
 
-             memcpy(&buf[character], &bounce_buffer[offset_in_block], read_characters);
+          //a block that failed its checksum ends the read
+          if(read_status != 0){
+              return bytesRead > 0 ? (int)bytesRead : -1;
           }
 
           fdEntry->offset += read_characters;
@@ -623,9 +1503,13 @@ int fs_read(int fd, void *buf, size_t count)
 
               read_block =  skip_blocks(read_block, 1);
               raw_read_block =  get_actual_block_index(read_block);
+              block_index++;
           }
     }
 
+    fdEntry->cursor_index = block_index;
+    fdEntry->cursor_block = read_block;
+
     return bytesRead;
 }
 
@@ -652,11 +1536,22 @@ bool isValidMetadata(){
         return false;
     }
 
+    if(volume.version!=FS_VERSION_FAT16 && volume.version!=FS_VERSION_FAT32){
+        return false;
+    }
+
+    if((volume.features & ~FS_FEATURES_KNOWN)!=0){
+        return false;
+    }
+
+    if(volume.entry_size < sizeof(struct DirEntry) || volume.entry_size > DIR_ENTRY_SIZE_MAX){
+        return false;
+    }
 
-    size_t totalBlocks = (size_t)diskMetadata->totalBlocks;
+    size_t totalBlocks = volume.total_blocks;
     size_t min_blocks = 4;//1 super+1 fat+1 root directory+1 data block
 
-    if(totalBlocks != block_disk_count()){
+    if(totalBlocks != (size_t)block_disk_count()){
         return false;
     }
 
@@ -664,10 +1559,11 @@ bool isValidMetadata(){
         return false;
     }
 
-    size_t rootDirectoryIndex = (size_t)diskMetadata->rootDirectoryIndex;
-    size_t dataStartIndex = (size_t)diskMetadata->dataStartIndex;
-    size_t totalDataBlocks = (size_t)diskMetadata->totalDataBlocks;
-    size_t totalFatBlocks = (size_t)diskMetadata->totalFatBlocks;
+    size_t rootDirectoryIndex = volume.root_directory_index;
+    size_t dataStartIndex = volume.data_start_index;
+    size_t totalDataBlocks = volume.data_blocks;
+    size_t totalFatBlocks = volume.fat_blocks;
+    size_t fatEntries = volume.fat_entries;
 
     if(totalDataBlocks < 1 || totalFatBlocks < 1){
         return false;
@@ -679,24 +1575,399 @@ bool isValidMetadata(){
         return false;
     }
 
-    size_t extra_fat_block = (totalDataBlocks % (size_t)FAT_ENTRIES == 0) ? 0 : 1;
+    size_t extra_fat_block = (totalDataBlocks % fatEntries == 0) ? 0 : 1;
 
-    size_t fat_blocks_required = totalDataBlocks / (size_t)FAT_ENTRIES + extra_fat_block;
+    size_t fat_blocks_required = totalDataBlocks / fatEntries + extra_fat_block;
 
     if(fat_blocks_required != totalFatBlocks){
         return false;
     }
 
-    if(totalDataBlocks > totalFatBlocks * (size_t)FAT_ENTRIES){
+    if(totalDataBlocks > totalFatBlocks * fatEntries){
+        return false;
+    }
+
+    size_t rootDirectoryBlocks = volume.root_directory_blocks;
+
+    if(rootDirectoryBlocks > totalBlocks - 3){
         return false;
     }
 
     //1+ totalFatBlocks and 1 + totalFatBlocks + 1 because of 0-based indexing
     if(rootDirectoryIndex!= 1 + totalFatBlocks
-            || dataStartIndex!= 1 + totalFatBlocks + 1){
+            || dataStartIndex!= 1 + totalFatBlocks + rootDirectoryBlocks){
         return false;
     }
 
+    size_t journalStartIndex = volume.journal_start_index;
+    size_t journalBlocks = volume.journal_blocks;
+
+    //the journal, if any, is a run of blocks inside the data region
+    if(journalBlocks!=0){
+        if(journalStartIndex < dataStartIndex
+                || journalStartIndex + journalBlocks > dataStartIndex + totalDataBlocks){
+            return false;
+        }
+
+        if(journalBlocks < journal_min_blocks(dataStartIndex - 1)){
+            return false;
+        }
+    }
+
+    size_t checksumStartIndex = volume.checksum_start_index;
+    size_t checksumBlocks = volume.checksum_blocks;
+
+    //the checksum region, if any, too, and it covers every data block
+    if(checksumBlocks!=0){
+        if(checksumStartIndex < dataStartIndex
+                || checksumStartIndex + checksumBlocks > dataStartIndex + totalDataBlocks){
+            return false;
+        }
+
+        if(checksumStartIndex < journalStartIndex + journalBlocks
+                && journalStartIndex < checksumStartIndex + checksumBlocks){
+            return false;
+        }
+
+        if(checksumBlocks < checksum_region_blocks(totalDataBlocks, block_size)){
+            return false;
+        }
+    }
+
     return true;
 }
 
+/*
+ * Public entry points. Each one accounts its calls, block I/O and
+ * wall time before handing off to the implementation above. The ones
+ * that change metadata give the journal a chance to group commit.
+ */
+int fs_mount(const char *diskname)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_mount(diskname, NULL);
+    op_end(FS_OP_MOUNT, &sample, 0);
+
+    return ret;
+}
+
+int fs_mount_with(const char *diskname, const struct fs_mount_options *options)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_mount(diskname, options);
+    op_end(FS_OP_MOUNT, &sample, 0);
+
+    return ret;
+}
+
+int fs_umount(void)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_umount();
+    op_end(FS_OP_UMOUNT, &sample, 0);
+
+    return ret;
+}
+
+int fs_info(void)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_info();
+    op_end(FS_OP_INFO, &sample, 0);
+
+    return ret;
+}
+
+int fs_create(const char *filename)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_create(filename);
+    metadata_op_end();
+    op_end(FS_OP_CREATE, &sample, 0);
+
+    return ret;
+}
+
+int fs_delete(const char *filename)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_delete(filename);
+    metadata_op_end();
+    op_end(FS_OP_DELETE, &sample, 0);
+
+    return ret;
+}
+
+int fs_mkdir(const char *dirname)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_mkdir(dirname);
+    metadata_op_end();
+    op_end(FS_OP_MKDIR, &sample, 0);
+
+    return ret;
+}
+
+int fs_rmdir(const char *dirname)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_rmdir(dirname);
+    metadata_op_end();
+    op_end(FS_OP_RMDIR, &sample, 0);
+
+    return ret;
+}
+
+int fs_ls(void)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_ls();
+    op_end(FS_OP_LS, &sample, 0);
+
+    return ret;
+}
+
+int fs_lsdir(const char *dirname)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_lsdir(dirname);
+    op_end(FS_OP_LSDIR, &sample, 0);
+
+    return ret;
+}
+
+int fs_opendir(const char *dirname)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_opendir(dirname);
+    op_end(FS_OP_OPENDIR, &sample, 0);
+
+    return ret;
+}
+
+int fs_readdir(int dd, struct fs_dirent *entries, size_t count)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_readdir(dd, entries, count);
+    op_end(FS_OP_READDIR, &sample, 0);
+
+    return ret;
+}
+
+int fs_closedir(int dd)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_closedir(dd);
+    op_end(FS_OP_CLOSEDIR, &sample, 0);
+
+    return ret;
+}
+
+int fs_open(const char *filename)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_open(filename);
+    op_end(FS_OP_OPEN, &sample, 0);
+
+    return ret;
+}
+
+int fs_close(int fd)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_close(fd);
+    metadata_op_end();
+    op_end(FS_OP_CLOSE, &sample, 0);
+
+    return ret;
+}
+
+int fs_stat(int fd)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_stat(fd);
+    op_end(FS_OP_STAT, &sample, 0);
+
+    return ret;
+}
+
+int fs_stat_size(int fd, uint64_t *size)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_stat_size(fd, size);
+    op_end(FS_OP_STAT_SIZE, &sample, 0);
+
+    return ret;
+}
+
+int fs_stat_name(const char *filename, struct fs_dirent *dirent)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_stat_name(filename, dirent);
+    op_end(FS_OP_STAT_NAME, &sample, 0);
+
+    return ret;
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_lseek(fd, offset);
+    op_end(FS_OP_LSEEK, &sample, 0);
+
+    return ret;
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_write(fd, buf, count);
+    metadata_op_end();
+    op_end(FS_OP_WRITE, &sample, count);
+
+    return ret;
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_read(fd, buf, count);
+    op_end(FS_OP_READ, &sample, count);
+
+    return ret;
+}
+
+int fs_snapshot_create(const char *name)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_snapshot_create(name);
+    metadata_op_end();
+    op_end(FS_OP_SNAPSHOT_CREATE, &sample, 0);
+
+    return ret;
+}
+
+int fs_snapshot_delete(const char *name)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_snapshot_delete(name);
+    metadata_op_end();
+    op_end(FS_OP_SNAPSHOT_DELETE, &sample, 0);
+
+    return ret;
+}
+
+int fs_snapshot_ls(void)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_snapshot_ls();
+    op_end(FS_OP_SNAPSHOT_LS, &sample, 0);
+
+    return ret;
+}
+
+int fs_copy_file(const char *src, const char *dst, enum fs_copy_mode mode)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_copy_file(src, dst, mode);
+    metadata_op_end();
+    op_end(FS_OP_COPY, &sample, 0);
+
+    return ret;
+}
+
+int fs_dedup(void)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_dedup();
+    metadata_op_end();
+    op_end(FS_OP_DEDUP, &sample, 0);
+
+    return ret;
+}
+
+int fs_set_compression(const char *filename, bool compress)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_set_compression(filename, compress);
+    metadata_op_end();
+    op_end(FS_OP_COMPRESS, &sample, 0);
+
+    return ret;
+}
+
+int fs_sync(void)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_sync();
+    op_end(FS_OP_SYNC, &sample, 0);
+
+    return ret;
+}
+
+int fs_fsync(int fd)
+{
+    struct op_sample sample;
+
+    op_begin(&sample);
+    int ret = do_fsync(fd);
+    op_end(FS_OP_FSYNC, &sample, 0);
+
+    return ret;
+}
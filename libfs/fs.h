@@ -11,7 +11,12 @@
 #define FS_FILENAME_LEN 16
 #endif
 
-/** Maximum number of files in the root directory */
+/** Maximum path length (including the NULL character) */
+#ifndef FS_PATH_MAX_LEN
+#define FS_PATH_MAX_LEN 256
+#endif
+
+/** Number of files in the root directory of a disk formatted with the defaults */
 #ifndef FS_FILE_MAX_COUNT
 #define FS_FILE_MAX_COUNT 128
 #endif
@@ -22,6 +27,9 @@
 #define FS_OPEN_MAX_COUNT 32
 #endif
 
+/** Maximum number of snapshots of a disk, see fs_snapshot_create() */
+#define FS_SNAPSHOT_MAX_COUNT 16
+
 /*
  * variables needed for part 4
  */
@@ -50,10 +58,147 @@ struct __attribute__((__packed__)) DiskMetadata{
     uint16_t dataStartIndex;
     uint16_t totalDataBlocks;
     uint8_t totalFatBlocks;
+    /*
+     * Unused space in the original format, zero on disks without a
+     * journal. The journal blocks are data blocks marked used in the FAT.
+     */
+    uint16_t journalStartIndex;
+    uint16_t journalBlocks;
+    /*
+     * FS_STATE_CLEAN once unmounted properly, FS_STATE_DIRTY while a
+     * mounted disk has changes that may not all be on it, FS_STATE_CHECK
+     * while blocks a change of this superblock leaves unused are being
+     * freed. Any other value, such as the 0 of a formatter that knows
+     * nothing about it, is handled like FS_STATE_DIRTY.
+     */
+    uint8_t state;
+    /*
+     * CRC32C of every data block, zero on disks formatted without. Like the
+     * journal, the region is made of data blocks marked used in the FAT.
+     */
+    uint16_t checksumStartIndex;
+    uint16_t checksumBlocks;
+    /*
+     * FS_VERSION_FAT16 for the original format, whose reserved bytes are
+     * zero. FS_VERSION_FAT32 disks describe themselves in the 64 bit fields
+     * of struct DiskMetadata32 and leave the 16 bit ones above zero, so that
+     * implementations of the original format reject them.
+     */
+    uint8_t version;
+    /*
+     * log2 of the block size, zero for BLOCK_SIZE_DEFAULT blocks, as on
+     * disks formatted before the size could be chosen
+     */
+    uint8_t blockShift;
+    /*
+     * Blocks of the root directory, from rootDirectoryIndex up to
+     * dataStartIndex. Zero for the single block of the original format.
+     */
+    uint16_t rootDirectoryBlocks;
+    /*
+     * FS_FEATURE_* flags of optional formats that implementations of the
+     * original one cannot read correctly, zero on disks without any. Disks
+     * with a flag this implementation does not know are not mounted.
+     */
+    uint8_t features;
+    /*
+     * log2 of the size of a directory entry on FS_FEATURE_INLINE_DATA
+     * disks, zero for the 32 bytes of struct DirEntry on the others
+     */
+    uint8_t entryShift;
+};
+
+#define FS_STATE_CLEAN 0xC1
+#define FS_STATE_DIRTY 0xD1
+#define FS_STATE_CHECK 0xCE
+
+/* 16 bit FAT entries, struct DirEntry */
+#define FS_VERSION_FAT16 0
+/* 32 bit FAT entries, struct DirEntry32 */
+#define FS_VERSION_FAT32 1
+
+/* small files and the tails of larger ones share blocks, see fragment.h */
+#define FS_FEATURE_TAIL_PACKING 0x01
+
+/*
+ * directory entries are larger than struct DirEntry, the bytes past it
+ * holding the content of files that fit there
+ */
+#define FS_FEATURE_INLINE_DATA 0x02
+
+/* sizes of the directory entries of FS_FEATURE_INLINE_DATA disks */
+#define DIR_ENTRY_SIZE_MIN 64
+#define DIR_ENTRY_SIZE_MAX 256
+
+/*
+ * the disk has snapshots, whose blocks the FAT of the live file system
+ * marks FAT_HELD once it frees them, see snapshot.h
+ */
+#define FS_FEATURE_SNAPSHOTS 0x04
+
+/*
+ * files copied with FS_COPY_REFLINK may share the end of their chains,
+ * see reflink.h
+ */
+#define FS_FEATURE_REFLINK 0x08
+
+/*
+ * files marked with fs_set_compression() may hold their content
+ * compressed, in fewer blocks than their size needs, see compress.h
+ */
+#define FS_FEATURE_COMPRESSION 0x10
+
+#define FS_FEATURES_KNOWN (FS_FEATURE_TAIL_PACKING | FS_FEATURE_INLINE_DATA \
+                           | FS_FEATURE_SNAPSHOTS | FS_FEATURE_REFLINK \
+                           | FS_FEATURE_COMPRESSION)
+
+struct __attribute__((__packed__)) DiskMetadata32{
+    /* signature, state and version; block counts and indexes are zero */
+    struct DiskMetadata header;
+    /* keeps the fields below in place as the header grows */
+    uint8_t reserved[64 - sizeof(struct DiskMetadata)];
+    uint64_t totalBlocks;
+    uint64_t rootDirectoryIndex;
+    uint64_t dataStartIndex;
+    uint64_t totalDataBlocks;
+    uint64_t totalFatBlocks;
+    uint64_t journalStartIndex;
+    uint64_t journalBlocks;
+    uint64_t checksumStartIndex;
+    uint64_t checksumBlocks;
+    uint64_t rootDirectoryBlocks;
 };
 
 extern struct DiskMetadata* diskMetadata;
 
+/*
+ * Layout of the mounted disk, read from the superblock of either
+ * version. Everything past fs_mount() uses it rather than the superblock.
+ */
+struct volume_layout{
+    uint8_t version;
+    uint8_t features;
+    size_t block_size;
+    /* bytes per FAT entry, and FAT entries per FAT block */
+    size_t fat_entry_size;
+    size_t fat_entries;
+    size_t total_blocks;
+    size_t fat_blocks;
+    size_t root_directory_index;
+    size_t root_directory_blocks;
+    /* bytes per directory entry, and entries of the root directory */
+    size_t entry_size;
+    size_t directory_entries;
+    size_t data_start_index;
+    size_t data_blocks;
+    size_t journal_start_index;
+    size_t journal_blocks;
+    size_t checksum_start_index;
+    size_t checksum_blocks;
+};
+
+extern struct volume_layout volume;
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -67,6 +212,80 @@ extern struct DiskMetadata* diskMetadata;
  */
 int fs_mount(const char *diskname);
 
+/*
+ * How hard the file system works to keep the disk image consistent and
+ * up to date if the machine goes down. Barriers are fdatasync() calls on
+ * the disk image, issued once per group of changes rather than once per
+ * block write.
+ */
+enum fs_durability {
+    /* never sync, leave it to the host page cache */
+    FS_DURABILITY_NONE,
+    /*
+     * order data before the metadata that points to it, and the journal
+     * before the home locations it replaces: a crash loses at most the
+     * last group of operations, never consistency
+     */
+    FS_DURABILITY_METADATA,
+    /*
+     * like FS_DURABILITY_METADATA, and every call that changes the file
+     * system is on stable storage when it returns
+     */
+    FS_DURABILITY_FULL
+};
+
+/*
+ * Which data block reads are checked against their CRC32C, on disks
+ * formatted with checksums. A block that does not match fails the read.
+ */
+enum fs_verify {
+    FS_VERIFY_OFF,
+    /* one data block read out of 16 */
+    FS_VERIFY_SAMPLED,
+    FS_VERIFY_ALWAYS
+};
+
+struct fs_mount_options {
+    enum fs_durability durability;
+    enum fs_verify verify;
+    /*
+     * Do not check a disk that was not unmounted cleanly. fs_check() uses
+     * it to report what is on the disk rather than what mounting repaired.
+     */
+    bool skip_check;
+    /*
+     * Mount snapshot @snapshot, taken by fs_snapshot_create(), rather than
+     * the live file system, NULL for the latter. The file system is then
+     * read-only: calls that would change it fail.
+     */
+    const char* snapshot;
+    /*
+     * Share the data blocks of files ending the same way, looked up in an
+     * index of content hashes: files are deduplicated when the last
+     * descriptor they were written through is closed, and by fs_dedup().
+     * Ignored when mounting a snapshot.
+     */
+    bool dedup;
+};
+
+/**
+ * fs_mount_with - Mount a file system with options
+ * @diskname: Name of the virtual disk file
+ * @options: Mount options, NULL for the defaults used by fs_mount()
+ *
+ * Same as fs_mount(), with control over how the mounted file system behaves.
+ * fs_mount() uses %FS_DURABILITY_METADATA and %FS_VERIFY_SAMPLED.
+ *
+ * A disk whose superblock is not marked clean was not unmounted properly:
+ * its journal is replayed, then the part of the FAT a crash could have left
+ * inconsistent is checked and leaked blocks are freed, unless
+ * @options->skip_check is set. A clean disk skips both.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, if no valid file
+ * system can be located, or if @options are invalid. 0 otherwise.
+ */
+int fs_mount_with(const char *diskname, const struct fs_mount_options *options);
+
 /**
  * fs_umount - Unmount file system
  *
@@ -96,9 +315,16 @@ int fs_info(void);
  * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
  * character).
  *
+ * @filename can also be a path such as "a/b/file", or "/a/b/file", to create
+ * the file in an existing subdirectory. Every component of a path follows the
+ * rules of a file name, and the whole path cannot exceed %FS_PATH_MAX_LEN
+ * characters (including the NULL character). The same goes for the other calls
+ * taking a file name.
+ *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if a
  * file named @filename already exists, or if string @filename is too long, or
- * if the root directory already contains %FS_FILE_MAX_COUNT files. 0 otherwise.
+ * if the root directory already contains %FS_FILE_MAX_COUNT files, or if a
+ * subdirectory cannot grow. 0 otherwise.
  */
 int fs_create(const char *filename);
 
@@ -107,14 +333,39 @@ int fs_create(const char *filename);
  * @filename: File name
  *
  * Delete the file named @filename from the root directory of the mounted file
- * system.
+ * system, or from the subdirectory its path leads to.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * there is no file named @filename to delete, or if file @filename is currently
- * open. 0 otherwise.
+ * there is no file named @filename to delete, or if @filename is a directory,
+ * or if file @filename is currently open. 0 otherwise.
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_mkdir - Create a directory
+ * @dirname: Directory name or path
+ *
+ * Create a new and empty directory @dirname, in the root directory or in the
+ * subdirectory its path leads to. A directory takes an entry in its parent
+ * like a file does, and no data block until its first entry is created.
+ *
+ * Return: -1 if no FS is currently mounted, or if @dirname is invalid, or if
+ * a file or directory named @dirname already exists, or if its parent
+ * directory is full. 0 otherwise.
+ */
+int fs_mkdir(const char *dirname);
+
+/**
+ * fs_rmdir - Remove a directory
+ * @dirname: Directory name or path
+ *
+ * Remove the empty directory @dirname and free its data blocks.
+ *
+ * Return: -1 if no FS is currently mounted, or if @dirname is invalid, or if
+ * there is no directory named @dirname, or if it is not empty. 0 otherwise.
+ */
+int fs_rmdir(const char *dirname);
+
 /**
  * fs_ls - List files on file system
  *
@@ -124,9 +375,97 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/**
+ * fs_lsdir - List files of a directory
+ * @dirname: Directory name or path
+ *
+ * Same as fs_ls(), for the files located in directory @dirname. Only the
+ * blocks of that directory are visited.
+ *
+ * Return: -1 if no FS is currently mounted, or if @dirname is invalid, or if
+ * there is no directory named @dirname. 0 otherwise.
+ */
+int fs_lsdir(const char *dirname);
+
+/*
+ * Maximum number of directories open with fs_opendir() at once
+ */
+#define FS_DIR_OPEN_MAX_COUNT 32
+
+/*
+ * A file or directory as returned by fs_readdir() and fs_stat_name()
+ */
+struct fs_dirent {
+    char name[FS_FILENAME_LEN];
+    uint64_t size;
+
+    /* FAT_EOC when nothing is allocated */
+    size_t first_block;
+    /* data blocks the content takes, fewer than @size needs if compressed */
+    size_t block_count;
+
+    bool is_directory;
+    /* marked with fs_set_compression(), and stored compressed */
+    bool compress;
+    bool is_compressed;
+};
+
+/**
+ * fs_opendir - Open a directory for reading
+ * @dirname: Directory name or path, "/" for the root directory
+ *
+ * Open directory @dirname so that fs_readdir() can return its entries, from
+ * the first one on.
+ *
+ * Return: -1 if no FS is currently mounted, or if @dirname is invalid, or if
+ * there is no directory named @dirname, or if there are already
+ * %FS_DIR_OPEN_MAX_COUNT directories currently open. Otherwise, return the
+ * directory descriptor.
+ */
+int fs_opendir(const char *dirname);
+
+/**
+ * fs_readdir - Read directory entries
+ * @dd: Directory descriptor
+ * @entries: Array filled with the entries read
+ * @count: Number of entries @entries holds
+ *
+ * Fill @entries with up to @count of the next entries of the directory
+ * referenced by directory descriptor @dd, in directory order. Entries come
+ * from the cached directory blocks: no file is opened, and only a
+ * subdirectory not walked into yet is read from disk.
+ *
+ * Return: -1 if no FS is currently mounted, or if directory descriptor @dd is
+ * invalid (out of bounds or not currently open). Otherwise return the number
+ * of entries read, 0 once every entry was returned or if the directory was
+ * removed.
+ */
+int fs_readdir(int dd, struct fs_dirent *entries, size_t count);
+
+/**
+ * fs_closedir - Close a directory
+ * @dd: Directory descriptor
+ *
+ * Return: -1 if no FS is currently mounted, or if directory descriptor @dd is
+ * invalid (out of bounds or not currently open). 0 otherwise.
+ */
+int fs_closedir(int dd);
+
+/**
+ * fs_stat_name - Get file status by name
+ * @filename: File or directory name or path
+ * @dirent: Filled with the status of @filename
+ *
+ * Same as fs_readdir() for the single entry @filename, without opening it.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
+ * there is no file or directory named @filename. 0 otherwise.
+ */
+int fs_stat_name(const char *filename, struct fs_dirent *dirent);
+
 /**
  * fs_open - Open a file
- * @filename: File name
+ * @filename: File name or path
  *
  * Open file named @filename for reading and writing, and return the
  * corresponding file descriptor. The file descriptor is a non-negative integer
@@ -137,9 +476,9 @@ int fs_ls(void);
  * simultaneously.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * there is no file named @filename to open, or if there are already
- * %FS_OPEN_MAX_COUNT files currently open. Otherwise, return the file
- * descriptor.
+ * there is no file named @filename to open, or if @filename is a directory,
+ * or if there are already %FS_OPEN_MAX_COUNT files currently open. Otherwise,
+ * return the file descriptor.
  */
 int fs_open(const char *filename);
 
@@ -161,11 +500,24 @@ int fs_close(int fd);
  * Get the current size of the file pointed by file descriptor @fd.
  *
  * Return: -1 if no FS is currently mounted, of if file descriptor @fd is
- * invalid (out of bounds or not currently open). Otherwise return the current
- * size of file.
+ * invalid (out of bounds or not currently open), or if the size of the file
+ * does not fit in an int. Otherwise return the current size of file.
  */
 int fs_stat(int fd);
 
+/**
+ * fs_stat_size - Get the size of a file of any size
+ * @fd: File descriptor
+ * @size: Filled with the current size of the file
+ *
+ * Same as fs_stat(), for files on FS_VERSION_FAT32 disks whose size does not
+ * fit in an int.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open). 0 otherwise.
+ */
+int fs_stat_size(int fd, uint64_t *size);
+
 /**
  * fs_lseek - Set file offset
  * @fd: File descriptor
@@ -201,8 +553,11 @@ int fs_lseek(int fd, size_t offset);
  * number of bytes that were actually written.
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
- * return the number of bytes actually written.
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if a
+ * block could not be written, or a block partially overwritten could not be
+ * read or failed its checksum, before any byte was written. Otherwise return
+ * the number of bytes actually written, fewer than @count if such a block
+ * was reached after some bytes were.
  */
 int fs_write(int fd, void *buf, size_t count);
 
@@ -222,10 +577,342 @@ int fs_write(int fd, void *buf, size_t count);
  * implicitly incremented by the number of bytes that were actually read.
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
- * return the number of bytes actually read.
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if the
+ * first block to read could not be read or failed its checksum. Otherwise
+ * return the number of bytes actually read, fewer than @count if such a block
+ * was reached after some bytes were read.
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_sync - Flush the file system to stable storage
+ *
+ * Commit the metadata changes not yet committed and wait until everything
+ * written so far, data and metadata, is on stable storage. Works the same in
+ * every durability mode.
+ *
+ * Return: -1 if no FS is currently mounted or if flushing failed. 0 otherwise.
+ */
+int fs_sync(void);
+
+/**
+ * fs_fsync - Flush a file to stable storage
+ * @fd: File descriptor
+ *
+ * Make the content and size of the file referenced by file descriptor @fd
+ * durable. The disk image is flushed as a whole, so this costs the same as
+ * fs_sync().
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if flushing failed. 0
+ * otherwise.
+ */
+int fs_fsync(int fd);
+
+/**
+ * fs_snapshot_create - Take a snapshot of the file system
+ * @name: Name of the snapshot
+ *
+ * Freeze the current state of the mounted file system as snapshot @name, which
+ * fs_mount_with() can mount read-only later on. Only the FAT and the
+ * directories are copied: the data blocks of the files are shared until the
+ * live file system writes them, which then moves them to new blocks. Up to
+ * %FS_SNAPSHOT_MAX_COUNT snapshots can be kept.
+ *
+ * Return: -1 if no FS is currently mounted, if it is a snapshot, if @name is
+ * invalid or already taken, if there are too many snapshots, or if the disk
+ * has no room for the copy of the metadata. 0 otherwise.
+ */
+int fs_snapshot_create(const char *name);
+
+/**
+ * fs_snapshot_delete - Delete a snapshot
+ * @name: Name of the snapshot
+ *
+ * Delete snapshot @name, freeing its copy of the metadata and the data blocks
+ * that no other snapshot or file holds.
+ *
+ * Return: -1 if no FS is currently mounted, if it is a snapshot, or if there
+ * is no snapshot @name. 0 otherwise.
+ */
+int fs_snapshot_delete(const char *name);
+
+/**
+ * fs_snapshot_ls - List snapshots
+ *
+ * List the snapshots of the mounted disk.
+ *
+ * Return: -1 if no FS is currently mounted. 0 otherwise.
+ */
+int fs_snapshot_ls(void);
+
+enum fs_copy_mode {
+    /* share the data blocks, copying them when either file writes them */
+    FS_COPY_REFLINK,
+    /* write a copy of every data block */
+    FS_COPY_DEEP,
+};
+
+/**
+ * fs_copy_file - Copy a file
+ * @src: Path of the file to copy
+ * @dst: Path of the copy, which must not exist
+ * @mode: FS_COPY_REFLINK or FS_COPY_DEEP
+ *
+ * Create file @dst with the content of file @src without going through file
+ * descriptors. With %FS_COPY_REFLINK, @dst shares the data blocks of @src, so
+ * that the copy costs a directory entry whatever the size of @src; a write to
+ * either file first gives it its own copy of the blocks from the first shared
+ * one up to the last one written. Files whose tail is packed, and inline ones,
+ * are copied as with %FS_COPY_DEEP, which reads and writes runs of
+ * consecutive blocks with one system call each.
+ *
+ * Return: -1 if no FS is currently mounted, if it is a snapshot, if @src is not
+ * a file, if @dst is invalid or already exists, or if the disk has no room
+ * for the copy. 0 otherwise.
+ */
+int fs_copy_file(const char *src, const char *dst, enum fs_copy_mode mode);
+
+/**
+ * fs_dedup - Deduplicate every file
+ *
+ * Share the data blocks of the files of a disk mounted with
+ * fs_mount_options.dedup with files ending with the same blocks, as
+ * fs_close() does for the files written. Blocks are shared from the first one
+ * of a file whose following blocks all match, like those of reflinked
+ * copies, so a file only shares the end of its content. Files that are open,
+ * inline ones and those whose tail is packed are left alone.
+ *
+ * Return: -1 if no FS is currently mounted, if it was not mounted with
+ * deduplication, or if a block could not be read. The number of data blocks
+ * freed otherwise.
+ */
+int fs_dedup(void);
+
+/**
+ * fs_set_compression - Store a file compressed or not
+ * @filename: File name
+ * @compress: Whether to compress the file
+ *
+ * Mark file @filename to be stored compressed, or not. The content of a marked
+ * file is compressed in units of 16 blocks right away, then whenever the last
+ * descriptor open on it is closed after a write, if that takes fewer blocks.
+ * fs_read() decompresses the unit holding the offset read, and fs_write()
+ * compresses the units it changes again, to new blocks, or stores the file
+ * uncompressed again until it is closed once that saves no block. fs_stat_name()
+ * and fs_readdir() tell the blocks the content takes, while the size stays the
+ * one of the content.
+ *
+ * Return: -1 if no FS is currently mounted, if it is a snapshot, if @filename
+ * is not a file, if it is open, or if there is no room for its content when
+ * @compress is false. 0 otherwise.
+ */
+int fs_set_compression(const char *filename, bool compress);
+
+struct fs_check_options {
+    /* free leaked blocks */
+    bool repair;
+    /* threads walking the chains, 0 for one per online CPU */
+    unsigned int threads;
+    /* print every problem found on stdout */
+    bool verbose;
+    /*
+     * read every block of every file and check its CRC32C, on disks
+     * formatted with checksums. With repair, blocks that do not match are
+     * stamped with their current content.
+     */
+    bool scrub;
+};
+
+struct fs_check_report {
+    /* directory entries in use, subdirectories and what they hold included */
+    size_t files;
+    /* blocks reachable from a file or from the journal */
+    size_t used_blocks;
+    /*
+     * chains that do not end in FAT_EOC: they point past totalDataBlocks,
+     * at a free FAT entry, or back into themselves
+     */
+    size_t bad_chains;
+    /* chains that run into a block another chain already reached */
+    size_t shared_chains;
+    /* files whose chain length does not match their size */
+    size_t size_mismatches;
+    /* blocks used in the FAT that no chain reaches */
+    size_t leaked_blocks;
+    /* leaked blocks freed by repair */
+    size_t repaired_blocks;
+    /* file blocks whose CRC32C does not match, found by scrub */
+    size_t checksum_errors;
+    /* of those, blocks stamped again by repair */
+    size_t restamped_blocks;
+    /* time spent checking, mounting excluded */
+    uint64_t check_ns;
+};
+
+/**
+ * fs_check - Check the consistency of a file system
+ * @diskname: Name of the virtual disk file
+ * @options: Check options, NULL to only report problems
+ * @report: Structure to be filled with what was found
+ *
+ * Mount @diskname, which replays its journal, then walk the chain of every
+ * file from the cached FAT, spread over several threads that share a bitmap
+ * of visited blocks. With @options->repair, leaked blocks are freed before
+ * the file system is unmounted. No file system may be mounted already.
+ *
+ * Return: -1 if @diskname cannot be mounted or if @report is NULL. Otherwise
+ * the number of problems left on the disk, 0 if it is consistent.
+ */
+int fs_check(const char *diskname, const struct fs_check_options *options,
+             struct fs_check_report *report);
+
+/*
+ * Public fs_* calls tracked by fs_stats()
+ */
+enum fs_op {
+    FS_OP_MOUNT,
+    FS_OP_UMOUNT,
+    FS_OP_INFO,
+    FS_OP_CREATE,
+    FS_OP_DELETE,
+    FS_OP_LS,
+    FS_OP_OPEN,
+    FS_OP_CLOSE,
+    FS_OP_STAT,
+    FS_OP_LSEEK,
+    FS_OP_WRITE,
+    FS_OP_READ,
+    FS_OP_SYNC,
+    FS_OP_FSYNC,
+    FS_OP_MKDIR,
+    FS_OP_RMDIR,
+    FS_OP_SNAPSHOT_CREATE,
+    FS_OP_SNAPSHOT_DELETE,
+    FS_OP_COPY,
+    FS_OP_DEDUP,
+    FS_OP_COMPRESS,
+    FS_OP_LSDIR,
+    FS_OP_OPENDIR,
+    FS_OP_READDIR,
+    FS_OP_CLOSEDIR,
+    FS_OP_STAT_SIZE,
+    FS_OP_STAT_NAME,
+    FS_OP_SNAPSHOT_LS,
+    FS_OP_COUNT
+};
+
+/*
+ * Counters for one public fs_* call. Block reads, writes, bytes and syncs
+ * are the block layer work issued while the call was running.
+ */
+struct fs_op_stats {
+    uint64_t calls;
+    uint64_t bytes_requested;
+    uint64_t block_reads;
+    uint64_t block_writes;
+    uint64_t block_bytes;
+    uint64_t block_syncs;
+    uint64_t wall_ns;
+};
+
+struct fs_stats {
+    struct fs_op_stats ops[FS_OP_COUNT];
+
+    /*
+     * Totals for the block layer, including I/O issued outside of
+     * any fs_* call
+     */
+    uint64_t block_reads;
+    uint64_t block_writes;
+    uint64_t block_bytes;
+    uint64_t block_syncs;
+
+    /*
+     * Mounts of a disk marked clean, and of one that was not. Time spent
+     * mounting is ops[FS_OP_MOUNT].wall_ns, the part of it spent checking
+     * disks that were not clean is mount_check_ns.
+     */
+    uint64_t clean_mounts;
+    uint64_t dirty_mounts;
+    uint64_t mount_check_ns;
+    uint64_t mount_repaired_blocks;
+
+    /* data block reads checked against their CRC32C, and failed checks */
+    uint64_t blocks_verified;
+    uint64_t checksum_errors;
+};
+
+/**
+ * fs_stats - Get I/O accounting counters
+ * @stats: Structure to be filled with the counters
+ *
+ * Copy the per-operation counters collected since the program started, or
+ * since the last call to fs_stats_reset(), into @stats. Counters are kept
+ * across mounts.
+ *
+ * Return: -1 if @stats is NULL. 0 otherwise.
+ */
+int fs_stats(struct fs_stats *stats);
+
+/**
+ * fs_stats_reset - Reset I/O accounting counters
+ *
+ * Reset the counters returned by fs_stats() and the latency histograms used
+ * by fs_latency(), typically between benchmark phases.
+ */
+void fs_stats_reset(void);
+
+/**
+ * fs_op_name - Get the printable name of an operation
+ * @op: Operation, or one of the %FS_LAT_BLOCK_* latency sources
+ *
+ * Return: name of @op, such as "write".
+ */
+const char *fs_op_name(int op);
+
+/*
+ * Latency histograms are kept for every fs_* call (indexed by enum fs_op)
+ * and for the block layer backends.
+ */
+enum {
+    FS_LAT_BLOCK_READ = FS_OP_COUNT,
+    FS_LAT_BLOCK_WRITE,
+    FS_LAT_BLOCK_SYNC,
+    FS_LAT_COUNT
+};
+
+struct fs_latency {
+    uint64_t count;
+    uint64_t min_ns;
+    uint64_t mean_ns;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+    uint64_t max_ns;
+};
+
+/**
+ * fs_latency - Get latency percentiles of an operation
+ * @source: enum fs_op value or one of the %FS_LAT_BLOCK_* sources
+ * @lat: Structure to be filled with the percentiles
+ *
+ * Merge the latency histograms recorded by every thread for @source and
+ * compute its percentiles. Percentiles are reported as the upper bound of
+ * the histogram bucket they fall in, which is within 1/16th of the actual
+ * value. All fields are 0 if nothing was recorded.
+ *
+ * Return: -1 if @source is out of bounds or @lat is NULL. 0 otherwise.
+ */
+int fs_latency(int source, struct fs_latency *lat);
+
+/**
+ * fs_latency_percentile - Get an arbitrary latency percentile
+ * @source: enum fs_op value or one of the %FS_LAT_BLOCK_* sources
+ * @percentile: Percentile in [0, 100]
+ *
+ * Return: latency in nanoseconds, 0 if nothing was recorded for @source.
+ */
+uint64_t fs_latency_percentile(int source, double percentile);
 
 #endif /* _FS_H */
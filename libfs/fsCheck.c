@@ -0,0 +1,704 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fsCheck.h"
+#include "blockChecksum.h"
+#include "dedup.h"
+#include "directory.h"
+#include "fragment.h"
+#include "journal.h"
+#include "metadata.h"
+#include "snapshot.h"
+#include "stats.h"
+
+enum chain_status{
+    CHAIN_OK,
+    /* points at reserved block 0 or past totalDataBlocks */
+    CHAIN_OUT_OF_RANGE,
+    /* reaches a block whose FAT entry is 0 */
+    CHAIN_FREE_BLOCK,
+    /* reaches a block already visited, by itself or another chain */
+    CHAIN_VISITED
+};
+
+struct chain_result{
+    enum chain_status status;
+    /* blocks walked before stopping */
+    size_t blocks;
+    /* block the walk stopped at, when status is not CHAIN_OK */
+    size_t bad_block;
+    /* last block of the chain, when status is CHAIN_OK */
+    size_t last_block;
+};
+
+/*
+ * State shared by the threads walking the chains
+ */
+struct check_state{
+    /* the FAT, with 32 bit entries if wide */
+    const void* fat;
+    bool wide;
+    size_t blocks;
+
+    /* one bit per data block, set by the first chain reaching it */
+    uint64_t* visited;
+
+    /* one bit per data block, set for the fragment blocks packed tails end in */
+    uint64_t* fragments;
+
+    /*
+     * entries in use in every directory, subdirectories included, and
+     * what walking their chain found
+     */
+    struct DirEntry** entries;
+    struct chain_result* results;
+    size_t entry_count;
+    size_t entry_capacity;
+
+    /* next index in entries to hand out */
+    size_t next;
+};
+
+static inline uint32_t fat_next(const struct check_state* state, size_t block){
+    if(state->wide){
+        return ((const uint32_t*)state->fat)[block];
+    }
+
+    return ((const uint16_t*)state->fat)[block];
+}
+
+/*
+ * Returns: true if @block was already visited
+ */
+static inline bool test_and_visit(uint64_t* visited, size_t block){
+    uint64_t bit = (uint64_t)1 << (block % 64);
+
+    return (__atomic_fetch_or(&visited[block / 64], bit, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+static inline bool is_visited(const uint64_t* visited, size_t block){
+    return (visited[block / 64] >> (block % 64)) & 1;
+}
+
+/*
+ * Walks the chain from @first. The last block of a @packed chain is a
+ * fragment block, which other chains may end in too.
+ */
+static void walk_chain(struct check_state* state, size_t first, bool packed,
+        struct chain_result* result){
+
+    size_t block = first;
+
+    result->status = CHAIN_OK;
+    result->blocks = 0;
+    result->bad_block = 0;
+    result->last_block = FAT_EOC;
+
+    if(first==FAT_EOC){
+        return;
+    }
+
+    while(1){
+        if(block==0 || block >= state->blocks){
+            result->status = CHAIN_OUT_OF_RANGE;
+            break;
+        }
+
+        if(fat_next(state, block)==0){
+            result->status = CHAIN_FREE_BLOCK;
+            break;
+        }
+
+        bool tail = packed && fat_next(state, block)==FAT_EOC;
+
+        if(tail){
+            test_and_visit(state->fragments, block);
+        } else if(test_and_visit(state->visited, block)){
+            result->status = CHAIN_VISITED;
+            break;
+        }
+
+        result->blocks++;
+
+        if(fat_next(state, block)==FAT_EOC){
+            result->last_block = block;
+            return;
+        }
+
+        block = fat_next(state, block);
+    }
+
+    result->bad_block = block;
+}
+
+static void* walk_entries(void* arg){
+    struct check_state* state = (struct check_state*)arg;
+
+    while(1){
+        size_t next = __atomic_fetch_add(&state->next, 1, __ATOMIC_RELAXED);
+
+        if(next >= state->entry_count){
+            return NULL;
+        }
+
+        struct DirEntry* entry = state->entries[next];
+
+        walk_chain(state, dir_entry_first_block(entry), dir_entry_is_packed(entry),
+                &state->results[next]);
+    }
+}
+
+/*
+ * A chain that stopped on a visited block either loops back into itself
+ * or runs into another chain. Walking it again up to where it stopped
+ * tells which.
+ */
+static bool loops_back(struct check_state* state, size_t first,
+        struct chain_result* result){
+
+    size_t block = first;
+
+    for(size_t step = 0; step < result->blocks; step++){
+        if(block==result->bad_block){
+            return true;
+        }
+
+        block = fat_next(state, block);
+    }
+
+    return false;
+}
+
+static unsigned int thread_count(const struct fs_check_options* options,
+        size_t entry_count){
+
+    long threads = options->threads;
+
+    if(threads==0){
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    if(threads < 1){
+        threads = 1;
+    }
+
+    if((size_t)threads > entry_count){
+        threads = entry_count==0 ? 1 : (long)entry_count;
+    }
+
+    return (unsigned int)threads;
+}
+
+static void walk_all(struct check_state* state, unsigned int threads){
+    if(threads<=1){
+        walk_entries(state);
+        return;
+    }
+
+    pthread_t* workers = (pthread_t*)calloc(threads - 1, sizeof(pthread_t));
+    size_t started = 0;
+
+    for(; workers!=NULL && started < threads - 1; started++){
+        if(pthread_create(&workers[started], NULL, walk_entries, state)){
+            break;
+        }
+    }
+
+    //this thread works too, and alone if no worker could be started
+    walk_entries(state);
+
+    for(size_t worker = 0; worker < started; worker++){
+        pthread_join(workers[worker], NULL);
+    }
+
+    free(workers);
+}
+
+/*
+ * The journal and the checksum region are chains of consecutive blocks
+ * that no directory entry points to
+ */
+static void check_region(struct check_state* state, const char* name,
+        size_t start_index, size_t blocks, bool verbose,
+        struct fs_check_report* report){
+
+    if(blocks==0){
+        return;
+    }
+
+    size_t first = start_index - volume.data_start_index;
+
+    struct chain_result result;
+
+    walk_chain(state, first, false, &result);
+
+    bool contiguous = result.status==CHAIN_OK && result.blocks==blocks;
+
+    for(size_t block = first; contiguous && block + 1 < first + result.blocks; block++){
+        contiguous = fat_next(state, block)==block + 1;
+    }
+
+    if(!contiguous){
+        report->bad_chains++;
+
+        if(verbose){
+            printf("fs_check: %s: chain is not %zu consecutive blocks from block %zu\n",
+                    name, blocks, first);
+        }
+    }
+}
+
+/*
+ * Snapshot regions are chains no directory entry points to either, not
+ * always of consecutive blocks
+ */
+static void check_snapshots(struct check_state* state, bool verbose,
+        struct fs_check_report* report){
+
+    size_t first;
+    size_t blocks;
+
+    for(size_t index = 0; snapshot_region(index, &first, &blocks); index++){
+        struct chain_result result;
+
+        walk_chain(state, first, false, &result);
+
+        if(result.status!=CHAIN_OK || result.blocks!=blocks){
+            report->bad_chains++;
+
+            if(verbose){
+                printf("fs_check: snapshot %zu: chain is not %zu blocks from block %zu\n",
+                        index, blocks, first);
+            }
+        }
+    }
+}
+
+/*
+ * The region of the deduplication index is one more chain
+ */
+static void check_dedup(struct check_state* state, bool verbose,
+        struct fs_check_report* report){
+
+    size_t first;
+    size_t blocks;
+
+    if(!dedup_region(&first, &blocks)){
+        return;
+    }
+
+    struct chain_result result;
+
+    walk_chain(state, first, false, &result);
+
+    if(result.status!=CHAIN_OK || result.blocks!=blocks){
+        report->bad_chains++;
+
+        if(verbose){
+            printf("fs_check: dedup index: chain is not %zu blocks from block %zu\n",
+                    blocks, first);
+        }
+    }
+}
+
+/*
+ * Reads every block of the chains that checked out and compares it with
+ * its checksum
+ */
+static void scrub(struct check_state* state, const struct fs_check_options* options,
+        struct fs_check_report* report){
+
+    uint8_t* buffer = (uint8_t*)malloc(block_size);
+
+    if(buffer==NULL){
+        return;
+    }
+
+    for(size_t i = 0; i < state->entry_count; i++){
+        struct DirEntry* entry = state->entries[i];
+
+        //directory blocks are journaled instead
+        if(state->results[i].status!=CHAIN_OK || dir_entry_is_directory(entry)){
+            continue;
+        }
+
+        for(size_t block = dir_entry_first_block(entry); block!=FAT_EOC;
+                block = fat_next(state, block)){
+            size_t disk_block = get_actual_block_index(block);
+
+            //fragment blocks are journaled too
+            if(dir_entry_is_packed(entry) && fat_next(state, block)==FAT_EOC){
+                continue;
+            }
+
+            if(!checksums_cover(disk_block) || block_read(disk_block, buffer)){
+                continue;
+            }
+
+            if(checksum_matches(disk_block, buffer)){
+                continue;
+            }
+
+            report->checksum_errors++;
+
+            if(options->verbose){
+                printf("fs_check: %s: block %zu does not match its checksum%s\n",
+                        (const char*)entry->filename, block,
+                        options->repair ? ", stamped again" : "");
+            }
+
+            if(options->repair){
+                struct iovec iov = { buffer, block_size };
+
+                checksums_stamp(disk_block, &iov, 1);
+                report->restamped_blocks++;
+            }
+        }
+    }
+
+    free(buffer);
+}
+
+/*
+ * On FS_FEATURE_REFLINK disks, chains may end in the blocks of another.
+ * A chain that ran into one is counted to its end, which the chain that
+ * got there first was checked up to.
+ */
+static void join_shared(struct check_state* state, size_t first,
+        struct chain_result* result){
+
+    if((volume.features & FS_FEATURE_REFLINK)==0 || result->status!=CHAIN_VISITED
+            || loops_back(state, first, result)){
+        return;
+    }
+
+    size_t block = result->bad_block;
+
+    for(size_t step = 0; step < state->blocks; step++){
+        if(block==0 || block >= state->blocks || fat_next(state, block)==0){
+            return;
+        }
+
+        result->blocks++;
+
+        if(fat_next(state, block)==FAT_EOC){
+            result->status = CHAIN_OK;
+            result->last_block = block;
+            return;
+        }
+
+        block = fat_next(state, block);
+    }
+}
+
+static void report_chain(struct check_state* state, struct DirEntry* entry,
+        struct chain_result* result, bool verbose,
+        struct fs_check_report* report){
+
+    const char* name = (const char*)entry->filename;
+
+    join_shared(state, dir_entry_first_block(entry), result);
+
+    size_t size = (size_t)dir_entry_size(entry);
+
+    //inline files have no chain, compressed ones a shorter one
+    size_t expected_blocks = dir_entry_is_inline(entry) ? 0 : total_block_size(size);
+
+    switch(result->status){
+    case CHAIN_OK:
+        if(dir_entry_is_inline(entry) && size > dir_inline_max()){
+            report->size_mismatches++;
+
+            if(verbose){
+                printf("fs_check: %s: %zu bytes do not fit inline\n", name, size);
+            }
+        } else if(dir_entry_is_compressed(entry)
+                ? result->blocks==0 || result->blocks > expected_blocks
+                : result->blocks!=expected_blocks){
+            report->size_mismatches++;
+
+            if(verbose){
+                printf("fs_check: %s: %zu blocks for %zu bytes\n",
+                        name, result->blocks, size);
+            }
+        } else if(dir_entry_is_packed(entry) && is_visited(state->visited, result->last_block)){
+            report->shared_chains++;
+
+            if(verbose){
+                printf("fs_check: %s: fragment block %zu belongs to another chain\n",
+                        name, result->last_block);
+            }
+        } else if(dir_entry_is_packed(entry)
+                && !fragment_valid(result->last_block, dir_entry_fragment(entry),
+                        size - ((result->blocks - 1) << block_shift))){
+            report->bad_chains++;
+
+            if(verbose){
+                printf("fs_check: %s: block %zu has no fragment in slot %zu\n",
+                        name, result->last_block, dir_entry_fragment(entry));
+            }
+        }
+        break;
+    case CHAIN_OUT_OF_RANGE:
+        report->bad_chains++;
+
+        if(verbose){
+            printf("fs_check: %s: chain points to block %zu, out of range\n",
+                    name, result->bad_block);
+        }
+        break;
+    case CHAIN_FREE_BLOCK:
+        report->bad_chains++;
+
+        if(verbose){
+            printf("fs_check: %s: chain runs into free block %zu\n",
+                    name, result->bad_block);
+        }
+        break;
+    case CHAIN_VISITED:
+        if(loops_back(state, dir_entry_first_block(entry), result)){
+            report->bad_chains++;
+
+            if(verbose){
+                printf("fs_check: %s: chain loops back to block %zu\n",
+                        name, result->bad_block);
+            }
+        } else {
+            report->shared_chains++;
+
+            if(verbose){
+                printf("fs_check: %s: block %zu belongs to another chain\n",
+                        name, result->bad_block);
+            }
+        }
+        break;
+    }
+}
+
+/*
+ * Adds the used entries of @dir to the state, then those of the
+ * subdirectories it holds, reading them if they were not walked into.
+ * A subdirectory that cannot be read is left to the walk of its chain.
+ *
+ * Returns: 0 on success, -1 if memory ran out
+ */
+static int collect_entries(struct check_state* state, struct directory* dir){
+    for(size_t i = dir_next_used(dir, 0); i < dir_capacity(dir); i = dir_next_used(dir, i + 1)){
+        if(state->entry_count==state->entry_capacity){
+            size_t capacity = state->entry_capacity==0 ? 256 : 2 * state->entry_capacity;
+
+            struct DirEntry** entries = (struct DirEntry**)realloc(state->entries,
+                    capacity * sizeof(struct DirEntry*));
+
+            if(entries==NULL){
+                return -1;
+            }
+
+            state->entries = entries;
+            state->entry_capacity = capacity;
+        }
+
+        struct DirEntry* entry = dir_entry(dir, i);
+
+        state->entries[state->entry_count++] = entry;
+
+        struct directory* child = dir_child(dir, i);
+
+        if(child!=NULL && collect_entries(state, child)){
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Returns: true if the leak scan covers the FAT block holding the entry
+ * of data block @block
+ */
+static bool in_scope(size_t block, bool replayed_only){
+    if(!replayed_only){
+        return true;
+    }
+
+    return journal_replayed(get_fat_block_index(block));
+}
+
+static size_t check(const struct fs_check_options* options,
+        struct fs_check_report* report, bool replayed_only){
+
+    uint64_t start_ns = stats_now_ns();
+
+    memset(report, 0, sizeof(struct fs_check_report));
+
+    struct check_state state;
+
+    memset(&state, 0, sizeof(struct check_state));
+
+    state.fat = metadata_fat();
+    state.wide = volume.fat_entry_size==sizeof(uint32_t);
+    state.blocks = data_blocks;
+    state.visited = (uint64_t*)calloc(data_blocks / 64 + 1, sizeof(uint64_t));
+    state.fragments = (uint64_t*)calloc(data_blocks / 64 + 1, sizeof(uint64_t));
+
+    if(state.fat!=NULL && state.visited!=NULL && state.fragments!=NULL
+            && collect_entries(&state, dir_root())==0){
+        state.results = (struct chain_result*)calloc(state.entry_count + 1,
+                sizeof(struct chain_result));
+    }
+
+    if(state.fat==NULL || state.visited==NULL || state.results==NULL){
+        free(state.visited);
+        free(state.fragments);
+        free(state.entries);
+        free(state.results);
+
+        //nothing could be checked, report that as a problem
+        return 1;
+    }
+
+    //data block 0 is reserved
+    test_and_visit(state.visited, 0);
+
+    if(fat_next(&state, 0)!=FAT_EOC){
+        report->bad_chains++;
+
+        if(options->verbose){
+            printf("fs_check: reserved FAT entry 0 is %u, not FAT_EOC\n",
+                    (unsigned int)fat_next(&state, 0));
+        }
+    }
+
+    check_region(&state, "journal", volume.journal_start_index,
+            volume.journal_blocks, options->verbose, report);
+    check_region(&state, "checksums", volume.checksum_start_index,
+            volume.checksum_blocks, options->verbose, report);
+
+    check_snapshots(&state, options->verbose, report);
+    check_dedup(&state, options->verbose, report);
+
+    report->files = state.entry_count;
+
+    walk_all(&state, thread_count(options, state.entry_count));
+
+    for(size_t i = 0; i < state.entry_count; i++){
+        report_chain(&state, state.entries[i], &state.results[i], options->verbose, report);
+    }
+
+    if(options->scrub){
+        scrub(&state, options, report);
+    }
+
+    for(size_t block = 1; block < data_blocks; block++){
+        if(is_visited(state.visited, block) || is_visited(state.fragments, block)){
+            report->used_blocks++;
+            continue;
+        }
+
+        //freed by the file system, still read by a snapshot
+        if(fat_next(&state, block)==FAT_HELD && snapshot_held(block)){
+            report->used_blocks++;
+            continue;
+        }
+
+        if(fat_next(&state, block)==0 || !in_scope(block, replayed_only)){
+            continue;
+        }
+
+        report->leaked_blocks++;
+
+        if(options->verbose){
+            printf("fs_check: block %zu is used but no chain reaches it%s\n",
+                    block, options->repair ? ", freed" : "");
+        }
+
+        if(options->repair){
+            set_fat_entry(block, 0);
+            report->repaired_blocks++;
+        }
+    }
+
+    free(state.visited);
+    free(state.fragments);
+    free(state.entries);
+    free(state.results);
+
+    report->check_ns = stats_now_ns() - start_ns;
+
+    return report->bad_chains + report->shared_chains + report->size_mismatches
+         + report->leaked_blocks - report->repaired_blocks
+         + report->checksum_errors - report->restamped_blocks;
+}
+
+size_t check_mounted(const struct fs_check_options* options,
+        struct fs_check_report* report){
+
+    return check(options, report, false);
+}
+
+size_t check_unclean_mount(struct fs_check_report* report){
+    struct fs_check_options options = {
+        .repair = true,
+    };
+
+    //blocks a superblock change left to free may be anywhere in the FAT
+    if(!journal_enabled() || diskMetadata->state==FS_STATE_CHECK){
+        return check(&options, report, false);
+    }
+
+    //replayed transactions are the only changes the crash may have cut short
+    for(size_t block = FAT_BLOCK_START_INDEX; block < root_directory_index; block++){
+        if(journal_replayed(block)){
+            return check(&options, report, true);
+        }
+    }
+
+    memset(report, 0, sizeof(struct fs_check_report));
+
+    return 0;
+}
+
+int fs_check(const char *diskname, const struct fs_check_options *options,
+             struct fs_check_report *report)
+{
+    struct fs_check_options defaults;
+
+    //report what is on the disk, not what mounting it repaired
+    struct fs_mount_options mount_options = {
+        .durability = FS_DURABILITY_METADATA,
+        .verify = FS_VERIFY_OFF,
+        .skip_check = true,
+    };
+
+    if(report==NULL || disk_mounted==true){
+        return -1;
+    }
+
+    if(options==NULL){
+        memset(&defaults, 0, sizeof(struct fs_check_options));
+        options = &defaults;
+    }
+
+    if(fs_mount_with(diskname, &mount_options)){
+        return -1;
+    }
+
+    size_t problems = check_mounted(options, report);
+
+    //so that the next mount repairs what it can
+    if(problems!=0){
+        metadata_keep_dirty();
+    }
+
+    if(fs_umount()){
+        return -1;
+    }
+
+    return (int)problems;
+}
@@ -0,0 +1,27 @@
+#ifndef FSCHECK_H_
+#define FSCHECK_H_
+
+#include <stddef.h>
+
+#include "fs.h"
+
+/*
+ * Checks the mounted file system from the metadata cache, and frees
+ * leaked blocks if @options->repair is set
+ *
+ * Returns: the number of problems left
+ */
+size_t check_mounted(const struct fs_check_options* options,
+        struct fs_check_report* report);
+
+/*
+ * Checks a disk mounted without being marked clean and frees the leaked
+ * blocks found. On disks with a journal, the leak scan only covers the FAT
+ * blocks replayed at mount, and nothing is checked if none was, unless
+ * the disk says FS_STATE_CHECK.
+ *
+ * Returns: the number of problems left
+ */
+size_t check_unclean_mount(struct fs_check_report* report);
+
+#endif
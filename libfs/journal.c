@@ -0,0 +1,489 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "checksum.h"
+#include "disk.h"
+#include "fs.h"
+#include "journal.h"
+#include "metadata.h"
+
+/* targets that fit in a descriptor block */
+#define DESCRIPTOR_TARGETS \
+    ((block_size - sizeof(struct JournalDescriptor)) / sizeof(uint32_t))
+
+static bool enabled = false;
+
+static bool use_barriers = false;
+
+static size_t journal_start = 0;
+static size_t journal_blocks = 0;
+
+/* metadata blocks live in [1, metadata_end) */
+static size_t metadata_end = 0;
+
+/* directory blocks attached to the metadata cache live in [metadata_end, data_end) */
+static size_t data_end = 0;
+
+/* most blocks a transaction carries on this journal */
+static size_t capacity = 0;
+
+/* sequence number the next transaction gets */
+static uint64_t sequence = 0;
+
+/* journal block the next transaction starts at */
+static size_t head = 1;
+
+/* metadata blocks committed since the last checkpoint */
+static bool* checkpoint_pending = NULL;
+
+/* and the directory blocks, which are few */
+static size_t* pending_directory_blocks = NULL;
+static size_t pending_directory_count = 0;
+
+/* metadata blocks written by replay() when the journal was opened */
+static bool* replayed_blocks = NULL;
+
+static uint8_t* descriptor_block = NULL;
+static uint8_t* commit_block = NULL;
+
+static size_t transaction_blocks(size_t metadata_blocks){
+    return metadata_blocks < JOURNAL_TRANSACTION_BLOCKS ? metadata_blocks
+                                                        : JOURNAL_TRANSACTION_BLOCKS;
+}
+
+size_t journal_min_blocks(size_t metadata_blocks){
+    return 1 + transaction_blocks(metadata_blocks) + 2;
+}
+
+size_t journal_format_blocks(size_t metadata_blocks){
+    return 1 + 4 * (transaction_blocks(metadata_blocks + JOURNAL_DIRECTORY_BLOCKS) + 2);
+}
+
+bool journal_enabled(){
+    return enabled;
+}
+
+bool journal_replayed(size_t block){
+    return enabled && block < metadata_end && replayed_blocks[block];
+}
+
+static size_t largest_transaction(){
+    return capacity + 2;
+}
+
+size_t journal_transaction_blocks(){
+    return capacity;
+}
+
+/*
+ * Returns: true if a transaction can carry block @block: a metadata block
+ * or a data block outside of the journal
+ */
+static bool valid_target(size_t block){
+    if(block < FAT_BLOCK_START_INDEX || block >= data_end){
+        return false;
+    }
+
+    return block < journal_start || block >= journal_start + journal_blocks;
+}
+
+static int write_header(){
+    memset(descriptor_block, 0, block_size);
+
+    struct JournalHeader* header = (struct JournalHeader*)descriptor_block;
+
+    memcpy(header->signature, JOURNAL_SIGNATURE, 8);
+    header->sequence = sequence;
+
+    return block_write(journal_start, descriptor_block);
+}
+
+/*
+ * Zeroes the whole journal and starts over at sequence 1. Used when the
+ * header is unreadable: old transactions could otherwise match the
+ * sequence numbers handed out from now on.
+ */
+static int reset_journal(){
+    memset(descriptor_block, 0, block_size);
+
+    for(size_t block = 0; block < journal_blocks; block++){
+        if(block_write(journal_start + block, descriptor_block)){
+            return -1;
+        }
+    }
+
+    sequence = 1;
+    if(use_barriers && block_sync()){
+        return -1;
+    }
+
+    head = 1;
+
+    return write_header();
+}
+
+/*
+ * Reads the transaction starting at journal block @position into
+ * @buffer (descriptor, then the images).
+ *
+ * Returns: the number of blocks it carries, 0 if there is no valid
+ * transaction with the expected sequence number there
+ */
+static size_t read_transaction(size_t position, uint8_t* buffer){
+    if(position + 2 > journal_blocks){
+        return 0;
+    }
+
+    if(block_read(journal_start + position, buffer)){
+        return 0;
+    }
+
+    struct JournalDescriptor* descriptor = (struct JournalDescriptor*)buffer;
+
+    if(memcmp(descriptor->signature, JOURNAL_DESCRIPTOR_SIGNATURE, 8)!=0
+            || descriptor->sequence!=sequence){
+        return 0;
+    }
+
+    size_t count = descriptor->count;
+
+    if(count==0 || count > capacity || position + count + 2 > journal_blocks){
+        return 0;
+    }
+
+    for(size_t i = 0; i < count; i++){
+        if(!valid_target(descriptor->targets[i])){
+            return 0;
+        }
+    }
+
+    struct iovec iov[2] = {
+        { &buffer[block_size], count * block_size },
+        { commit_block, block_size },
+    };
+
+    if(block_readv(journal_start + position + 1, iov, 2)){
+        return 0;
+    }
+
+    struct JournalCommit* commit = (struct JournalCommit*)commit_block;
+
+    if(memcmp(commit->signature, JOURNAL_COMMIT_SIGNATURE, 8)!=0
+            || commit->sequence!=sequence || commit->count!=count){
+        return 0;
+    }
+
+    if(crc32c(0, buffer, (count + 1) * block_size)!=commit->checksum){
+        return 0;
+    }
+
+    return count;
+}
+
+static int replay(){
+    uint8_t* buffer = (uint8_t*)malloc((largest_transaction() - 1) * block_size);
+
+    if(buffer==NULL){
+        return -1;
+    }
+
+    size_t replayed = 0;
+
+    while(1){
+        size_t count = read_transaction(head, buffer);
+
+        if(count==0){
+            break;
+        }
+
+        struct JournalDescriptor* descriptor = (struct JournalDescriptor*)buffer;
+
+        for(size_t i = 0; i < count; i++){
+            if(block_write(descriptor->targets[i], &buffer[(i + 1) * block_size])){
+                free(buffer);
+                return -1;
+            }
+
+            if(descriptor->targets[i] < metadata_end){
+                replayed_blocks[descriptor->targets[i]] = true;
+            }
+        }
+
+        head += count + 2;
+        sequence++;
+        replayed++;
+    }
+
+    free(buffer);
+
+    head = 1;
+
+    //an empty journal needs no new header
+    if(replayed==0){
+        return 0;
+    }
+
+    if(block_sync()){
+        return -1;
+    }
+
+    return write_header();
+}
+
+int journal_open(bool barriers, bool replay_transactions){
+    enabled = false;
+    use_barriers = barriers;
+
+    if(volume.journal_blocks==0){
+        return 0;
+    }
+
+    journal_start = volume.journal_start_index;
+    journal_blocks = volume.journal_blocks;
+    metadata_end = volume.data_start_index;
+    data_end = volume.data_start_index + volume.data_blocks;
+
+    /*
+     * Journals hold four transactions of every metadata block at least,
+     * the ones formatted since directory blocks are journaled hold more
+     */
+    capacity = transaction_blocks(metadata_end - 1);
+
+    if((journal_blocks - 1) / 4 > capacity + 2){
+        capacity = (journal_blocks - 1) / 4 - 2;
+    }
+
+    if(capacity > JOURNAL_TRANSACTION_BLOCKS){
+        capacity = JOURNAL_TRANSACTION_BLOCKS;
+    }
+
+    if(capacity > DESCRIPTOR_TARGETS){
+        capacity = DESCRIPTOR_TARGETS;
+    }
+
+    descriptor_block = (uint8_t*)calloc(1, block_size);
+    commit_block = (uint8_t*)calloc(1, block_size);
+    checkpoint_pending = (bool*)calloc(metadata_end, sizeof(bool));
+    replayed_blocks = (bool*)calloc(metadata_end, sizeof(bool));
+    pending_directory_blocks = (size_t*)calloc(journal_blocks, sizeof(size_t));
+
+    if(descriptor_block==NULL || commit_block==NULL || checkpoint_pending==NULL
+            || replayed_blocks==NULL || pending_directory_blocks==NULL){
+        journal_close();
+        return -1;
+    }
+
+    if(block_read(journal_start, descriptor_block)){
+        journal_close();
+        return -1;
+    }
+
+    struct JournalHeader* header = (struct JournalHeader*)descriptor_block;
+
+    int ret;
+
+    head = 1;
+
+    if(memcmp(header->signature, JOURNAL_SIGNATURE, 8)!=0 || header->sequence==0){
+        ret = reset_journal();
+    } else {
+        sequence = header->sequence;
+        ret = replay_transactions ? replay() : 0;
+    }
+
+    if(ret){
+        journal_close();
+        return -1;
+    }
+
+    enabled = true;
+
+    return 0;
+}
+
+void journal_close(){
+    free(descriptor_block);
+    free(commit_block);
+    free(checkpoint_pending);
+    free(replayed_blocks);
+    free(pending_directory_blocks);
+
+    descriptor_block = NULL;
+    commit_block = NULL;
+    checkpoint_pending = NULL;
+    replayed_blocks = NULL;
+    pending_directory_blocks = NULL;
+    pending_directory_count = 0;
+
+    enabled = false;
+    use_barriers = false;
+    journal_start = 0;
+    journal_blocks = 0;
+    metadata_end = 0;
+    data_end = 0;
+    capacity = 0;
+    sequence = 0;
+    head = 1;
+}
+
+/*
+ * Every journaled block takes a journal block, so the list never holds
+ * more than the journal
+ */
+static void add_pending_directory_block(size_t block){
+    for(size_t i = 0; i < pending_directory_count; i++){
+        if(pending_directory_blocks[i]==block){
+            return;
+        }
+    }
+
+    pending_directory_blocks[pending_directory_count++] = block;
+}
+
+int journal_commit(const size_t* blocks, size_t count){
+    if(!enabled || count==0){
+        return 0;
+    }
+
+    if(count > capacity || head + count + 2 > journal_blocks){
+        return -1;
+    }
+
+    //data blocks, and the header of a fresh journal, go first
+    if(use_barriers && block_sync()){
+        return -1;
+    }
+
+    struct iovec* iov = (struct iovec*)malloc((count + 2) * sizeof(struct iovec));
+
+    if(iov==NULL){
+        return -1;
+    }
+
+    memset(descriptor_block, 0, block_size);
+    memset(commit_block, 0, block_size);
+
+    struct JournalDescriptor* descriptor = (struct JournalDescriptor*)descriptor_block;
+
+    memcpy(descriptor->signature, JOURNAL_DESCRIPTOR_SIGNATURE, 8);
+    descriptor->sequence = sequence;
+    descriptor->count = (uint32_t)count;
+
+    iov[0].iov_base = descriptor_block;
+    iov[0].iov_len = block_size;
+
+    for(size_t i = 0; i < count; i++){
+        descriptor->targets[i] = (uint32_t)blocks[i];
+
+        iov[i + 1].iov_base = metadata_block(blocks[i]);
+        iov[i + 1].iov_len = block_size;
+    }
+
+    uint32_t checksum = 0;
+
+    for(size_t i = 0; i < count + 1; i++){
+        checksum = crc32c(checksum, iov[i].iov_base, block_size);
+    }
+
+    struct JournalCommit* commit = (struct JournalCommit*)commit_block;
+
+    memcpy(commit->signature, JOURNAL_COMMIT_SIGNATURE, 8);
+    commit->sequence = sequence;
+    commit->count = (uint32_t)count;
+    commit->checksum = checksum;
+
+    iov[count + 1].iov_base = commit_block;
+    iov[count + 1].iov_len = block_size;
+
+    int ret = block_writev(journal_start + head, iov, (int)count + 2);
+
+    free(iov);
+
+    if(ret){
+        return -1;
+    }
+
+    for(size_t i = 0; i < count; i++){
+        if(blocks[i] < metadata_end){
+            checkpoint_pending[blocks[i]] = true;
+        } else {
+            add_pending_directory_block(blocks[i]);
+        }
+    }
+
+    head += count + 2;
+    sequence++;
+
+    //the cache holds exactly the committed state right now
+    if(head + largest_transaction() > journal_blocks){
+        return journal_checkpoint();
+    }
+
+    return 0;
+}
+
+int journal_checkpoint(){
+    if(!enabled || head==1){
+        return 0;
+    }
+
+    if(use_barriers && block_sync()){
+        return -1;
+    }
+
+    size_t block = FAT_BLOCK_START_INDEX;
+
+    //pending blocks are adjacent in the cache too, write them in runs
+    while(block < metadata_end){
+        if(!checkpoint_pending[block]){
+            block++;
+            continue;
+        }
+
+        size_t run = 0;
+
+        while(block + run < metadata_end && checkpoint_pending[block + run]){
+            run++;
+        }
+
+        struct iovec iov = { metadata_block(block), run * block_size };
+
+        if(block_writev(block, &iov, 1)){
+            return -1;
+        }
+
+        for(; run > 0; run--, block++){
+            checkpoint_pending[block] = false;
+        }
+    }
+
+    while(pending_directory_count > 0){
+        size_t directory_block = pending_directory_blocks[pending_directory_count - 1];
+
+        if(block_write(directory_block, metadata_block(directory_block))){
+            return -1;
+        }
+
+        pending_directory_count--;
+    }
+
+    //the home locations are on the disk before the journal stops covering them
+    if(use_barriers && block_sync()){
+        return -1;
+    }
+
+    head = 1;
+
+    return write_header();
+}
+
+void journal_forget(size_t block){
+    for(size_t i = 0; i < pending_directory_count; i++){
+        if(pending_directory_blocks[i]==block){
+            pending_directory_blocks[i] = pending_directory_blocks[--pending_directory_count];
+            return;
+        }
+    }
+}
@@ -0,0 +1,142 @@
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Write-ahead journal for the metadata blocks, and for the blocks of
+ * subdirectories and the fragment blocks attached to the metadata cache.
+ *
+ * The journal is a run of journalBlocks blocks starting at
+ * journalStartIndex. create_disk() carves it out of the end of the data
+ * region and marks its blocks used in the FAT, so that implementations
+ * that do not know about it leave it alone.
+ *
+ * Block 0 of the journal is a JournalHeader. Transactions follow it back
+ * to back, each made of a descriptor block listing the metadata blocks
+ * it carries, the images of those blocks, and a commit block holding a
+ * CRC32C of the descriptor and the images. A transaction counts only if
+ * its commit block is there and the checksum matches, so the whole
+ * transaction is written with a single vectored write.
+ *
+ * Committed blocks are written to their home location lazily, when the
+ * journal runs out of room for another transaction or at unmount. The
+ * header then gets a new sequence number, which invalidates every
+ * transaction already in the journal.
+ *
+ * With barriers on, block_sync() is called before a transaction is
+ * written, so the data blocks it points to reach the disk first, and on
+ * both sides of the home location writes of a checkpoint, so the journal
+ * is never emptied before what it protects is stable.
+ */
+
+/*
+ * Most metadata blocks a transaction carries. Every metadata block of a
+ * FS_VERSION_FAT16 disk fits in one transaction, the FAT of a
+ * FS_VERSION_FAT32 disk can be much larger.
+ */
+#define JOURNAL_TRANSACTION_BLOCKS 256
+
+/*
+ * Room journal_format_blocks() leaves in a transaction for directory
+ * blocks, on top of every metadata block
+ */
+#define JOURNAL_DIRECTORY_BLOCKS 16
+
+#define JOURNAL_SIGNATURE "ECS150JL"
+#define JOURNAL_DESCRIPTOR_SIGNATURE "ECS150JD"
+#define JOURNAL_COMMIT_SIGNATURE "ECS150JC"
+
+struct __attribute__((__packed__)) JournalHeader{
+    uint8_t signature[8];
+    /* sequence number of the first transaction in the journal */
+    uint64_t sequence;
+};
+
+struct __attribute__((__packed__)) JournalDescriptor{
+    uint8_t signature[8];
+    uint64_t sequence;
+    uint32_t count;
+    /* home locations of the count blocks that follow */
+    uint32_t targets[];
+};
+
+struct __attribute__((__packed__)) JournalCommit{
+    uint8_t signature[8];
+    uint64_t sequence;
+    uint32_t count;
+    uint32_t checksum;
+};
+
+/*
+ * Smallest journal able to hold the largest transaction on a disk with
+ * @metadata_blocks metadata blocks
+ */
+size_t journal_min_blocks(size_t metadata_blocks);
+
+/*
+ * Journal size create_disk() reserves for @metadata_blocks metadata
+ * blocks: room for several full transactions between checkpoints
+ */
+size_t journal_format_blocks(size_t metadata_blocks);
+
+/*
+ * Opens the journal of the mounted disk, if it has one, and replays
+ * the transactions it holds onto their home locations. A disk unmounted
+ * cleanly was checkpointed, so @replay_transactions can be false to skip
+ * looking.
+ *
+ * Returns: 0 on success, -1 if replaying failed
+ */
+int journal_open(bool barriers, bool replay_transactions);
+
+/*
+ * Returns: true if opening the journal replayed a transaction carrying
+ * metadata block @block
+ */
+bool journal_replayed(size_t block);
+
+/*
+ * Forgets about the journal of the disk being unmounted
+ */
+void journal_close();
+
+/*
+ * Returns: true if the mounted disk has a journal
+ */
+bool journal_enabled();
+
+/*
+ * Returns: the most blocks a transaction of the mounted disk carries,
+ * between every metadata block of a small disk and
+ * JOURNAL_TRANSACTION_BLOCKS, as the size of its journal allows
+ */
+size_t journal_transaction_blocks();
+
+/*
+ * Writes the cached copies of @count metadata blocks as one transaction.
+ * Checkpoints once the journal has no room left for another one.
+ *
+ * Returns: 0 on success, -1 otherwise
+ */
+int journal_commit(const size_t* blocks, size_t count);
+
+/*
+ * Writes every committed block to its home location and empties the
+ * journal. The metadata cache must not hold uncommitted changes.
+ *
+ * Returns: 0 on success, -1 otherwise
+ */
+int journal_checkpoint();
+
+/*
+ * Drops attached block @block, about to leave the metadata cache, from
+ * the blocks the next checkpoint writes. The caller checkpoints first if
+ * the block may be reused: replaying a transaction carrying it would
+ * write it back.
+ */
+void journal_forget(size_t block);
+
+#endif
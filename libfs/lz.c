@@ -0,0 +1,221 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/* log2 of the entries of the hash table */
+#define LZ_HASH_BITS 12
+
+/* the last literals are never matched, so that matches need no bound check */
+#define LZ_LAST_LITERALS 8
+
+static inline uint32_t read32(const uint8_t* p){
+    uint32_t value;
+
+    memcpy(&value, p, sizeof(uint32_t));
+
+    return value;
+}
+
+static inline uint32_t hash32(uint32_t value){
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/*
+ * Appends the rest of a length whose nibble is 15
+ *
+ * Returns: false if it does not fit before @end
+ */
+static bool put_length(uint8_t** op, const uint8_t* end, size_t length){
+    for(; length >= 255; length -= 255){
+        if(*op >= end){
+            return false;
+        }
+
+        *(*op)++ = 255;
+    }
+
+    if(*op >= end){
+        return false;
+    }
+
+    *(*op)++ = (uint8_t)length;
+
+    return true;
+}
+
+/*
+ * Appends a record of the literals from @anchor to @literal_end, and a
+ * match of @match_length bytes @distance back unless @match_length is 0
+ */
+static bool put_record(uint8_t** op, const uint8_t* end, const uint8_t* anchor,
+        const uint8_t* literal_end, size_t distance, size_t match_length){
+
+    size_t literals = (size_t)(literal_end - anchor);
+    size_t match_code = match_length==0 ? 0 : match_length - LZ_MIN_MATCH;
+
+    if(*op >= end){
+        return false;
+    }
+
+    uint8_t* token = (*op)++;
+
+    *token = (uint8_t)(((literals < 15 ? literals : 15) << 4) | (match_code < 15 ? match_code : 15));
+
+    if(literals >= 15 && !put_length(op, end, literals - 15)){
+        return false;
+    }
+
+    if((size_t)(end - *op) < literals){
+        return false;
+    }
+
+    memcpy(*op, anchor, literals);
+    *op += literals;
+
+    if(match_length==0){
+        return true;
+    }
+
+    if(end - *op < 2){
+        return false;
+    }
+
+    *(*op)++ = (uint8_t)(distance & 0xFF);
+    *(*op)++ = (uint8_t)(distance >> 8);
+
+    return match_code < 15 || put_length(op, end, match_code - 15);
+}
+
+size_t lz_compress(const uint8_t* in, size_t length, uint8_t* out, size_t capacity){
+    uint32_t table[1 << LZ_HASH_BITS];
+
+    memset(table, 0, sizeof(table));
+
+    const uint8_t* ip = in;
+    const uint8_t* anchor = in;
+    const uint8_t* in_end = in + length;
+    const uint8_t* match_limit = length > LZ_LAST_LITERALS ? in_end - LZ_LAST_LITERALS : in;
+
+    uint8_t* op = out;
+    const uint8_t* out_end = out + capacity;
+
+    while(ip + LZ_MIN_MATCH <= match_limit){
+        uint32_t sequence = read32(ip);
+        uint32_t* slot = &table[hash32(sequence)];
+
+        //positions are kept plus one, 0 being none
+        const uint8_t* ref = *slot==0 ? NULL : in + *slot - 1;
+
+        *slot = (uint32_t)(ip - in) + 1;
+
+        if(ref==NULL || (size_t)(ip - ref) > LZ_MAX_DISTANCE || read32(ref)!=sequence){
+            //skips faster through data that does not match
+            ip += 1 + ((size_t)(ip - anchor) >> 6);
+            continue;
+        }
+
+        size_t match_length = LZ_MIN_MATCH;
+
+        while(ip + match_length < match_limit && ref[match_length]==ip[match_length]){
+            match_length++;
+        }
+
+        if(!put_record(&op, out_end, anchor, ip, (size_t)(ip - ref), match_length)){
+            return 0;
+        }
+
+        ip += match_length;
+        anchor = ip;
+    }
+
+    if(!put_record(&op, out_end, anchor, in_end, 0, 0)){
+        return 0;
+    }
+
+    return (size_t)(op - out);
+}
+
+/*
+ * Reads the rest of a length whose nibble is 15
+ */
+static bool get_length(const uint8_t** ip, const uint8_t* end, size_t* length){
+    uint8_t byte;
+
+    do{
+        if(*ip >= end){
+            return false;
+        }
+
+        byte = *(*ip)++;
+        *length += byte;
+    } while(byte==255);
+
+    return true;
+}
+
+int lz_decompress(const uint8_t* in, size_t in_length, uint8_t* out, size_t length){
+    const uint8_t* ip = in;
+    const uint8_t* in_end = in + in_length;
+
+    uint8_t* op = out;
+    uint8_t* out_end = out + length;
+
+    while(ip < in_end){
+        uint8_t token = *ip++;
+
+        size_t literals = token >> 4;
+
+        if(literals==15 && !get_length(&ip, in_end, &literals)){
+            return -1;
+        }
+
+        if((size_t)(in_end - ip) < literals || (size_t)(out_end - op) < literals){
+            return -1;
+        }
+
+        memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+
+        //the last record has no match
+        if(ip==in_end){
+            break;
+        }
+
+        if(in_end - ip < 2){
+            return -1;
+        }
+
+        size_t distance = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+
+        size_t match_length = token & 0x0F;
+
+        if(match_length==15 && !get_length(&ip, in_end, &match_length)){
+            return -1;
+        }
+
+        match_length += LZ_MIN_MATCH;
+
+        if(distance==0 || distance > (size_t)(op - out) || (size_t)(out_end - op) < match_length){
+            return -1;
+        }
+
+        const uint8_t* ref = op - distance;
+
+        //a match may overlap what it copies, repeating it
+        if(distance >= match_length){
+            memcpy(op, ref, match_length);
+            op += match_length;
+        } else {
+            for(size_t i = 0; i < match_length; i++){
+                *op++ = ref[i];
+            }
+        }
+    }
+
+    return op==out_end ? 0 : -1;
+}
@@ -0,0 +1,38 @@
+#ifndef LZ_H_
+#define LZ_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A byte oriented LZ77 codec in the style of LZ4, for compressed files.
+ *
+ * The compressed stream is a sequence of records, each a token byte whose
+ * high nibble is a literal count and low nibble a match length minus
+ * LZ_MIN_MATCH, a nibble of 15 continuing in the bytes that follow up to
+ * one below 255, then the literals, then a 16 bit little endian distance
+ * back to the match and the match length bytes. The last record has
+ * literals only. Matches are found with a hash table of the last position
+ * every 4 byte sequence was seen at, no further than LZ_MAX_DISTANCE.
+ */
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_DISTANCE 65535
+
+/*
+ * Compresses the @length bytes at @in to @out
+ *
+ * Returns: the compressed length, 0 if it would take more than @capacity
+ * bytes, in which case the compression stops there
+ */
+size_t lz_compress(const uint8_t* in, size_t length, uint8_t* out, size_t capacity);
+
+/*
+ * Decompresses the @in_length bytes at @in to the @length bytes at @out
+ *
+ * Returns: 0 on success, -1 if the stream is corrupted or does not
+ * decompress to exactly @length bytes
+ */
+int lz_decompress(const uint8_t* in, size_t in_length, uint8_t* out, size_t length);
+
+#endif
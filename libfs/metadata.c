@@ -0,0 +1,593 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "blockChecksum.h"
+#include "disk.h"
+#include "fs.h"
+#include "journal.h"
+#include "metadata.h"
+#include "stats.h"
+
+static enum fs_durability durability_mode = FS_DURABILITY_NONE;
+
+/* copy of block 0, rewritten to change the state of the disk */
+static uint8_t* superblock = NULL;
+
+/* the superblock on disk says FS_STATE_DIRTY, or something else than clean */
+static bool disk_dirty = false;
+
+/* leave the disk marked dirty at unmount */
+static bool keep_dirty = false;
+
+/* a snapshot is mounted, nothing is ever written */
+static bool read_only = false;
+
+/* cached blocks 1 to cache_end - 1, back to back */
+static uint8_t* cache = NULL;
+static size_t cache_end = 0;
+
+/* per metadata block: changed since the last commit */
+static bool* dirty = NULL;
+static size_t dirty_count = 0;
+
+/*
+ * Directory blocks attached by metadata_attach(), in an open addressing
+ * hash table keyed by disk block, linear probing. Slots with a NULL copy
+ * are empty.
+ */
+struct attached_block{
+    size_t block;
+    uint8_t* copy;
+    bool dirty;
+};
+
+static struct attached_block* attached = NULL;
+static size_t attached_mask = 0;
+static size_t attached_count = 0;
+
+/* the dirty ones, counted in dirty_count too */
+static size_t* attached_dirty = NULL;
+static size_t attached_dirty_count = 0;
+
+/* one bit per data block freed since the last commit */
+static uint8_t* pending_frees = NULL;
+static size_t pending_free_count = 0;
+
+/* operations that changed metadata since the last commit */
+static size_t pending_ops = 0;
+static uint64_t first_change_ns = 0;
+
+static void free_cache(){
+    free(superblock);
+    free(cache);
+    free(dirty);
+    free(pending_frees);
+    free(attached);
+    free(attached_dirty);
+
+    superblock = NULL;
+    cache = NULL;
+    dirty = NULL;
+    pending_frees = NULL;
+    attached = NULL;
+    attached_dirty = NULL;
+
+    attached_mask = 0;
+    attached_count = 0;
+    attached_dirty_count = 0;
+
+    disk_dirty = false;
+    keep_dirty = false;
+    read_only = false;
+
+    cache_end = 0;
+    dirty_count = 0;
+    pending_free_count = 0;
+    pending_ops = 0;
+    first_change_ns = 0;
+}
+
+/*
+ * Writes @state to the superblock. Going dirty is made durable before
+ * any metadata it covers: by the barrier in front of the next journal
+ * transaction, or right away on disks without a journal.
+ */
+static int write_state(uint8_t state){
+    ((struct DiskMetadata*)superblock)->state = state;
+    diskMetadata->state = state;
+
+    if(block_write(SUPERBLOCK_INDEX, superblock)){
+        return -1;
+    }
+
+    disk_dirty = state!=FS_STATE_CLEAN;
+
+    if(durability_mode==FS_DURABILITY_NONE
+            || (disk_dirty && journal_enabled())){
+        return 0;
+    }
+
+    return block_sync();
+}
+
+int metadata_load(enum fs_durability durability){
+    durability_mode = durability;
+
+    bool clean = diskMetadata->state==FS_STATE_CLEAN;
+
+    if(journal_open(durability!=FS_DURABILITY_NONE, !clean)){
+        return -1;
+    }
+
+    cache_end = volume.data_start_index;
+
+    size_t cache_blocks = cache_end - (size_t)FAT_BLOCK_START_INDEX;
+
+    superblock = (uint8_t*)malloc(block_size);
+    cache = (uint8_t*)malloc(cache_blocks * block_size);
+    dirty = (bool*)calloc(cache_end, sizeof(bool));
+    pending_frees = (uint8_t*)calloc(data_blocks / 8 + 1, sizeof(uint8_t));
+    attached_dirty = (size_t*)calloc(JOURNAL_TRANSACTION_BLOCKS, sizeof(size_t));
+
+    if(superblock==NULL || cache==NULL || dirty==NULL || pending_frees==NULL
+            || attached_dirty==NULL){
+        free_cache();
+        journal_close();
+        return -1;
+    }
+
+    //blocks 0 to dataStartIndex - 1 in one read
+    struct iovec iov[2] = {
+        { superblock, block_size },
+        { cache, cache_blocks * block_size },
+    };
+
+    if(block_readv(SUPERBLOCK_INDEX, iov, 2)){
+        free_cache();
+        journal_close();
+        return -1;
+    }
+
+    disk_dirty = !clean;
+
+    return 0;
+}
+
+int metadata_unload(){
+    if(cache==NULL){
+        return 0;
+    }
+
+    int ret = 0;
+
+    if(read_only){
+        journal_close();
+        free_cache();
+        return 0;
+    }
+
+    if(metadata_commit() || journal_checkpoint()){
+        ret = -1;
+    }
+
+    if(durability_mode!=FS_DURABILITY_NONE && block_sync()){
+        ret = -1;
+    }
+
+    //everything is on the disk, it can say so
+    if(ret==0 && disk_dirty && !keep_dirty && write_state(FS_STATE_CLEAN)){
+        ret = -1;
+    }
+
+    journal_close();
+
+    free_cache();
+
+    return ret;
+}
+
+static inline size_t attached_slot(size_t block, size_t mask){
+    return (size_t)(block * 0x9e3779b97f4a7c15ull >> 17) & mask;
+}
+
+/*
+ * Returns the slot of attached block @block, or NULL if it is not attached
+ */
+static struct attached_block* find_attached(size_t block){
+    if(attached_count==0){
+        return NULL;
+    }
+
+    size_t slot = attached_slot(block, attached_mask);
+
+    while(attached[slot].copy!=NULL){
+        if(attached[slot].block==block){
+            return &attached[slot];
+        }
+
+        slot = (slot + 1) & attached_mask;
+    }
+
+    return NULL;
+}
+
+static void insert_attached(struct attached_block* table, size_t mask,
+        const struct attached_block* record){
+
+    size_t slot = attached_slot(record->block, mask);
+
+    while(table[slot].copy!=NULL){
+        slot = (slot + 1) & mask;
+    }
+
+    table[slot] = *record;
+}
+
+/*
+ * Doubles the table once it is half full, so that probes stay short
+ */
+static int grow_attached(){
+    if(attached!=NULL && 2 * (attached_count + 1) <= attached_mask + 1){
+        return 0;
+    }
+
+    size_t slot_count = attached==NULL ? 64 : 2 * (attached_mask + 1);
+
+    struct attached_block* table =
+            (struct attached_block*)calloc(slot_count, sizeof(struct attached_block));
+
+    if(table==NULL){
+        return -1;
+    }
+
+    for(size_t slot = 0; attached!=NULL && slot <= attached_mask; slot++){
+        if(attached[slot].copy!=NULL){
+            insert_attached(table, slot_count - 1, &attached[slot]);
+        }
+    }
+
+    free(attached);
+
+    attached = table;
+    attached_mask = slot_count - 1;
+
+    return 0;
+}
+
+uint8_t* metadata_block(size_t block){
+    if(cache==NULL || block < FAT_BLOCK_START_INDEX){
+        return NULL;
+    }
+
+    if(block >= cache_end){
+        struct attached_block* record = find_attached(block);
+
+        return record==NULL ? NULL : record->copy;
+    }
+
+    return &cache[(block - (size_t)FAT_BLOCK_START_INDEX) * block_size];
+}
+
+int metadata_attach(size_t block, uint8_t* copy){
+    if(cache==NULL || copy==NULL || block < cache_end || find_attached(block)!=NULL){
+        return -1;
+    }
+
+    if(grow_attached()){
+        return -1;
+    }
+
+    struct attached_block record = { block, copy, false };
+
+    insert_attached(attached, attached_mask, &record);
+    attached_count++;
+
+    return 0;
+}
+
+void metadata_detach(size_t block){
+    struct attached_block* record = find_attached(block);
+
+    if(record==NULL){
+        return;
+    }
+
+    if(record->dirty){
+        for(size_t i = 0; i < attached_dirty_count; i++){
+            if(attached_dirty[i]==block){
+                attached_dirty[i] = attached_dirty[--attached_dirty_count];
+                break;
+            }
+        }
+
+        dirty_count--;
+    }
+
+    journal_forget(block);
+
+    //shift back the records probed past it, so that lookups need no tombstones
+    size_t slot = (size_t)(record - attached);
+    size_t next = slot;
+
+    while(1){
+        next = (next + 1) & attached_mask;
+
+        if(attached[next].copy==NULL){
+            break;
+        }
+
+        size_t home = attached_slot(attached[next].block, attached_mask);
+
+        if(((next - home) & attached_mask) >= ((next - slot) & attached_mask)){
+            attached[slot] = attached[next];
+            slot = next;
+        }
+    }
+
+    memset(&attached[slot], 0, sizeof(struct attached_block));
+    attached_count--;
+}
+
+void* metadata_fat(){
+    return metadata_block(FAT_BLOCK_START_INDEX);
+}
+
+uint8_t* metadata_superblock(){
+    return superblock;
+}
+
+int metadata_write_superblock(){
+    if(cache==NULL || read_only){
+        return -1;
+    }
+
+    if(block_write(SUPERBLOCK_INDEX, superblock)){
+        return -1;
+    }
+
+    return durability_mode==FS_DURABILITY_NONE ? 0 : block_sync();
+}
+
+int metadata_write_superblock_check(){
+    if(cache==NULL || read_only){
+        return -1;
+    }
+
+    uint8_t state = ((struct DiskMetadata*)superblock)->state;
+
+    ((struct DiskMetadata*)superblock)->state = FS_STATE_CHECK;
+
+    if(metadata_write_superblock()){
+        ((struct DiskMetadata*)superblock)->state = state;
+        return -1;
+    }
+
+    diskMetadata->state = FS_STATE_CHECK;
+    disk_dirty = true;
+
+    return 0;
+}
+
+int metadata_commit_check(){
+    if(metadata_commit()){
+        return -1;
+    }
+
+    //the frees reach the disk before it stops saying so
+    if(durability_mode!=FS_DURABILITY_NONE && block_sync()){
+        return -1;
+    }
+
+    return write_state(FS_STATE_DIRTY);
+}
+
+int metadata_set_feature(uint8_t feature){
+    if((volume.features & feature)==feature){
+        return 0;
+    }
+
+    uint8_t features = (uint8_t)(volume.features | feature);
+
+    ((struct DiskMetadata*)superblock)->features = features;
+
+    if(metadata_write_superblock()){
+        ((struct DiskMetadata*)superblock)->features = volume.features;
+        return -1;
+    }
+
+    diskMetadata->features = features;
+    volume.features = features;
+
+    return 0;
+}
+
+void metadata_set_read_only(){
+    read_only = true;
+}
+
+int metadata_dirty(size_t block){
+    uint8_t* cached = metadata_block(block);
+
+    if(cached==NULL || read_only){
+        return -1;
+    }
+
+    if(!disk_dirty && write_state(FS_STATE_DIRTY)){
+        return -1;
+    }
+
+    if(!journal_enabled()){
+        return block_write(block, cached);
+    }
+
+    struct attached_block* record = block < cache_end ? NULL : find_attached(block);
+
+    bool was_dirty = record==NULL ? dirty[block] : record->dirty;
+
+    //a change too large for one transaction is committed in several
+    if(!was_dirty && dirty_count==journal_transaction_blocks() && metadata_commit()){
+        return -1;
+    }
+
+    if(!was_dirty){
+        if(record==NULL){
+            dirty[block] = true;
+        } else {
+            record->dirty = true;
+            attached_dirty[attached_dirty_count++] = block;
+        }
+
+        if(dirty_count++==0 && first_change_ns==0){
+            first_change_ns = stats_now_ns();
+        }
+    }
+
+    return 0;
+}
+
+int metadata_reserve(size_t blocks){
+    if(cache==NULL || !journal_enabled() || dirty_count==0){
+        return 0;
+    }
+
+    if(dirty_count + blocks > journal_transaction_blocks()){
+        return metadata_commit();
+    }
+
+    return 0;
+}
+
+int metadata_keep_dirty(){
+    if(cache==NULL || read_only){
+        return -1;
+    }
+
+    keep_dirty = true;
+
+    if(!disk_dirty){
+        return write_state(FS_STATE_DIRTY);
+    }
+
+    return 0;
+}
+
+void metadata_free_block(size_t data_block){
+    if(!journal_enabled() || data_block >= data_blocks){
+        return;
+    }
+
+    uint8_t bit = (uint8_t)(1 << (data_block % 8));
+
+    if(!(pending_frees[data_block / 8] & bit)){
+        pending_frees[data_block / 8] |= bit;
+        pending_free_count++;
+    }
+}
+
+bool metadata_pending_free(size_t data_block){
+    if(pending_free_count==0 || data_block >= data_blocks){
+        return false;
+    }
+
+    return (pending_frees[data_block / 8] & (1 << (data_block % 8))) != 0;
+}
+
+bool metadata_has_pending_frees(){
+    return pending_free_count!=0;
+}
+
+int metadata_commit(){
+    if(cache==NULL || read_only){
+        return 0;
+    }
+
+    //checksums of the data the transaction points to go with that data
+    if(checksums_flush()){
+        return -1;
+    }
+
+    if(dirty_count==0){
+        pending_ops = 0;
+        first_change_ns = 0;
+        return 0;
+    }
+
+    size_t* blocks = (size_t*)malloc(dirty_count * sizeof(size_t));
+
+    if(blocks==NULL){
+        return -1;
+    }
+
+    size_t count = 0;
+
+    for(size_t block = FAT_BLOCK_START_INDEX; block < cache_end; block++){
+        if(dirty[block]){
+            blocks[count++] = block;
+        }
+    }
+
+    for(size_t i = 0; i < attached_dirty_count; i++){
+        blocks[count++] = attached_dirty[i];
+    }
+
+    int ret = journal_commit(blocks, count);
+
+    free(blocks);
+
+    if(ret){
+        return -1;
+    }
+
+    for(size_t i = 0; i < attached_dirty_count; i++){
+        find_attached(attached_dirty[i])->dirty = false;
+    }
+
+    attached_dirty_count = 0;
+
+    memset(dirty, 0, cache_end * sizeof(bool));
+    memset(pending_frees, 0, data_blocks / 8 + 1);
+
+    dirty_count = 0;
+    pending_free_count = 0;
+    pending_ops = 0;
+    first_change_ns = 0;
+
+    return 0;
+}
+
+int metadata_sync(){
+    if(metadata_commit()){
+        return -1;
+    }
+
+    return block_sync();
+}
+
+void metadata_op_end(){
+    if(cache==NULL){
+        return;
+    }
+
+    if(durability_mode==FS_DURABILITY_FULL){
+        metadata_sync();
+        return;
+    }
+
+    if(dirty_count==0 && !checksums_dirty()){
+        return;
+    }
+
+    //overwrites in place only change checksums
+    if(first_change_ns==0){
+        first_change_ns = stats_now_ns();
+    }
+
+    pending_ops++;
+
+    if(pending_ops >= METADATA_GROUP_OPS
+            || stats_now_ns() - first_change_ns >= METADATA_GROUP_NS){
+        metadata_commit();
+    }
+}
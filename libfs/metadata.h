@@ -0,0 +1,206 @@
+#ifndef METADATA_H_
+#define METADATA_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fs.h"
+
+/*
+ * In-memory copy of the metadata blocks: the FAT blocks and the root
+ * directory, disk blocks 1 to dataStartIndex - 1. It is loaded at mount,
+ * after the journal has been replayed, and is what every FAT and
+ * directory access reads from.
+ *
+ * Changes are made to the cached blocks and then announced with
+ * metadata_dirty(). On disks without a journal the block is written
+ * through right away. On disks with one, dirty blocks are collected
+ * into a transaction that is committed to the journal once
+ * METADATA_GROUP_OPS operations changed metadata, or once the oldest
+ * change is METADATA_GROUP_NS old, whichever comes first. A transaction
+ * carries at most journal_transaction_blocks() blocks: an operation changing
+ * more, which only the FAT of a FS_VERSION_FAT32 disk or a directory growing
+ * on a disk formatted before they were journaled allows, is committed in
+ * several transactions, and a crash can leave it half done.
+ *
+ * The blocks of subdirectories are data blocks, cached by directory.c as
+ * they are walked into, and so are the fragment blocks of fragment.c.
+ * Attached with metadata_attach(), they are journaled and checkpointed
+ * along with the metadata blocks.
+ *
+ * The durability mode picked at mount decides where block_sync() barriers
+ * go. Without a journal there is nothing to order, so
+ * FS_DURABILITY_METADATA only syncs at unmount there.
+ *
+ * The superblock state is set to FS_STATE_DIRTY before the first change
+ * of a mount reaches the disk, and back to FS_STATE_CLEAN once unmounting
+ * wrote everything, so mounts that only read leave the disk untouched. A
+ * clean disk has an empty journal, which is then not replayed. It says
+ * FS_STATE_CHECK instead while blocks a superblock change left unused are
+ * freed, see metadata_write_superblock_check().
+ */
+
+/*
+ * Group commit policy
+ */
+#define METADATA_GROUP_OPS 64
+#define METADATA_GROUP_NS (10 * 1000 * 1000)
+
+/*
+ * Replays the journal unless the disk is clean, then reads the superblock
+ * and the metadata blocks into memory with one vectored read
+ *
+ * Returns: 0 on success, -1 otherwise
+ */
+int metadata_load(enum fs_durability durability);
+
+/*
+ * Commits pending changes, checkpoints the journal and frees the cache
+ *
+ * Returns: 0 on success, -1 if the metadata could not be written
+ */
+int metadata_unload();
+
+/*
+ * Returns the cached copy of metadata block @block, or NULL if @block
+ * is neither a metadata block nor attached
+ */
+uint8_t* metadata_block(size_t block);
+
+/*
+ * Makes data block @block, whose cached copy @copy is kept by the caller,
+ * a block metadata_block() and metadata_dirty() know about
+ *
+ * Returns: 0 on success, -1 if it is a metadata block, already attached,
+ * or if memory ran out
+ */
+int metadata_attach(size_t block, uint8_t* copy);
+
+/*
+ * Forgets attached block @block, with its uncommitted changes, before its
+ * copy is freed
+ */
+void metadata_detach(size_t block);
+
+/*
+ * The FAT blocks as one array of entries, indexed by data block. Entries
+ * are uint16_t or uint32_t, as volume.fat_entry_size says.
+ */
+void* metadata_fat();
+
+/*
+ * The cached copy of block 0, the superblock followed by the snapshot
+ * table and the deduplication record, which is written whole whenever the
+ * disk changes state
+ */
+uint8_t* metadata_superblock();
+
+/*
+ * Writes the cached copy of block 0 now, and waits until it is on stable
+ * storage unless the disk was mounted with FS_DURABILITY_NONE
+ *
+ * Returns: 0 on success, -1 otherwise
+ */
+int metadata_write_superblock();
+
+/*
+ * metadata_write_superblock() for a change that leaves blocks to free,
+ * such as a region no record points to anymore. The disk says
+ * FS_STATE_CHECK until metadata_commit_check() is called once they are
+ * freed, so that a crash in between has the next mount look for leaked
+ * blocks in the whole FAT rather than in the FAT blocks replayed only.
+ *
+ * Returns: 0 on success, -1 otherwise
+ */
+int metadata_write_superblock_check();
+
+/*
+ * Commits the frees that follow metadata_write_superblock_check(), then
+ * marks the disk FS_STATE_DIRTY again
+ *
+ * Returns: 0 on success, -1 otherwise
+ */
+int metadata_commit_check();
+
+/*
+ * Adds FS_FEATURE_* flag @feature to the superblock, written now, and to
+ * the layout of the mounted disk, before anything needing it is written
+ *
+ * Returns: 0 on success, -1 if the superblock could not be written
+ */
+int metadata_set_feature(uint8_t feature);
+
+/*
+ * Makes the mount read-only, for snapshots: the cached blocks may then be
+ * replaced, metadata_dirty() fails, and nothing is committed or written
+ * back at unmount
+ */
+void metadata_set_read_only();
+
+/*
+ * Must be called after changing the cached copy of @block
+ *
+ * Returns: 0 on success, -1 if the block could not be written
+ */
+int metadata_dirty(size_t block);
+
+/*
+ * Commits the running transaction now if fewer than @blocks more blocks
+ * fit in it, so that the changes that follow, up to @blocks blocks, go in
+ * the same transaction. Called where the running operation has nothing
+ * half done.
+ *
+ * Returns: 0 on success, -1 if the journal could not be written
+ */
+int metadata_reserve(size_t blocks);
+
+/*
+ * Marks the disk dirty until it is unmounted again, and keeps it that way
+ * afterwards, so that the next mount checks it
+ *
+ * Returns: 0 on success, -1 if the superblock could not be written
+ */
+int metadata_keep_dirty();
+
+/*
+ * Records that data block @data_block was freed by the running
+ * transaction. Until it commits the block is not handed out again, so
+ * a crash cannot leave a committed file pointing at another file's data.
+ */
+void metadata_free_block(size_t data_block);
+
+/*
+ * Returns: true if @data_block was freed by the running transaction
+ */
+bool metadata_pending_free(size_t data_block);
+
+/*
+ * Returns: true if blocks freed by the running transaction are waiting
+ * for it to commit
+ */
+bool metadata_has_pending_frees();
+
+/*
+ * Commits the running transaction now
+ *
+ * Returns: 0 on success, -1 if the journal could not be written
+ */
+int metadata_commit();
+
+/*
+ * Commits the running transaction and waits until everything written
+ * so far is on stable storage
+ *
+ * Returns: 0 on success, -1 otherwise
+ */
+int metadata_sync();
+
+/*
+ * Called at the end of every operation that may change the disk,
+ * commits the running transaction when the group commit policy or the
+ * durability mode says so
+ */
+void metadata_op_end();
+
+#endif
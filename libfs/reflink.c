@@ -0,0 +1,303 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "directory.h"
+#include "disk.h"
+#include "fdTable.h"
+#include "fragment.h"
+#include "fs.h"
+#include "metadata.h"
+#include "reflink.h"
+
+/* per data block, the files reaching it past the first, NULL while none share */
+static uint16_t* sharers = NULL;
+
+static void count_chain(size_t block){
+    for(size_t step = 0; step < data_blocks; step++){
+        if(block==FAT_EOC || block==0 || block >= data_blocks){
+            return;
+        }
+
+        if(sharers[block] < UINT16_MAX){
+            sharers[block]++;
+        }
+
+        block = get_fat_entry(block);
+    }
+}
+
+/*
+ * Counts in sharers the files below @dir reaching every block
+ */
+static int count_directory(struct directory* dir){
+    size_t capacity = dir_capacity(dir);
+
+    for(size_t i = dir_next_used(dir, 0); i < capacity; i = dir_next_used(dir, i + 1)){
+        struct DirEntry* entry = dir_entry(dir, i);
+
+        //packed files are never reflinked, inline ones have no chain
+        if(dir_entry_is_inline(entry) || dir_entry_is_packed(entry)){
+            continue;
+        }
+
+        if(dir_entry_is_directory(entry)){
+            struct directory* child = dir_child(dir, i);
+
+            if(child==NULL || count_directory(child)){
+                return -1;
+            }
+
+            continue;
+        }
+
+        count_chain(dir_entry_first_block(entry));
+    }
+
+    return 0;
+}
+
+int reflink_load(){
+    reflink_unload();
+
+    if((volume.features & FS_FEATURE_REFLINK)==0){
+        return 0;
+    }
+
+    sharers = (uint16_t*)calloc(data_blocks, sizeof(uint16_t));
+
+    if(sharers==NULL || count_directory(dir_root())){
+        reflink_unload();
+        return -1;
+    }
+
+    //the first file reaching a block is not a sharer
+    for(size_t block = 0; block < data_blocks; block++){
+        if(sharers[block]!=0){
+            sharers[block]--;
+        }
+    }
+
+    return 0;
+}
+
+void reflink_unload(){
+    free(sharers);
+
+    sharers = NULL;
+}
+
+bool reflink_shared(size_t block){
+    return sharers!=NULL && block < data_blocks && sharers[block]!=0;
+}
+
+void reflink_put(size_t block){
+    if(reflink_shared(block)){
+        sharers[block]--;
+    }
+}
+
+int reflink_share(size_t first){
+    if(sharers==NULL){
+        sharers = (uint16_t*)calloc(data_blocks, sizeof(uint16_t));
+
+        if(sharers==NULL){
+            return -1;
+        }
+    }
+
+    //checked up front, so that no block is left counted on failure
+    size_t block = first;
+
+    for(size_t step = 0; step < data_blocks && block!=FAT_EOC; step++){
+        if(block==0 || block >= data_blocks || sharers[block] >= UINT16_MAX - 1){
+            return -1;
+        }
+
+        block = get_fat_entry(block);
+    }
+
+    //the disk says chains may join before one does
+    if(metadata_set_feature(FS_FEATURE_REFLINK)){
+        return -1;
+    }
+
+    for(block = first; block!=FAT_EOC; block = get_fat_entry(block)){
+        sharers[block]++;
+    }
+
+    return 0;
+}
+
+size_t reflink_saved_blocks(){
+    size_t saved = 0;
+
+    for(size_t block = 0; sharers!=NULL && block < data_blocks; block++){
+        saved += sharers[block];
+    }
+
+    return saved;
+}
+
+/*
+ * Gives @entry a copy of every block of @from, its packed tail going to a
+ * block of its own
+ *
+ * Returns: the first block of the copy, FAT_EOC on failure with nothing
+ * left allocated
+ */
+static size_t copy_blocks(const struct DirEntry* from){
+    size_t size = (size_t)dir_entry_size(from);
+
+    //compressed chains are shorter than their size needs
+    size_t blocks = dir_entry_is_compressed(from)
+            ? total_file_blocks(dir_entry_first_block(from)) : total_block_size(size);
+
+    bool packed = dir_entry_is_packed(from);
+
+    size_t full = packed ? blocks - 1 : blocks;
+
+    size_t source[COPY_BATCH_BLOCKS];
+    size_t target[COPY_BATCH_BLOCKS];
+
+    uint8_t* buffer = (uint8_t*)malloc(COPY_BATCH_BLOCKS * block_size);
+
+    size_t first_copy = FAT_EOC;
+    size_t last_copy = FAT_EOC;
+
+    size_t block = dir_entry_first_block(from);
+
+    int ret = buffer==NULL ? -1 : 0;
+
+    for(size_t done = 0; ret==0 && done < blocks; ){
+        size_t batch = done < full ? full - done : 1;
+
+        if(batch > COPY_BATCH_BLOCKS){
+            batch = COPY_BATCH_BLOCKS;
+        }
+
+        for(size_t i = 0; ret==0 && i < batch; i++){
+            if(block==FAT_EOC || block==0 || block >= data_blocks
+                    || first_block_available(&target[i])==false){
+                ret = -1;
+                break;
+            }
+
+            source[i] = block;
+            block = get_fat_entry(block);
+
+            set_fat_entry(target[i], FAT_EOC);
+
+            if(last_copy==FAT_EOC){
+                first_copy = target[i];
+            } else {
+                set_fat_entry(last_copy, (uint32_t)target[i]);
+            }
+
+            last_copy = target[i];
+        }
+
+        if(ret!=0){
+            break;
+        }
+
+        if(done < full){
+            if(transfer_blocks(source, batch, buffer, false) || transfer_blocks(target, batch, buffer, true)){
+                ret = -1;
+            }
+        } else {
+            //the tail is read from its fragment block
+            uint8_t* tail = fragment_tail(from, source[0]);
+
+            memset(buffer, 0, block_size);
+
+            if(tail==NULL){
+                ret = -1;
+            } else {
+                memcpy(buffer, tail, size - (full << block_shift));
+
+                ret = block_write(get_actual_block_index(target[0]), buffer);
+            }
+        }
+
+        done += batch;
+    }
+
+    free(buffer);
+
+    if(ret!=0){
+        erase_file(first_copy);
+        return FAT_EOC;
+    }
+
+    return first_copy;
+}
+
+int reflink_copy(struct directory* from_dir, size_t from_index,
+        struct directory* dir, size_t entry_index, enum fs_copy_mode mode){
+
+    const struct DirEntry* from = dir_entry(from_dir, from_index);
+    struct DirEntry* entry = dir_entry(dir, entry_index);
+
+    uint64_t size = dir_entry_size(from);
+
+    if(dir_entry_is_inline(from)){
+        memcpy(dir_entry_inline_data(entry), dir_entry_inline_data((struct DirEntry*)from),
+                (size_t)size);
+
+        dir_entry_set_inline(entry, true);
+        dir_entry_set_size(entry, size);
+
+        return dir_update(dir, entry_index);
+    }
+
+    if(dir_entry_first_block(from)==FAT_EOC){
+        return 0;
+    }
+
+    //the copy is stored as the file is
+    dir_entry_set_compress(entry, dir_entry_compress(from));
+    dir_entry_set_compressed(entry, dir_entry_is_compressed(from));
+
+    if(mode==FS_COPY_REFLINK && !dir_entry_is_packed(from)){
+        if(metadata_reserve(1) || reflink_share(dir_entry_first_block(from))){
+            return -1;
+        }
+
+        dir_entry_set_first_block(entry, dir_entry_first_block(from));
+        dir_entry_set_size(entry, size);
+
+        return dir_update(dir, entry_index);
+    }
+
+    size_t first_copy = copy_blocks(from);
+
+    if(first_copy==FAT_EOC){
+        return -1;
+    }
+
+    //filled in last, a crash before leaves an empty file
+    dir_entry_set_first_block(entry, first_copy);
+    dir_entry_set_size(entry, size);
+
+    int ret = dir_update(dir, entry_index);
+
+    if(ret==0 && dir_entry_is_packed(from)){
+        struct fdNode copy;
+
+        memset(&copy, 0, sizeof(struct fdNode));
+
+        copy.directory = dir;
+        copy.dir_entry_index = entry_index;
+        copy.size = (size_t)size;
+        copy.first_data_block = first_copy;
+        copy.cursor_block = FAT_EOC;
+        copy.last_block = FAT_EOC;
+
+        //packed again, as fs_close() would
+        if(fragment_pack(&copy) || fragment_release()){
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
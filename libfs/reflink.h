@@ -0,0 +1,89 @@
+#ifndef REFLINK_H_
+#define REFLINK_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "directory.h"
+#include "fs.h"
+
+/*
+ * File copies made by fs_copy_file().
+ *
+ * A FAT entry holds a single next block, so files cannot share blocks in
+ * the middle of their chains, only their ends: a reflinked copy points to
+ * the first block of the file it copies, and a file that gave itself its
+ * own copy of some blocks still ends in the blocks it shared. Whatever
+ * file reaches a block, every block after it in the chain is reached by
+ * that file too.
+ *
+ * How many files reach a block is kept in memory only, counted at mount
+ * on disks with FS_FEATURE_REFLINK, which the first reflink sets. A copy
+ * changes a single directory entry, so a crash leaves either no copy or a
+ * whole one. Before fs_write() changes a shared block, or appends to a
+ * file ending in one, unshare_blocks() copies the blocks from the first
+ * shared one to the last one written. Freeing a shared block drops a
+ * reference instead, and tails shared blocks end in are not packed.
+ *
+ * A deep copy allocates the blocks of the new file and copies the blocks
+ * of the old one in batches of COPY_BATCH_BLOCKS, reading and writing each
+ * run of consecutive blocks with one system call. The new entry is filled
+ * in last, so a crash before leaves an empty file and blocks fs_check()
+ * reports as leaked.
+ */
+
+#define COPY_BATCH_BLOCKS 64
+
+/*
+ * Counts the files reaching every data block of disks with
+ * FS_FEATURE_REFLINK. Called once the directories and the FAT are loaded.
+ *
+ * Returns: 0 on success, -1 if a subdirectory could not be read or memory
+ * ran out
+ */
+int reflink_load();
+
+/*
+ * Drops the counts
+ */
+void reflink_unload();
+
+/*
+ * Returns: true if more than one file reaches data block @block
+ */
+bool reflink_shared(size_t block);
+
+/*
+ * Drops the reference of a file being freed or unshared to shared data
+ * block @block
+ */
+void reflink_put(size_t block);
+
+/*
+ * Gives every block of the chain starting at data block @first one more
+ * sharer, for a file about to point to it, marking the disk
+ * FS_FEATURE_REFLINK first
+ *
+ * Returns: 0 on success, -1 if the superblock could not be written, memory
+ * ran out, or a block is shared by too many files already
+ */
+int reflink_share(size_t first);
+
+/*
+ * Returns: the data blocks sharing saves, one per file reaching a block
+ * past the first
+ */
+size_t reflink_saved_blocks();
+
+/*
+ * Fills entry @entry_index of @dir, an empty file, with a copy of the file
+ * of @from in the same directory or another one
+ *
+ * Returns: 0 on success, -1 if the disk is full, a block could not be read
+ * or written, or a block is shared by too many files already
+ */
+int reflink_copy(struct directory* from_dir, size_t from_index,
+        struct directory* dir, size_t entry_index, enum fs_copy_mode mode);
+
+#endif
@@ -0,0 +1,783 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "directory.h"
+#include "disk.h"
+#include "fs.h"
+#include "metadata.h"
+#include "snapshot.h"
+
+/*
+ * A region read back from the disk
+ */
+struct image{
+    /* data blocks of the region, in order */
+    size_t* region;
+    size_t blocks;
+    /* the FAT and root directory copies, in the metadata cache if mounted */
+    uint8_t* fat;
+    uint8_t* root;
+    bool cached;
+    /* data blocks copied, sorted, the first copy being region[first_copy] */
+    uint64_t* copied;
+    size_t copies;
+    size_t first_copy;
+};
+
+struct block_list{
+    size_t* blocks;
+    size_t count;
+    size_t capacity;
+};
+
+/* per data block, the snapshots reaching it, NULL while there are none */
+static uint8_t* references = NULL;
+
+/* the snapshot mounted read-only, if snapshot_mounted */
+static struct image mounted;
+static bool snapshot_mounted = false;
+
+static int push_block(struct block_list* list, size_t block){
+    if(list->count==list->capacity){
+        size_t capacity = list->capacity==0 ? 64 : 2 * list->capacity;
+
+        size_t* grown = (size_t*)realloc(list->blocks, capacity * sizeof(size_t));
+
+        if(grown==NULL){
+            return -1;
+        }
+
+        list->blocks = grown;
+        list->capacity = capacity;
+    }
+
+    list->blocks[list->count++] = block;
+
+    return 0;
+}
+
+static int compare_blocks(const void* a, const void* b){
+    size_t left = *(const size_t*)a;
+    size_t right = *(const size_t*)b;
+
+    return left < right ? -1 : left > right;
+}
+
+/*
+ * Returns: the table in the cached block 0, NULL if it was never written
+ */
+static struct SnapshotTable* snapshot_table(){
+    uint8_t* superblock = metadata_superblock();
+
+    if(superblock==NULL){
+        return NULL;
+    }
+
+    struct SnapshotTable* table = (struct SnapshotTable*)&superblock[SNAPSHOT_TABLE_OFFSET];
+
+    if(memcmp(table->signature, SNAPSHOT_TABLE_SIGNATURE, 8)!=0){
+        return NULL;
+    }
+
+    return table;
+}
+
+static struct SnapshotRecord* find_record(const char* name){
+    struct SnapshotTable* table = snapshot_table();
+
+    for(size_t i = 0; table!=NULL && i < FS_SNAPSHOT_MAX_COUNT; i++){
+        struct SnapshotRecord* record = &table->records[i];
+
+        if(record->firstBlock!=0 && strncmp((char*)record->name, name, FS_FILENAME_LEN)==0){
+            return record;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Sets or clears FS_FEATURE_SNAPSHOTS in the cached superblock and the
+ * layout of the mounted disk
+ */
+static void set_feature(bool on){
+    uint8_t features = on ? (uint8_t)(volume.features | FS_FEATURE_SNAPSHOTS)
+                          : (uint8_t)(volume.features & ~FS_FEATURE_SNAPSHOTS);
+
+    ((struct DiskMetadata*)metadata_superblock())->features = features;
+    diskMetadata->features = features;
+    volume.features = features;
+}
+
+static void free_image(struct image* image){
+    free(image->region);
+    free(image->copied);
+
+    if(!image->cached){
+        free(image->fat);
+        free(image->root);
+    }
+
+    memset(image, 0, sizeof(struct image));
+}
+
+static int read_region(const struct image* image, size_t index, void* buf){
+    return block_read(get_actual_block_index(image->region[index]), buf);
+}
+
+/*
+ * Reads blocks @first to @first + @count - 1 of the region of @image into
+ * @buf, back to back
+ */
+static int read_regions(const struct image* image, size_t first, size_t count, uint8_t* buf){
+    for(size_t i = 0; i < count; i++){
+        if(read_region(image, first + i, &buf[i * block_size])){
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Reads the region of @record, with the FAT and root directory copies
+ * going to the metadata cache if @cached. The chain of the region is
+ * walked in the FAT of the disk before anything is read.
+ *
+ * Returns: 0 on success, -1 otherwise, with @image left empty
+ */
+static int load_image(const struct SnapshotRecord* record, struct image* image, bool cached){
+    memset(image, 0, sizeof(struct image));
+
+    size_t blocks = (size_t)record->blocks;
+
+    image->region = (size_t*)malloc((blocks==0 ? 1 : blocks) * sizeof(size_t));
+
+    uint8_t* buffer = (uint8_t*)malloc(block_size);
+
+    if(image->region==NULL || buffer==NULL || blocks > data_blocks){
+        free(buffer);
+        free_image(image);
+        return -1;
+    }
+
+    size_t block = (size_t)record->firstBlock;
+
+    for(image->blocks = 0; image->blocks < blocks; image->blocks++){
+        if(block==0 || block >= data_blocks){
+            break;
+        }
+
+        image->region[image->blocks] = block;
+
+        block = get_fat_entry(block);
+    }
+
+    struct SnapshotHeader* header = (struct SnapshotHeader*)buffer;
+
+    size_t table_entries = block_size / sizeof(uint64_t);
+
+    if(image->blocks!=blocks || blocks==0 || read_region(image, 0, buffer)
+            || memcmp(header->signature, SNAPSHOT_SIGNATURE, 8)!=0
+            || header->fatBlocks!=volume.fat_blocks
+            || header->rootDirectoryBlocks!=volume.root_directory_blocks
+            || header->copies > header->copyTableBlocks * table_entries
+            || 1 + volume.fat_blocks + volume.root_directory_blocks
+                    + header->copyTableBlocks + header->copies != blocks){
+        free(buffer);
+        free_image(image);
+        return -1;
+    }
+
+    image->copies = (size_t)header->copies;
+    image->first_copy = blocks - image->copies;
+
+    size_t table_blocks = (size_t)header->copyTableBlocks;
+
+    free(buffer);
+
+    image->cached = cached;
+
+    if(cached){
+        image->fat = metadata_block(FAT_BLOCK_START_INDEX);
+        image->root = metadata_block(root_directory_index);
+    } else {
+        image->fat = (uint8_t*)malloc(volume.fat_blocks * block_size);
+        image->root = (uint8_t*)malloc(volume.root_directory_blocks * block_size);
+    }
+
+    image->copied = (uint64_t*)malloc((table_blocks==0 ? 1 : table_blocks) * block_size);
+
+    if(image->fat==NULL || image->root==NULL || image->copied==NULL
+            || read_regions(image, 1, volume.fat_blocks, image->fat)
+            || read_regions(image, 1 + volume.fat_blocks, volume.root_directory_blocks, image->root)
+            || read_regions(image, image->first_copy - table_blocks, table_blocks,
+                    (uint8_t*)image->copied)){
+        free_image(image);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns: the index of the copy of data block @block in @image,
+ * image->copies if it was not copied
+ */
+static size_t find_copy(const struct image* image, size_t block){
+    size_t low = 0;
+    size_t high = image->copies;
+
+    while(low < high){
+        size_t middle = low + (high - low) / 2;
+
+        if(image->copied[middle] < block){
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low < image->copies && image->copied[low]==block ? low : image->copies;
+}
+
+static inline uint32_t image_next(const struct image* image, size_t block){
+    if(volume.fat_entry_size==sizeof(uint32_t)){
+        return ((const uint32_t*)image->fat)[block];
+    }
+
+    return ((const uint16_t*)image->fat)[block];
+}
+
+static void count_block(uint8_t* counts, size_t block){
+    if(counts[block] < UINT8_MAX){
+        counts[block]++;
+    }
+}
+
+static int count_subdirectory(const struct image* image, const struct DirEntry* entry,
+        uint8_t* counts, size_t depth);
+
+/*
+ * Counts in @counts the file blocks below the directory whose @count
+ * blocks are @blocks, in snapshot @image
+ */
+static int count_directory(const struct image* image, const uint8_t* blocks, size_t count,
+        uint8_t* counts, size_t depth){
+
+    size_t entries = count * (block_size / volume.entry_size);
+
+    for(size_t i = 0; i < entries; i++){
+        const struct DirEntry* entry = (const struct DirEntry*)&blocks[i * volume.entry_size];
+
+        if(entry->filename[0]=='\0' || dir_entry_is_inline(entry)){
+            continue;
+        }
+
+        if(dir_entry_is_directory(entry)){
+            if(count_subdirectory(image, entry, counts, depth + 1)){
+                return -1;
+            }
+
+            continue;
+        }
+
+        bool packed = dir_entry_is_packed(entry);
+        size_t block = dir_entry_first_block(entry);
+
+        for(size_t step = 0; step < data_blocks; step++){
+            if(block==FAT_EOC || block==0 || block >= data_blocks){
+                break;
+            }
+
+            uint32_t next = image_next(image, block);
+
+            //a packed tail is in a fragment block, which was copied
+            if(!packed || next!=FAT_EOC){
+                count_block(counts, block);
+            }
+
+            block = next;
+        }
+    }
+
+    return 0;
+}
+
+static int count_subdirectory(const struct image* image, const struct DirEntry* entry,
+        uint8_t* counts, size_t depth){
+
+    //deeper than any path, the chains loop
+    if(depth > FS_PATH_MAX_LEN){
+        return -1;
+    }
+
+    struct block_list chain = { NULL, 0, 0 };
+
+    size_t block = dir_entry_first_block(entry);
+
+    while(block!=FAT_EOC && block!=0 && block < data_blocks && chain.count < data_blocks){
+        if(push_block(&chain, block)){
+            free(chain.blocks);
+            return -1;
+        }
+
+        block = image_next(image, block);
+    }
+
+    uint8_t* blocks = (uint8_t*)malloc((chain.count==0 ? 1 : chain.count) * block_size);
+
+    int ret = blocks==NULL ? -1 : 0;
+
+    for(size_t i = 0; ret==0 && i < chain.count; i++){
+        size_t copy = find_copy(image, chain.blocks[i]);
+
+        if(copy==image->copies || read_region(image, image->first_copy + copy, &blocks[i * block_size])){
+            ret = -1;
+        }
+    }
+
+    if(ret==0){
+        ret = count_directory(image, blocks, chain.count, counts, depth);
+    }
+
+    free(blocks);
+    free(chain.blocks);
+
+    return ret;
+}
+
+/*
+ * Counts the file blocks every snapshot reaches into *@result, NULL if
+ * there is no snapshot
+ */
+static int count_snapshots(uint8_t** result){
+    struct SnapshotTable* table = snapshot_table();
+
+    uint8_t* counts = NULL;
+
+    for(size_t i = 0; table!=NULL && i < FS_SNAPSHOT_MAX_COUNT; i++){
+        if(table->records[i].firstBlock==0){
+            continue;
+        }
+
+        if(counts==NULL){
+            counts = (uint8_t*)calloc(data_blocks, sizeof(uint8_t));
+        }
+
+        struct image image;
+
+        if(counts==NULL || load_image(&table->records[i], &image, false)){
+            free(counts);
+            return -1;
+        }
+
+        int ret = count_directory(&image, image.root, volume.root_directory_blocks, counts, 0);
+
+        free_image(&image);
+
+        if(ret){
+            free(counts);
+            return -1;
+        }
+    }
+
+    *result = counts;
+
+    return 0;
+}
+
+/*
+ * Counts the file blocks every snapshot reaches, replacing the counts
+ * only once all of them were read
+ */
+static int count_all(){
+    uint8_t* counts;
+
+    if(count_snapshots(&counts)){
+        return -1;
+    }
+
+    free(references);
+
+    references = counts;
+
+    return 0;
+}
+
+int snapshot_load(const char* name){
+    snapshot_unload();
+
+    if(name==NULL){
+        return count_all();
+    }
+
+    struct SnapshotRecord* record = find_record(name);
+
+    if(record==NULL || load_image(record, &mounted, true)){
+        return -1;
+    }
+
+    snapshot_mounted = true;
+
+    return 0;
+}
+
+void snapshot_unload(){
+    free(references);
+
+    references = NULL;
+
+    if(snapshot_mounted){
+        free_image(&mounted);
+    }
+
+    snapshot_mounted = false;
+}
+
+bool snapshot_held(size_t block){
+    return references!=NULL && block < data_blocks && references[block]!=0;
+}
+
+int snapshot_read(size_t disk_block, void* buf){
+    if(snapshot_mounted && disk_block >= volume.data_start_index){
+        size_t copy = find_copy(&mounted, disk_block - volume.data_start_index);
+
+        if(copy < mounted.copies){
+            return read_region(&mounted, mounted.first_copy + copy, buf);
+        }
+    }
+
+    return block_read(disk_block, buf);
+}
+
+bool snapshot_region(size_t index, size_t* first_block, size_t* blocks){
+    struct SnapshotTable* table = snapshot_table();
+
+    for(size_t i = 0; table!=NULL && i < FS_SNAPSHOT_MAX_COUNT; i++){
+        if(table->records[i].firstBlock==0 || index-- != 0){
+            continue;
+        }
+
+        *first_block = (size_t)table->records[i].firstBlock;
+        *blocks = (size_t)table->records[i].blocks;
+
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Adds the subdirectory and fragment blocks below @dir of the mounted file
+ * system to @copies or, if @copies is NULL, counts a reference to the file
+ * blocks below it
+ */
+static int walk_live(struct directory* dir, struct block_list* copies){
+    size_t capacity = dir_capacity(dir);
+
+    for(size_t i = dir_next_used(dir, 0); i < capacity; i = dir_next_used(dir, i + 1)){
+        struct DirEntry* entry = dir_entry(dir, i);
+
+        if(dir_entry_is_inline(entry)){
+            continue;
+        }
+
+        bool directory = dir_entry_is_directory(entry);
+        bool packed = dir_entry_is_packed(entry);
+        size_t block = dir_entry_first_block(entry);
+
+        while(block!=FAT_EOC && block < data_blocks){
+            uint32_t next = get_fat_entry(block);
+
+            if(directory || (packed && next==FAT_EOC)){
+                if(copies!=NULL && push_block(copies, block)){
+                    return -1;
+                }
+            } else if(copies==NULL){
+                count_block(references, block);
+            }
+
+            block = next;
+        }
+
+        if(directory){
+            struct directory* child = dir_child(dir, i);
+
+            if(child==NULL || walk_live(child, copies)){
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Writes the region of a snapshot of the mounted file system to the data
+ * blocks @region, copying the data blocks @copies
+ */
+static int write_region(const size_t* region, const struct block_list* copies,
+        size_t table_blocks, uint8_t* buffer){
+
+    size_t index = 0;
+
+    memset(buffer, 0, block_size);
+
+    struct SnapshotHeader* header = (struct SnapshotHeader*)buffer;
+
+    memcpy(header->signature, SNAPSHOT_SIGNATURE, 8);
+    header->fatBlocks = volume.fat_blocks;
+    header->rootDirectoryBlocks = volume.root_directory_blocks;
+    header->copies = copies->count;
+    header->copyTableBlocks = table_blocks;
+
+    if(block_write(get_actual_block_index(region[index++]), buffer)){
+        return -1;
+    }
+
+    for(size_t i = 0; i < volume.fat_blocks; i++){
+        if(block_write(get_actual_block_index(region[index++]),
+                metadata_block(FAT_BLOCK_START_INDEX + i))){
+            return -1;
+        }
+    }
+
+    for(size_t i = 0; i < volume.root_directory_blocks; i++){
+        if(block_write(get_actual_block_index(region[index++]),
+                metadata_block(root_directory_index + i))){
+            return -1;
+        }
+    }
+
+    size_t table_entries = block_size / sizeof(uint64_t);
+
+    for(size_t i = 0; i < table_blocks; i++){
+        memset(buffer, 0, block_size);
+
+        for(size_t entry = 0; entry < table_entries && i * table_entries + entry < copies->count; entry++){
+            ((uint64_t*)buffer)[entry] = copies->blocks[i * table_entries + entry];
+        }
+
+        if(block_write(get_actual_block_index(region[index++]), buffer)){
+            return -1;
+        }
+    }
+
+    for(size_t i = 0; i < copies->count; i++){
+        size_t disk_block = get_actual_block_index(copies->blocks[i]);
+
+        //attached blocks are newer than their home location
+        const uint8_t* copy = metadata_block(disk_block);
+
+        if(copy==NULL){
+            if(block_read(disk_block, buffer)){
+                return -1;
+            }
+
+            copy = buffer;
+        }
+
+        if(block_write(get_actual_block_index(region[index++]), copy)){
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int snapshot_create(const char* name){
+    if(metadata_superblock()==NULL || find_record(name)!=NULL){
+        return -1;
+    }
+
+    struct SnapshotTable* table = snapshot_table();
+    struct SnapshotTable* cached = (struct SnapshotTable*)&metadata_superblock()[SNAPSHOT_TABLE_OFFSET];
+
+    struct SnapshotRecord* record = NULL;
+
+    for(size_t i = 0; i < FS_SNAPSHOT_MAX_COUNT && record==NULL; i++){
+        if(table==NULL || table->records[i].firstBlock==0){
+            record = &cached->records[i];
+        }
+    }
+
+    if(record==NULL){
+        return -1;
+    }
+
+    //counted before the table says the snapshot exists
+    if(references==NULL){
+        references = (uint8_t*)calloc(data_blocks, sizeof(uint8_t));
+
+        if(references==NULL){
+            return -1;
+        }
+    }
+
+    struct block_list copies = { NULL, 0, 0 };
+
+    if(walk_live(dir_root(), &copies)){
+        free(copies.blocks);
+        return -1;
+    }
+
+    //fragment blocks are shared by several files, and a snapshot owning
+    //none has no array to sort
+    if(copies.count > 1){
+        qsort(copies.blocks, copies.count, sizeof(size_t), compare_blocks);
+    }
+
+    size_t unique = 0;
+
+    for(size_t i = 0; i < copies.count; i++){
+        if(unique==0 || copies.blocks[unique - 1]!=copies.blocks[i]){
+            copies.blocks[unique++] = copies.blocks[i];
+        }
+    }
+
+    copies.count = unique;
+
+    size_t table_entries = block_size / sizeof(uint64_t);
+    size_t table_blocks = (copies.count + table_entries - 1) / table_entries;
+
+    size_t total = 1 + volume.fat_blocks + volume.root_directory_blocks + table_blocks + copies.count;
+
+    size_t* region = (size_t*)malloc(total * sizeof(size_t));
+    uint8_t* buffer = (uint8_t*)malloc(block_size);
+
+    if(region==NULL || buffer==NULL || total > fat_free_blocks()){
+        free(region);
+        free(buffer);
+        free(copies.blocks);
+        return -1;
+    }
+
+    size_t allocated = 0;
+
+    while(allocated < total && first_block_available(&region[allocated])){
+        set_fat_entry(region[allocated], FAT_EOC);
+
+        if(allocated > 0){
+            set_fat_entry(region[allocated - 1], (uint32_t)region[allocated]);
+        }
+
+        allocated++;
+    }
+
+    //the region is committed before the table points to it
+    int ret = allocated==total ? 0 : -1;
+
+    if(ret==0 && (write_region(region, &copies, table_blocks, buffer) || metadata_sync())){
+        ret = -1;
+    }
+
+    if(ret==0){
+        if(table==NULL){
+            memset(cached, 0, sizeof(struct SnapshotTable));
+            memcpy(cached->signature, SNAPSHOT_TABLE_SIGNATURE, 8);
+        }
+
+        memset(record, 0, sizeof(struct SnapshotRecord));
+        memcpy(record->name, name, strlen(name));
+        record->firstBlock = region[0];
+        record->blocks = total;
+
+        set_feature(true);
+
+        if(metadata_write_superblock()){
+            size_t first_block;
+            size_t blocks;
+
+            memset(record, 0, sizeof(struct SnapshotRecord));
+            set_feature(snapshot_region(0, &first_block, &blocks));
+            ret = -1;
+        }
+    }
+
+    if(ret==0){
+        walk_live(dir_root(), NULL);
+    } else if(allocated > 0){
+        erase_file(region[0]);
+    }
+
+    free(region);
+    free(buffer);
+    free(copies.blocks);
+
+    return ret;
+}
+
+int snapshot_delete(const char* name){
+    struct SnapshotRecord* record = find_record(name);
+
+    if(record==NULL){
+        return -1;
+    }
+
+    struct SnapshotRecord saved = *record;
+
+    memset(record, 0, sizeof(struct SnapshotRecord));
+
+    //what the others hold is read first, so that a failed read changes nothing
+    uint8_t* counts;
+
+    if(count_snapshots(&counts)){
+        *record = saved;
+        return -1;
+    }
+
+    size_t first_block;
+    size_t blocks;
+
+    if(!snapshot_region(0, &first_block, &blocks)){
+        set_feature(false);
+    }
+
+    //taken out of the table before anything it holds is freed, a crash in
+    //between leaving them to the check of the next mount
+    if(metadata_write_superblock_check()){
+        *record = saved;
+        set_feature(true);
+        free(counts);
+        return -1;
+    }
+
+    free(references);
+
+    references = counts;
+
+    for(size_t block = 1; block < data_blocks; block++){
+        if(get_fat_entry(block)==FAT_HELD && !snapshot_held(block)){
+            set_fat_entry(block, 0);
+        }
+    }
+
+    if(erase_file((size_t)saved.firstBlock)){
+        return -1;
+    }
+
+    return metadata_commit_check();
+}
+
+void snapshot_list(){
+    struct SnapshotTable* table = snapshot_table();
+
+    printf("FS Snapshots:\n");
+
+    for(size_t i = 0; table!=NULL && i < FS_SNAPSHOT_MAX_COUNT; i++){
+        struct SnapshotRecord* record = &table->records[i];
+
+        if(record->firstBlock==0){
+            continue;
+        }
+
+        char name[FS_FILENAME_LEN + 1];
+
+        memcpy(name, record->name, FS_FILENAME_LEN);
+        name[FS_FILENAME_LEN] = '\0';
+
+        printf("snapshot: %s, blocks: %llu\n", name, (unsigned long long)record->blocks);
+    }
+}
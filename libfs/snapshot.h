@@ -0,0 +1,125 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fs.h"
+
+/*
+ * Read-only snapshots of the whole file system, taken by
+ * fs_snapshot_create() and mounted with fs_mount_options.snapshot.
+ *
+ * A snapshot is a region of data blocks chained in the FAT, like the
+ * journal, holding a SnapshotHeader, a copy of the FAT, a copy of the root
+ * directory, the sorted table of the subdirectory and fragment blocks
+ * copied, and those copies in the same order. Directory and fragment
+ * blocks are changed in place through the metadata cache, so they are
+ * copied, while the data blocks of files are not: taking a snapshot costs
+ * the metadata of the disk, whatever the size of the files.
+ *
+ * Regions are listed in the SnapshotTable stored in block 0 past the
+ * superblock, which the disk keeps FS_FEATURE_SNAPSHOTS for while the
+ * table is not empty. A region is written and committed before the table
+ * points to it, and taken out of the table before it is freed, so a crash
+ * leaves at worst a region fs_check() reports as leaked.
+ *
+ * At mount, the file blocks every snapshot reaches are counted. fs_write()
+ * moves a counted block to a new one with copy_on_write() before writing
+ * it, and set_fat_entry() turns the 0 of a counted block the file system
+ * frees into FAT_HELD, so that it is not handed out again. Deleting a
+ * snapshot frees the held blocks no other snapshot counts.
+ */
+
+#define SNAPSHOT_TABLE_SIGNATURE "ECS150ST"
+#define SNAPSHOT_SIGNATURE "ECS150SN"
+
+/* where the table starts in block 0, past the largest superblock */
+#define SNAPSHOT_TABLE_OFFSET 1024
+
+struct __attribute__((__packed__)) SnapshotRecord{
+    uint8_t name[16];
+    /* first data block of the region, 0 for a free record */
+    uint64_t firstBlock;
+    uint64_t blocks;
+};
+
+struct __attribute__((__packed__)) SnapshotTable{
+    uint8_t signature[8];
+    struct SnapshotRecord records[FS_SNAPSHOT_MAX_COUNT];
+};
+
+/*
+ * First block of a region
+ */
+struct __attribute__((__packed__)) SnapshotHeader{
+    uint8_t signature[8];
+    /* of the disk when the snapshot was taken, the same as now */
+    uint64_t fatBlocks;
+    uint64_t rootDirectoryBlocks;
+    /* blocks copied, and blocks of the table of their data block indexes */
+    uint64_t copies;
+    uint64_t copyTableBlocks;
+};
+
+/*
+ * Counts the file blocks the snapshots of the mounted disk reach or, if
+ * @name is not NULL, replaces the FAT and the root directory in the
+ * metadata cache with the ones of snapshot @name, which the metadata
+ * cache must have been made read-only for. Called before the directories
+ * and the FAT free counts are loaded.
+ *
+ * Returns: 0 on success, -1 if there is no such snapshot or a region could
+ * not be read
+ */
+int snapshot_load(const char* name);
+
+/*
+ * Drops the reference counts, or the snapshot mounted
+ */
+void snapshot_unload();
+
+/*
+ * Returns: true if a snapshot reaches data block @block
+ */
+bool snapshot_held(size_t block);
+
+/*
+ * block_read() for directory and fragment blocks, which come from their
+ * copies when a snapshot is mounted
+ *
+ * Returns: 0 on success, -1 otherwise
+ */
+int snapshot_read(size_t disk_block, void* buf);
+
+/*
+ * Region of the snapshot @index, counting in-use records only, for
+ * fs_check()
+ *
+ * Returns: false past the last snapshot
+ */
+bool snapshot_region(size_t index, size_t* first_block, size_t* blocks);
+
+/*
+ * Takes snapshot @name of the mounted file system
+ *
+ * Returns: 0 on success, -1 if the name is taken, the table full, or the
+ * disk could not hold or write the region
+ */
+int snapshot_create(const char* name);
+
+/*
+ * Deletes snapshot @name and frees its region and the blocks only it held
+ *
+ * Returns: 0 on success, -1 if there is no such snapshot or it could not
+ * be read
+ */
+int snapshot_delete(const char* name);
+
+/*
+ * Prints the snapshots of the mounted disk
+ */
+void snapshot_list();
+
+#endif
@@ -0,0 +1,420 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fs.h"
+#include "stats.h"
+
+struct block_io_counters block_io = { 0 };
+
+static struct fs_stats op_stats = { 0 };
+
+static const char* op_names[FS_LAT_COUNT] = {
+    [FS_OP_MOUNT]  = "mount",
+    [FS_OP_UMOUNT] = "umount",
+    [FS_OP_INFO]   = "info",
+    [FS_OP_CREATE] = "create",
+    [FS_OP_DELETE] = "delete",
+    [FS_OP_LS]     = "ls",
+    [FS_OP_OPEN]   = "open",
+    [FS_OP_CLOSE]  = "close",
+    [FS_OP_STAT]   = "stat",
+    [FS_OP_LSEEK]  = "lseek",
+    [FS_OP_WRITE]  = "write",
+    [FS_OP_READ]   = "read",
+    [FS_OP_SYNC]   = "sync",
+    [FS_OP_FSYNC]  = "fsync",
+    [FS_OP_MKDIR]  = "mkdir",
+    [FS_OP_RMDIR]  = "rmdir",
+    [FS_OP_SNAPSHOT_CREATE] = "snap_add",
+    [FS_OP_SNAPSHOT_DELETE] = "snap_rm",
+    [FS_OP_COPY]   = "copy",
+    [FS_OP_DEDUP]  = "dedup",
+    [FS_OP_COMPRESS] = "compress",
+    [FS_OP_LSDIR]  = "lsdir",
+    [FS_OP_OPENDIR] = "opendir",
+    [FS_OP_READDIR] = "readdir",
+    [FS_OP_CLOSEDIR] = "closedir",
+    [FS_OP_STAT_SIZE] = "stat_size",
+    [FS_OP_STAT_NAME] = "stat_name",
+    [FS_OP_SNAPSHOT_LS] = "snap_ls",
+    [FS_LAT_BLOCK_READ]  = "blk_read",
+    [FS_LAT_BLOCK_WRITE] = "blk_write",
+    [FS_LAT_BLOCK_SYNC]  = "blk_sync",
+};
+
+/*
+ * Log-linear latency histogram: values below 2^LAT_SUB_BITS ns get a
+ * bucket each, above that every power of two is split in
+ * 2^LAT_SUB_BITS equal sub-buckets. Anything above 2^LAT_MAX_BITS ns
+ * (about 68 seconds) lands in the last bucket.
+ */
+#define LAT_SUB_BITS 4
+#define LAT_SUB_COUNT (1 << LAT_SUB_BITS)
+#define LAT_MAX_BITS 36
+#define LAT_BUCKETS ((LAT_MAX_BITS - LAT_SUB_BITS + 2) * LAT_SUB_COUNT)
+
+struct latency_histogram{
+    uint64_t buckets[LAT_BUCKETS];
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+};
+
+/*
+ * Histograms owned by one thread. Only the owner writes to them, other
+ * threads merge them on query, so recording never takes a lock.
+ */
+struct latency_set{
+    struct latency_histogram histograms[FS_LAT_COUNT];
+
+    /*
+     * Value of reset_generation the histograms were last zeroed at
+     */
+    uint64_t generation;
+
+    struct latency_set* next;
+};
+
+static __thread struct latency_set* thread_latency = NULL;
+
+/*
+ * Every latency_set ever created. Sets of exited threads are kept so
+ * their samples still show up in queries.
+ */
+static struct latency_set* latency_sets = NULL;
+
+static pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Bumped by fs_stats_reset(). A thread zeroes its own set the next time
+ * it records after noticing the generation changed, and queries skip
+ * sets that have not caught up yet.
+ */
+static uint64_t reset_generation = 0;
+
+#define load_relaxed(ptr) __atomic_load_n(ptr, __ATOMIC_RELAXED)
+#define store_relaxed(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELAXED)
+
+uint64_t stats_now_ns(){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static size_t latency_bucket(uint64_t value_ns){
+    if(value_ns < LAT_SUB_COUNT){
+        return (size_t)value_ns;
+    }
+
+    size_t msb = 63 - (size_t)__builtin_clzll(value_ns);
+
+    if(msb > LAT_MAX_BITS){
+        return LAT_BUCKETS - 1;
+    }
+
+    size_t shift = msb - LAT_SUB_BITS;
+
+    return ((shift + 1) << LAT_SUB_BITS)
+            | (size_t)((value_ns >> shift) & (LAT_SUB_COUNT - 1));
+}
+
+/*
+ * Largest value that falls in a bucket
+ */
+static uint64_t latency_bucket_upper(size_t bucket){
+    if(bucket < LAT_SUB_COUNT){
+        return bucket;
+    }
+
+    size_t shift = (bucket >> LAT_SUB_BITS) - 1;
+
+    uint64_t lower = (uint64_t)(LAT_SUB_COUNT | (bucket & (LAT_SUB_COUNT - 1))) << shift;
+
+    return lower + ((uint64_t)1 << shift) - 1;
+}
+
+static struct latency_set* local_latency_set(){
+    struct latency_set* set = thread_latency;
+
+    if(set==NULL){
+        set = (struct latency_set*)calloc(1, sizeof(struct latency_set));
+
+        if(set==NULL){
+            return NULL;
+        }
+
+        pthread_mutex_lock(&latency_lock);
+
+        set->generation = reset_generation;
+        set->next = latency_sets;
+        latency_sets = set;
+
+        pthread_mutex_unlock(&latency_lock);
+
+        thread_latency = set;
+    }
+
+    uint64_t generation = load_relaxed(&reset_generation);
+
+    if(set->generation != generation){
+        for(int source = 0; source < FS_LAT_COUNT; source++){
+            struct latency_histogram* histogram = &set->histograms[source];
+
+            for(size_t bucket = 0; bucket < LAT_BUCKETS; bucket++){
+                store_relaxed(&histogram->buckets[bucket], 0);
+            }
+
+            store_relaxed(&histogram->count, 0);
+            store_relaxed(&histogram->sum_ns, 0);
+            store_relaxed(&histogram->min_ns, 0);
+            store_relaxed(&histogram->max_ns, 0);
+        }
+
+        __atomic_store_n(&set->generation, generation, __ATOMIC_RELEASE);
+    }
+
+    return set;
+}
+
+void latency_record(int source, uint64_t value_ns){
+    struct latency_set* set = local_latency_set();
+
+    if(set==NULL){
+        return;
+    }
+
+    struct latency_histogram* histogram = &set->histograms[source];
+
+    size_t bucket = latency_bucket(value_ns);
+
+    uint64_t count = load_relaxed(&histogram->count);
+
+    store_relaxed(&histogram->buckets[bucket], load_relaxed(&histogram->buckets[bucket]) + 1);
+    store_relaxed(&histogram->sum_ns, load_relaxed(&histogram->sum_ns) + value_ns);
+
+    if(count==0 || value_ns < load_relaxed(&histogram->min_ns)){
+        store_relaxed(&histogram->min_ns, value_ns);
+    }
+
+    if(value_ns > load_relaxed(&histogram->max_ns)){
+        store_relaxed(&histogram->max_ns, value_ns);
+    }
+
+    store_relaxed(&histogram->count, count + 1);
+}
+
+/*
+ * Sums the histograms of every thread for @source into @merged
+ */
+static void latency_merge(int source, struct latency_histogram* merged){
+    memset(merged, 0, sizeof(struct latency_histogram));
+
+    pthread_mutex_lock(&latency_lock);
+
+    uint64_t generation = load_relaxed(&reset_generation);
+
+    for(struct latency_set* set = latency_sets; set!=NULL; set = set->next){
+
+        if(__atomic_load_n(&set->generation, __ATOMIC_ACQUIRE) != generation){
+            continue;
+        }
+
+        struct latency_histogram* histogram = &set->histograms[source];
+
+        uint64_t count = load_relaxed(&histogram->count);
+
+        if(count==0){
+            continue;
+        }
+
+        for(size_t bucket = 0; bucket < LAT_BUCKETS; bucket++){
+            merged->buckets[bucket] += load_relaxed(&histogram->buckets[bucket]);
+        }
+
+        uint64_t min_ns = load_relaxed(&histogram->min_ns);
+        uint64_t max_ns = load_relaxed(&histogram->max_ns);
+
+        if(merged->count==0 || min_ns < merged->min_ns){
+            merged->min_ns = min_ns;
+        }
+
+        if(max_ns > merged->max_ns){
+            merged->max_ns = max_ns;
+        }
+
+        merged->count += count;
+        merged->sum_ns += load_relaxed(&histogram->sum_ns);
+    }
+
+    pthread_mutex_unlock(&latency_lock);
+}
+
+static uint64_t histogram_percentile(struct latency_histogram* histogram, double percentile){
+    uint64_t total = 0;
+
+    for(size_t bucket = 0; bucket < LAT_BUCKETS; bucket++){
+        total += histogram->buckets[bucket];
+    }
+
+    if(total==0){
+        return 0;
+    }
+
+    if(percentile < 0){
+        percentile = 0;
+    }
+
+    if(percentile > 100){
+        percentile = 100;
+    }
+
+    /* rank of the sample the percentile falls on, 1-based */
+    double exact_rank = percentile / 100.0 * (double)total;
+
+    uint64_t rank = (uint64_t)exact_rank;
+
+    if((double)rank < exact_rank){
+        rank++;
+    }
+
+    if(rank==0){
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+
+    for(size_t bucket = 0; bucket < LAT_BUCKETS; bucket++){
+        seen += histogram->buckets[bucket];
+
+        if(seen >= rank){
+            uint64_t upper = latency_bucket_upper(bucket);
+
+            return upper < histogram->max_ns ? upper : histogram->max_ns;
+        }
+    }
+
+    return histogram->max_ns;
+}
+
+int fs_latency(int source, struct fs_latency* lat){
+    if(source < 0 || source >= FS_LAT_COUNT || lat==NULL){
+        return -1;
+    }
+
+    struct latency_histogram* merged =
+            (struct latency_histogram*)malloc(sizeof(struct latency_histogram));
+
+    if(merged==NULL){
+        return -1;
+    }
+
+    latency_merge(source, merged);
+
+    memset(lat, 0, sizeof(struct fs_latency));
+
+    if(merged->count!=0){
+        lat->count = merged->count;
+        lat->min_ns = merged->min_ns;
+        lat->mean_ns = merged->sum_ns / merged->count;
+        lat->p50_ns = histogram_percentile(merged, 50.0);
+        lat->p99_ns = histogram_percentile(merged, 99.0);
+        lat->p999_ns = histogram_percentile(merged, 99.9);
+        lat->max_ns = merged->max_ns;
+    }
+
+    free(merged);
+
+    return 0;
+}
+
+uint64_t fs_latency_percentile(int source, double percentile){
+    if(source < 0 || source >= FS_LAT_COUNT){
+        return 0;
+    }
+
+    struct latency_histogram* merged =
+            (struct latency_histogram*)malloc(sizeof(struct latency_histogram));
+
+    if(merged==NULL){
+        return 0;
+    }
+
+    latency_merge(source, merged);
+
+    uint64_t value = histogram_percentile(merged, percentile);
+
+    free(merged);
+
+    return value;
+}
+
+void op_begin(struct op_sample* sample){
+    sample->io = block_io;
+    sample->start_ns = stats_now_ns();
+}
+
+void op_end(enum fs_op op, struct op_sample* sample, size_t bytes_requested){
+    uint64_t end_ns = stats_now_ns();
+
+    struct fs_op_stats* stats = &op_stats.ops[op];
+
+    stats->calls++;
+    stats->bytes_requested += bytes_requested;
+    stats->block_reads += block_io.reads - sample->io.reads;
+    stats->block_writes += block_io.writes - sample->io.writes;
+    stats->block_bytes += block_io.bytes - sample->io.bytes;
+    stats->block_syncs += block_io.syncs - sample->io.syncs;
+    stats->wall_ns += end_ns - sample->start_ns;
+
+    latency_record(op, end_ns - sample->start_ns);
+}
+
+void stats_mount(bool clean, uint64_t check_ns, size_t repaired_blocks){
+    if(clean){
+        op_stats.clean_mounts++;
+        return;
+    }
+
+    op_stats.dirty_mounts++;
+    op_stats.mount_check_ns += check_ns;
+    op_stats.mount_repaired_blocks += repaired_blocks;
+}
+
+int fs_stats(struct fs_stats* stats){
+    if(stats==NULL){
+        return -1;
+    }
+
+    memcpy(stats, &op_stats, sizeof(struct fs_stats));
+
+    stats->block_reads = block_io.reads;
+    stats->block_writes = block_io.writes;
+    stats->block_bytes = block_io.bytes;
+    stats->block_syncs = block_io.syncs;
+    stats->blocks_verified = block_io.verified;
+    stats->checksum_errors = block_io.checksum_errors;
+
+    return 0;
+}
+
+void fs_stats_reset(void){
+    memset(&op_stats, 0, sizeof(struct fs_stats));
+    memset(&block_io, 0, sizeof(struct block_io_counters));
+
+    pthread_mutex_lock(&latency_lock);
+    __atomic_add_fetch(&reset_generation, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&latency_lock);
+}
+
+const char* fs_op_name(int op){
+    if(op < 0 || op >= FS_LAT_COUNT){
+        return "unknown";
+    }
+
+    return op_names[op];
+}
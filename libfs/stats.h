@@ -0,0 +1,64 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fs.h"
+
+/*
+ * Block layer counters. These are bumped by block_read(), block_write()
+ * and friends on every successful transfer, by block_sync() on every
+ * fdatasync() it issues, and by the checksum code on every data block
+ * read it verifies.
+ */
+struct block_io_counters{
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t bytes;
+    uint64_t syncs;
+    uint64_t verified;
+    uint64_t checksum_errors;
+};
+
+extern struct block_io_counters block_io;
+
+/*
+ * Snapshot taken when a public fs_* call starts, used to
+ * attribute the block I/O and time spent to that call.
+ */
+struct op_sample{
+    uint64_t start_ns;
+    struct block_io_counters io;
+};
+
+/*
+ * Monotonic clock in nanoseconds
+ */
+uint64_t stats_now_ns();
+
+/*
+ * Adds a latency sample to the calling thread's histogram for @source,
+ * an enum fs_op value or one of the FS_LAT_BLOCK_* sources
+ */
+void latency_record(int source, uint64_t value_ns);
+
+/*
+ * Starts accounting for a public fs_* call
+ */
+void op_begin(struct op_sample* sample);
+
+/*
+ * Finishes accounting for a public fs_* call, adding the block I/O
+ * issued since op_begin() to the counters of @op.
+ */
+void op_end(enum fs_op op, struct op_sample* sample, size_t bytes_requested);
+
+/*
+ * Counts a mount of a disk that was marked clean or not, and what
+ * checking it cost
+ */
+void stats_mount(bool clean, uint64_t check_ns, size_t repaired_blocks);
+
+#endif
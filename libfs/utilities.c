@@ -1,250 +1,426 @@
-#include <fcntl.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <unistd.h>
-#include <string.h>
-#include<stdbool.h>
-
-#include "disk.h"
-#include "fs.h"
-#include "utilities.h"
-
-uint8_t* utilities_buffer = NULL;
-
-struct __attribute__((__packed__)) metadata{
-    uint8_t signature[8];
-    uint16_t totalBlocks;
-    uint16_t rootDirectoryIndex;
-    uint16_t dataStartIndex;
-    uint16_t totalDataBlocks;
-    uint8_t totalFatBlocks;
-};
-
-
-int create_disk(size_t data_blocks,char* filename){
-    if(data_blocks==0 || data_blocks > 8198){
-        printf("create_disk: invalid data block total, valid data block total [1,8198]\n");
-        return -1;
-    }
-
-    int fd = open(filename, O_CREAT | O_EXCL | O_WRONLY, 0644);
-
-    if (fd == -1) {
-       printf("create_disk: file already exists\n");
-       return -1;
-    }
-
-    size_t fat_blocks = data_blocks / (size_t)FAT_ENTRIES;
-
-    if(data_blocks % FAT_ENTRIES !=0){
-        fat_blocks += 1;
-    }
-
-    if(utilities_buffer==NULL){
-        utilities_buffer = (uint8_t*)calloc(1, bounce_buffer_size);
-     } else {
-        memset(utilities_buffer,0,bounce_buffer_size);
-     }
-
-    size_t disk_blocks = 1 + fat_blocks + 1 + data_blocks;
-
-    for(size_t block = 0; block < disk_blocks; block++){
-        write(fd, utilities_buffer, bounce_buffer_size);
-        memset(utilities_buffer,0,bounce_buffer_size);
-    }
-
-    struct metadata* metadata=(struct metadata*)utilities_buffer;
-
-    char* diskFormat="ECS150FS";
-
-    memcpy(metadata->signature, diskFormat, strlen(diskFormat));
-
-    metadata->totalBlocks=(uint16_t)disk_blocks;
-    metadata->rootDirectoryIndex= (uint16_t)1 + (uint16_t)fat_blocks;
-    metadata->dataStartIndex = (uint16_t)1 + (uint16_t)fat_blocks +  (uint16_t)1;
-    metadata->totalDataBlocks=(uint16_t)data_blocks;
-    metadata->totalFatBlocks=(uint8_t)fat_blocks;
-
-    lseek(fd, 0 , SEEK_SET);
-
-    write(fd, utilities_buffer, bounce_buffer_size);
-
-    memset(utilities_buffer,0,bounce_buffer_size);
-
-    uint16_t* fat_ptr=(uint16_t*)utilities_buffer;
-
-    *fat_ptr = FAT_EOC;
-
-    lseek(fd, BLOCK_SIZE , SEEK_SET);
-
-    write(fd, utilities_buffer, bounce_buffer_size);
-
-    close(fd);
-
-    printf("created disk with %zu data blocks\n",data_blocks);
-
-    return 0;
-}
-
-
-int erase_all_files(){
-    if(disk_mounted==false){
-        return -1;
-    }
-
-    if(fd_table->fdsOccupied!=0){
-        return -1;
-    }
-
-    if(utilities_buffer==NULL){
-        utilities_buffer = (uint8_t*)calloc(1, bounce_buffer_size);
-    } else {
-       memset(utilities_buffer,0,bounce_buffer_size);
-    }
-
-    block_read(root_directory_index,utilities_buffer);
-
-    struct DirEntry* entry = (struct DirEntry*)utilities_buffer;
-
-    for(int i=0;i<FS_FILE_MAX_COUNT;i++){
-
-        if(*(entry->filename)!='\0'){
-
-            if(entry->index!=FAT_EOC){
-                erase_file(entry->index);
-            }
-
-            memset(entry,0,sizeof(struct DirEntry));
-            *(entry->filename)='\0';
-        }
-
-        entry++;
-    }
-
-    block_write(root_directory_index, utilities_buffer);
-
-    return 0;
-}
-
-void print_allocated_blocks(struct fdNode* fd){
-    size_t current_block=fd->first_data_block;
-
-    printf("Allocated blocks for %s:\n",fd->filename);
-
-    size_t total_blocks=0;
-
-    while(current_block!=FAT_EOC){
-        printf("%zu ",current_block);
-
-        current_block = get_fat_entry(current_block);
-
-        total_blocks++;
-    }
-
-    printf("\ntotal blocks: %zu\n",total_blocks);
-}
-
-void hex_dump_file(struct fdNode* fd){
-    size_t current_block=fd->first_data_block;
-
-    if(utilities_buffer==NULL){
-        utilities_buffer = (uint8_t*)calloc(1, bounce_buffer_size);
-    } else {
-       memset(utilities_buffer,0,bounce_buffer_size);
-    }
-
-    while(current_block!=FAT_EOC){
-        block_read(get_actual_block_index(current_block),utilities_buffer);
-
-        hex_dump(utilities_buffer,bounce_buffer_size);
-        printf("\n-----------------------\n");
-
-        memset(utilities_buffer,0,bounce_buffer_size);
-
-        current_block = get_fat_entry(current_block);
-    }
-}
-
-void hex_dump(void *data, size_t length) {
-    unsigned char *byte = (unsigned char *)data;
-
-    for (size_t i = 0; i < length; ++i) {
-        if (i % 16 == 0){
-            printf("%08zx  ", i);
-        }
-
-        printf("%02x ", byte[i]);
-
-        if ((i + 1) % 8 == 0){
-            printf(" ");
-        }
-
-        if ((i + 1) % 16 == 0 || i + 1 == length) {
-            size_t bytes_missing = 16 - ((i + 1) % 16);
-
-            if (bytes_missing < 16) {
-
-                for (size_t j = 0; j < bytes_missing; ++j){
-                    printf("   ");
-                }
-                if (bytes_missing >= 8){
-                    printf("  ");
-                }
-            }
-
-            printf(" |");
-
-            for (size_t j = i - (i % 16); j <= i; j++){
-
-                printf("%c", (byte[j] >= 32 && byte[j] <= 126) ? byte[j] : '.');
-            }
-
-            printf("|\n");
-        }
-    }
-}
-
-size_t free_blocks(){
-    if(disk_mounted==false){
-        return 0;
-    }
-
-    if(utilities_buffer==NULL){
-        utilities_buffer = (uint8_t*)calloc(1, bounce_buffer_size);
-    } else {
-        memset(utilities_buffer,0,bounce_buffer_size);
-    }
-
-    size_t free_blocks = 0;
-
-    for(size_t fat_block_index = (size_t)FAT_BLOCK_START_INDEX;
-            fat_block_index < root_directory_index; fat_block_index++){
-
-        block_read(fat_block_index, utilities_buffer);
-
-        uint16_t* fat_entry=(uint16_t*)utilities_buffer;
-
-        for(int entry = 0; entry < FAT_ENTRIES; entry++){
-
-            size_t data_block_index = (fat_block_index - (size_t)FAT_BLOCK_START_INDEX)
-                           * (size_t)FAT_ENTRIES + (size_t)entry;
-
-            if(data_block_index == data_blocks){
-                break;
-            }
-
-            if(*fat_entry==0){
-                 free_blocks++;
-            }
-
-            fat_entry++;
-        }
-
-        memset(utilities_buffer,0,bounce_buffer_size);
-    }
-
-    return free_blocks;
-}
-
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <string.h>
+#include<stdbool.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "utilities.h"
+#include "fatScan.h"
+#include "directory.h"
+#include "dentryCache.h"
+#include "metadata.h"
+#include "journal.h"
+#include "blockChecksum.h"
+#include "fragment.h"
+
+uint8_t* utilities_buffer = NULL;
+
+static const struct disk_format default_format = {
+    .checksums = false,
+    .version = FS_VERSION_FAT16,
+};
+
+static void set_format_entry(void* fat, bool wide, size_t entry, uint32_t value){
+    if(wide){
+        ((uint32_t*)fat)[entry] = value;
+    } else {
+        ((uint16_t*)fat)[entry] = (uint16_t)value;
+    }
+}
+
+/*
+ * Closes and removes the image create_disk() could not finish
+ */
+static int discard_disk(int fd, const char* filename){
+    close(fd);
+    unlink(filename);
+
+    return -1;
+}
+
+int create_disk(size_t data_blocks,char* filename){
+    return create_disk_with(data_blocks, filename, NULL);
+}
+
+int create_disk_with(size_t data_blocks, char* filename, const struct disk_format* format){
+    if(format==NULL){
+        format = &default_format;
+    }
+
+    bool wide = format->version==FS_VERSION_FAT32;
+
+    if(format->version!=FS_VERSION_FAT16 && !wide){
+        printf("create_disk: invalid format version %u\n", (unsigned int)format->version);
+        return -1;
+    }
+
+    if(!wide && (data_blocks==0 || data_blocks > 8198)){
+        printf("create_disk: invalid data block total, valid data block total [1,8198]\n");
+        return -1;
+    }
+
+    if(wide && (data_blocks==0 || data_blocks > FAT32_MAX_DATA_BLOCKS)){
+        printf("create_disk: invalid data block total, valid data block total [1,%u]\n",
+                (unsigned int)FAT32_MAX_DATA_BLOCKS);
+        return -1;
+    }
+
+    size_t bytes = format->block_size==0 ? (size_t)BLOCK_SIZE_DEFAULT : format->block_size;
+
+    if(bytes < BLOCK_SIZE_MIN || bytes > BLOCK_SIZE_MAX || (bytes & (bytes - 1))!=0){
+        printf("create_disk: invalid block size, valid block sizes are powers of two in [%d,%d]\n",
+                BLOCK_SIZE_MIN, BLOCK_SIZE_MAX);
+        return -1;
+    }
+
+    size_t fat_entries = bytes / (wide ? sizeof(uint32_t) : sizeof(uint16_t));
+
+    size_t entry_size = format->entry_size==0 ? sizeof(struct DirEntry) : format->entry_size;
+
+    if(format->entry_size!=0 && (entry_size < DIR_ENTRY_SIZE_MIN || entry_size > DIR_ENTRY_SIZE_MAX
+            || (entry_size & (entry_size - 1))!=0)){
+        printf("create_disk: invalid directory entry size, valid sizes are powers of two in [%d,%d]\n",
+                DIR_ENTRY_SIZE_MIN, DIR_ENTRY_SIZE_MAX);
+        return -1;
+    }
+
+    size_t directory_entries = format->directory_entries==0 ? (size_t)FS_FILE_MAX_COUNT
+                                                            : format->directory_entries;
+
+    if(directory_entries > DIRECTORY_MAX_ENTRIES){
+        printf("create_disk: invalid directory entry total, valid directory entry total [1,%d]\n",
+                DIRECTORY_MAX_ENTRIES);
+        return -1;
+    }
+
+    size_t entries_per_block = bytes / entry_size;
+    size_t directory_blocks = (directory_entries + entries_per_block - 1) / entries_per_block;
+    uint32_t eoc = wide ? FAT32_EOC : FAT16_EOC;
+
+    //the journal and the checksum region go after the requested data blocks,
+    //sized for the fat they end up needing
+    size_t journal_blocks = 0;
+    size_t checksum_blocks = 0;
+    size_t fat_blocks = 0;
+
+    while(1){
+        size_t total_data_blocks = data_blocks + journal_blocks + checksum_blocks;
+
+        fat_blocks = total_data_blocks / fat_entries;
+
+        if(total_data_blocks % fat_entries !=0){
+            fat_blocks += 1;
+        }
+
+        size_t needed_journal = journal_format_blocks(fat_blocks + directory_blocks);
+        size_t needed_checksums = format->checksums ? checksum_region_blocks(total_data_blocks, bytes) : 0;
+
+        if(needed_journal == journal_blocks && needed_checksums == checksum_blocks){
+            break;
+        }
+
+        journal_blocks = needed_journal;
+        checksum_blocks = needed_checksums;
+    }
+
+    size_t total_data_blocks = data_blocks + journal_blocks + checksum_blocks;
+
+    size_t disk_blocks = 1 + fat_blocks + directory_blocks + total_data_blocks;
+
+    //every block index of the original format is 16 bits
+    if(!wide && disk_blocks > UINT16_MAX){
+        printf("create_disk: %zu blocks do not fit the fat16 format\n", disk_blocks);
+        return -1;
+    }
+
+    int fd = open(filename, O_CREAT | O_EXCL | O_WRONLY, 0644);
+
+    if (fd == -1) {
+       printf("create_disk: file already exists\n");
+       return -1;
+    }
+
+    if(utilities_buffer==NULL){
+        utilities_buffer = (uint8_t*)calloc(1, BLOCK_SIZE_MAX);
+     } else {
+        memset(utilities_buffer,0,bytes);
+     }
+
+    //the blocks past the end of the file read as zeros, as a new disk needs
+    if(ftruncate(fd, (off_t)(disk_blocks * bytes))!=0){
+        printf("create_disk: cannot size the disk\n");
+        return discard_disk(fd, filename);
+    }
+
+    if(format->preallocate){
+        int error = posix_fallocate(fd, 0, (off_t)(disk_blocks * bytes));
+
+        if(error!=0){
+            printf("create_disk: cannot allocate the disk: %s\n", strerror(error));
+            return discard_disk(fd, filename);
+        }
+    }
+
+    struct DiskMetadata* metadata=(struct DiskMetadata*)utilities_buffer;
+
+    char* diskFormat="ECS150FS";
+
+    memcpy(metadata->signature, diskFormat, strlen(diskFormat));
+
+    metadata->state = FS_STATE_CLEAN;
+    metadata->version = format->version;
+
+    if(format->tail_packing){
+        metadata->features |= FS_FEATURE_TAIL_PACKING;
+    }
+
+    if(format->entry_size!=0){
+        metadata->features |= FS_FEATURE_INLINE_DATA;
+        metadata->entryShift = (uint8_t)__builtin_ctzl(entry_size);
+    }
+
+    //left zero for default blocks, which fs_ref.x reads as reserved space
+    if(bytes!=BLOCK_SIZE_DEFAULT){
+        metadata->blockShift = (uint8_t)__builtin_ctzl(bytes);
+    }
+
+    size_t data_start = 1 + fat_blocks + directory_blocks;
+    size_t journal_start = data_start + data_blocks;
+    size_t checksum_start = checksum_blocks!=0 ? journal_start + journal_blocks : 0;
+
+    if(wide){
+        struct DiskMetadata32* metadata32 = (struct DiskMetadata32*)utilities_buffer;
+
+        metadata32->totalBlocks = disk_blocks;
+        metadata32->rootDirectoryIndex = 1 + fat_blocks;
+        metadata32->dataStartIndex = data_start;
+        metadata32->totalDataBlocks = total_data_blocks;
+        metadata32->totalFatBlocks = fat_blocks;
+        metadata32->journalStartIndex = journal_start;
+        metadata32->journalBlocks = journal_blocks;
+        metadata32->checksumStartIndex = checksum_start;
+        metadata32->checksumBlocks = checksum_blocks;
+        metadata32->rootDirectoryBlocks = directory_blocks;
+    } else {
+        metadata->totalBlocks=(uint16_t)disk_blocks;
+        metadata->rootDirectoryIndex= (uint16_t)1 + (uint16_t)fat_blocks;
+        metadata->dataStartIndex = (uint16_t)data_start;
+        metadata->totalDataBlocks=(uint16_t)total_data_blocks;
+        metadata->totalFatBlocks=(uint8_t)fat_blocks;
+        metadata->journalStartIndex = (uint16_t)journal_start;
+        metadata->journalBlocks = (uint16_t)journal_blocks;
+        metadata->checksumStartIndex = (uint16_t)checksum_start;
+        metadata->checksumBlocks = (uint16_t)checksum_blocks;
+
+        //left zero for a single block, which fs_ref.x reads as reserved space
+        if(directory_blocks!=1){
+            metadata->rootDirectoryBlocks = (uint16_t)directory_blocks;
+        }
+    }
+
+    //data block 0 is reserved, the journal and checksum blocks are chained like files
+    void* fat = calloc(fat_blocks, bytes);
+
+    if(fat==NULL){
+        return discard_disk(fd, filename);
+    }
+
+    set_format_entry(fat, wide, 0, eoc);
+
+    size_t checksum_data_start = data_blocks + journal_blocks;
+
+    for(size_t block = data_blocks; block < checksum_data_start; block++){
+        set_format_entry(fat, wide, block,
+                (block + 1 < checksum_data_start) ? (uint32_t)(block + 1) : eoc);
+    }
+
+    for(size_t block = checksum_data_start; block < total_data_blocks; block++){
+        set_format_entry(fat, wide, block,
+                (block + 1 < total_data_blocks) ? (uint32_t)(block + 1) : eoc);
+    }
+
+    //the directory starts empty, so its blocks are the zeros of the file
+    struct iovec metadata_blocks[2] = {
+        { .iov_base = utilities_buffer, .iov_len = bytes },
+        { .iov_base = fat, .iov_len = fat_blocks * bytes },
+    };
+
+    ssize_t written = pwritev(fd, metadata_blocks, 2, 0);
+
+    free(fat);
+
+    if(written!=(ssize_t)((1 + fat_blocks) * bytes)){
+        printf("create_disk: cannot write the fat\n");
+        return discard_disk(fd, filename);
+    }
+
+    memset(utilities_buffer,0,bytes);
+
+    struct JournalHeader* header = (struct JournalHeader*)utilities_buffer;
+
+    memcpy(header->signature, JOURNAL_SIGNATURE, 8);
+    header->sequence = 1;
+
+    written = pwrite(fd, utilities_buffer, bytes, (off_t)(journal_start * bytes));
+
+    memset(utilities_buffer,0,bytes);
+
+    if(written!=(ssize_t)bytes){
+        printf("create_disk: cannot write the journal\n");
+        return discard_disk(fd, filename);
+    }
+
+    close(fd);
+
+    printf("created disk with %zu data blocks\n",data_blocks);
+
+    return 0;
+}
+
+
+/*
+ * Erases the files of @dir, and of the subdirectories it holds first
+ */
+static void erase_directory(struct directory* dir){
+    for(size_t i = dir_next_used(dir, 0); i < dir_capacity(dir); i = dir_next_used(dir, i + 1)){
+
+        struct DirEntry* entry = dir_entry(dir, i);
+
+        struct directory* child = dir_child(dir, i);
+
+        if(child!=NULL){
+            erase_directory(child);
+        }
+
+        fragment_erase(entry);
+
+        if(dir_entry_first_block(entry)!=FAT_EOC){
+            erase_file(dir_entry_first_block(entry));
+        }
+
+        dir_entry_clear(entry);
+
+        dir_update(dir, i);
+    }
+}
+
+int erase_all_files(){
+    if(disk_mounted==false){
+        return -1;
+    }
+
+    if(fd_table->fdsOccupied!=0){
+        return -1;
+    }
+
+    struct directory* root = dir_root();
+
+    erase_directory(root);
+
+    dentry_clear();
+
+    //see fs_rmdir(), the freed directory blocks must not be replayed
+    int ret = 0;
+
+    if(fragment_release() || metadata_commit() || journal_checkpoint()){
+        ret = -1;
+    }
+
+    for(size_t i = 0; i < dir_capacity(root); i++){
+        dir_forget_child(root, i);
+    }
+
+    return ret;
+}
+
+void print_allocated_blocks(struct fdNode* fd){
+    size_t current_block=fd->first_data_block;
+
+    printf("Allocated blocks for %s:\n",fd->filename);
+
+    size_t total_blocks=0;
+
+    while(current_block!=FAT_EOC){
+        printf("%zu ",current_block);
+
+        current_block = get_fat_entry(current_block);
+
+        total_blocks++;
+    }
+
+    printf("\ntotal blocks: %zu\n",total_blocks);
+}
+
+void hex_dump_file(struct fdNode* fd){
+    size_t current_block=fd->first_data_block;
+
+    if(utilities_buffer==NULL){
+        utilities_buffer = (uint8_t*)calloc(1, BLOCK_SIZE_MAX);
+    } else {
+       memset(utilities_buffer,0,block_size);
+    }
+
+    while(current_block!=FAT_EOC){
+        block_read(get_actual_block_index(current_block),utilities_buffer);
+
+        hex_dump(utilities_buffer,block_size);
+        printf("\n-----------------------\n");
+
+        memset(utilities_buffer,0,block_size);
+
+        current_block = get_fat_entry(current_block);
+    }
+}
+
+void hex_dump(void *data, size_t length) {
+    unsigned char *byte = (unsigned char *)data;
+
+    for (size_t i = 0; i < length; ++i) {
+        if (i % 16 == 0){
+            printf("%08zx  ", i);
+        }
+
+        printf("%02x ", byte[i]);
+
+        if ((i + 1) % 8 == 0){
+            printf(" ");
+        }
+
+        if ((i + 1) % 16 == 0 || i + 1 == length) {
+            size_t bytes_missing = 16 - ((i + 1) % 16);
+
+            if (bytes_missing < 16) {
+
+                for (size_t j = 0; j < bytes_missing; ++j){
+                    printf("   ");
+                }
+                if (bytes_missing >= 8){
+                    printf("  ");
+                }
+            }
+
+            printf(" |");
+
+            for (size_t j = i - (i % 16); j <= i; j++){
+
+                printf("%c", (byte[j] >= 32 && byte[j] <= 126) ? byte[j] : '.');
+            }
+
+            printf("|\n");
+        }
+    }
+}
+
+size_t free_blocks(){
+    if(disk_mounted==false){
+        return 0;
+    }
+
+    return fat_free_blocks();
+}
@@ -1,24 +1,85 @@
-
-#ifndef UTILITIES_H_
-#define UTILITIES_H_
-
-#include "disk.h"
-#include "fs.h"
+
+#ifndef UTILITIES_H_
+#define UTILITIES_H_
+
+#include "disk.h"
+#include "fs.h"
 #include "fdTable.h"
 
-extern uint8_t* utilities_buffer;
-
-int erase_all_files();
-
-void print_allocated_blocks(struct fdNode* fd);
-
-void hex_dump_file(struct fdNode* fd);
-
-void hex_dump(void *data, size_t length);
-
-int create_disk(size_t data_blocks,char* filename);
-
-size_t free_blocks();
-
-
-#endif
+extern uint8_t* utilities_buffer;
+
+int erase_all_files();
+
+void print_allocated_blocks(struct fdNode* fd);
+
+void hex_dump_file(struct fdNode* fd);
+
+void hex_dump(void *data, size_t length);
+
+/*
+ * Optional features of a disk, chosen when it is formatted
+ */
+struct disk_format{
+    /* keep a CRC32C of every data block, see blockChecksum.h */
+    bool checksums;
+    /*
+     * FS_VERSION_FAT16, the original format, up to 8198 data blocks and
+     * 4 GiB files, or FS_VERSION_FAT32, up to FAT32_MAX_DATA_BLOCKS data
+     * blocks and 64 bit file sizes
+     */
+    uint8_t version;
+    /*
+     * bytes per block, a power of two in [BLOCK_SIZE_MIN, BLOCK_SIZE_MAX],
+     * or 0 for BLOCK_SIZE_DEFAULT
+     */
+    size_t block_size;
+    /*
+     * entries of the root directory, rounded up to whole blocks, or 0 for
+     * FS_FILE_MAX_COUNT
+     */
+    size_t directory_entries;
+    /* pack small files and file tails in shared blocks, see fragment.h */
+    bool tail_packing;
+    /*
+     * bytes per directory entry, a power of two in [DIR_ENTRY_SIZE_MIN,
+     * DIR_ENTRY_SIZE_MAX] storing files of up to that size less 32 bytes
+     * inline, or 0 for the 32 bytes of struct DirEntry
+     */
+    size_t entry_size;
+    /*
+     * allocate every block of the image on the host now, instead of
+     * leaving the data blocks sparse until they are first written, so that
+     * first writes take no extra allocation
+     */
+    bool preallocate;
+};
+
+/*
+ * Keeps block numbers of FS_VERSION_FAT32 disks well away from FAT32_EOC,
+ * and disks within the int block count of block_disk_count()
+ */
+#define FAT32_MAX_DATA_BLOCKS 0x0FFFFFF0
+
+/* Keeps entry indexes within the int returned by dir_lookup() */
+#define DIRECTORY_MAX_ENTRIES (1 << 24)
+
+/*
+ * Formats new image @filename with @data_blocks data blocks. The image is
+ * sized with ftruncate(), so the blocks nothing is written to read as
+ * zeros without taking room on the host, and the superblock and the FAT
+ * are written with a single vectored write, then the journal header.
+ *
+ * Returns: 0 on success, -1 if the format is invalid, @filename already
+ * exists, or the image could not be written, in which case it is removed
+ */
+int create_disk(size_t data_blocks,char* filename);
+
+/*
+ * create_disk() with @format, NULL for the defaults create_disk() uses
+ */
+int create_disk_with(size_t data_blocks, char* filename, const struct disk_format* format);
+
+size_t free_blocks();
+
+
+#endif